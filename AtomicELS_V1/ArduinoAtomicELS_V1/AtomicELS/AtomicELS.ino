@@ -61,14 +61,30 @@
 //  MOM-OFF-MOM toggle switch provide the user interface.
 //  A great deal of functionality is bound up in the Nextion
 //  display programming, so refer to the Nextion configuration.
-//  There is no error checking in the Nextion communications, so there's a bit of risk there.
 //  The display is configured to return data only on failures.
-//  No problem as long as there's never a glitch.  An error-checking wrapper would be possible?
+//  Everything it returns is parsed a byte at a time into frames by nextionFrame(),
+//  which throws away anything with a bad length or terminator and resynchronizes,
+//  so a glitch costs one event rather than scrambling the rest.
 //
 //================================================================================
 
 #include "configuration.h"
+#include "Pins.h"
+#include "Timebase.h"
 #include "tables.h"
+#include "Events.h"
+#include "Display.h"
+#include "Ratio.h"
+#include "Planner.h"
+#include "ThreadCycle.h"
+#include "Cross.h"
+#include "Steps.h"
+#include "Speed.h"
+#include "Index.h"
+#include "Journal.h"
+#include "Machine.h"
+#include "Telemetry.h"
+#include "Profile.h"
 
 // M Naylor
 #include "EncoderDiagnostics.h"
@@ -83,41 +99,62 @@
 
 void setup(void) {
 
+  machineLoad();                      //The default machine profile, until the journal says otherwise
+
   //Configure the input pins
   pinMode(SPINDLE_A, INPUT);          //Spindle encoder quadrature inputs
   pinMode(SPINDLE_B, INPUT);          //Put 2k pullups on these inputs to avoid spurious interrupts
-  pinMode(ALARM, INPUT_PULLUP);       //ALM+ open collector output from controller (not implemented yet)
   pinMode(LEFT_MOM, INPUT_PULLUP);    //MOM-OFF-MOM toggle switch for controlling feed direction
   pinMode(RIGHT_MOM, INPUT_PULLUP);
+  indexInit();                        //Spindle index pulse
+  alarmInit();                        //And the driver's ALARM on the same interrupt
 
   Serial.begin(38400);               //Keep the default port for debugging
-  Serial2.begin(38400);               //Use USART2 for the Nextion display
+  Serial2.begin(NEXTION_BAUD);        //Use USART2 for the Nextion display
 
   /*
   * Call Diagnostic setup code - MJMN Jan 2021
   */
   DiagnosticsSetup ();
+#ifdef ELS_TELEMETRY
+  telemetryInit();                    //After the diagnostics' text report
+#endif
 
   nextionInit();                      //Initialize the Nextion display
   nextionLeft();                      //Defaults to feeding toward the headstock
 
+  //Default to 40tpi, 0.5mm, and lowest diametral and module.
+  feed_index[inch_feed] = pitchFind("  40");
+  feed_index[metric_feed] = rateFind("  0.5 ");
+  feed_index[diametral_feed] = 0;
+  feed_index[module_feed] = 0;
   feedSelect(inch_feed);              //Default to INCH mode
 
-  feedFill(inch[pitchFind("  40")].steps);  //Initialize the lookup table for 40tpi (1 step per spindle tick).
+  feedFill(pgm_read_word(&inch[pitchFind("  40")].steps));  //Initialize the lookup table for 40tpi (1 step per spindle tick).
+
+#ifdef ELS_BENCHMARK
+  benchmarkReport();                  //Tick budget and speed limit for every pitch
+#endif
 
-  tc3Init();                          //Initialize the timers
+  timebaseInit();                     //Initialize the timers
   tc4Init();
+#ifdef CROSS_SLIDE
+  crossInit();                        //And TC1 for the cross-slide
+#endif
 
   pcint4Enab();                       //Enable timer interrupt
 
-  tc3Enab();                          //Enable timers
+  timebaseEnab();                     //Enable timers
   tc4Enab();
 
-  zeroSet(!waitSerial2);              //Zero the leadscrew and clear the limits.
+  zeroSet();                          //Zero the leadscrew and clear the limits.
+  journalRestore();                   //Then put back whatever was saved
+  planInit();                         //Jog acceleration ramp, for the restored profile's top speed
+  machineEdit();                      //Profile changes over the debug port start from that
 
   //Falling edges are sharper, and generally provide better noise margin
-  attachInterrupt(digitalPinToInterrupt(KNOB_A), knob, FALLING);
-  attachInterrupt(digitalPinToInterrupt(SPINDLE_A), spindle, FALLING);
+  extAttach(EXT_INT(KNOB_A), EXT_FALLING);
+  spindleAttach();
 
   steps = 0;
 
@@ -130,20 +167,48 @@ void setup(void) {
 //================================================================================
 
 void loop(void) {
+  //Nothing in here waits for anything, so every pass is short.
+  //Input is picked up on every pass, and the rest runs on a fixed UI_TICK schedule.
+
+  static unsigned long tick_time = 0;
+  static byte rpm_tick = 0;
+
+#ifdef ELS_PROFILE
+  profLoop();           //Time the passes, see Profile.h
+#endif
+  eventCheck();         //Collect whatever the interrupts have posted
+  nextionCheck();       //Has the display sent anything?
+  nextionFlush();       //Keep the display queue moving
+  journalFlush();       //And the EEPROM writes
+  machineSerial();      //Machine profile commands on the debug port
+#ifdef ELS_TELEMETRY
+  telemetryFlush();     //And the telemetry
+#endif
+
+  if (millis() - tick_time >= UI_TICK) {    //No point in updating too fast
+    PROF_LONG_START(ui_time);
+    tick_time = millis();
 
-  int i;
-
-  for (i = 0; i < 4; i++) {
     knobCheck();        //Has the encoder knob been turned?
     toggleCheck();      //Feed switch activated?
-    nextionCheck();     //Has the display sent anything?
+    uiTick();           //Jogging and held buttons
+    pickupCheck();      //A thread pickup waiting for the index pulse
+    stepResume();       //A held feed waiting to pick its groove back up
+    journalCheck();     //Save settings that have changed
     nextionDirection(); //Correctly reflect the feed direction
     nextionLead();      //Display the leadscrew position.
-    delay(25);          //No point in updating too fast
+#ifdef CROSS_SLIDE
+    crossDisplay();     //And the cross-slide's
+#endif
+
+    if (++rpm_tick >= RPM_TICKS) {
+      rpm_tick = 0;
+      nextionRPM();     //Display less often so the flicker isn't so distracting.
+      nextionRefresh();
+    }
+    PROF_LONG_END(prof_ui, ui_time);
   }
 
-  nextionRPM();         //Display less often so the flicker isn't so distracting.
-
   /*
   * Call diagnostic loop code - MJMN Jan 2021
   */
@@ -169,17 +234,18 @@ void nextionInit(void) {
   //The display design is done in the Nextion editor.
   //Refer to the Nextion .HMI display configuration file for the object names and id's.
 
-  Serial2.print(F("page start\xFF\xFF\xFF"));
-  Serial2.print(F("inch_btn.pco=WHITE\xFF\xFF\xFF"));               //INCH text white
-  Serial2.print(F("metric_btn.pco=BLACK\xFF\xFF\xFF"));             //METRIC black
-  Serial2.print(F("diam_btn.pco=BLACK\xFF\xFF\xFF"));               // etc...
-  Serial2.print(F("module_btn.pco=BLACK\xFF\xFF\xFF"));
-  Serial2.print(F("inch_btn.bco=1024\xFF\xFF\xFF"));                //INCH background toggle
-  Serial2.print(F("inch_btn.bco=44415\xFF\xFF\xFF"));               //44415 = pale blue
-  Serial2.print(F("shoulder.left_lim.txt=\"-----\"\xFF\xFF\xFF"));
-  Serial2.print(F("shoulder.right_lim.txt=\"-----\"\xFF\xFF\xFF"));
-  Serial2.print(F("shoulder.left_lim.bco=33816\xFF\xFF\xFF"));      //33816 = dark blue
-  Serial2.print(F("shoulder.right_lim.bco=33816\xFF\xFF\xFF"));     //33816 = dark blue
+  nextionInvalidate();
+  nextionSend(F("page start\xFF\xFF\xFF"));
+  nextionSend(F("inch_btn.pco=WHITE\xFF\xFF\xFF"));               //INCH text white
+  nextionSend(F("metric_btn.pco=BLACK\xFF\xFF\xFF"));             //METRIC black
+  nextionSend(F("diam_btn.pco=BLACK\xFF\xFF\xFF"));               // etc...
+  nextionSend(F("module_btn.pco=BLACK\xFF\xFF\xFF"));
+  nextionSend(F("inch_btn.bco=1024\xFF\xFF\xFF"));                //INCH background toggle
+  nextionSend(F("inch_btn.bco=44415\xFF\xFF\xFF"));               //44415 = pale blue
+  nextionSet(nf_left_lim, "-----");
+  nextionSet(nf_right_lim, "-----");
+  nextionSet(nf_left_bco, nxDBLUE);
+  nextionSet(nf_right_bco, nxDBLUE);
   //Serial2.print(F("thup=1\xFF\xFF\xFF"));                         //Auto wake on touch
   //Serial2.print(F("thsp=600\xFF\xFF\xFF"));                       //Sleep on no touch after 10 minutes
 }
@@ -187,95 +253,184 @@ void nextionInit(void) {
 void nextionRPM(void) {
   // Sends the spindle rpm value to the display.
 
-  char str[30];
+  char str[10];
   static unsigned int spin;
   int rpm;
 
-  //If stopped, spin_rate is set to 0xFFFF by TC3 overflow interrupt.
-  if ((spin = spinAvg(spin_rate)) < RPM20) {
+  //If stopped, spin_rate is set to 0xFFFF by the timebase overflow interrupt.
+  if ((spin = speedRateGet()) < machine.rpm20) {
     if (fault) {
       //A fault means that an encoder interrupt occurred before all the steps were output,
       //indicating that the lathe is running too fast for the feed rate.
-      //Make RPM background red.  Might need more for a color-blind operator.
-      sprintf(str, "%s%s", "rpm.bco=RED", NX_END);
-      Serial2.print(str);
+      //Make RPM background red, or yellow while the feed is held (see Steps.h).
+      //Might need more for a color-blind operator.
+      nextionSet(nf_rpm_bco, step_hold ? "YELLOW" : "RED");
     }
-    rpm = T3CPM / spin / SCPR;
-    sprintf(str, "%s%d%s", "rpm.txt=\"", rpm, QTNX_END);
+    rpm = machine.rpm_scale / spin;
+    sprintf(str, "%d", rpm);
+#ifdef ELS_BENCHMARK
+    benchmarkRPM(rpm);
+#endif
   } else {
-    sprintf(str, "%s%s", "rpm.txt=\"0", QTNX_END);
+    strcpy(str, "0");
   }
-  Serial2.print(str);
+  nextionSet(nf_rpm, str);
 }
 
 void nextionLead(void) {
   //Output the leadscrew position to the display
 
   char leadstr[20];
-  char str[50];
 
-  sprintf(str, "%s%s%s", "shoulder.leadscrew.txt=\"", leadStr(leadscrew, leadstr), QTNX_END);
-  Serial2.print(str);
+  //Only when an interrupt has reported that it moved
+  if (!lead_update)
+    return;
+  lead_update = false;
+
+  nextionSet(nf_lead, leadStr(leadscrewGet(), leadstr));
 }
 
 void nextionCheck(void) {
-  //Handler for touch events from the display
+  //Handle whatever complete frames the display has sent
+
+  byte len;
+
+  while ((len = nextionFrame())) {
+    if (nx_rx[0] == NXR_TOUCH) {
+      nextionTouch(nx_rx);
+    } else if (nx_rx[0] == NXR_NUMBER) {
+      //Whoever asked with "get" gets the answer
+      if (custom_pending) {
+        customNumber(nx_rx);
+#ifdef CROSS_SLIDE
+      } else if (cross_pending) {
+        crossNumber(nx_rx);
+#endif
+      } else {
+        cycleNumber(nx_rx);
+      }
+    } else if (nx_rx[0] <= NXR_ERRORS) {
+      //Failure codes don't need any action, but they're counted for the benchmark
+      nx_rx_failures++;
+    }
+  }
+}
 
-  char buf[20];
+void nextionTouch(const byte *buf) {
+  //Handler for touch events from the display
 
   //Things get a little complicated here.
-  //Wait for an event from the Nextion display.
   //The mode buttons only send a "press" event.
-  //The left/right and limit buttons also send a "release" event
-  //which is used in the called functions to implement delays and spin checks.
-  if (Serial2.available()) {
-    Serial2.readBytes(buf, 7);
-    //The mode-select ID's 1 through 4 appear on all three Nextion pages.
-    //It took some care to make sure that the ID's were the same on each page.
-    //ID's 5 and 6 are the left and right feed select "arrows", 7 is the "BACK" button,
-    //and 8, 9 and 10 are the "LEFT", "ZERO" and "RIGHT" limit buttons.
-    //            touch              page 0            page 1            page 2             press
-    if (buf[0] == 0x65 && (buf[1] == 0x00 || buf[1] == 0x01 || buf[1] == 0x02) && buf[3] == 0x01) {
-      //Figure out which button press came from the touchscreen:
-      switch (buf[2]) {   // Component ID
-        case inch_btn:
-          feed_mode = inch_feed;
-          break;
-        case metric_btn:
-          feed_mode = metric_feed;
-          break;
-        case diametral_btn:
-          feed_mode = diametral_feed;
-          break;
-        case module_btn:
-          feed_mode = module_feed;
-          break;
-        case left_btn:
-          //Left arrow
-          jogCheck(true);
-          break;
-        case right_btn:
-          //Right arrow
-          jogCheck(false);
-          break;
-        case lset_btn:
-          leftSet();
-          break;
-        case zset_btn:
-          zeroSet(waitSerial2);
-          break;
-        case rset_btn:
-          rightSet();
-          break;
-        case lclr_btn:
-          leftClr(waitSerial2);
-          break;
-        case rclr_btn:
-          rightClr(waitSerial2);
-          break;
-      }
+  //The left/right and limit buttons also send a "release" event,
+  //which finishes whatever the press started in the user interface state machine.
+
+  int mode = feed_mode;
+
+  //The page may have changed, so bring everything up to date
+  nextionInvalidate();
+  //The mode-select ID's 1 through 4 appear on all three Nextion pages.
+  //It took some care to make sure that the ID's were the same on each page.
+  //ID's 5 and 6 are the left and right feed select "arrows", 7 is the "BACK" button,
+  //and 8, 9 and 10 are the "LEFT", "ZERO" and "RIGHT" limit buttons.
+  //ID's 29 to 32 are the TPI, MM, DP and MOD unit buttons on the CUSTOM page,
+  //33 and 34 are the rapid traverse buttons, 35 starts the threading cycle,
+  //36 is the thread pickup, and 37 to 45 are the CROSS page's (see Cross.h).
+  //            touch         page 0 to NX_PAGES - 1     press
+  if (buf[0] == 0x65 && buf[1] < NX_PAGES && buf[3] == 0x01) {
+    //A press can't arrive while a button is held unless the release was lost
+    uiRelease();
+    //Any press stops a rapid traverse or the threading cycle, except CYCLE
+    //when the cycle is waiting for the tool to be retracted (see ThreadCycle.h)
+    if (jogging)
+      planStop();
+    bool cycled = buf[2] == cycle_btn && cycleConfirm();
+    if (!cycled)
+      cycled = cycleStop();
+    //Figure out which button press came from the touchscreen:
+    switch (buf[2]) {   // Component ID
+      case inch_btn:
+        feed_mode = inch_feed;
+        break;
+      case metric_btn:
+        feed_mode = metric_feed;
+        break;
+      case diametral_btn:
+        feed_mode = diametral_feed;
+        break;
+      case module_btn:
+        feed_mode = module_feed;
+        break;
+      case left_btn:
+        //Left arrow
+        jogCheck(true);
+        break;
+      case right_btn:
+        //Right arrow
+        jogCheck(false);
+        break;
+      case lset_btn:
+        leftSet();
+        break;
+      case zset_btn:
+        zeroSet();
+        uiHold(F("shoulder.zset_btn.bco2=1024\xFF\xFF\xFF"));
+        break;
+      case rset_btn:
+        rightSet();
+        break;
+      case lclr_btn:
+        leftClr();
+        uiHold(F("shoulder.lclr_btn.bco2=1024\xFF\xFF\xFF"));
+        break;
+      case rclr_btn:
+        rightClr();
+        uiHold(F("shoulder.rclr_btn.bco2=1024\xFF\xFF\xFF"));
+        break;
+      case ctpi_btn:
+      case cmm_btn:
+      case cdp_btn:
+      case cmod_btn:
+        //The pitch comes back in a numeric frame, see customNumber()
+        customRequest(inch_feed + buf[2] - ctpi_btn);
+        break;
+      case lrapid_btn:
+        rapidTo(true);
+        break;
+      case rrapid_btn:
+        rapidTo(false);
+        break;
+      case cycle_btn:
+        //The same button ends a cycle that's running, or sends it back for the next pass
+        if (!cycled)
+          cycleStart();
+        break;
+      case pickup_btn:
+        pickupApply();
+        break;
+#ifdef CROSS_SLIDE
+      case xoff_btn:
+      case xtaper_btn:
+      case xface_btn:
+      case xminus_btn:
+      case xplus_btn:
+      case xzero_btn:
+      case xmin_btn:
+      case xmax_btn:
+      case xfree_btn:
+        crossTouch(buf[2]);
+        break;
+#endif
     }
-    feedSelect(feed_mode);
+  } else {
+    //A release ends a held button
+    uiRelease();
+  }
+  if (feed_mode != mode) {
+    feedSelect(feed_mode);    //A mode button
+  } else {
+    //Refilling the step table and setting the period with a feed engaged
+    //isn't something to do on every touch, so just put the feed back on the page
+    feedShow();
   }
 }
 
@@ -283,209 +438,194 @@ void leftSet(void) {
   //Set the left limit and update the display
 
   char lead[10];
-  char str[30];
 
   left_limited = true;
-  left_limit = leadscrew;
-  sprintf(str, "%s%s%s", "shoulder.left_lim.bco=", nxDGREEN, NX_END);
-  Serial2.print(str);
-  sprintf(str, "%s%s%s", "shoulder.left_lim.txt=\"", leadStr(left_limit, lead), QTNX_END);
-  Serial2.print(str);
+  left_limit = leadscrewGet();
+  nextionSet(nf_left_bco, nxDGREEN);
+  nextionSet(nf_left_lim, leadStr(left_limit, lead));
 }
 
 void rightSet(void) {
   //Set the right limit and update the display
 
   char lead[10];
-  char str[30];
 
   right_limited = true;
-  right_limit = leadscrew;
-  sprintf(str, "%s%s%s", "shoulder.right_lim.bco=", nxDGREEN, NX_END);
-  Serial2.print(str);
-  sprintf(str, "%s%s%s", "shoulder.right_lim.txt=\"", leadStr(right_limit, lead), QTNX_END);
-  Serial2.print(str);
+  right_limit = leadscrewGet();
+  nextionSet(nf_right_bco, nxDGREEN);
+  nextionSet(nf_right_lim, leadStr(right_limit, lead));
 }
 
-void leftClr(bool wait) {
+void leftClr(void) {
   //Clear the limit and update the display
 
-  if (spin_rate != SPINDLE_STOPPED) {
+  if (spinRateGet() != SPINDLE_STOPPED) {
     //Refuse if the spindle is turning, for safety's sake
-    Serial2.print(F("shoulder.lclr_btn.bco2=RED\xFF\xFF\xFF"));
+    nextionSend(F("shoulder.lclr_btn.bco2=RED\xFF\xFF\xFF"));
   } else {
     left_limited = false;
-    Serial2.print(F("shoulder.left_lim.bco=33816\xFF\xFF\xFF"));
-    Serial2.print(F("shoulder.left_lim.txt=\"-----\"\xFF\xFF\xFF"));
-  }
-  if (wait) {
-    while (!Serial2.available()); //Wait for the release event
-    Serial2.print(F("shoulder.lclr_btn.bco2=1024\xFF\xFF\xFF"));
+    nextionSet(nf_left_bco, nxDBLUE);
+    nextionSet(nf_left_lim, "-----");
   }
 }
 
-void rightClr(bool wait) {
+void rightClr(void) {
   //Clear the limit and update the display
 
-  if (spin_rate != SPINDLE_STOPPED) {
+  if (spinRateGet() != SPINDLE_STOPPED) {
     //Refuse if the spindle is turning, for safety's sake
-    Serial2.print(F("shoulder.rclr_btn.bco2=RED\xFF\xFF\xFF"));
+    nextionSend(F("shoulder.rclr_btn.bco2=RED\xFF\xFF\xFF"));
   } else {
     right_limited = false;
-    Serial2.print(F("shoulder.right_lim.bco=33816\xFF\xFF\xFF"));
-    Serial2.print(F("shoulder.right_lim.txt=\"-----\"\xFF\xFF\xFF"));
-  }
-  if (wait) {
-    while (!Serial2.available()); //Wait for the release event
-    Serial2.print(F("shoulder.rclr_btn.bco2=1024\xFF\xFF\xFF"));
+    nextionSet(nf_right_bco, nxDBLUE);
+    nextionSet(nf_right_lim, "-----");
   }
 }
 
-void zeroSet(bool wait) {
+void zeroSet(void) {
   //Zero the leadscrew and clear the limits.
-  //Optionally wait for a button release event from the display.
 
-  if (spin_rate != SPINDLE_STOPPED) {
+  if (spinRateGet() != SPINDLE_STOPPED) {
     //Refuse if the spindle is turning, for safety's sake,
     //because having the spindle suddenly start moving could be bad.
-    Serial2.print(F("shoulder.zset_btn.bco2=RED\xFF\xFF\xFF"));
+    nextionSend(F("shoulder.zset_btn.bco2=RED\xFF\xFF\xFF"));
   } else {
+    pickupShift(leadscrewGet());      //The saved thread stays where it is on the work
     spin_count = 0;
+    ddaSync();
     leadscrew = 0L;
+    lead_update = true;
     left_limit = 0L;
     right_limit = 0L;
-    leftClr(!waitSerial2);
-    rightClr(!waitSerial2);
-  }
-  if (wait) {
-    while (!Serial2.available()); //Wait for the release event
-    Serial2.print(F("shoulder.zset_btn.bco2=1024\xFF\xFF\xFF"));
+    leftClr();
+    rightClr();
   }
 }
 
 void jogCheck(bool feed) {
-  //Decide whether it's safe to jog
-
-  unsigned long timer = millis();
-  long lead;
-
-  while (!Serial2.available()) {
-    //The button hasn't been released.
-    //Don't jog unless the Nextion button is held for 500ms.
-    //This needs to be extended to also jog from the toggle switch.
-    if ((millis() - timer) > 500UL) {
-      if (spin_rate != SPINDLE_STOPPED) {
-        //Refuse if the spindle is turning.
-        //I'm considering allowing creeping up on a shoulder and nudging the limit. It's on the list.
-        noJog(feed);
-      } else {
-        //Save the leadscrew position
-        lead = leadscrew;
-        //Spin the leadscrew
-        detachInterrupt(digitalPinToInterrupt(SPINDLE_A));    //No spindle interrupts
-        nextionJog(feed);
-        //Compensate the leadscrew value by the distance jogged
-        jogAdjust(leadscrew - lead);
-        attachInterrupt(digitalPinToInterrupt(SPINDLE_A), spindle, FALLING);
-      }
-    }
-  }
-  feed_left = feed;
+  //A direction button was pressed.
+  //It only becomes a jog if it's still held after JOG_HOLD, which uiTick() decides.
+  //This needs to be extended to also jog from the toggle switch.
+
+  ui_feed = feed;
+  ui_timer = millis();
+  ui_state = ui_jog_wait;
 }
 
-void nextionRamp(void) {
-  //Accelerate until the loop finishes at ICR4_MIN or the button is released
-  //This needs a little more work to handle parameter changes better
+void uiHold(const __FlashStringHelper *restore) {
+  //A limit or zero button was pressed, and its color needs restoring on release
 
-  unsigned int accel = ICR4_ACCEL;
-  unsigned int i, j;
+  ui_restore = restore;
+  ui_state = ui_release;
+}
 
-  //Smoothly accelerate
-  for ( j = ICR4_MAX ; j != ICR4_MIN ; /* decrement j index in inner loop */ ) {
-    for ( i = 32 ; i > 0 ; i--, j -= accel ) {
-      _icr4 = j;  //ICR4 updates from this in the interrupt handler for smoothness
-      if ( Serial2.available() ) break ;  //Direction button release message received
-      nextionLead();
-      delay( 50 );  //Determines the time to ramp up
-    }
-    if ( Serial2.available() ) break ;
-    accel = accel / 2;
+void uiTick(void) {
+  //Called on every scheduler pass to carry on with whatever button is held
+
+  switch (ui_state) {
+    case ui_jog_wait:
+      //Wait for the last move to finish slowing down, too
+      if ((millis() - ui_timer) > JOG_HOLD && !jogging) {
+        if (spinRateGet() != SPINDLE_STOPPED) {
+          //Refuse if the spindle is turning.
+          //I'm considering allowing creeping up on a shoulder and nudging the limit. It's on the list.
+          noJog(ui_feed);
+          ui_state = ui_nojog;
+        } else {
+          jogStart(ui_feed, PLAN_FOREVER);
+          ui_state = ui_jogging;
+        }
+      }
+      break;
+    default:
+      break;
   }
-  while ( !Serial2.available() ) {
-    //The jog button hasn't been released
-    //Still jogging at max speed, but need to keep the position updated
-    nextionLead();
-    delay( 25 );
+}
+
+void uiRelease(void) {
+  //The held button was let go
+
+  switch (ui_state) {
+    case ui_jog_wait:
+      //Just a press, so it only selects the direction
+      feed_left = ui_feed;
+      break;
+    case ui_jogging:
+      jogStop();
+      feed_left = ui_feed;
+      break;
+    case ui_nojog:
+      yesJog(ui_feed);
+      feed_left = ui_feed;
+      break;
+    case ui_release:
+      nextionSend(ui_restore);
+      break;
+    default:
+      break;
   }
+  ui_state = ui_idle;
 }
 
 void noJog(bool feed) {
-  //Change the direction button background RED
+  //Change the direction button background RED until it's released
 
   char str[30];
 
-  //Turn left or right button RED
-  //Then wait until the button is released
   if (feed) {
     //You're on a page with a left_btn, so no need for the page name
     sprintf(str, "%s%s%s", "left_btn.bco2=", "RED", NX_END);
-    Serial2.print(str);
-    while (!Serial2.available());
-    sprintf(str, "%s%s%s", "left_btn.bco2=", nxDGREEN, NX_END);
-    Serial2.print(str);
   } else {
     sprintf(str, "%s%s", "right_btn.bco2=RED", NX_END);
-    Serial2.print(str);
-    while (!Serial2.available());
+  }
+  nextionSend(str);
+}
+
+void yesJog(bool feed) {
+  //And back to green
+
+  char str[30];
+
+  if (feed) {
+    sprintf(str, "%s%s%s", "left_btn.bco2=", nxDGREEN, NX_END);
+  } else {
     sprintf(str, "%s%s%s", "right_btn.bco2=", nxDGREEN, NX_END);
-    Serial2.print(str);
   }
+  nextionSend(str);
 }
 
-void nextionFeed(FEED_TABLE *table, int i) {
+void nextionFeed(const FEED_TABLE *feed) {
   //Display the rate and pitch values
 
-  char nxstr[50];
-  char rate[20];
-
   //Changing the rate always clears the fault
   fault = false;
+  fault_count = 0;
 
-  sprintf(nxstr, "%s%s%s", "rpm.bco=", nxDBLUE, NX_END);
-  Serial2.print(nxstr);
-
-  sprintf(rate, "%s%s", table[i].rate, QTNX_END);
+  nextionSet(nf_rpm_bco, nxDBLUE);
 
-  //Unfortunately, this has to be sent to all three pages
-  sprintf(nxstr, "%s%s", "start.rate.txt=\"", rate);
-  Serial2.print(nxstr);
-  sprintf(nxstr, "%s%s", "shoulder.rate.txt=\"", rate);
-  Serial2.print(nxstr);
-  sprintf(nxstr, "%s%s", "setup.rate.txt=\"", rate);
-  Serial2.print(nxstr);
+  //Unfortunately, this has to be sent to all three pages.
+  //Only the ones that changed actually go out.
+  nextionSet(nf_start_rate, feed->rate);
+  nextionSet(nf_shoulder_rate, feed->rate);
+  nextionSet(nf_setup_rate, feed->rate);
 
-  sprintf(rate, "%s%s", table[i].pitch, QTNX_END);
-
-  sprintf(nxstr, "%s%s", "start.pitch.txt=\"", rate);
-  Serial2.print(nxstr);
-  sprintf(nxstr, "%s%s", "shoulder.pitch.txt=\"", rate);
-  Serial2.print(nxstr);
-  sprintf(nxstr, "%s%s", "setup.pitch.txt=\"", rate);
-  Serial2.print(nxstr);
+  nextionSet(nf_start_pitch, feed->pitch);
+  nextionSet(nf_shoulder_pitch, feed->pitch);
+  nextionSet(nf_setup_pitch, feed->pitch);
 }
 
 void nextionLeft(void) {
   //"Click" the left direction button
 
-  Serial2.print(F("click left_btn,1\xFF\xFF\xFF"));
-  Serial2.print(F("click left_btn,0\xFF\xFF\xFF"));
+  nextionSend(F("click left_btn,1\xFF\xFF\xFF"));
+  nextionSend(F("click left_btn,0\xFF\xFF\xFF"));
 }
 
 void nextionRight(void) {
   //Click the right direction button
 
-  Serial2.print(F("click right_btn,1\xFF\xFF\xFF"));
-  Serial2.print(F("click right_btn,0\xFF\xFF\xFF"));
+  nextionSend(F("click right_btn,1\xFF\xFF\xFF"));
+  nextionSend(F("click right_btn,0\xFF\xFF\xFF"));
 }
 
 void nextionDirection(void) {
@@ -505,12 +645,14 @@ void nextionDirection(void) {
 
 void nextionUseRPM(void) {
   //Blank the RPM values on the SETUP screen that are too high for the current feed rate
-  //"Too high" is defined as driving the stepper faster than 1500rpm.
+  //"Too high" is defined as driving the stepper faster than 1500rpm,
+  //or not leaving time for a full burst of steps between spindle ticks.
 
   int i;
+  unsigned int rpm_max = maxRPM(steps_per_rev);
 
   for ( i=0 ; i<12 ; i++ ) {
-    if (steps_per_rev * (long)rpm_table[i] >= STEPPER_LIMIT) {
+    if (rpm_table[i] >= rpm_max) {
       rpmHide(i);
     } else {
       rpmShow(i);
@@ -519,17 +661,11 @@ void nextionUseRPM(void) {
 }
 
 void rpmHide(int i) {
-  char str[30];
-
-  sprintf(str, "%s%s%s%s", "setup.", nxrpmID[i], ".pco=33816", NX_END);
-  Serial2.print(str);
+  nextionSet(nf_rpm_pco + i, nxDBLUE);
 }
 
 void rpmShow(int i) {
-  char str[30];
-
-  sprintf(str, "%s%s%s%s", "setup.", nxrpmID[i], ".pco=WHITE", NX_END);
-  Serial2.print(str);
+  nextionSet(nf_rpm_pco + i, "WHITE");
 }
 
 
@@ -542,62 +678,147 @@ void rpmShow(int i) {
 **************************************/
 
 int pitchFind(const char *pitch) {
-  //Search the feed table for the pitch string and return the index.
+  //Search the feed table for the pitch string and return the index, or the
+  //first entry if it isn't there.
   //I got tired of doing this manually every time I changed the table.
 
   int i;
 
   for (i = 0 ; i < INCHES ; i++) {
-    if (strcmp(inch[i].pitch, pitch) == 0) return i;
+    if (strcmp_P(pitch, inch[i].pitch) == 0) return i;
   }
+  return 0;
 }
 
 int rateFind(const char *rate){
-  //Search the feed table for the rate string and return the index.
+  //Search the feed table for the rate string and return the index, or the
+  //first entry if it isn't there.
 
   int i;
 
   for (i = 0 ; i < METRICS ; i++) {
-    if (strcmp(metric[i].rate, rate) == 0) return i;
+    if (strcmp_P(rate, metric[i].rate) == 0) return i;
   }
+  return 0;
+}
+
+unsigned int maxRPM(int steps_per) {
+  //Highest spindle RPM for a pitch, limited either by the stepper speed
+  //or by the time it takes to output a burst of steps at period_list[] rate.
+
+  int spt;            //Maximum steps per spindle tick
+  long limit;
+#ifdef CROSS_SLIDE
+  long xlimit;
+#endif
+
+  spt = (steps_per + SCPR - 1) / SCPR;
+  limit = machine.stepper_limit / steps_per;
+
+#ifdef STEP_CONTINUOUS
+  //The steps are spread over 3/4 of the tick, but no faster than STP_MIN
+  if (T4CPM / 4 * 3 / ((long)SCPR * spt * STP_MIN) < limit)
+    limit = T4CPM / 4 * 3 / ((long)SCPR * spt * STP_MIN);
+#else
+  //Burst time in TC4 counts has to fit within one spindle tick
+  if (T4CPM / ((long)SCPR * spt * period_list[spt]) < limit)
+    limit = T4CPM / ((long)SCPR * spt * period_list[spt]);
+#endif
+
+#ifdef CROSS_SLIDE
+  //The cross-slide's steps have to keep up too, and facing doesn't step the leadscrew at all
+  if (cross_mode != cross_off) {
+    xlimit = crossMaxRPM(steps_per);
+    if (cross_mode == cross_face || xlimit < limit)
+      limit = xlimit;
+  }
+#endif
+
+  return limit;
 }
 
 void feedSelect(int fmode) {
   //Fill the step lookup table according to mode and feed rate, and update the display.
 
-  //Default to 40tpi, 0.5mm, and lowest diametral and module.
-  static int i[4] = {pitchFind("  40"), rateFind("  0.5 "), 0, 0};
+  int *i = feed_index;
 
   switch (fmode) {
     case inch_feed:
       i[fmode] = knobCount(i[fmode], INCHES);   //Update and remember the rate
-      feedFill(inch[i[fmode]].steps);           //Update the lookup table
-      //Serial.println(inch[i[fmode]].steps);
-      nextionFeed(inch, i[fmode]);              //Update the display
-      nextionUseRPM();
+      feedSet(inch, i[fmode]);
       break;
     case metric_feed:
       i[fmode] = knobCount(i[fmode], METRICS);
-      feedFill(metric[i[fmode]].steps);
-      //Serial.println(metric[i[fmode]].steps);
-      nextionFeed(metric, i[fmode]);
-      nextionUseRPM();
+      feedSet(metric, i[fmode]);
       break;
     case diametral_feed:
       i[fmode] = knobCount(i[fmode], DIAMETRALS);
-      feedFill(diametral[i[fmode]].steps);
-      //Serial.println(diametral[i[fmode]].steps);
-      nextionFeed(diametral, i[fmode]);
-      nextionUseRPM();
+      feedSet(diametral, i[fmode]);
       break;
     case module_feed:
       i[fmode] = knobCount(i[fmode], MODULES);
-      feedFill(module[i[fmode]].steps);
-      //Serial.println(module[i[fmode]].steps);
-      nextionFeed(module, i[fmode]);
-      nextionUseRPM();
+      feedSet(module, i[fmode]);
+      break;
+    case custom_feed:
+      knobCount(0, 1);                          //The knob doesn't do anything here
+      customSet();
+      break;
+  }
+}
+
+void feedShow(void) {
+  //Send the feed to the display again without changing it
+
+  FEED_TABLE feed;
+
+  switch (feed_mode) {
+    case inch_feed:
+      feedGet(inch, feed_index[inch_feed], &feed);
+      break;
+    case metric_feed:
+      feedGet(metric, feed_index[metric_feed], &feed);
+      break;
+    case diametral_feed:
+      feedGet(diametral, feed_index[diametral_feed], &feed);
+      break;
+    case module_feed:
+      feedGet(module, feed_index[module_feed], &feed);
       break;
+    case custom_feed:
+      customShow();
+      return;
   }
+  nextionFeed(&feed);
+  nextionUseRPM();
+}
+
+void feedGet(const FEED_TABLE *table, int i, FEED_TABLE *feed) {
+  //Copy a feed table entry out of flash, with the steps for the machine profile
+
+  byte kind;
+
+  if (table == inch)
+    kind = inch_feed;
+  else if (table == metric)
+    kind = metric_feed;
+  else if (table == diametral)
+    kind = diametral_feed;
+  else
+    kind = module_feed;
+  memcpy_P(feed, &table[i], sizeof(FEED_TABLE));
+  machineSteps(kind, feed->thou, machine, &feed->steps, &feed->error);   //machineCheck() made sure it fits
+}
+
+void feedSet(const FEED_TABLE *table, int i) {
+  //Switch to a feed table entry
+
+  FEED_TABLE feed;
+
+  feedGet(table, i, &feed);
+  feedFill(feed.steps);           //Update the lookup table
+  //Serial.println(feed.steps);
+  nextionFeed(&feed);             //Update the display
+  nextionUseRPM();
 }
 
 char *leadStr(long lead, char *leadstr) {
@@ -610,15 +831,17 @@ char *leadStr(long lead, char *leadstr) {
     sign = '-';
   else
     sign = ' ';
-  if (feed_mode == inch_feed || feed_mode == diametral_feed) {
+  int units = (feed_mode == custom_feed) ? custom_kind : (int)feed_mode;
+
+  if (units == inch_feed || units == diametral_feed) {
     //Format in inches
-    whole = abs(lead) / LSPI;
-    fraction = (abs(lead) * 10 / LSPM10) % 1000;          //Scale to 0.001"
+    whole = abs(lead) / machine.lspi;
+    fraction = (abs(lead) * 10 / machine.lspm10) % 1000;  //Scale to 0.001"
     sprintf(leadstr, "%c%d.%03d", sign, whole, fraction );
   } else {
     //Format in millimeters with extra precision
-    whole = abs(lead) * 10 / LSPMM10;  //Lead is a long, so the long calculation is cast to int
-    fraction = (abs(lead) * 10 % LSPMM10) * 100 / LSPMM10;  //Scale to .01mm
+    whole = abs(lead) * 10 / machine.lspmm10;  //Lead is a long, so the long calculation is cast to int
+    fraction = (abs(lead) * 10 % machine.lspmm10) * 100 / machine.lspmm10;  //Scale to .01mm
     sprintf(leadstr, "%c%d.%02d", sign, whole, fraction );
   }
   return (leadstr);
@@ -627,10 +850,12 @@ char *leadStr(long lead, char *leadstr) {
 void feedFill(int steps_per) {
   //Distribute the steps evenly around one spindle rotation
 
-  int i;
   int spsc;           //Steps per spindle count
   int rem;            //Remainder
+#ifndef STEP_DDA
+  int i;
   int sum = 0;        //For accumulating remainders
+#endif
 
   steps_per_rev = steps_per;
 
@@ -642,6 +867,10 @@ void feedFill(int steps_per) {
   if (rem)
     max_steps++;
 
+#ifdef STEP_DDA
+  //The spindle interrupt does the distributing
+  ddaSet(steps_per, SCPR);
+#else
   for (i = 0; i < SCPR; i++) {
     step_table[i] = spsc;
     sum += rem;
@@ -651,23 +880,62 @@ void feedFill(int steps_per) {
       sum -= SCPR;
     }
   }
+#endif
   pwmPeriodSet();
 }
 
-int spinAvg(unsigned int rate) {
-  //Average 16 spindle rate readings for RPM calculation.
+void feedRatio(unsigned long num, unsigned long den) {
+  //Like feedFill(), for steps per spindle count of num/den, which needn't come
+  //out to a whole number of steps per revolution.
+
+#ifdef STEP_DDA
+  steps_per_rev = ((unsigned long long)num * SCPR + den - 1) / den;
+  max_steps = (num + den - 1) / den;
+  ddaSet(num, den);
+  pwmPeriodSet();
+#else
+  //The lookup table repeats every revolution, so customRatio() has already rounded it
+  feedFill(((unsigned long long)num * SCPR + den / 2) / den);
+#endif
+}
 
-  static unsigned int spin[16];
-  unsigned long sum = 0L;
-  static int i = 0;
-  int j;
+#ifdef STEP_DDA
+void ddaSet(unsigned long num, unsigned long den) {
+  //Load the accumulator with steps per spindle count of num/den
 
-  spin[i++] = rate;
-  if (i == 16)
-    i = 0;
-  for (j = 0; j < 16; j++)
-    sum += spin[j];
-  return sum / 16;
+  noInterrupts();
+  dda_whole = num / den;
+  dda_rem = num % den;
+  dda_den = den;
+  interrupts();
+  ddaSync();
+}
+#endif
+
+void ddaSync(void) {
+  //Bring the step accumulator in line with spin_count after it has been changed.
+  //Nothing to do when the steps come from the lookup table.
+
+#ifdef STEP_DDA
+  //(spin_count * dda_rem) % dda_den by shift and subtract, because a 64-bit
+  //multiply and divide would keep interrupts off for too long
+  unsigned int bit;
+  long acc = 0;
+
+  noInterrupts();
+  for (bit = 0x8000; bit; bit >>= 1) {
+    acc <<= 1;
+    if (acc >= dda_den)
+      acc -= dda_den;
+    if (spin_count & bit) {
+      acc += dda_rem;
+      if (acc >= dda_den)
+        acc -= dda_den;
+    }
+  }
+  dda_acc = acc;
+  interrupts();
+#endif
 }
 
 void spinModulus(bool ccw) {
@@ -680,12 +948,26 @@ void spinModulus(bool ccw) {
     } else {
       spin_count = 0;
     }
+    if (++spin_index == SCPR)
+      spin_index = 0;
+#ifdef STEP_DDA
+    //Carry the remainder forward
+    if ((dda_acc += dda_rem) >= dda_den)
+      dda_acc -= dda_den;
+#endif
   } else {
     if (spin_count > 0) {
       spin_count--;
     } else {
       spin_count = SCPR - 1;
     }
+    if (--spin_index < 0)
+      spin_index = SCPR - 1;
+#ifdef STEP_DDA
+    //Or back
+    if ((dda_acc -= dda_rem) < 0)
+      dda_acc += dda_den;
+#endif
   }
 }
 
@@ -704,26 +986,41 @@ void jogAdjust(long jog_count) {
   if ((spin_count -= jog_adjust) < 0) {
     spin_count += SCPR;
   }
+  ddaSync();
 }
 
-void nextionJog(bool feed) {
-  //While the direction button is held, advance the leadscrew with smooth acceleration
+void jogStart(bool feed, long count) {
+  //Start moving the leadscrew count steps, or until jogStop(),
+  //with the acceleration and deceleration handled by the planner
 
-  //Save the timer registers
-  volatile int icr4 = ICR4;
-  volatile int tcnt4 = TCNT4;
+  //Save the leadscrew position and the timer registers
+  jog_lead = leadscrewGet();
+  jog_icr4 = ICR4;
+  jog_tcnt4 = TCNT4;
 
-  jogging = true;
+  spindleDetach();                    //No spindle interrupts
 
-  pwmOn(feed);
+  planMove(feed, count);
+}
+
+void jogStop(void) {
+  //The direction button was released, so start slowing down.
+  //jogFinish() puts things back when the planner is done.
 
-  nextionRamp();
+  planStop();
+}
+
+void jogFinish(void) {
+  //The planner stopped the move (ev_move_done)
 
-  pwmOff();
   jogging = false;
 
-  TCNT4 = tcnt4;    //Restore the timer registers
-  ICR4 = icr4;
+  TCNT4 = jog_tcnt4;    //Restore the timer registers
+  ICR4 = jog_icr4;
+
+  //Compensate the leadscrew value by the distance jogged
+  jogAdjust(leadscrewGet() - jog_lead);
+  spindleAttach();
 }
 
 void knobCheck(void) {
@@ -754,9 +1051,6 @@ void toggleCheck(void) {
 
   //I intend to add the jog function to the toggle switch, but haven't gotten to it yet.
 
-  unsigned long timer = millis();
-  long lead;
-
   volatile int this_left = digitalRead(LEFT_MOM);
   volatile int this_right = digitalRead(RIGHT_MOM);
   static int last_left;
@@ -802,18 +1096,32 @@ void pcint4Enab(void) {
   EIMSK |= _BV(INT4);
 }
 
-void tc3Init(void) {
-  // Configure TC3 for checking spindle speed
-
-  TCCR3A  = _BV(COM3A0);    //Because the high byte doesn't increment in '00' mode
-  TCCR3B  = _BV(CS30);      //Run TCNT3 at 16Mhz to get better RPM resolution at high speed
-  tc3.low = TCNT3;          //Initialize to the current value of the counter
+void spindleAttach(void) {
+  //Spindle encoder interrupts.
+  //Falling edges are sharper, and generally provide better noise margin,
+  //but x4 decoding needs both edges of both phases.
+
+#ifdef SPINDLE_X4
+  quad_last = quadState();            //Start from wherever the encoder is sitting
+  extAttach(EXT_INT(SPINDLE_A), EXT_CHANGE);
+  extAttach(EXT_INT(SPINDLE_B), EXT_CHANGE);
+#elif defined(SPINDLE_ICP)
+  TIFR5 = _BV(ICF5);                  //Forget an edge captured while detached
+  TIMSK5 |= _BV(ICIE5);               //The capture unit is set to falling edges, see timebaseInit()
+#else
+  extAttach(EXT_INT(SPINDLE_A), EXT_FALLING);
+#endif
 }
 
-void tc3Enab(void) {
-  //Enable TC3 overflow interrupt
-
-  TIMSK3  = _BV(TOIE3);
+void spindleDetach(void) {
+#ifdef SPINDLE_ICP
+  TIMSK5 &= ~_BV(ICIE5);
+#else
+  extDetach(EXT_INT(SPINDLE_A));
+#endif
+#ifdef SPINDLE_X4
+  extDetach(EXT_INT(SPINDLE_B));
+#endif
 }
 
 void tc4Init(void) {
@@ -857,11 +1165,131 @@ void pwmPeriodSet(void) {
   //Set the period value according to the number of steps per spindle tick.
   //Update ICR4 with interrupts off since it's not double-buffered.
 
+  unsigned int rpm = maxRPM(steps_per_rev);
+  long limit = rpm ? machine.rpm_scale / rpm : SPEED_LIMIT_MAX;
+#ifndef STEP_CONTINUOUS
+  unsigned int period = period_list[max_steps];
+#endif
+
+  if (limit > SPEED_LIMIT_MAX)
+    limit = SPEED_LIMIT_MAX;
   noInterrupts();
-  ICR4 = period_list[max_steps];
+  PROF_START(masked_time);
+#ifdef STEP_CONTINUOUS
+  //stepLoad() sets the period for every tick
+#else
+  if (jogging) {
+    //The planner has ICR4, and jogFinish() puts this back
+    jog_icr4 = period;
+    if (jog_tcnt4 > period - PUL_MIN)
+      jog_tcnt4 = period - PUL_MIN;
+  } else if (TCCR4B & _BV(CS41)) {
+    //A train is going out.  If the counter is already past the new TOP it would
+    //run on round 0xFFFF, so bring the next pulse forward, the same as stepLoad()
+    //does in continuous mode.  A pulse in progress has TCNT4 < PUL_MIN.
+    TCCR4B = _BV(WGM43) | _BV(WGM42);
+    if (TCNT4 > period - PUL_MIN)
+      TCNT4 = period - PUL_MIN;
+    ICR4 = period;
+    TCCR4B = _BV(WGM43) | _BV(WGM42) | _BV(CS41);
+  } else {
+    ICR4 = period;
+    TCNT4 = period - PUL_MIN;   //First pulse immediately, as the TIMER4 interrupt leaves it
+  }
+#endif
+#ifdef STEP_CONTINUOUS
+  step_recip = STEP_SPREAD / max_steps;
+#endif
+  step_lag_max = STEP_LAG_TICKS * max_steps;
+  speed_limit = limit;
+  PROF_END(prof_masked, masked_time);
   interrupts();
 }
 
+#ifdef STEP_CONTINUOUS
+inline unsigned int stepPeriod(void) {
+  //The step period that spreads max_steps over this spindle tick.
+  //The last spindle period is the best guess at how long this one will be.
+
+  unsigned int period = spinNext();
+
+  if (period != SPINDLE_STOPPED) {
+    period = ((unsigned long)period * step_recip) >> 16;
+    if (period < STP_MIN)
+      period = STP_MIN;
+  } else {
+    //Just starting up, so there's no measurement yet
+    period = period_list[max_steps];
+  }
+  return period;
+}
+#endif
+
+inline byte stepLoad(bool feed) {
+  //Load the steps for this spindle tick and set the step period.
+  //Returns the number of steps, and the caller turns on the PWM if it's non-zero.
+
+  static bool burst_left;     //Direction of the steps in progress
+#ifdef STEP_CONTINUOUS
+  unsigned int period = stepPeriod();
+#endif
+
+#ifdef CROSS_SLIDE
+  if (cross_mode != cross_off) {
+    //The cross-slide has to be able to take the steps still going out and this
+    //tick's, and with facing it takes them instead of the leadscrew (see Cross.h)
+    if (crossBlocked(feed, steps + TICK_STEPS)) {
+      stepHold(hold_cross);
+      return 0;
+    }
+    if (cross_mode == cross_face) {
+      crossFollow(feed, TICK_STEPS);
+      return 0;
+    }
+  }
+#endif
+
+  if (steps) {
+    //The last tick's steps aren't finished.  Add this tick's steps to the end of
+    //the train, so the leadscrew catches back up with the spindle.
+    //If the train is going the other way, or has fallen too far behind, the
+    //train finishes and the feed is held (see Steps.h).
+    stepLag(steps);
+    if (feed == burst_left && steps <= step_lag_max) {
+#ifdef STEP_CONTINUOUS
+      //The period was set from the last tick, which may have been much slower.
+      //ICR4 isn't double-buffered, so stop the clock to change it, and bring
+      //the next pulse forward if the counter is already past the new TOP.
+      //A pulse in progress has TCNT4 < PUL_MIN and is left alone.
+      if (period < ICR4) {
+        TCCR4B = _BV(WGM43) | _BV(WGM42);
+        if (TCNT4 > period - PUL_MIN)
+          TCNT4 = period - PUL_MIN;
+        ICR4 = period;
+        TCCR4B = _BV(WGM43) | _BV(WGM42) | _BV(CS41);
+      }
+#endif
+      //Count the steps that have gone out, so burst only holds what's still to go.
+      //A train can carry on for a long time at the limit, and burst is a byte.
+      if (PORTH & _BV(DIR_N))
+        leadscrew -= burst - steps;
+      else
+        leadscrew += burst - steps;
+      steps += TICK_STEPS;
+      return (burst = steps);
+    }
+    stepHold(hold_lag);
+    return 0;
+  }
+#ifdef STEP_CONTINUOUS
+  //The clock is stopped, so it's safe to change the period
+  ICR4 = period;
+  TCNT4 = period - PUL_MIN;   //First pulse is output immediately
+#endif
+  burst_left = feed;
+  return (steps = burst = TICK_STEPS);
+}
+
 
 /********************************************************
 *********************************************************
@@ -871,21 +1299,72 @@ void pwmPeriodSet(void) {
 *********************************************************
 ********************************************************/
 
-void spindle(void) {
-  //This interrupt is called on falling edges of SPINDLE_A
-
+ISR(SPINDLE_VECT) {
+  //This interrupt is called on falling edges of SPINDLE_A,
+  //or on every edge of SPINDLE_A and SPINDLE_B with x4 decoding.
+  //With SPINDLE_ICP it's TC5's capture interrupt, still on falling edges of SPINDLE_A.
+
+#ifdef SPINDLE_ICP
+  unsigned int edge = ICR5;           //Latched by the capture unit at the edge
+  PROF_START(isr_time);
+  PROF_END(prof_spindle_lat, edge);   //How long since, see Profile.h
+#else
+  unsigned int edge = SPIN_TCNT;      //First, so the time doesn't depend on the path below
+  PROF_START(isr_time);
+#endif
   bool feeding_left;
+#ifdef ELS_TELEMETRY
+  bool overrun = false;
+#endif
   static bool last_feed = feed_left;  //Just for the first time
 
+#ifdef SPINDLE_X4
+  byte quad = quadState();
+  byte changed = quad ^ quad_last;
+  signed char dir = quad_table[(quad_last << 2) | quad];
+
+  quad_last = quad;
+  if (dir == 0) {
+    //Either nothing changed (a bounce that settled back) or both did
+    if (changed == 3) {
+      quad_glitches++;
+      //An interrupt was missed, but its edge still happened, so the diagnostics
+      //are told about the falling ones or they'd count them as missing
+      if (!(quad & 2))
+        ChannelCheck (&AHealth, spinExtend(edge), 'A');
+      if (!(quad & 1))
+        ChannelCheck (&BHealth, spinExtend(edge), 'B');
+    }
+    PROF_END(prof_spindle, isr_time);
+    return;
+  }
+#endif
+
+  spinEdge(edge);       //Sets spin_rate, see Timebase.h
+  speedEdge();
+  if (synced && !jogging && speedOver(0))
+    stepHold(hold_speed); //Before the steps can't keep up, see Speed.h
+
   // First check if all steps have been sent from the last time.
   // If steps are left over, the spindle is going too fast for the feed rate.
-  // A fault here will cause the displayed RPM to turn red, but nothing stops.
+  // A fault here will cause the displayed RPM to turn red, and stepLoad() either
+  // carries the steps into this tick or holds the feed (see Steps.h).
   // Things can get strange with the driver if the difference is too extreme.
   // Several times it has seemed to trip something so that both driver status LED's went out.
   // Turning it off for a couple of minutes has reset it so far, so thermal protection?
 
-  if (steps != 0)
+  if (steps != 0) {
     fault = true;
+    fault_count++;
+#ifdef ELS_TELEMETRY
+    overrun = true;
+#endif
+  }
+
+  //A feed that never engaged at a sync count, the one from power up or one whose
+  //rate was changed while it fed, is on its thread from here, so a hold can find it
+  if (synced && steps == 0 && engage_steps != steps_per_rev)
+    pickupMark();
 
   // SPINDLE_A brought us here, now determine the direction it's turning.
   // The lathe's reverse lever position isn't known.  I keep it in the latched-down position.
@@ -899,11 +1378,15 @@ void spindle(void) {
   // since adding 2k external pull-up resistors to the Arduino inputs to speed up the rising edges.
   // The Arduino's internal pull-ups were just too big and slow.
 
-  if (digitalRead(SPINDLE_B)) {   //Spindle is turning CCW if B is high
+#ifdef SPINDLE_X4
+  spinModulus(spin_ccw = (dir > 0));
+#else
+  if (FastPin<SPINDLE_B>::read()) {   //Spindle is turning CCW if B is high
     spinModulus(spin_ccw = true);
   } else {
     spinModulus(spin_ccw = false);
   }
+#endif
 
   if (feed_left != last_feed) {
     //Changed direction, so remember sync count
@@ -919,17 +1402,21 @@ void spindle(void) {
   //Save a few clock cycles later
   feeding_left = (spin_ccw && feed_left) || (!spin_ccw && !feed_left);
 
-  if (feeding_left) {
+  if (jogging) {
+    //The threading cycle is returning to the start limit, see ThreadCycle.ino.
+    //Keep counting so the phase is right when it gets there, but don't step.
+  } else if (feeding_left) {
     if (synced) {
       //Is feeding left possible?
       if ( !left_limited || (leadscrew > left_limit) ) {
         //Turn on PWM if steps is non-zero.
-        if (steps = step_table[spin_count]) {
+        if (stepLoad(feeding_left)) {
           pwmOn(feeding_left);
         }
       } else {
         //The left limit was just reached
         synced = false;
+        eventPut(ev_left_limit);
         if (spin_count) {
           lsync_count = SCPR - spin_count;
         } else {
@@ -940,21 +1427,27 @@ void spindle(void) {
       //Hit the right limit last time, so wait for sync before going left
       if (spin_count == rsync_count) {
         synced = true;
+        cycleEngage();
+        pickupMark();
+        eventPut(ev_synced);
       }
     } else if (!left_limited || (leadscrew > left_limit)) {
       //It was an on-the-fly direction change
       if (spin_count == sync_count) {
         synced = true;
+        pickupMark();
+        eventPut(ev_synced);
       }
     }
   } else {
     if (synced) {
       if ( !right_limited || (leadscrew < right_limit) ) {
-        if (steps = step_table[spin_count]) {
+        if (stepLoad(feeding_left)) {
           pwmOn(feeding_left);
         }
       } else {
         synced = false;
+        eventPut(ev_right_limit);
         if (spin_count) {
           rsync_count = SCPR - spin_count;
         } else {
@@ -964,49 +1457,92 @@ void spindle(void) {
     } else if (left_limited && (leadscrew <= left_limit)) {
       if (spin_count == lsync_count) {
         synced = true;
+        cycleEngage();
+        pickupMark();
+        eventPut(ev_synced);
       }
     } else if (!right_limited || (leadscrew < right_limit)) {
       if (spin_count == sync_count) {
         synced = true;
+        pickupMark();
+        eventPut(ev_synced);
       }
     }
   }
 
   last_feed = feed_left;
 
-  tc3.low = TCNT3;  //tc3.high is handled by the counter overflow interrupt
-  spin_rate = tc3.count - last_tc3;
-  last_tc3 = tc3.count;
-  
+#ifdef ELS_TELEMETRY
+  tlmTick(overrun);
+#endif
+
   /*
    * Call diagnostic code ISR MJMN Jan 2021
    */
+#ifdef SPINDLE_X4
+  //Only the falling edges, which are what the diagnostics expect
+  if ((changed & 2) && !(quad & 2))
+    AChannelISR ();
+  if ((changed & 1) && !(quad & 1))
+    BChannelISR ();
+#else
   AChannelISR ();
+#endif
+  PROF_END(prof_spindle, isr_time);
 }
 
-void knob(void) {
+#ifdef SPINDLE_X4
+//Both phases do the same decoding
+ISR(EXT_VECT(SPINDLE_B), ISR_ALIASOF(SPINDLE_VECT));
+#endif
+
+ISR(EXT_VECT(KNOB_A)) {
   //This interrupt is called by KNOB_A
   //It really just keeps track of the direction of the click.
 
-  if (digitalRead(KNOB_B)) {
-    knob_count-- ;
+  PROF_START(isr_time);
+  if (FastPin<KNOB_B>::read()) {
+    eventPut(ev_knob_down);
   } else {
-    knob_count++ ;
+    eventPut(ev_knob_up);
   }
+  PROF_END(prof_knob, isr_time);
 }
 
-ISR(TIMER3_OVF_vect) {
-  // TIMER3 provides the master clock for determining spindle speed.
+ISR(PCINT0_vect) {
+  //SPINDLE_Z and ALARM are the pin change interrupts enabled on PORTB.
+  //They interrupt on both edges, and either can change without the other,
+  //so each is compared with how it was last time.
+
+  byte pins = FastPin<SPINDLE_Z>::in();
+  byte changed = pins ^ pinb_last;
+
+  pinb_last = pins;
+  if ((changed & _BV(FastPin<SPINDLE_Z>::bit)) && !(pins & _BV(FastPin<SPINDLE_Z>::bit))) {
+    //The falling edge of Z is the index
+    spinIndex();          //Keep spin_count honest, see Index.h
+    ZChannelISR();        //And the encoder diagnostics' count per rev
+  }
+  if ((changed & _BV(FastPin<ALARM>::bit)) && alarmActive(pins)) {
+    stepStop();           //The driver isn't following, see Steps.h
+    stepHold(hold_alarm);
+  }
+}
+
+ISR(SPIN_OVF_vect) {
+  // TIMER3, or TIMER5 with SPINDLE_ICP, provides the master clock for determining spindle speed.
   // This interrupt counts 16-bit timer overflows to extend the precision.
   // It also provides a convenient place to check whether the spindle is moving.
 
-  tc3.count += 0x10000;
+  spin_high++;
 
-  // Detect that the spindle has stopped
-  if (spin_rate == last_spin)
+  // Detect that the spindle has stopped: every edge clears spin_idle, so if it's
+  // still set there was no edge for a whole overflow.
+  if (spin_idle) {
     spin_rate = SPINDLE_STOPPED;
-
-  last_spin = spin_rate;
+    spin_edge_count = 0;
+  }
+  spin_idle = true;
 }
 
 ISR(TIMER4_COMPA_vect) {
@@ -1014,11 +1550,12 @@ ISR(TIMER4_COMPA_vect) {
   // resets the counter for the next spindle tick according to feed rate,
   // and keeps track of the carriage movement.
 
-  static int i;
-
+  PROF_COMPARE(prof_timer4_lat, 4);   //First, see Profile.h
+  PROF_START(isr_time);
   if (!jogging) {
     if (--steps == 0) {   //Get out fast if there's another step coming
       pwmOff();
+      eventSteps();
 
       //The clock is stopped, so TCNT4 is no longer incrementing.
       //Now, preload TCNT4 so that the first step pulse will be
@@ -1028,20 +1565,32 @@ ISR(TIMER4_COMPA_vect) {
 
       //When feeding, the granularity of the leadscrew value
       //is determined by counts per spindle tick.
-      if (FEEDING_LEFT) {
-        leadscrew -= step_table[spin_count];
+      //Carried-over steps are included.
+      if (PORTH & _BV(DIR_N)) {   //The way the train went, even if the spindle has reversed since
+        leadscrew -= burst;
       } else {
-        leadscrew += step_table[spin_count];
+        leadscrew += burst;
       }
     }
   } else {
-    //Synchronously update ICR4 here for smoother acceleration
-    ICR4 = _icr4;
     //When jogging, the leadscrew is incremented/decremented by one
     if (PORTH & _BV(DIR_N)) {   //Cheat a little here and read the bit directly
       --leadscrew;
     } else {
       ++leadscrew;
     }
+    eventSteps();
+    //Synchronously update ICR4 here for smoother acceleration
+    if (planStep()) {
+      pwmOff();
+      eventPut(ev_move_done);
+    }
   }
+
+#ifdef CROSS_SLIDE
+  //The cross-slide follows every step, after the clock has been seen to (see Cross.h)
+  if (cross_mode == cross_taper)
+    crossStep(PORTH & _BV(DIR_N));
+#endif
+  PROF_END(prof_timer4, isr_time);
 }
@@ -0,0 +1,134 @@
+// Copyright (c) 2020 Jon Bryan
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+//================================================================================
+//
+//  Step pipeline benchmark
+//
+//  Enabled by defining ELS_BENCHMARK in configuration.h.
+//
+//  At startup every entry in the inch, metric, diametral and module tables is
+//  listed on the debug port with its steps per revolution, their rounding error
+//  in parts per million, the largest burst of steps per spindle tick, the time
+//  that burst takes at the period_list[] rate, and the maximum spindle RPM
+//  allowed by maxRPM().  The tick budget is the time
+//  between spindle ticks at that RPM, in 16Mhz clock cycles, so the margin left
+//  over for the spindle and TIMER4 interrupts is the budget less the burst.
+//  The spindle interrupt rate at that RPM is listed too, since it goes up four
+//  times with SPINDLE_X4.  tools/els_sim.cpp runs the sketch on the PC with
+//  estimated interrupt costs and shows what that rate does to the CPU load.
+//
+//  While running, the spindle RPM is printed along with the step overrun count,
+//  the most steps left over at a tick and the feed holds (see Steps.h),
+//  the display queue depth and throughput, and the events lost to a full ring
+//  (see Events.h), so a change can be checked against the same numbers on the
+//  lathe.
+//
+//================================================================================
+
+#ifdef ELS_BENCHMARK
+
+void benchmarkReport(void) {
+  //Print the budget for every feed table entry
+
+  Serial.println(F("table  pitch    rate  steps   ppm max period burst budget maxrpm  irq/s"));
+  benchmarkTable("inch  ", inch, INCHES);
+  benchmarkTable("metric", metric, METRICS);
+  benchmarkTable("diam  ", diametral, DIAMETRALS);
+  benchmarkTable("module", module, MODULES);
+}
+
+void benchmarkTable(const char *name, const FEED_TABLE *table, int size) {
+  //Print the budget for one table
+
+  char str[80];
+  int i;
+  FEED_TABLE feed;
+  int spt;                  //Maximum steps per spindle tick
+  unsigned int rpm;
+  unsigned long burst;      //16Mhz cycles to output the largest burst
+  unsigned long budget;     //16Mhz cycles between spindle ticks at maximum RPM
+  unsigned long irqs;       //Spindle interrupts per second at maximum RPM
+
+  for (i = 0; i < size; i++) {
+    feedGet(table, i, &feed);
+    spt = (feed.steps + SCPR - 1) / SCPR;
+    rpm = maxRPM(feed.steps);
+    burst = 8UL * spt * period_list[spt];   //TC4 runs at 2Mhz
+    budget = T3CPM / ((long)rpm * SCPR);
+    irqs = (unsigned long)rpm * SCPR / 60;
+    sprintf(str, "%s %s %s %5u %5ld %3d %6d %5lu %6lu %6u %6lu",
+            name, feed.pitch, feed.rate, feed.steps, feed.error,
+            spt, period_list[spt], burst, budget, rpm, irqs);
+    Serial.println(str);
+  }
+}
+
+void benchmarkRPM(int rpm) {
+  //Running spindle speed and step overruns
+
+  unsigned int holds;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    holds = step_holds;
+  }
+  Serial.print(F("rpm "));
+  Serial.print(rpm);
+  Serial.print(F(" faults "));
+  Serial.print(faultCountGet());
+  Serial.print(F(" worst lag "));
+  Serial.print(step_lag_worst);
+  Serial.print(F(" holds "));
+  Serial.print(holds);
+  Serial.print(F(" display queue "));
+  Serial.print(nextionDepth());
+  Serial.print(F(" peak "));
+  Serial.print(nx_peak);
+  Serial.print(F(" bytes/s "));
+  Serial.print(benchmarkRate());
+  Serial.print(F(" frames "));
+  Serial.print(nx_rx_frames);
+  Serial.print(F(" framing errors "));
+  Serial.print(nx_rx_framing);
+  Serial.print(F(" failures "));
+  Serial.print(nx_rx_failures);
+  Serial.print(F(" event drops "));
+  Serial.print(eventDropsGet());
+#ifdef SPINDLE_X4
+  Serial.print(F(" glitches "));
+  Serial.print(quad_glitches);
+#endif
+  Serial.println();
+}
+
+unsigned long benchmarkRate(void) {
+  //Bytes per second sent to the display since the last call
+
+  static unsigned long last_sent = 0;
+  static unsigned long last_time = 0;
+  unsigned long rate;
+
+  rate = (nx_sent - last_sent) * 1000UL / (millis() - last_time + 1);
+  last_sent = nx_sent;
+  last_time = millis();
+  return rate;
+}
+
+#endif // ELS_BENCHMARK
@@ -0,0 +1,180 @@
+#ifndef __CROSS_H
+#define __CROSS_H
+
+//================================================================================
+// Cross-slide axis
+//================================================================================
+
+// With CROSS_SLIDE a second stepper drives the cross-slide, with step pulses from
+// TC1 on OC1A (X_PUL_N) the same way TC4 makes the leadscrew's.  TC5 would have
+// been the other free timer, but SPINDLE_ICP needs it for the timebase.
+//
+// The cross-slide is a position follower: cross is where it is, counted by the
+// TIMER1 interrupt as each pulse goes out, and cross_target is where it should be.
+// Whatever moves cross_target calls crossStart(), which sets X_DIR_N and starts
+// the clock if it's stopped, and the interrupt keeps stepping at X_PERIOD until
+// cross equals cross_target, turning round if the target has gone the other way.
+//
+// The target moves by a fixed ratio of leadscrew steps, cross_whole and
+// cross_rem / cross_den X steps each, kept in an accumulator like STEP_DDA's.
+// The accumulator runs backwards exactly the way it ran forwards, so the
+// cross-slide is always the same function of the leadscrew however it got there.
+// cross_neg means X goes down as the leadscrew goes up.  In cross_mode:
+//  cross_taper   every leadscrew step the TIMER4 interrupt counts moves the target,
+//                feeding, jogging or the threading cycle's return, so a taper or
+//                a chamfer is cut in one pass and stays on the line when the
+//                carriage is run back.
+//  cross_face    the spindle tick's steps go to the cross-slide instead of the
+//                leadscrew, for facing at the selected feed per rev.  The ratio
+//                is X_LSPI / lspi so the feed is the same distance either way.
+//
+// Before the spindle interrupt loads a tick, crossBlocked() checks that the steps
+// still going out and the new ones can't take the cross-slide past a limit, from
+// a bound of cross_whole + 1 per step rather than running the accumulator, and the
+// feed is held (hold_cross in Steps.h) up to a tick short of it, or if the
+// cross-slide has fallen more than CROSS_LAG_MAX steps behind its target.
+// maxRPM() takes the cross-slide's steps into account, so neither should happen
+// in the normal course of things.  Facing is checked and held the same way,
+// before the tick's steps go to the cross-slide.  The carriage doesn't move
+// while facing, and there are no limits on it in any mode.  A jog isn't held,
+// and the cross-slide just catches up afterwards.
+//
+// The TIMER4 interrupt follows the leadscrew after it has stopped the clock or
+// set the next jog period, so the taper doesn't eat into the time it has to do
+// that.  The TIMER1 interrupt counts a step per compare, so it mustn't be held
+// off for a whole X_PERIOD: X_PERIOD has to stay well over the longest spindle
+// interrupt, which with facing also runs the accumulator for the tick's steps.
+//
+// It's set up on the display's CROSS page, which shows the position, the mode
+// and the limits:
+//   OFF               leadscrew only
+//   TAPER             cross-slide moves N for every D of carriage, from the n and
+//                     d numbers on the page, N signed
+//   FACE              feed the cross-slide instead, the sign of n is its direction
+//   IN, OUT           jog the cross-slide the jog distance (3 decimals) either way
+//   ZERO              call where the cross-slide is zero
+//   MIN, MAX          limits where the cross-slide is now
+//   FREE              clear the limits
+// The numbers come back with "get", like the CUSTOM page's pitch, and a button
+// that's refused, or whose numbers are out of range, goes red until it's let go.
+// The same things are commands on the debug port (see Machine.h):
+//   xshow             mode, ratio, position and limits
+//   xoff              leadscrew only
+//   xtaper N D        as TAPER
+//   xface S           as FACE, S is 1 or -1
+//   xjog N            move the cross-slide N thousandths, with the spindle stopped
+//   xzero             call where the cross-slide is zero
+//   xmin N, xmax N    limits in thousandths
+//   xfree             clear the limits
+// Modes only change with the spindle stopped and nothing moving.  Distances are
+// in thousandths of an inch on the cross-slide.
+
+#ifdef CROSS_SLIDE
+
+#define CROSS_RATIO_MAX 1000          //Largest N or D for xtaper, so cross_den fits the accumulator
+#define CROSS_THOU_MAX  50000L        //Longest xjog or limit in thousandths
+#define CROSS_N         "cross.n.val"     //Nextion numbers, the ratio
+#define CROSS_D         "cross.d.val"
+#define CROSS_JOG       "cross.jog.val"   //and the jog distance (x-float, 3 decimals)
+
+static_assert(X_PERIOD >= STP_MIN && X_JOG_PERIOD >= X_PERIOD, "X_PERIOD out of range");
+static_assert(X_LSPI * CROSS_THOU_MAX <= 0x7FFFFFFFLL, "X_LSPI is too big for CROSS_THOU_MAX");
+
+enum {
+  cross_off,
+  cross_taper,
+  cross_face
+};
+
+byte cross_mode = cross_off;
+int cross_n = 1;                      //The ratio as entered, X moves cross_n for every cross_d of Z
+int cross_d = 1;
+
+volatile long cross = 0;              //Cross-slide position in steps, counted by the TIMER1 interrupt
+volatile long cross_target = 0;       //Where it's heading
+long cross_whole;                     //Whole X steps per leadscrew step
+long cross_rem;                       //And the remainder, in 1/cross_den
+long cross_den = 1;
+long cross_acc = 0;                   //Accumulated remainder
+bool cross_neg;                       //X goes down when the leadscrew goes up
+bool cross_limited = false;
+long cross_min;                       //Limits in steps, when cross_limited
+long cross_max;
+byte cross_pending = 0;               //Numbers still to come back from the display
+byte cross_request;                   //For which button
+long cross_first;                     //And the first of two
+
+inline void crossAdd(bool up, long &target, long &acc) {
+  //One leadscrew step's worth of cross-slide, up or down
+
+  if (up) {
+    target += cross_whole;
+    if ((acc += cross_rem) >= cross_den) {
+      acc -= cross_den;
+      target++;
+    }
+  } else {
+    target -= cross_whole;
+    if (acc < cross_rem) {
+      acc += cross_den - cross_rem;
+      target--;
+    } else {
+      acc -= cross_rem;
+    }
+  }
+}
+
+inline void crossStart(void) {
+  //Set the cross-slide going if it isn't already.  With interrupts off.
+
+  if ((TCCR1B & _BV(CS11)) || cross_target == cross)
+    return;             //Running, and the interrupt follows the target, or already there
+  if (cross_target < cross) {
+    PORTB |= _BV(X_DIR_N);
+  } else {
+    PORTB &= ~_BV(X_DIR_N);
+  }
+  TCCR1B = _BV(WGM13) | _BV(WGM12) | _BV(CS11);
+}
+
+inline void crossStep(bool neg) {
+  //From the TIMER4 interrupt in cross_taper mode, for a leadscrew step.
+  //neg is DIR_N, the leadscrew went down.
+
+  long target = cross_target;
+
+  crossAdd(neg == cross_neg, target, cross_acc);
+  cross_target = target;
+  crossStart();
+}
+
+inline void crossFollow(bool neg, byte n) {
+  //From the spindle interrupt in cross_face mode, with the tick's steps
+
+  long target = cross_target;
+  bool up = neg == cross_neg;
+
+  while (n--)
+    crossAdd(up, target, cross_acc);
+  cross_target = target;
+  crossStart();
+}
+
+inline bool crossBlocked(bool neg, byte n) {
+  //True if n more leadscrew steps could take the cross-slide past a limit,
+  //or it's too far behind.  From the spindle interrupt, or with interrupts off.
+
+  long reach = (cross_whole + 1) * n;
+
+  if (cross_target - cross > CROSS_LAG_MAX || cross - cross_target > CROSS_LAG_MAX)
+    return true;
+  if (!cross_limited)
+    return false;
+  if (neg == cross_neg)
+    return cross_target + reach > cross_max;
+  return cross_target - reach < cross_min;
+}
+
+#endif // CROSS_SLIDE
+
+#endif // __CROSS_H
@@ -0,0 +1,450 @@
+// Copyright (c) 2020 Jon Bryan
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+//================================================================================
+//
+//  Cross-slide axis
+//
+//  See Cross.h.  TC1 and its interrupt, the ratio, the speed limit, the
+//  CROSS page and the commands on the debug port.
+//
+//================================================================================
+
+#ifdef CROSS_SLIDE
+
+void crossInit(void) {
+  //TC1 generates the step pulses to drive the cross-slide, set up like TC4
+
+  ICR1  = X_PERIOD;
+  OCR1A = PUL_MIN;                                    //Pulse width is constant
+  TCCR1B = _BV(WGM13) | _BV(WGM12);                   //Set Fast PWM Mode 14 with the clock off
+  PORTB |= _BV(X_DIR_N) | _BV(X_PUL_N);               //Set high or it glitches low when enabled
+  DDRB  |= _BV(DDB5) | _BV(DDB4);                     //Set timer pins to output
+  TCCR1A =  _BV(WGM11) | _BV(COM1A1) | _BV(COM1A0);   //Set on compare match
+  TCNT1 = X_PERIOD - PUL_MIN;                         //Preload the (stopped) counter for immediate pulse
+  TIMSK1 = _BV(OCIE1A);
+  crossModeShow();                                    //And what the CROSS page shows
+  crossLimitShow();
+}
+
+ISR(TIMER1_COMPA_vect) {
+  //A cross-slide step pulse has just finished.  Count it, and stop at the
+  //target, or turn round if the target has gone back the other way.
+
+  PROF_COMPARE(prof_timer1_lat, 1);   //First, see Profile.h
+  PROF_START(isr_time);
+  bool down = PORTB & _BV(X_DIR_N);
+  long here = cross;
+
+  if (down) {
+    --here;
+  } else {
+    ++here;
+  }
+  cross = here;
+  if (here == cross_target) {
+    TCCR1B = _BV(WGM13) | _BV(WGM12);   //Clock off
+    ICR1 = X_PERIOD;                    //It may have been a jog
+    TCNT1 = X_PERIOD - PUL_MIN;         //First pulse immediately next time
+  } else if ((cross_target < here) != down) {
+    PORTB ^= _BV(X_DIR_N);              //Almost a whole period before the next pulse
+  }
+  PROF_END(prof_timer1, isr_time);
+}
+
+void crossRatio(void) {
+  //Work out the cross-slide steps per leadscrew step from cross_n / cross_d,
+  //and start the accumulator over.  Called by machineLoad() too, since it's
+  //in leadscrew steps.
+
+  unsigned long num = (unsigned long)abs(cross_n) * X_LSPI;
+  unsigned long den = (unsigned long)cross_d * machine.lspi;
+  unsigned long g = ratioGcd(num, den);
+
+  num /= g;
+  den /= g;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    cross_whole = num / den;
+    cross_rem = num % den;
+    cross_den = den;
+    cross_acc = 0;
+    cross_neg = cross_n < 0;
+  }
+}
+
+long crossMaxRPM(int steps_per) {
+  //Highest spindle RPM for the cross-slide's share of steps_per leadscrew steps
+  //per rev, limited the same ways as the leadscrew in maxRPM()
+
+  long xsteps;        //Cross-slide steps per rev, rounded up
+  long spt;           //And per spindle tick
+  long limit;
+
+  xsteps = steps_per * cross_whole + ((unsigned long long)steps_per * cross_rem + cross_den - 1) / cross_den;
+  if (xsteps == 0)
+    return 0xFFFF;
+  spt = (xsteps + SCPR - 1) / SCPR;
+  limit = X_STEPPER_LIMIT / xsteps;
+  //A tick's worth at X_PERIOD has to fit within the tick
+  if (T4CPM / X_PERIOD / ((long)SCPR * spt) < limit)
+    limit = T4CPM / X_PERIOD / ((long)SCPR * spt);
+  return limit < 0xFFFF ? limit : 0xFFFF;     //maxRPM() returns an unsigned int
+}
+
+bool crossIdle(void) {
+  //Nothing moving, so the mode or the position can be changed
+
+  bool running;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    running = TCCR1B & _BV(CS11);
+  }
+  return !running && !jogging && cycle_state == cycle_idle && spinRateGet() == SPINDLE_STOPPED;
+}
+
+long crossSteps(long thou) {
+  //Thousandths to cross-slide steps
+  return thou * X_LSPI / 1000;
+}
+
+char *crossStr(long x, char *str, size_t size) {
+  //Format a cross-slide position in steps as inches, into size bytes of str
+
+  long steps = abs(x);
+  long thou = steps / X_LSPI * 1000 + steps % X_LSPI * 1000 / X_LSPI;
+
+  snprintf(str, size, "%c%ld.%03ld", x < 0 ? '-' : ' ', thou / 1000, thou % 1000);
+  return str;
+}
+
+void crossShow(void) {
+  //Print the mode, ratio, position and limits
+
+  long here, target, lo, hi;
+  char str[16];
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    here = cross;
+    target = cross_target;
+  }
+  lo = cross_min;
+  hi = cross_max;
+  if (cross_mode == cross_taper) {
+    Serial.print(F("taper "));
+    Serial.print(cross_n);
+    Serial.print(' ');
+    Serial.println(cross_d);
+  } else if (cross_mode == cross_face) {
+    Serial.print(F("face "));
+    Serial.println(cross_n);
+  } else {
+    Serial.println(F("off"));
+  }
+  Serial.print(F("steps per leadscrew step "));
+  Serial.print(cross_whole);
+  Serial.print(' ');
+  Serial.print(cross_rem);
+  Serial.print('/');
+  Serial.println(cross_den);
+  Serial.print(F("x "));
+  Serial.print(crossStr(here, str, sizeof str));
+  Serial.print(F(" target "));
+  Serial.println(crossStr(target, str, sizeof str));
+  if (cross_limited) {
+    Serial.print(F("limits "));
+    Serial.print(crossStr(lo, str, sizeof str));
+    Serial.print(' ');
+    Serial.println(crossStr(hi, str, sizeof str));
+  } else {
+    Serial.println(F("no limits"));
+  }
+}
+
+void crossModeShow(void) {
+  //Put the mode and ratio on the CROSS page
+
+  char str[24];
+
+  if (cross_mode == cross_taper)
+    snprintf(str, sizeof str, "TAPER %d:%d", cross_n, cross_d);
+  else if (cross_mode == cross_face)
+    snprintf(str, sizeof str, "FACE %c", cross_n < 0 ? '-' : '+');
+  else
+    strcpy(str, "OFF");
+  nextionSet(nf_cross_mode, str);
+}
+
+void crossLimitShow(void) {
+  //And the limits
+
+  char str[16];
+
+  if (cross_limited) {
+    nextionSet(nf_cross_min, crossStr(cross_min, str, sizeof str));
+    nextionSet(nf_cross_max, crossStr(cross_max, str, sizeof str));
+  } else {
+    nextionSet(nf_cross_min, "-----");
+    nextionSet(nf_cross_max, "-----");
+  }
+}
+
+void crossDisplay(void) {
+  //Display the cross-slide position, from the UI tick
+
+  long here;
+  char str[16];
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    here = cross;
+  }
+  nextionSet(nf_cross_x, crossStr(here, str, sizeof str));
+}
+
+bool crossSet(byte mode, int n, int d) {
+  //Change the mode and ratio, when nothing is moving.  False if it can't.
+
+  if (!crossIdle())
+    return false;
+  cross_mode = mode;
+  cross_n = n;
+  cross_d = d;
+  crossRatio();
+  pwmPeriodSet();                   //maxRPM() depends on it
+  nextionUseRPM();
+  crossModeShow();
+  return true;
+}
+
+bool crossJog(long thou) {
+  //Move the cross-slide, when nothing else is moving
+
+  if (!crossIdle())
+    return false;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    //The clock is stopped, and the interrupt puts X_PERIOD back when it gets there
+    ICR1 = X_JOG_PERIOD;
+    TCNT1 = X_JOG_PERIOD - PUL_MIN;
+    cross_target += crossSteps(thou);
+    crossStart();
+  }
+  return true;
+}
+
+bool crossZero(void) {
+  //Call where the cross-slide is zero, when nothing is moving
+
+  if (!crossIdle())
+    return false;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    cross = 0;
+    cross_target = 0;
+  }
+  return true;
+}
+
+void crossLimit(bool hi, long x) {
+  //Set a limit in steps
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if (!cross_limited) {
+      //The other one starts out as far as it can be
+      cross_min = -crossSteps(CROSS_THOU_MAX);
+      cross_max = crossSteps(CROSS_THOU_MAX);
+    }
+    if (hi)
+      cross_max = x;
+    else
+      cross_min = x;
+    cross_limited = true;
+  }
+  crossLimitShow();
+}
+
+void crossFree(void) {
+  //Clear the limits
+  cross_limited = false;
+  crossLimitShow();
+}
+
+void crossRefuse(byte id) {
+  //Turn a CROSS page button red until it's let go
+
+  switch (id) {
+    case xoff_btn:
+      nextionSend(F("cross.xoff_btn.bco2=RED\xFF\xFF\xFF"));
+      uiHold(F("cross.xoff_btn.bco2=1024\xFF\xFF\xFF"));
+      break;
+    case xtaper_btn:
+      nextionSend(F("cross.xtaper_btn.bco2=RED\xFF\xFF\xFF"));
+      uiHold(F("cross.xtaper_btn.bco2=1024\xFF\xFF\xFF"));
+      break;
+    case xface_btn:
+      nextionSend(F("cross.xface_btn.bco2=RED\xFF\xFF\xFF"));
+      uiHold(F("cross.xface_btn.bco2=1024\xFF\xFF\xFF"));
+      break;
+    case xminus_btn:
+      nextionSend(F("cross.xminus_btn.bco2=RED\xFF\xFF\xFF"));
+      uiHold(F("cross.xminus_btn.bco2=1024\xFF\xFF\xFF"));
+      break;
+    case xplus_btn:
+      nextionSend(F("cross.xplus_btn.bco2=RED\xFF\xFF\xFF"));
+      uiHold(F("cross.xplus_btn.bco2=1024\xFF\xFF\xFF"));
+      break;
+    case xzero_btn:
+      nextionSend(F("cross.xzero_btn.bco2=RED\xFF\xFF\xFF"));
+      uiHold(F("cross.xzero_btn.bco2=1024\xFF\xFF\xFF"));
+      break;
+  }
+}
+
+void crossTouch(byte id) {
+  //A CROSS page button was pressed, from nextionTouch()
+
+  long here;
+  bool ok = true;
+
+  switch (id) {
+    case xoff_btn:
+      ok = crossSet(cross_off, 1, 1);
+      break;
+    case xtaper_btn:
+    case xface_btn:
+    case xminus_btn:
+    case xplus_btn:
+      //The numbers come back in numeric frames, see crossNumber()
+      ok = crossIdle();
+      if (ok) {
+        cross_request = id;
+        if (id == xtaper_btn) {
+          cross_pending = 2;
+          nextionSend(F("get " CROSS_N "\xFF\xFF\xFF"));
+          nextionSend(F("get " CROSS_D "\xFF\xFF\xFF"));
+        } else if (id == xface_btn) {
+          cross_pending = 1;
+          nextionSend(F("get " CROSS_N "\xFF\xFF\xFF"));
+        } else {
+          cross_pending = 1;
+          nextionSend(F("get " CROSS_JOG "\xFF\xFF\xFF"));
+        }
+      }
+      break;
+    case xzero_btn:
+      ok = crossZero();
+      break;
+    case xmin_btn:
+    case xmax_btn:
+      ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        here = cross;
+      }
+      crossLimit(id == xmax_btn, here);
+      break;
+    case xfree_btn:
+      crossFree();
+      break;
+  }
+  if (!ok)
+    crossRefuse(id);
+}
+
+void crossNumber(const byte *buf) {
+  //Numeric frame from the display, for the button in cross_request
+
+  long value;
+  bool ok = false;
+
+  if (!cross_pending)
+    return;             //Not ours
+
+  //Signed, since N can be
+  value = (int32_t)((uint32_t)buf[1] | ((uint32_t)buf[2] << 8) | ((uint32_t)buf[3] << 16) | ((uint32_t)buf[4] << 24));
+  if (--cross_pending) {
+    cross_first = value;
+    return;
+  }
+  switch (cross_request) {
+    case xtaper_btn:
+      if (cross_first != 0 && labs(cross_first) <= CROSS_RATIO_MAX && value > 0 && value <= CROSS_RATIO_MAX)
+        ok = crossSet(cross_taper, cross_first, value);
+      break;
+    case xface_btn:
+      if (value != 0)
+        ok = crossSet(cross_face, value < 0 ? -1 : 1, 1);
+      break;
+    case xminus_btn:
+    case xplus_btn:
+      if (value > 0 && value <= CROSS_THOU_MAX)
+        ok = crossJog(cross_request == xminus_btn ? -value : value);
+      break;
+  }
+  if (!ok)
+    crossRefuse(cross_request);
+}
+
+bool crossCommand(char *cmd, char *arg1, char *arg2) {
+  //Called by machineCommand() first.  False if it isn't a cross-slide command.
+
+  long a = arg1 ? atol(arg1) : 0L;
+  long b = arg2 ? atol(arg2) : 0L;
+  bool ok = true;
+  bool idle = true;
+
+  if (strcmp(cmd, "xshow") == 0) {
+    crossShow();
+    return true;
+  } else if (strcmp(cmd, "xoff") == 0) {
+    idle = crossSet(cross_off, 1, 1);
+  } else if (strcmp(cmd, "xtaper") == 0) {
+    if (a != 0 && abs(a) <= CROSS_RATIO_MAX && b > 0 && b <= CROSS_RATIO_MAX)
+      idle = crossSet(cross_taper, a, b);
+    else
+      ok = false;
+  } else if (strcmp(cmd, "xface") == 0) {
+    if (a == 1 || a == -1)
+      idle = crossSet(cross_face, a, 1);
+    else
+      ok = false;
+  } else if (strcmp(cmd, "xjog") == 0) {
+    if (labs(a) > CROSS_THOU_MAX)
+      ok = false;
+    else
+      idle = crossJog(a);
+  } else if (strcmp(cmd, "xzero") == 0) {
+    idle = crossZero();
+  } else if (strcmp(cmd, "xmin") == 0 || strcmp(cmd, "xmax") == 0) {
+    if (arg1 == NULL || labs(a) > CROSS_THOU_MAX)
+      ok = false;
+    else
+      crossLimit(cmd[2] == 'a', crossSteps(a));
+  } else if (strcmp(cmd, "xfree") == 0) {
+    crossFree();
+  } else {
+    return false;
+  }
+  if (!ok)
+    Serial.println(F("?"));
+  else if (!idle)
+    Serial.println(F("stop the spindle first"));
+  else
+    Serial.println(F("ok"));
+  return true;
+}
+
+#endif // CROSS_SLIDE
@@ -0,0 +1,138 @@
+#ifndef __DISPLAY_H
+#define __DISPLAY_H
+
+//================================================================================
+// Nextion display output
+//================================================================================
+
+// Everything for the display goes through a transmit queue that loop() trickles
+// into Serial2 only as fast as its buffer has room, so printing never stalls loop().
+// The values of the fields are remembered, and only sent when they change.
+// A field waits for room in the queue with its latest value, so setting it
+// never waits either.
+
+#define NX_QUEUE      256     //Transmit queue size, byte indexes wrap around by themselves
+#define NX_NAME       24      //Longest field name + 1
+#define NX_VALUE      16      //Longest remembered value + 1
+#define NX_REFRESH    2000UL  //Resend everything this often (ms) in case a page was reloaded
+#define NX_SPARE      64      //Room waiting fields leave for one-off commands
+#define NX_BIT(field) (1UL << (field))
+
+//The remembered fields
+enum nextionField {
+  nf_rpm,
+  nf_rpm_bco,
+  nf_lead,
+  nf_left_lim,
+  nf_left_bco,
+  nf_right_lim,
+  nf_right_bco,
+  nf_start_rate,
+  nf_shoulder_rate,
+  nf_setup_rate,
+  nf_start_pitch,
+  nf_shoulder_pitch,
+  nf_setup_pitch,
+  nf_custom_err,
+  nf_cycle,
+  nf_encoder,
+#ifdef CROSS_SLIDE
+  nf_cross_x,
+  nf_cross_mode,
+  nf_cross_min,
+  nf_cross_max,
+#endif
+  nf_rpm_pco,                 //First of the 12 belt speed colors on the SETUP page
+  NX_FIELDS = nf_rpm_pco + 12
+};
+
+static_assert(NX_FIELDS <= 32, "nx_waiting has a bit for each field");
+
+struct NEXTION_FIELD {
+  char name[NX_NAME];         //Page.component.attribute
+  bool quoted;                //Text attributes need the value in quotes
+};
+
+//In the same order as nextionField.
+//The belt speeds have ID's "t3" to "t14" in order of descending RPM.
+const NEXTION_FIELD nx_fields[NX_FIELDS] PROGMEM = {
+  {"rpm.txt",                true },
+  {"rpm.bco",                false},
+  {"shoulder.leadscrew.txt", true },
+  {"shoulder.left_lim.txt",  true },
+  {"shoulder.left_lim.bco",  false},
+  {"shoulder.right_lim.txt", true },
+  {"shoulder.right_lim.bco", false},
+  {"start.rate.txt",         true },
+  {"shoulder.rate.txt",      true },
+  {"setup.rate.txt",         true },
+  {"start.pitch.txt",        true },
+  {"shoulder.pitch.txt",     true },
+  {"setup.pitch.txt",        true },
+  {"custom.err.txt",         true },
+  {"shoulder.cycle.txt",     true },
+  {"setup.encoder.txt",      true },
+#ifdef CROSS_SLIDE
+  {"cross.x.txt",            true },
+  {"cross.mode.txt",         true },
+  {"cross.min.txt",          true },
+  {"cross.max.txt",          true },
+#endif
+  {"setup.t3.pco",           false},
+  {"setup.t4.pco",           false},
+  {"setup.t5.pco",           false},
+  {"setup.t6.pco",           false},
+  {"setup.t7.pco",           false},
+  {"setup.t8.pco",           false},
+  {"setup.t9.pco",           false},
+  {"setup.t10.pco",          false},
+  {"setup.t11.pco",          false},
+  {"setup.t12.pco",          false},
+  {"setup.t13.pco",          false},
+  {"setup.t14.pco",          false}
+};
+
+char nx_value[NX_FIELDS][NX_VALUE];   //Last value set for each field, sent or waiting to be
+unsigned long nx_waiting = 0;         //NX_BIT() of each field waiting for room in the queue
+
+byte nx_queue[NX_QUEUE];
+byte nx_head = 0;                     //Next byte in
+byte nx_tail = 0;                     //Next byte out
+
+unsigned long nx_sent = 0;            //Bytes handed to Serial2
+byte nx_peak = 0;                     //Deepest the queue has been
+
+
+
+//================================================================================
+// Nextion display input
+//================================================================================
+
+// Everything the display returns is a frame ending in \xFF\xFF\xFF.
+// Bytes are collected one at a time as they arrive, so nothing ever waits,
+// and a frame that turns out to be the wrong length or to be missing its
+// terminator is thrown away.  After that, bytes are skipped up to the next
+// terminator, so one dropped or extra byte costs one event, not all the rest.
+
+#define NX_FRAME      16      //Longest frame that's kept
+#define NX_RX_BUDGET  32      //Most bytes taken from Serial2 in one call
+
+//Return codes that start a frame
+#define NXR_TOUCH     0x65    //Touch event: page, component, press/release
+#define NXR_PAGE      0x66    //Current page
+#define NXR_XY        0x67    //Touch coordinates
+#define NXR_XY_SLEEP  0x68    //Touch coordinates in sleep mode
+#define NXR_STRING    0x70    //String data, variable length
+#define NXR_NUMBER    0x71    //Numeric data, 4 bytes little-endian
+#define NXR_ERRORS    0x24    //0x00 to 0x24 are failure codes, e.g. 0x1A invalid variable
+
+byte nx_rx[NX_FRAME];                 //Frame being collected
+byte nx_rx_len = 0;
+byte nx_rx_ffs = 0;                   //Consecutive 0xFF's at the end of nx_rx
+bool nx_rx_hunt = false;              //Skipping to the next terminator after a framing error
+
+unsigned int nx_rx_frames = 0;        //Good frames
+unsigned int nx_rx_framing = 0;       //Frames thrown away for bad length or terminator
+unsigned int nx_rx_failures = 0;      //Failure codes returned by the display
+
+#endif // __DISPLAY_H
@@ -0,0 +1,273 @@
+// Copyright (c) 2020 Jon Bryan
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+//================================================================================
+//
+//  Nextion transmit queue and field cache
+//
+//  HardwareSerial already empties its own 64-byte buffer from the USART2 data
+//  register empty interrupt, but Serial2.print() waits whenever that buffer is
+//  full.  Here the commands are queued instead, and nextionFlush() hands over
+//  only as many bytes as Serial2.availableForWrite() says will fit.
+//
+//  nextionSet() skips a field if its value hasn't changed since it was last set.
+//  Otherwise it's marked as waiting, and nextionFlush() queues the fields that
+//  are waiting, lowest first, whenever there's room for them with NX_SPARE left
+//  over.  A field that's set again before it goes out just goes out with the
+//  newer value, so the RPM and leadscrew can't fill the queue, and after a touch
+//  the whole page can be sent again without loop() waiting for it.  One-off
+//  commands, like the button colours, use the room the fields leave, and only
+//  wait for more the same way Serial2.print() did.
+//
+//================================================================================
+
+void nextionSet(byte field, const char *value) {
+  //Send a field when there's room, if its value has changed
+
+  if (strlen(value) >= NX_VALUE) {
+    //Too long to remember, so it goes out now, waiting for room if it has to
+    nx_value[field][0] = '\0';
+    nx_waiting &= ~NX_BIT(field);
+    while (!nxField(field, value, 0))
+      nextionFlush();
+    nextionFlush();
+    return;
+  }
+  if (strcmp(nx_value[field], value) == 0)
+    return;
+  strcpy(nx_value[field], value);
+  nx_waiting |= NX_BIT(field);
+  nextionFlush();
+}
+
+void nextionSend(const char *str) {
+  //Queue a one-off command, waiting for room if necessary
+
+  while ((int)strlen(str) > nxRoom())
+    nextionFlush();
+  nxPut(str);
+  nextionFlush();
+}
+
+void nextionSend(const __FlashStringHelper *fstr) {
+  //Same again from flash
+
+  const char *p = (const char *)fstr;
+  char c;
+
+  while ((int)strlen_P(p) > nxRoom())
+    nextionFlush();
+  while ((c = pgm_read_byte(p++)))
+    nxByte(c);
+  nextionFlush();
+}
+
+void nextionFlush(void) {
+  //Queue the fields that are waiting while there's room for them, then move as
+  //much as will fit without waiting into the Serial2 buffer
+
+  byte field;
+  int room;
+
+  for (field = 0; nx_waiting && field < NX_FIELDS; field++) {
+    if (nx_waiting & NX_BIT(field)) {
+      if (!nxField(field, nx_value[field], NX_SPARE))
+        break;
+      nx_waiting &= ~NX_BIT(field);
+    }
+  }
+
+  room = Serial2.availableForWrite();
+  while (room-- > 0 && nx_tail != nx_head) {
+    Serial2.write(nx_queue[nx_tail++]);
+    nx_sent++;
+  }
+}
+
+void nextionInvalidate(void) {
+  //Send every field that has been set again
+
+  byte field;
+
+  for (field = 0; field < NX_FIELDS; field++)
+    if (nx_value[field][0])
+      nx_waiting |= NX_BIT(field);
+}
+
+void nextionRefresh(void) {
+  //Resend everything every so often.
+  //If a page is reloaded, its components go back to the values they were designed with.
+
+  static unsigned long timer = 0;
+
+  if (millis() - timer >= NX_REFRESH) {
+    timer = millis();
+    nextionInvalidate();
+  }
+}
+
+byte nextionDepth(void) {
+  //Bytes waiting in the queue
+
+  return nx_head - nx_tail;
+}
+
+int nxRoom(void) {
+  //Free space in the queue, keeping one byte empty to tell full from empty
+
+  return NX_QUEUE - 1 - (byte)(nx_head - nx_tail);
+}
+
+bool nxField(byte field, const char *value, int spare) {
+  //Queue name=value or name="value", or false if there isn't room with spare left over
+
+  char name[NX_NAME];
+  bool quoted;
+
+  memcpy_P(name, nx_fields[field].name, NX_NAME);
+  quoted = pgm_read_byte(&nx_fields[field].quoted);
+  if ((int)(strlen(name) + 1 + strlen(value) + (quoted ? 2 : 0) + 3) > nxRoom() - spare)
+    return false;
+
+  nxPut(name);
+  nxPut("=");
+  if (quoted)
+    nxPut("\"");
+  nxPut(value);
+  if (quoted)
+    nxPut("\"");
+  nxPut(NX_END);
+  return true;
+}
+
+void nxPut(const char *str) {
+  //Caller has already checked that there's room
+
+  while (*str)
+    nxByte(*str++);
+}
+
+void nxByte(char c) {
+  nx_queue[nx_head++] = c;
+  if (nextionDepth() > nx_peak)
+    nx_peak = nextionDepth();
+}
+
+
+//================================================================================
+//
+//  Nextion return frame parser
+//
+//  nextionFrame() takes what has arrived so far and returns the length of the
+//  next complete frame in nx_rx[], or zero if there isn't one yet.
+//
+//  Touch, page, coordinate and numeric frames have a fixed length.  Numeric
+//  data can contain 0xFF bytes, so those frames are only checked for the
+//  terminator once they're the full length.  Anything else runs up to the
+//  first terminator, which includes the 0x00 0x00 0x00 startup frame.
+//
+//================================================================================
+
+byte nextionFrame(void) {
+  //Collect bytes and return the length of a complete frame
+
+  byte c;
+  byte len;
+  byte need;
+  byte budget = NX_RX_BUDGET;
+
+  while (budget-- && Serial2.available()) {
+    c = Serial2.read();
+    nx_rx_ffs = (c == 0xFF) ? nx_rx_ffs + 1 : 0;
+
+    if (nx_rx_hunt) {
+      //Resynchronize on the next terminator
+      if (nx_rx_ffs >= 3) {
+        nx_rx_hunt = false;
+        nx_rx_len = 0;
+        nx_rx_ffs = 0;
+      }
+      continue;
+    }
+
+    if (nx_rx_len == NX_FRAME) {
+      //No terminator where there should have been one
+      nxFramingError();
+      continue;
+    }
+    nx_rx[nx_rx_len++] = c;
+
+    need = nxFrameLength(nx_rx[0]);
+    if (need && nx_rx_len < need) {
+      if (nx_rx_ffs >= 3 && nx_rx[0] != NXR_NUMBER) {
+        //Terminated early, so a byte was lost, but it's already back in step
+        nx_rx_framing++;
+        nx_rx_len = 0;
+        nx_rx_ffs = 0;
+      }
+      continue;
+    }
+    if (nx_rx_ffs >= 3) {
+      len = nx_rx_len;
+      nx_rx_len = 0;
+      nx_rx_ffs = 0;
+      if (len > 3) {      //A lone terminator is just noise
+        nx_rx_frames++;
+        return len;
+      }
+    } else if (need) {
+      //Full length but not terminated, so something extra got in
+      nxFramingError();
+    }
+  }
+  return 0;
+}
+
+byte nxFrameLength(byte code) {
+  //Length of a fixed-length frame including the terminator, or 0 if it's variable
+
+  switch (code) {
+    case NXR_TOUCH:
+      return 7;
+    case NXR_PAGE:
+      return 5;
+    case NXR_XY:
+    case NXR_XY_SLEEP:
+      return 9;
+    case NXR_NUMBER:
+      return 8;
+    default:
+      return 0;
+  }
+}
+
+void nxFramingError(void) {
+  //Throw away the frame and skip to the next terminator
+
+  //The 0xFF's already counted may be the start of that terminator.
+
+  nx_rx_framing++;
+  nx_rx_len = 0;
+  if (nx_rx_ffs >= 3) {
+    nx_rx_ffs = 0;
+  } else {
+    nx_rx_hunt = true;
+  }
+}
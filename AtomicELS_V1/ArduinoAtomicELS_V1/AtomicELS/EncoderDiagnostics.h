@@ -6,44 +6,93 @@ const static char  sOutput[] =			"Ouput Mode";
 const static char  sUnknownMode[] =		"Unknown mode";
 
 // Configuration items
-#define COUNT_PER_REV             800UL                         // Number of encoder signals per revolution per A or B channel
+#define COUNT_PER_REV             ((unsigned long)machine.encoder_ppr)  // Number of encoder signals per revolution per A or B channel
 #define ACHANNEL_PIN              SPINDLE_A
 #define ACHANNEL_MODE             INPUT
 #define BCHANNEL_PIN              SPINDLE_B
 #define BCHANNEL_MODE             INPUT
-#define ZCHANNEL_PIN              9								// will use Pin Change Interrupt to monitor this pin
+#define ZCHANNEL_PIN              SPINDLE_Z                     // the ELS code owns the Pin Change Interrupt for this pin (PB6/PCINT6)
 #define ZCHANNEL_MODE             INPUT_PULLUP
 #define BAUD_RATE                 115200
-#define LAST_N_REVS               10                            // How many rev times used at start to get an average
-#define ACCEPTABLE_MARGIN_PERCENT 10                            // sets the variation allowed in interrupt timings
-#define SETTLE_AVG_MARGIN         5UL                           // percentage of average all settle readings must be within
-#define STEPPER_CYCLE_TIME        5                             // seconds for each stepper cycle time
-#define VER                       1
+#define VER                       2
+
+// Health monitor
+#define EXPECTED_SHIFT            4                             // expected interval follows the measured one over about 2^4 edges
+#define MARGIN_SHIFT              3                             // an edge more than expected/2^3 (12.5%) early or late is a timing error
+#define SLOWEST_EDGE              0x10000UL                     // Timebase counts (4ms, about 19rpm at 800ppr); slower than this isn't timed
+#define HEALTH_REPORT             1000UL                        // ms between health reports
+#define HEALTH_ERRORS             4                             // timing errors in a report period before the encoder is called unhealthy
+#define OUTLIER_RUN               3                             // outliers in a row are the speed changing, not timing errors
 
 enum     LOG_LEVEL { MINIMAL, MEDIUM, ALL };                    // Valid values for a LOG_LEVEL variable
 enum  LOG_LEVEL eLogLevel = MEDIUM;                             // Configured logging Level wanted
 
-volatile bool           bRevRateDetermined = false;             // true when we have determined the inital average time of a rev
-volatile unsigned long  ulAvgZTime = 0UL;                       // Estimated time for each Z signal based on the average of previous signals that are all within a set % of their mean.
-volatile unsigned long  ulZMargin = 0UL;                        // max micros difference between latest Z signal time and expected average time before Z flagged as unstable
-volatile          long  lAUnderOver = 0UL;                      // number of microseconds over/under expected for time between interrupts
-volatile bool           bAChannelErr = false;                   // true if err seen on channel A timings
-volatile unsigned long  ulAChannelCount = 0UL;                  // Increments each time the A Channel interrupts
-volatile unsigned long  ulBChannelCount = 0UL;                  // Increments each time the B Channel interrupts
-volatile unsigned long  ulAChannelCountErr = 0UL;               // Snapshot of count of A Channel interrupts when a A channel signal is seen outside of expected timings
-volatile unsigned long  ulBChannelCountErr = 0UL;               // Snapshot of count of B Channel interrupts when a B channel signal is seen outside of expected timings
-volatile unsigned long  ulAChannelInts = 0UL;                   // Holds the number of A channel signals seen during last Z channel rev (i.e. between successive Z Channel interrupts)
-volatile unsigned long  ulBChannelInts = 0UL;                   // Holds the number of B channel signals seen during last Z channel rev (i.e. between successive Z Channel interrupts)
-volatile          long  lBUnderOver = 0UL;                      // number of microseconds over/under expected for time between interrupts
-volatile bool           bBChannelErr = false;                   // true if err seen on channel A timings
-volatile bool           bZUnstable = false;                     // true if Z Channel signals at point outside of (expected time +/- error margin)
-volatile unsigned long  ulZUnstableRevTime = 0UL;               // Time, in microseconds, between prior Z Channel signal and Z Signal deemed in error
-volatile bool           bZResultProcessed = true;               // Boolean flag used to synchronize ISR and loop processing. If true ISR can update with any new data, else wait for loop to process and clear
-volatile long           lZRevDeviation = 0L;                    // % that Z channel interrupt time is away from expected time. Stored at 100 times too large. Needs to be scaled during output. Saves using float
-volatile unsigned long  ulAChannelGoodInterruptCount = 0UL;     // count of A channel interupts within expected timings
-volatile unsigned long  ulBChannelGoodInterruptCount = 0UL;     // count of B channel interupts within expected timings
-volatile unsigned long  ulTimeofRevInterrupt[LAST_N_REVS];      // this used a circular array of times the Z channel interrupted         
-
-unsigned long  ulABInterval = 0UL;                              // How often A&B channel should interrupt
-unsigned long  ulABMargin = 0UL;                                // how much deviation from iABInterval is acceptable
-#endif
\ No newline at end of file
+// Per channel timing, all updated in the interrupts only.
+// Times are spindle timebase counts (16Mhz, see Timebase.h), which the spindle interrupt has already read, so nothing calls micros()
+struct CHANNEL_HEALTH
+{
+    unsigned long  ulLast;                                      // Timebase count at the last edge
+    unsigned long  ulExpected;                                  // Rolling expected interval between edges, timebase counts x 2^EXPECTED_SHIFT
+    unsigned long  ulEdges;                                     // Edges seen
+    unsigned long  ulAtZ;                                       // ulEdges at the last Z Channel signal
+    unsigned int   uiErrors;                                    // Edges outside of the expected timing
+    byte           ucOutliers;                                  // Outliers in a row up to this edge, not counted yet
+};
+
+volatile CHANNEL_HEALTH AHealth;
+volatile CHANNEL_HEALTH BHealth;
+
+volatile unsigned long  ulRevs = 0UL;                           // Z Channel signals seen
+volatile unsigned int   uiACountErrors = 0;                     // Revs that didn't have COUNT_PER_REV A Channel signals
+volatile unsigned int   uiBCountErrors = 0;                     // Likewise for B
+volatile          long  lAMissed = 0L;                          // Net A Channel signals missed (+) or extra (-) over all revs
+volatile          long  lBMissed = 0L;                          // Likewise for B
+
+inline void ChannelCheck (volatile CHANNEL_HEALTH* pHealth, unsigned long ulNow, char cChannel)
+{
+    // Called from the interrupts for each A or B falling edge.
+    // The expected interval tracks the spindle speed as it changes, so there is nothing to wait for at startup
+    unsigned long ulInterval = ulNow - pHealth->ulLast;
+    unsigned long ulExpected = pHealth->ulExpected >> EXPECTED_SHIFT;
+    long          lDeviation;
+
+    pHealth->ulLast = ulNow;
+    pHealth->ulEdges++;
+    if (ulInterval >= SLOWEST_EDGE || pHealth->ulEdges == 1UL)
+    {
+        // The first edge, stopped, or too slow to be worth timing, so start over from the next interval
+        pHealth->ulExpected = 0UL;
+        pHealth->ucOutliers = 0;
+        return;
+    }
+    if (ulExpected == 0UL)
+    {
+        pHealth->ulExpected = ulInterval << EXPECTED_SHIFT;
+        return;
+    }
+    lDeviation = (long)ulInterval - (long)ulExpected;
+    if ((unsigned long)abs (lDeviation) > (ulExpected >> MARGIN_SHIFT))
+    {
+        // An outlier doesn't move the expected interval, and it's only counted as
+        // an error once the next edge is back in time.  A glitch puts one or two
+        // edges out, but a step in the speed puts all of them out, so after a run
+        // of them the estimate starts over from this one.
+        if (++pHealth->ucOutliers >= OUTLIER_RUN)
+        {
+            pHealth->ulExpected = ulInterval << EXPECTED_SHIFT;
+            pHealth->ucOutliers = 0;
+        }
+#ifdef ELS_TELEMETRY
+        tlmPut (cChannel == 'A' ? tlm_a_err : tlm_b_err, 0, lDeviation / 16, pHealth->ulEdges - 1 - pHealth->ulAtZ);
+#else
+        (void)cChannel;
+#endif
+    }
+    else
+    {
+        pHealth->ulExpected += ulInterval - ulExpected;
+        pHealth->uiErrors += pHealth->ucOutliers;
+        pHealth->ucOutliers = 0;
+    }
+}
+#endif
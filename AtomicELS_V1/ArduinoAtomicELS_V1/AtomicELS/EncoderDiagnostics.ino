@@ -14,188 +14,166 @@
 * It monitors two primary channels the A and B channel that are expected to signal every COUNT_PER_REV times per revolution
 * It also monitors the index channel, referred to herein as the ZCHANNEL, that is expected to signal once per revolution
 * If all goes well the code should see COUNT_PER_REV ACHANNEL signals and COUNT_PER_REV BCHANNEL signals per ZCHANNEL signal
-* The diagnostic code will report via the Serial port if more or less A and B signals are seen per Z signal.
+* Each rev that sees more or less is counted, along with the net number of signals missed.
 *
 * The program also looks at the quality of the signals by monitoring if they occur at regular intervals.
-* To do this is waits until it sees a stable rpm (by looking at the times of consecutive ZCHANNEL signals.
-* Once the expected time for a ZCHANNEL signal is known, the time between consecutive A or B CHANNEL signals is implied as
-* expected ZCHANNEL rev time / COUNT_PER_REV
-*
-* From that point on the diagnnostic code will output down the serial port when A or B signals occur outside the expected timing +/- a configurable tolerance (%age)
-* The same is done for the Z signals.
+* Each channel keeps a rolling expected interval between its signals, timed with timebase counts that the spindle interrupt has
+* already read, which follows the spindle as it speeds up or slows down. A signal more than 1/2^MARGIN_SHIFT early or late
+* is counted as a timing error, and doesn't move the expected interval.
 *
 * The original purpose was to investigate the quality of the signals from a rotary encoder looking for manufacturing issues, however in practice it has been found
 * useful for seeing unexpected signals generated by EMI within the production environment. As shielding has been added the reduction in spurious signals can be seen in the change
 * of error rate being reported by the diagnostics
 *
 * Originally this code was standalone but here has been integrated into the AtomicELS code written and copyrighted by Jon R Bryan. The intent being to allow
-* diagnostics to be seen in a fully intergrated solution. The integration is designed to minimse the impact on the original codebase as follows
-*
-* No constants have been changed. No code has been amended or removed, there are 3 additional lines of code added to the AtomicELS.ino code file as follows:
-* 1) DiagnosticSetup() is called once at the start of the AtomicELS.ino setup() function
-* 2) DiagnosticLoop() is called once at the end of the AtomicELS.ino loop() function
+* diagnostics to be seen in a fully intergrated solution. It runs all the time alongside the ELS, from any spindle speed including stopped,
+* and never stops the program:
+* 1) DiagnosticSetup() is called once at the start of the AtomicELS.ino setup() function, and returns straight away
+* 2) DiagnosticLoop() is called once at the end of the AtomicELS.ino loop() function, and reports every HEALTH_REPORT ms
+*    to the SETUP page of the display, to the fault flag (which turns the RPM red) and to the Serial port
 * 3) Since AtomicELS.ino establishes an interrupt routine for the ACHANNEL (SPINDLE_A in AtomicELS parlance) a call to AChannelISR() is added to the end of the AtomicELS interrupt code
+* 4) Likewise the ZCHANNEL (SPINDLE_Z) interrupt belongs to AtomicELS.ino, which calls ZChannelISR() on the falling edge
 */
+
+// The pins are fixed when the sketch compiles, so the configuration is checked then rather than at startup
+static_assert (ACHANNEL_PIN != BCHANNEL_PIN && ACHANNEL_PIN != ZCHANNEL_PIN && BCHANNEL_PIN != ZCHANNEL_PIN,
+               "Invalid Config - expected three input different pins for the A,B and Z channels");
+
 void DiagnosticsSetup ()
 {
     Serial.begin (BAUD_RATE);
-    delay (1000);                   // Let comms settle before output
     // Print config state for this run
-    Serial.print (F ("Encoder Quality Check Ver. "));
+    Serial.print (F ("Encoder Health Monitor Ver. "));
     Serial.println (VER);
     Serial.print (F ("Serial output running at "));
     Serial.println (BAUD_RATE);
     Serial.print (F ("Channel A expected on Digital Pin "));
     Serial.print (ACHANNEL_PIN);
-    Serial.print (F (", connected to interrupt "));
-    Serial.print (digitalPinToInterrupt (ACHANNEL_PIN));
+#ifdef SPINDLE_ICP
+    Serial.print (F (", connected to input capture ICP5"));
+#else
+    Serial.print (F (", connected to interrupt INT"));
+    Serial.print (EXT_INT (ACHANNEL_PIN));
+#endif
     Serial.print (F (", mode is "));
     Serial.println (ModetoString (ACHANNEL_MODE));
     Serial.print (F ("Channel B expected on Digital Pin "));
     Serial.print (BCHANNEL_PIN);
-    Serial.print (F (", connected to interrupt "));
-    Serial.print (digitalPinToInterrupt (BCHANNEL_PIN));
+    Serial.print (F (", connected to interrupt INT"));
+    Serial.print (EXT_INT (BCHANNEL_PIN));
     Serial.print (F (", mode is "));
     Serial.println (ModetoString (BCHANNEL_MODE));
     Serial.print (F ("Channel Z expected on Digital Pin "));
     Serial.print (ZCHANNEL_PIN);
-    Serial.print (F (", connected to interrupt "));
-    Serial.print (digitalPinToInterrupt (ZCHANNEL_PIN));
+    Serial.print (F (", connected to interrupt PCINT"));
+    Serial.print (FastPin<ZCHANNEL_PIN>::bit);
     Serial.print (F (", mode is "));
     Serial.println (ModetoString (ZCHANNEL_MODE));
     Serial.println ();
 
-    // Sanity check config before implementing it
-    if (ACHANNEL_PIN == BCHANNEL_PIN || ACHANNEL_PIN == ZCHANNEL_PIN || BCHANNEL_PIN == ZCHANNEL_PIN)
-    {
-        TerminateProgram (F ("Invalid Config - expected three input different pins for the A,B and Z channels"));
-    }
-    else
-    {
-        if (digitalPinToInterrupt (ACHANNEL_PIN) == NOT_AN_INTERRUPT || digitalPinToInterrupt (BCHANNEL_PIN) == NOT_AN_INTERRUPT /*|| digitalPinToInterrupt (ZCHANNEL_PIN) == NOT_AN_INTERRUPT*/)
-        {
-            TerminateProgram (F ("Invalid Config - not all pins selected for channels support interrupts"));
-        }
-        else
-        {
-            if (strcmp (ModetoString (ACHANNEL_MODE), sUnknownMode) == 0 || strcmp (ModetoString (BCHANNEL_MODE), sUnknownMode) == 0 || strcmp (ModetoString (ZCHANNEL_MODE), sUnknownMode) == 0)
-            {
-                TerminateProgram (F ("Invalid Config - channel pins should be set to one of: INPUT / INPUT_PULLUP / OUTPUT"));
-            }
-        }
-    }
-    // Don't change A and B channel pins as ELS code is managing these
-    pinMode (ZCHANNEL_PIN, ZCHANNEL_MODE);          // internal pullup input pin
-
-    // Setting up interrupt for Z channel
-
-    //Enable pin change interrupts for digital pin 12 (ATmega 2560 pin PB6/PCINT6)
-    PCICR |= (1 << PCIE0);                          // enable group interrupts on PCINT[7:0] to any already setup
-    PCMSK0 |= (1 << PCINT6);                        // specifically enable interrupt digital pin 12 (PCINT6) to any set up
-                                                    // this will cause ISR (PCINT0_vect) to execute on any pin state change
-
-    // Wait for stable revs to occur
-    do
-    {
-        delay (100);
-    } while (bRevRateDetermined == false);
-
-    // Z has settled, set up channel B ISR (Channel A controlled by ELS code)
+    // Don't change A, B or Z channel pins as ELS code is managing these.
+    // The ELS uses Z to re-reference its spindle count, and its pin change interrupt calls ZChannelISR()
 
     // B falling signal from encoder will invoke BChannelISR().
-    attachInterrupt (digitalPinToInterrupt (BCHANNEL_PIN), BChannelISR, FALLING);
-
-    // Now show calculated rev speed
-    Serial.print (F ("Recent revs are taking an average of "));
-    Serial.print (ulAvgZTime);
-    Serial.print (F (" microseconds, each A or B channel signal should occur every "));
-    Serial.print (ulABInterval);
-    Serial.print (F (" microseconds. Will allow  "));
-    Serial.print (ulABMargin);
-    Serial.println (F (" microseconds either side"));
-    Serial.print (F ("This implies a rpm of "));
-    Serial.println ((1000000L * 60L) / ulAvgZTime);
-
-    Serial.println ();
-    Serial.print (F ("Rev times used for avg : "));
-    for (int i = 0; i < LAST_N_REVS; i++)
-    {
-        if (i > 0)
-        {
-            Serial.print (F (", "));
-        }
-        Serial.print (ulTimeofRevInterrupt[i]);
-    }
-    Serial.println ();
+    // With x4 decoding the ELS code owns channel B as well and calls BChannelISR() itself
+#ifndef SPINDLE_X4
+    extAttach (EXT_INT (BCHANNEL_PIN), EXT_FALLING);
+#endif
 }
 
 void DiagnosticsLoop ()
 {
-    // check for a rev outside of expected tolerance; if found tell user and quit
-    if (bZUnstable == true)
-    {
-        Serial.print (F ("Last revolution took "));
-        Serial.print (ulZUnstableRevTime);
-        Serial.print (F (" microseconds, expected "));
-        Serial.print (ulAvgZTime);
-        Serial.print (F (" with a tolerance of "));
-        Serial.println (ulZMargin);
-        Serial.print (F ("During run had "));
-        Serial.print (ulAChannelGoodInterruptCount);
-        Serial.println (F (" A Channel interrupts within tolerance"));
-        Serial.print (F ("During run had "));
-        Serial.print (ulBChannelGoodInterruptCount);
-        Serial.println (F (" B Channel interrupts within tolerance"));
-        // Rev rate on has changed, expected timings on A and B are no longer reliable
-        TerminateProgram (F ("Rev rate has changed, results now unreliable, halting program"));
+    // Report on the last HEALTH_REPORT ms. Nothing in here waits, and a bad encoder is reported, never fatal
+    static unsigned long ulLastReport = 0UL;
+    static unsigned int  uiLastAErrors = 0, uiLastBErrors = 0;
+    static unsigned int  uiLastACount = 0, uiLastBCount = 0;
+    unsigned int  uiAErrors, uiBErrors, uiACount, uiBCount;
+#ifndef ELS_TELEMETRY
+    static unsigned long ulLastRevs = 0UL;
+    unsigned long ulRevsNow;
+    long          lAMissedNow, lBMissedNow;
+    unsigned long ulExpected;
+    unsigned int  uiCorrections, uiRejects;
+    long          lSlip;
+#endif
+    bool          bHealthy;
+    char          str[24];
+
+    if (millis () - ulLastReport < HEALTH_REPORT)
+    {
+        return;
+    }
+    ulLastReport = millis ();
+
+    ATOMIC_BLOCK (ATOMIC_RESTORESTATE)
+    {
+        uiAErrors = AHealth.uiErrors;
+        uiBErrors = BHealth.uiErrors;
+        uiACount = uiACountErrors;
+        uiBCount = uiBCountErrors;
+#ifndef ELS_TELEMETRY
+        ulRevsNow = ulRevs;
+        lAMissedNow = lAMissed;
+        lBMissedNow = lBMissed;
+        ulExpected = AHealth.ulExpected >> EXPECTED_SHIFT;
+        uiCorrections = index_corrections;          // Totals since startup, from the ELS's own Z handling
+        uiRejects = index_rejects;
+        lSlip = index_slip;
+#endif
+    }
+
+    // Just this report period
+    uiAErrors -= uiLastAErrors;
+    uiLastAErrors += uiAErrors;
+    uiBErrors -= uiLastBErrors;
+    uiLastBErrors += uiBErrors;
+    uiACount -= uiLastACount;
+    uiLastACount += uiACount;
+    uiBCount -= uiLastBCount;
+    uiLastBCount += uiBCount;
+
+    bHealthy = uiACount == 0 && uiBCount == 0 && uiAErrors + uiBErrors < HEALTH_ERRORS;
+    if (bHealthy)
+    {
+        nextionSet (nf_encoder, "OK");
     }
     else
     {
-        // See if we have a new good result to show
-        if (bZResultProcessed == false)
-        {
-            Serial.print (F ("Z deviation from average "));
-            if (lZRevDeviation < 0)
-            {
-                Serial.print (F ("-"));
-            }
-            Serial.print (lZRevDeviation / 100);
-            Serial.print (F ("."));
-            Serial.print (abs (lZRevDeviation % 100));
-            Serial.print (F ("%, A Channel Interrupts this rev "));
-            Serial.print (ulAChannelInts);
-            Serial.print (F (", B Channel Interrupts this rev "));
-            Serial.println (ulBChannelInts);
-            bZResultProcessed = true;
-        }
-    }
-    // look for channnel A interrupt outside its time tolerance
-    if (bAChannelErr == true)
-    {
-        // A channel has interrupted oustide expected time
-        Serial.print (F ("A Channel has interrupted outside of expected timings. "));
-        Serial.print (lAUnderOver);
-        Serial.print (F (" microseconds away from expected time of "));
-        Serial.print (ulABMargin);
-        Serial.print (F (" at  "));
-        Serial.print (ulAChannelCountErr % COUNT_PER_REV);
-        Serial.println (F (" signals into rev"));
-        bAChannelErr = false;
-    }
-    // look for channnel B interrupt outside its time tolerance
-    if (bBChannelErr == true)
-    {
-        // A channel has interrupted oustide expected time
-        Serial.print (F ("B Channel has interrupted outside of expected timings. "));
-        Serial.print (lBUnderOver);
-        Serial.print (F (" microseconds away from expected time of "));
-        Serial.print (ulABMargin);
-        Serial.print (F (" at "));
-        Serial.print (ulBChannelCountErr % COUNT_PER_REV);
-        Serial.println (F (" signals into rev"));
-        bBChannelErr = false;
-    }
-
+        // Timing errors on A and B, and revs with the wrong count
+        sprintf (str, "A%u B%u Z%u", uiAErrors, uiBErrors, uiACount + uiBCount);
+        nextionSet (nf_encoder, str);
+        fault = true;                               // RPM goes red until the feed rate is changed
+    }
+
+#ifndef ELS_TELEMETRY
+    // The telemetry has a record of every timing error, so the text is only wanted without it
+    if (eLogLevel == ALL || (eLogLevel == MEDIUM && !bHealthy))
+    {
+        Serial.print (F ("revs "));
+        Serial.print (ulRevsNow - ulLastRevs);
+        Serial.print (F (" A/B timing errors "));
+        Serial.print (uiAErrors);
+        Serial.print (F ("/"));
+        Serial.print (uiBErrors);
+        Serial.print (F (" count errors "));
+        Serial.print (uiACount);
+        Serial.print (F ("/"));
+        Serial.print (uiBCount);
+        Serial.print (F (" missed "));
+        Serial.print (lAMissedNow);
+        Serial.print (F ("/"));
+        Serial.print (lBMissedNow);
+        Serial.print (F (" interval "));
+        Serial.print (ulExpected);
+        Serial.print (F (" index corrections "));
+        Serial.print (uiCorrections);
+        Serial.print (F (" slip "));
+        Serial.print (lSlip);
+        Serial.print (F (" rejects "));
+        Serial.println (uiRejects);
+    }
+    ulLastRevs = ulRevsNow;
+#endif
 }
 
 const char* ModetoString (int iMode)
@@ -222,204 +200,53 @@ const char* ModetoString (int iMode)
     return pResult;
 }
 
-void TerminateProgram (const __FlashStringHelper* pErrMsg)
-{
-    Serial.println (pErrMsg);
-    Serial.flush ();
-    exit (0);
-}
-// This code is called from ELS SPINDLE_A ISR
+// This code is called from ELS SPINDLE_A ISR, on the falling edges, just after it has stamped spin_edge
 void AChannelISR ()
 {
-    // check how long since last interrupt
-    static unsigned long ulALastTime = 0UL;
-    ulAChannelCount++;
-
-    if (CheckElapsedTime (&ulALastTime, &lAUnderOver) == false)
-    {
-        ulAChannelCountErr = ulAChannelCount;
-        bAChannelErr = true;
-    }
-    else
-    {
-        ulAChannelGoodInterruptCount++;
-    }
+    ChannelCheck (&AHealth, spin_edge, 'A');
 }
 
-// This is run directly as ELS code does not set up an interrupt for Channel B from encoder
+// With x4 decoding this is called from the ELS SPINDLE_A ISR too, for the B falling edges
 void BChannelISR ()
 {
-    // check how long since last interrupt
-    static unsigned long ulBLastTime = 0UL;
-    ulBChannelCount++;
-
-    if (CheckElapsedTime (&ulBLastTime, &lBUnderOver) == false)
-    {
-        ulBChannelCountErr = ulBChannelCount;
-        bBChannelErr = true;
-    }
-    else
-    {
-        ulBChannelGoodInterruptCount++;
-    }
+    ChannelCheck (&BHealth, spin_edge, 'B');
 }
 
 
-// Pin Chnage interrupt routine
-ISR (PCINT0_vect)
+#ifndef SPINDLE_X4
+// Channel B interrupt routine, enabled by DiagnosticsSetup ()
+// The ELS code doesn't see these edges, so the time has to be read here
+ISR (EXT_VECT (BCHANNEL_PIN))
 {
-    // Check if falling signal
-    if (digitalRead (ZCHANNEL_PIN) == LOW)
-    {
-        ZChannelISR ();
-    }
+    unsigned long ulNow = spinTime ();              // Extended the same way as the spindle edges, see Timebase.h
+    ChannelCheck (&BHealth, ulNow, 'B');
 }
+#endif
 
 void ZChannelISR ()
 {
-    enum    bZState { BEGIN_CALC_REV_RATE, MONITOR_REV_RATE };         // valid states for Z Channel logic
-    static  bZState           ZRevState = BEGIN_CALC_REV_RATE;                        // current state of Z channel logic
-    static  unsigned long     ulLastRevTime = 0UL;                                    // Time, in microseconds, that last Z channel interrupted
-    static  unsigned long     ulLastAChannelInts = 0UL;
-    static  unsigned long     ulLastBChannelInts = 0UL;
+    // Once per rev, check that each channel saw COUNT_PER_REV signals since the last Z
+    static bool bFirstZ = true;
+    long        lA = AHealth.ulEdges - AHealth.ulAtZ;
+    long        lB = BHealth.ulEdges - BHealth.ulAtZ;
 
-    switch (ZRevState)
+    AHealth.ulAtZ = AHealth.ulEdges;
+    BHealth.ulAtZ = BHealth.ulEdges;
+    ulRevs++;
+    if (bFirstZ)
     {
-    case BEGIN_CALC_REV_RATE:
-        ulLastRevTime = micros ();
-        if (ZSettled (ulLastRevTime, &ulAvgZTime) == true)
-        {
-            // Z has settled down so set the expexted values of each rev and times of A and B channel interrupts
-            ulZMargin = (ulAvgZTime * ACCEPTABLE_MARGIN_PERCENT) / 100UL;           // acceptable percent of rev time
-            ulABInterval = ulAvgZTime / COUNT_PER_REV;
-            ulABMargin = ulZMargin / COUNT_PER_REV;
-            bRevRateDetermined = true;
-            ZRevState = MONITOR_REV_RATE;
-        }
-        break;
-
-    case MONITOR_REV_RATE:
-        // keep an eye on rev rate, if it changes the checks will be wrong
-        unsigned long ulZTime = micros ();
-        if (bZUnstable == false)
-        {
-            // see how many A and B channel interrupts occured in this rev
-
-            ulAChannelInts = ulAChannelCount - ulLastAChannelInts;
-            ulLastAChannelInts = ulAChannelCount;
-            ulBChannelInts = ulBChannelCount - ulLastBChannelInts;
-            ulLastBChannelInts = ulBChannelCount;
-            // check how long this last rev took
-            ulZUnstableRevTime = ulZTime - ulLastRevTime;               // Time last rev took
-            long lThisDeviation = ulZUnstableRevTime - ulAvgZTime;       // deviation (in micros) from expected time
-            if (abs (lThisDeviation) > ulZMargin)
-            {
-                // revs speed has changed by greater than margin
-                bZUnstable = true;
-            }
-            else
-            {
-                // within acceptable bounds
-                // if last result has been processed update with this one
-                if (bZResultProcessed == true)
-                {
-                    // calc deviation as +/- percentage from expected average as 100 times too big - reduce on display
-                    lZRevDeviation = (lThisDeviation * 10000L) / (long)ulAvgZTime;
-                    bZResultProcessed = false;
-                }
-            }
-        }
-        ulLastRevTime = ulZTime;
-        break;
+        // Part of a rev since startup
+        bFirstZ = false;
+        return;
     }
-}
-
-/*
- * function to determine if Z has initially stabilised and we can set the expected rev times and by implication the interval between interrupts on the A and B channels
- * this is called for each Z interrupt at the start of the program
- *
- * This fills a circular buffer with the time of the last LAST_N_REVS interrupts and once all entries have a value it calculates the time between the oldest and newest. From this
- * the average interval time is calculated. This is deemed settled if all entries only deviate by +/- SETTLE_AVG_MARGIN % from the calculated average.
- *
- * Parameters
- * ulThisIntTime - time this interrupt occured in microseconds
- * pulAvgRevTime - pointer to var to hold the average time between interrupts once they have settled down
- *
- * Returns true if settled state is reached, pulAvgRevTime will be populated otherwise its value is undefined.
-*/
-bool ZSettled (unsigned long ulThisIntTime, volatile unsigned long* pulAvgRevTime)
-{
-    static int            iIndexTimeofRevInterrupt = 0;                       // point to next entry to be used
-    static int            iCountInterrupts = 0;                        // count of how many entries we have used so far
-    bool                  bSettled = false;                    // true when settled condition met
-    // Add latest time to circular array
-    ulTimeofRevInterrupt[iIndexTimeofRevInterrupt] = ulThisIntTime;
-    iCountInterrupts++;
-
-    // do we have minimum # of interrupt times to start analysis? 
-    if (iCountInterrupts >= LAST_N_REVS)
+    if (lA != (long)COUNT_PER_REV)
     {
-        // calculate time between oldest and newest interrupt. ( Oldest is next entry in circular array )
-
-        unsigned long ulElapsedTime = ulThisIntTime - ulTimeofRevInterrupt[(iIndexTimeofRevInterrupt + 1) % LAST_N_REVS];
-
-        *pulAvgRevTime = ulElapsedTime / (LAST_N_REVS - 1);
-
-        // look at prior entries and check that the elapsed times are within 5% of calcuated average
-        int iOldest = (iIndexTimeofRevInterrupt + 1) % LAST_N_REVS;
-        unsigned long ulMaxDiff = (*pulAvgRevTime * SETTLE_AVG_MARGIN) / 100UL;
-        bSettled = true;                                  // assume good
-        for (int i = 0; i < LAST_N_REVS - 1; i++)
-        {
-            int iNext = (iOldest + 1) % LAST_N_REVS;
-            unsigned long ulInterval = ulTimeofRevInterrupt[iNext] - ulTimeofRevInterrupt[iOldest];
-            long  ulDiff = ulInterval - *pulAvgRevTime;
-            if (abs (ulDiff) > ulMaxDiff)
-            {
-                // not settled
-                bSettled = false;
-                break;
-            }
-            iOldest = iNext;
-        }
+        uiACountErrors++;
+        lAMissed += (long)COUNT_PER_REV - lA;
     }
-    // move to next entry in circular buffer
-    ++iIndexTimeofRevInterrupt %= LAST_N_REVS;
-    return bSettled;
-}
-
-/*
-* This function looks at the time between signals on the A or B Channel and returns false if it is outside the accepted margin
-
-Parameters
-pulLastTime - pointer to the time of the last signal on this channel in microseconds
-plOverUnder - pointer to storeage to hold the number of microseconds that at above/below the expected interval
-*/
-bool CheckElapsedTime (unsigned long* pulLastTime, volatile long* plOverUnder)
-{
-    bool bResult = true;              // All OK
-    unsigned long ulNow = micros ();
-
-    // see if not first time this has run
-    if (*pulLastTime > 0UL)
+    if (lB != (long)COUNT_PER_REV)
     {
-        // ignore this time if micros() has reset
-        if (ulNow > *pulLastTime)
-        {
-            // if we have a target then compare it
-            if (ulABMargin > 0UL)
-            {
-                // see how much time has elapsed since last interrupt
-                unsigned long ulElapsed = ulNow - *pulLastTime;
-                *plOverUnder = ulElapsed - ulABInterval;
-                if ((unsigned long)abs (*plOverUnder) > ulABMargin)
-                {
-                    // error took too long or too soon
-                    bResult = false;
-                }
-            }
-        }
+        uiBCountErrors++;
+        lBMissed += (long)COUNT_PER_REV - lB;
     }
-    *pulLastTime = ulNow;
-    return bResult;
 }
@@ -0,0 +1,72 @@
+#ifndef __EVENTS_H
+#define __EVENTS_H
+
+#include <util/atomic.h>
+
+//================================================================================
+// Interrupt to loop() events
+//================================================================================
+
+// The interrupts post one-byte events into a ring buffer and loop() takes them out.
+// AVR interrupts don't nest, so all of the interrupt handlers together are the
+// single producer, and loop() is the single consumer.  The head index is only
+// written by the interrupts and the tail only by loop(), and each is a single byte,
+// so neither side needs to turn interrupts off.  If the ring is full the event is
+// dropped and counted in event_drops, which ELS_BENCHMARK prints with the RPM.
+//
+// Only the knob clicks and ev_steps go in the ring.  The events from ev_left_limit
+// on can't be lost, so each is a bit in event_flags instead, which the interrupts
+// set and loop() takes and clears with interrupts off.  Two of the same kind
+// before loop() gets to them come out as one, and they're handled in the order
+// of the enum.
+
+#define EVENT_RING    16      //Must be a power of two
+
+enum elsEvent {
+  ev_knob_up,                 //Knob clicked clockwise
+  ev_knob_down,               //Knob clicked counterclockwise
+  ev_steps,                   //Leadscrew moved (coalesced until loop() picks it up)
+  ev_left_limit,              //Feed stopped at the left limit, the first of the flags
+  ev_right_limit,             //Feed stopped at the right limit
+  ev_synced,                  //Leadscrew re-engaged with the spindle
+  ev_move_done,               //The planner has stopped a jog, rapid or cycle return
+  ev_hold                     //The feed was held, see Steps.h
+};
+
+static_assert(ev_hold - ev_left_limit < 8, "event_flags has a bit for each flag event");
+
+volatile byte event_ring[EVENT_RING];
+volatile byte event_head = 0;             //Next slot to write, interrupts only
+volatile byte event_tail = 0;             //Next slot to read, loop() only
+volatile byte event_flags = 0;            //A bit for each event from ev_left_limit on
+volatile unsigned int event_drops = 0;    //Events lost because loop() fell behind
+volatile bool steps_posted = false;       //An ev_steps is waiting in the ring
+
+bool lead_update = true;                  //The leadscrew display needs refreshing
+
+inline void eventPut(byte ev) {
+  //Called from interrupt handlers only
+
+  byte next = (event_head + 1) & (EVENT_RING - 1);
+
+  if (ev >= ev_left_limit) {
+    event_flags |= 1 << (ev - ev_left_limit);
+  } else if (next != event_tail) {
+    event_ring[event_head] = ev;
+    event_head = next;
+  } else {
+    event_drops++;
+  }
+}
+
+inline void eventSteps(void) {
+  //Only one leadscrew movement event is queued at a time, however fast it's stepping
+
+  if (!steps_posted) {
+    byte head = event_head;
+    eventPut(ev_steps);
+    steps_posted = event_head != head;    //If the ring was full, the next movement tries again
+  }
+}
+
+#endif // __EVENTS_H
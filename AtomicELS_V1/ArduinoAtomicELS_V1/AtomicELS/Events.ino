@@ -0,0 +1,127 @@
+// Copyright (c) 2020 Jon Bryan
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+//================================================================================
+//
+//  Events and snapshots
+//
+//  loop() side of the event ring in Events.h, and atomic copies of the
+//  multi-byte values that the interrupts update.  On an 8-bit AVR a long or an
+//  int is read a byte at a time, so an interrupt in the middle of the read can
+//  leave half of an old value and half of a new one.
+//
+//================================================================================
+
+void eventCheck(void) {
+  //Take everything the interrupts have posted since the last time
+
+  byte ev, flags;
+
+  while (event_tail != event_head) {
+    ev = event_ring[event_tail];
+    event_tail = (event_tail + 1) & (EVENT_RING - 1);
+
+    switch (ev) {
+      case ev_knob_up:
+        knob_count++;
+        break;
+      case ev_knob_down:
+        knob_count--;
+        break;
+      case ev_steps:
+        //Allow the next one to be posted before reading the leadscrew
+        steps_posted = false;
+        lead_update = true;
+        break;
+    }
+  }
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    flags = event_flags;
+    event_flags = 0;
+  }
+  for (ev = ev_left_limit; flags; ev++, flags >>= 1) {
+    if (!(flags & 1))
+      continue;
+    switch (ev) {
+      case ev_left_limit:
+      case ev_right_limit:
+        lead_update = true;
+        cycleLimit(ev == ev_left_limit);
+        break;
+      case ev_synced:
+        lead_update = true;
+        pickupSave();
+        break;
+      case ev_move_done:
+        if (!cycleMoveDone())
+          jogFinish();
+        break;
+      case ev_hold:
+        lead_update = true;
+        nextionSet(nf_rpm_bco, "YELLOW");
+        break;
+    }
+  }
+}
+
+long leadscrewGet(void) {
+  //Untorn copy of the leadscrew position
+
+  long lead;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    lead = leadscrew;
+  }
+  return lead;
+}
+
+unsigned int spinRateGet(void) {
+  //Untorn copy of the spindle period
+
+  unsigned int rate;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    rate = spin_rate;
+  }
+  return rate;
+}
+
+unsigned int faultCountGet(void) {
+  //Untorn copy of the step overrun count
+
+  unsigned int count;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    count = fault_count;
+  }
+  return count;
+}
+
+unsigned int eventDropsGet(void) {
+  //Untorn copy of the events lost to a full ring
+
+  unsigned int drops;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    drops = event_drops;
+  }
+  return drops;
+}
@@ -0,0 +1,145 @@
+#ifndef __INDEX_H
+#define __INDEX_H
+
+//================================================================================
+// Spindle index and thread pickup
+//================================================================================
+
+// spin_count only knows where the spindle is by counting edges from the last
+// zeroSet(), so a spurious edge or a missed one moves it for good, and every pass
+// after that starts in a different groove.  The encoder's Z output happens at the
+// same place on the spindle every revolution, so it's used to keep the count honest.
+//
+// spin_index counts alongside spin_count, but from the Z pulse instead of from
+// zeroSet(), and nothing else ever changes it.  The first Z after power up sets it
+// to zero.  At every Z after that spin_index should be where it was at the first
+// one in the same direction (the Z falling edge isn't at the same count both ways),
+// and if it isn't, the difference was counted wrongly.  spin_index, spin_count and
+// the DDA remainder are all moved back by the difference, and it's counted in
+// index_corrections, with the net counts in index_slip.  The health report (see
+// EncoderDiagnostics.h) prints both.  A pass in progress keeps the extra or
+// missing steps until it ends, but the next pass starts in the right place.
+//
+// A Z pulse more than INDEX_WINDOW counts away from where it should be is more
+// likely to be noise on the Z line than that many bad edges, so it's ignored.
+// Two of those in a row means the spindle really was turned while nothing was
+// counting, so the next Z starts over.
+//
+// Because spin_index is tied to the spindle itself, it can also remember a
+// thread.  Every time a feed starts in sync, the spindle interrupt notes
+// spin_index and the leadscrew, and loop() keeps them as the pickup, which the
+// journal keeps in EEPROM (see Journal.h).  Along a thread spin_index +
+// leadscrew * SCPR / steps_per_rev stays the same (minus for a left hand thread),
+// so the PICKUP button on the SHOULDER page can work out the spindle count at
+// which the carriage, wherever it is, would land back in that groove, and sets
+// the sync counts to it (after the first Z pulse, if it's pressed straight after
+// power up).  zeroSet() moves the pickup's leadscrew position along with the
+// leadscrew, so zeroing doesn't lose it.  The journal keeps the leadscrew
+// position too, so the pickup survives a power cycle as long as the carriage
+// isn't moved by hand while it's off.
+
+#define INDEX_WINDOW    machine.index_window    //Largest error believed at a Z pulse, SCPR / 64
+
+int spin_index = 0;                     //Spindle counts from the Z pulse, 0 to SCPR-1
+bool indexed = false;                   //A Z pulse has set spin_index
+byte index_seen = 0;                    //Directions with a reference, bit 0 CW, bit 1 CCW
+int index_ref[2];                       //spin_index at the Z pulse, CW and CCW
+bool index_missed = false;              //The last Z pulse was outside the window
+volatile unsigned int index_corrections = 0;  //Z pulses that corrected spin_count
+volatile unsigned int index_rejects = 0;      //Z pulses too far off to believe
+volatile long index_slip = 0L;          //Net counts corrected, extra edges are positive
+
+int engage_index;                       //spin_index and leadscrew where the last feed engaged
+long engage_lead;
+bool engage_rh;                         //Right hand thread (feed_left when it engaged)
+int engage_steps;                       //steps_per_rev when it engaged
+
+struct PICKUP {
+  bool rh;
+  int index;                            //spin_index when the feed engaged
+  int steps_per_rev;                    //Which pitch it was
+  long lead;                            //Leadscrew position when the feed engaged
+};
+
+PICKUP pickup;
+bool pickup_valid = false;              //The journal may set it at startup
+bool pickup_armed = false;              //PICKUP was pressed before the first Z pulse
+
+inline void indexAdjust(int err) {
+  //Take err counts off spin_count, spin_index and the DDA remainder
+
+  if ((spin_index -= err) < 0)
+    spin_index += SCPR;
+  else if (spin_index >= SCPR)
+    spin_index -= SCPR;
+  if ((spin_count -= err) < 0)
+    spin_count += SCPR;
+  else if (spin_count >= SCPR)
+    spin_count -= SCPR;
+#ifdef STEP_DDA
+  //At most INDEX_WINDOW counts, so a loop is cheaper than a multiply
+  for (; err > 0; err--) {
+    if ((dda_acc -= dda_rem) < 0)
+      dda_acc += dda_den;
+  }
+  for (; err < 0; err++) {
+    if ((dda_acc += dda_rem) >= dda_den)
+      dda_acc -= dda_den;
+  }
+#endif
+}
+
+inline void spinIndex(void) {
+  //Called from the pin change interrupt on the Z falling edge
+
+  byte dir = spin_ccw;
+  int err;
+
+  if (!indexed) {
+    //The first one, or starting over
+    spin_index = 0;
+    index_ref[dir] = 0;
+    index_seen = 1 << dir;
+    index_missed = false;
+    indexed = true;
+    return;
+  }
+  if (!(index_seen & (1 << dir))) {
+    //First time in this direction
+    index_ref[dir] = spin_index;
+    index_seen |= 1 << dir;
+    return;
+  }
+
+  err = spin_index - index_ref[dir];
+  if (err > machine.scpr_half)
+    err -= SCPR;
+  else if (err <= -machine.scpr_half)
+    err += SCPR;
+  if (err == 0) {
+    index_missed = false;
+    return;
+  }
+  if (err > INDEX_WINDOW || err < -INDEX_WINDOW) {
+    index_rejects++;
+    if (index_missed)
+      indexed = false;        //Twice, so the next Z starts over
+    index_missed = true;
+    return;
+  }
+  index_missed = false;
+  indexAdjust(err);
+  index_corrections++;
+  index_slip += err;
+}
+
+inline void pickupMark(void) {
+  //Called from the spindle interrupt when a feed engages
+
+  engage_index = spin_index;
+  engage_lead = leadscrew;
+  engage_rh = feed_left;
+  engage_steps = steps_per_rev;
+}
+
+#endif
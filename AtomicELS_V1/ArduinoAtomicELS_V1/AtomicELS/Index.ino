@@ -0,0 +1,163 @@
+// Copyright (c) 2020 Jon Bryan
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+//================================================================================
+//
+//  Spindle index and thread pickup
+//
+//  The Z pulse itself is handled in the pin change interrupt by spinIndex() in
+//  Index.h.  This is the loop() side, which keeps the pickup and puts it back.
+//  The journal saves the pickup along with the other settings.
+//
+//================================================================================
+
+void indexInit(void) {
+  //Enable the Z pulse interrupt
+
+  pinMode(SPINDLE_Z, INPUT_PULLUP);
+
+  //Pin change interrupts come in groups, and PCINT[7:0] is PORTB
+  static_assert(FastPin<SPINDLE_Z>::port == 'B', "SPINDLE_Z must be on PORTB, which is PCINT[7:0]");
+  PCICR |= _BV(PCIE0);
+  PCMSK0 |= _BV(FastPin<SPINDLE_Z>::bit);
+}
+
+long pickupPhase(const PICKUP &p, long lead) {
+  //Where the spindle should be on the pickup's thread with the leadscrew at lead,
+  //in spin_index counts.  Only the part of the distance short of a whole number
+  //of revolutions matters, which keeps the multiply inside a long.
+
+  long dist = (p.lead - lead) % p.steps_per_rev;
+  long phase;
+
+  if (dist < 0)
+    dist += p.steps_per_rev;
+  phase = (dist * SCPR + p.steps_per_rev / 2) / p.steps_per_rev;
+  if (!p.rh)
+    phase = -phase;
+  phase = (p.index + phase) % SCPR;
+  if (phase < 0)
+    phase += SCPR;
+  return phase;
+}
+
+void pickupSave(void) {
+  //A feed engaged (ev_synced), so it might be a new thread to remember
+
+  PICKUP now;
+
+  if (!indexed)
+    return;             //spin_index doesn't mean anything yet
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    now.index = engage_index;
+    now.lead = engage_lead;
+    now.rh = engage_rh;
+  }
+  now.steps_per_rev = steps_per_rev;
+
+  //Another pass on the same thread lands on the same phase, and isn't a new pickup
+  if (pickup_valid && pickup.rh == now.rh && pickup.steps_per_rev == now.steps_per_rev &&
+      pickupPhase(pickup, now.lead) == now.index)
+    return;
+
+  pickup.rh = now.rh;
+  pickup.index = now.index;
+  pickup.steps_per_rev = now.steps_per_rev;
+  pickup.lead = now.lead;
+  pickup_valid = true;      //journalCheck() saves it once the spindle stops
+}
+
+void pickupShift(long lead) {
+  //The leadscrew is about to be zeroed from lead, so move the pickup with it,
+  //and the last engagement, which a held feed picks up from (see Steps.h)
+
+  if (pickup_valid)
+    pickup.lead -= lead;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    engage_lead -= lead;
+  }
+}
+
+void pickupApply(void) {
+  //The PICKUP button was pressed.  Set the sync counts so the next feed starts
+  //in the saved thread's groove, from wherever the carriage is now.
+
+  if (!pickup_valid || jogging || (synced && spinRateGet() != SPINDLE_STOPPED) ||
+      pickup.steps_per_rev != steps_per_rev || pickup.rh != feed_left) {
+    //Nothing to pick up, or a different pitch or hand, or feeding
+    nextionSend(F("shoulder.pickup_btn.bco2=RED\xFF\xFF\xFF"));
+    uiHold(F("shoulder.pickup_btn.bco2=1024\xFF\xFF\xFF"));
+    return;
+  }
+
+  if (!indexed) {
+    //Straight after power up the spindle has to pass the Z pulse first.
+    //spin_count is never -1, so nothing engages until pickupCheck() sees it.
+    pickup_armed = true;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      synced = false;
+      sync_count = -1;
+      lsync_count = -1;
+      rsync_count = -1;
+    }
+    nextionSend(F("shoulder.pickup_btn.bco2=YELLOW\xFF\xFF\xFF"));
+    return;
+  }
+  pickup_armed = false;
+  pickupSync(pickup);
+  nextionSend(F("shoulder.pickup_btn.bco2=GREEN\xFF\xFF\xFF"));
+  uiHold(F("shoulder.pickup_btn.bco2=1024\xFF\xFF\xFF"));
+}
+
+void pickupCheck(void) {
+  //Called from loop() to finish a pickup that was waiting for the Z pulse
+
+  if (pickup_armed && indexed) {
+    pickup_armed = false;
+    pickupSync(pickup);
+    nextionSend(F("shoulder.pickup_btn.bco2=1024\xFF\xFF\xFF"));
+  }
+}
+
+void pickupSync(const PICKUP &p) {
+  //Point the sync counts at a thread, the pickup's or a held feed's (see Steps.h)
+
+  long phase;
+  int count, index;
+
+  phase = pickupPhase(p, leadscrewGet());
+
+  //spin_count and spin_index are a fixed distance apart until a jog or a zeroSet()
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    count = spin_count;
+    index = spin_index;
+  }
+  count = (phase + count - index + SCPR) % SCPR;
+
+  //Whichever way it engages, it's from here
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    synced = false;
+    sync_count = count;
+    lsync_count = count;
+    rsync_count = count;
+  }
+}
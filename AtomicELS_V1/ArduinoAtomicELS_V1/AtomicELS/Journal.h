@@ -0,0 +1,102 @@
+#ifndef __JOURNAL_H
+#define __JOURNAL_H
+
+#include <stddef.h>
+#include <EEPROM.h>
+#include <util/crc16.h>
+
+//================================================================================
+// Settings journal in EEPROM
+//================================================================================
+
+// The feed mode and rates, the custom pitch, the limits, the leadscrew position,
+// the belt speed table, the thread pickup and the machine profile are kept in
+// EEPROM, so a restart carries on where it left off instead of needing everything
+// set again.  A profile that doesn't pass machineCheck() when it's read back is
+// replaced by the defaults.
+//
+// The EEPROM is a ring of fixed size slots, each holding one value, its field id,
+// a sequence number and a CRC.  When a value changes, only that value is written,
+// to the next slot round the ring, with the next sequence number.  At startup
+// every slot is read, and for each field the good slot with the highest sequence
+// number wins.  Slots holding a field's latest value are skipped when the ring
+// comes round, so a setting that never changes stays put, and everything else
+// spreads the wear over the whole EEPROM.  Power failing in the middle of a write
+// only spoils the slot being written, which wasn't anyone's latest value, so that
+// field starts up with the value it had before the change.
+//
+// Fields that only make sense together are written as a group, in journal_groups[]:
+// the custom pitch and its units, the limits with the leadscrew and the pickup
+// (zeroing moves them all), and the machine profile with period_list[].  When any of a group changes
+// the whole group goes out in id order, in consecutive slots, and every slot but
+// the last has JOURNAL_MORE set in its id.  The last one commits the group: at
+// startup a group's fields only come from slots up to the latest good last slot,
+// so a group power failed part way through is ignored as a whole.  The slots of
+// the group before it stay latest, and so aren't written over, until then.
+//
+// Nothing is written while the spindle is turning, jogging or running a cycle,
+// and a change has to sit for JOURNAL_SETTLE ms first, so turning the knob through
+// a dozen rates is one write.  An EEPROM byte takes 3.3ms to write, so loop()
+// writes a byte at a time when the EEPROM is ready, and never waits for it.  The
+// interrupts never touch any of this.
+
+#define JOURNAL_SLOTS   (EEPROM.length() / sizeof(JOURNAL_SLOT))
+#define JOURNAL_SETTLE  2000UL      //ms a change has to stay before it's written
+#define JOURNAL_CRC     0x4B        //CRC seed, change it if the fields change meaning
+#define JOURNAL_BLANK   0xFF        //Not a field id, and what erased EEPROM reads
+#define JOURNAL_MORE    0x80        //Id bit, more of the group follows
+#define JOURNAL_GROUPS  3
+#define JOURNAL_GROUP_MAX 17        //Fields in the biggest group
+
+enum {
+  j_feed_mode,
+  j_feed_index,                     //One per table feed mode
+  j_custom_kind = j_feed_index + 4,
+  j_custom_value,
+  j_limits,                         //left_limited and right_limited
+  j_left_limit,
+  j_right_limit,
+  j_leadscrew,
+  j_pickup,                         //Index, hand and steps per rev
+  j_pickup_lead,
+  j_rpm_table,                      //One per belt speed
+  j_encoder_ppr = j_rpm_table + 12, //The machine profile
+  j_microsteps,
+  j_step_ratio,
+  j_ltpi,
+  j_stepper_limit,
+  j_period_list,                    //One per steps per tick
+  JOURNAL_FIELDS = j_period_list + 12
+};
+
+static_assert(JOURNAL_FIELDS <= JOURNAL_MORE, "field ids have to leave JOURNAL_MORE clear");
+
+//First and last field of each group
+const byte journal_groups[JOURNAL_GROUPS][2] = {
+  {j_custom_kind, j_custom_value},
+  {j_limits, j_pickup_lead},
+  {j_encoder_ppr, JOURNAL_FIELDS - 1}
+};
+
+static_assert(JOURNAL_FIELDS - j_encoder_ppr <= JOURNAL_GROUP_MAX, "the profile group is the biggest");
+
+struct JOURNAL_SLOT {
+  unsigned long seq;                //Never wraps, at one write a second it would take 136 years
+  long value;
+  byte id;
+  byte crc;
+};
+
+long journal_value[JOURNAL_FIELDS];       //What's in EEPROM
+int journal_slot[JOURNAL_FIELDS];         //Where, or -1 for nothing yet
+unsigned long journal_seq = 0UL;          //For the next slot
+int journal_head = 0;                     //Next slot to try
+JOURNAL_SLOT journal_write;               //Slot being written a byte at a time
+int journal_write_slot = -1;              //Where, or -1 when idle
+byte journal_write_step;                  //How far journalFlush() has got
+byte journal_group_next = JOURNAL_FIELDS; //Next field of the group being written, or none
+byte journal_group_first;                 //Its first and last fields
+byte journal_group_last;
+int journal_group_slot[JOURNAL_GROUP_MAX];  //Where its fields have gone so far
+
+#endif
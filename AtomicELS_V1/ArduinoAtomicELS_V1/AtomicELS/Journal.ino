@@ -0,0 +1,371 @@
+// Copyright (c) 2020 Jon Bryan
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+//================================================================================
+//
+//  Settings journal
+//
+//  See Journal.h for the layout.  All of it runs from loop() and setup().
+//
+//================================================================================
+
+const int journal_tables[4] = {INCHES, METRICS, DIAMETRALS, MODULES};
+
+long journalGet(byte id) {
+  //The current value of a journal field
+
+  switch (id) {
+    case j_feed_mode:
+      return feed_mode;
+    case j_custom_kind:
+      return custom_kind;
+    case j_custom_value:
+      return custom_value;
+    case j_limits:
+      return left_limited | (right_limited << 1);
+    case j_left_limit:
+      return left_limit;
+    case j_right_limit:
+      return right_limit;
+    case j_leadscrew:
+      return leadscrewGet();
+    case j_pickup:
+      //spin_index is less than 2^15, and no pickup is steps_per_rev 0
+      if (!pickup_valid)
+        return 0L;
+      return pickup.index | ((long)pickup.rh << 15) | ((long)pickup.steps_per_rev << 16);
+    case j_pickup_lead:
+      return pickup_valid ? pickup.lead : 0L;
+    case j_encoder_ppr:
+      return machine.encoder_ppr;
+    case j_microsteps:
+      return machine.microsteps;
+    case j_step_ratio:
+      return machine.step_ratio;
+    case j_ltpi:
+      return machine.ltpi;
+    case j_stepper_limit:
+      return machine.stepper_limit;
+  }
+  if (id >= j_period_list)
+    return period_list[id - j_period_list];
+  if (id >= j_rpm_table)
+    return rpm_table[id - j_rpm_table];
+  return feed_index[id - j_feed_index];
+}
+
+void journalSet(byte id, long value) {
+  //Put back a value from the journal, if it makes sense.
+  //journalRestore() sorts out the display afterwards.
+
+  switch (id) {
+    case j_feed_mode:
+      if (value >= inch_feed && value <= custom_feed)
+        feed_mode = (decltype(feed_mode))value;
+      return;
+    case j_custom_kind:
+      if (value >= inch_feed && value <= module_feed)
+        custom_kind = value;
+      return;
+    case j_custom_value:
+      custom_value = value;
+      return;
+    case j_limits:
+      left_limited = value & 1;
+      right_limited = (value & 2) != 0;
+      return;
+    case j_left_limit:
+      left_limit = value;
+      return;
+    case j_right_limit:
+      right_limit = value;
+      return;
+    case j_leadscrew:
+      ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        leadscrew = value;
+      }
+      return;
+    case j_pickup:
+      pickup.index = value & 0x7FFF;
+      pickup.rh = (value >> 15) & 1;
+      pickup.steps_per_rev = value >> 16;
+      pickup_valid = pickup.steps_per_rev > 0;
+      return;
+    case j_pickup_lead:
+      pickup.lead = value;
+      return;
+    case j_encoder_ppr:
+      machine.encoder_ppr = value;    //machineCheck() in journalRestore() sorts out the profile
+      return;
+    case j_microsteps:
+      machine.microsteps = value;
+      return;
+    case j_step_ratio:
+      machine.step_ratio = value;
+      return;
+    case j_ltpi:
+      machine.ltpi = value;
+      return;
+    case j_stepper_limit:
+      machine.stepper_limit = value;
+      return;
+  }
+  if (id >= j_period_list) {
+    period_list[id - j_period_list] = value;
+  } else if (id >= j_rpm_table) {
+    if (value > 0)
+      rpm_table[id - j_rpm_table] = value;
+  } else if (value >= 0 && value < journal_tables[id - j_feed_index]) {
+    feed_index[id - j_feed_index] = value;
+  }
+}
+
+byte journalCrc(const JOURNAL_SLOT &slot) {
+  //CRC of everything in a slot up to the CRC, which is the last byte on the AVR
+
+  byte crc = JOURNAL_CRC;
+  const byte *p = (const byte *)&slot;
+  byte i;
+
+  for (i = 0; i < offsetof(JOURNAL_SLOT, crc); i++)
+    crc = _crc8_ccitt_update(crc, p[i]);
+  return crc;
+}
+
+byte journalGroup(byte id, byte *last) {
+  //The first field of id's group, and its last, or id for both if it's on its own
+
+  byte g;
+
+  for (g = 0; g < JOURNAL_GROUPS; g++) {
+    if (id >= journal_groups[g][0] && id <= journal_groups[g][1]) {
+      *last = journal_groups[g][1];
+      return journal_groups[g][0];
+    }
+  }
+  *last = id;
+  return id;
+}
+
+int journalFree(int h) {
+  //The next slot from h round the ring that isn't some field's latest value
+
+  byte id;
+  bool used;
+
+  for (;;) {
+    if (h >= (int)JOURNAL_SLOTS)
+      h = 0;
+    used = false;
+    for (id = 0; id < JOURNAL_FIELDS; id++) {
+      if (journal_slot[id] == h)
+        used = true;
+    }
+    if (!used)
+      return h;
+    h++;
+  }
+}
+
+void journalRestore(void) {
+  //Read the whole journal, and put back the latest good value of every field.
+  //Called from setup() after zeroSet(), with the spindle stopped.
+
+  JOURNAL_SLOT slot;
+  unsigned long seq[JOURNAL_FIELDS];
+  unsigned long commit_seq[JOURNAL_GROUPS];
+  bool committed[JOURNAL_GROUPS];
+  unsigned long latest = 0UL;
+  bool any = false;
+  char lead[10];
+  byte id, g;
+  int i;
+
+  for (id = 0; id < JOURNAL_FIELDS; id++)
+    journal_slot[id] = -1;
+
+  //The latest committed write of each group, from its last field's slots
+  for (g = 0; g < JOURNAL_GROUPS; g++)
+    committed[g] = false;
+  for (i = 0; i < (int)JOURNAL_SLOTS; i++) {
+    EEPROM.get(i * sizeof(JOURNAL_SLOT), slot);
+    if (slot.id >= JOURNAL_FIELDS || slot.crc != journalCrc(slot))
+      continue;
+    for (g = 0; g < JOURNAL_GROUPS; g++) {
+      if (slot.id == journal_groups[g][1] && (!committed[g] || slot.seq > commit_seq[g])) {
+        commit_seq[g] = slot.seq;
+        committed[g] = true;
+      }
+    }
+  }
+
+  for (i = 0; i < (int)JOURNAL_SLOTS; i++) {
+    EEPROM.get(i * sizeof(JOURNAL_SLOT), slot);
+    id = slot.id & ~JOURNAL_MORE;
+    if (id >= JOURNAL_FIELDS || slot.crc != journalCrc(slot))
+      continue;         //Blank, spoiled, or something else
+    if (!any || slot.seq >= latest) {
+      latest = slot.seq;
+      journal_head = i + 1;
+      any = true;
+    }
+    for (g = 0; g < JOURNAL_GROUPS; g++) {
+      if (id >= journal_groups[g][0] && id <= journal_groups[g][1])
+        break;
+    }
+    if (g < JOURNAL_GROUPS && (!committed[g] || slot.seq > commit_seq[g]))
+      continue;         //Part of a group that was never finished
+    if (journal_slot[id] < 0 || slot.seq > seq[id]) {
+      journal_slot[id] = i;
+      journal_value[id] = slot.value;
+      seq[id] = slot.seq;
+    }
+  }
+  journal_seq = any ? latest + 1 : 0UL;
+  if (journal_head >= (int)JOURNAL_SLOTS)
+    journal_head = 0;
+
+  for (id = 0; id < JOURNAL_FIELDS; id++) {
+    if (journal_slot[id] >= 0)
+      journalSet(id, journal_value[id]);
+  }
+
+  //The profile comes back a field at a time, so it can only be checked now.
+  //If it's no good, the positions saved with it aren't either.
+  if (machineCheck(machine, rpm_table, period_list) != NULL) {
+    machineDefaults(machine, rpm_table, period_list);
+    pickup_valid = false;
+  }
+  machineLoad();
+  if (pickup.index >= SCPR)
+    pickup_valid = false;
+
+  //Whatever it is now is what the journal holds, so nothing is rewritten for it
+  for (id = 0; id < JOURNAL_FIELDS; id++)
+    journal_value[id] = journalGet(id);
+
+  //Bring everything that depends on the restored values up to date
+  if (feed_mode == custom_feed && !(custom_value && customRatio(custom_kind, custom_value)))
+    feed_mode = inch_feed;
+  feedSelect(feed_mode);
+  if (left_limited) {
+    nextionSet(nf_left_bco, nxDGREEN);
+    nextionSet(nf_left_lim, leadStr(left_limit, lead));
+  }
+  if (right_limited) {
+    nextionSet(nf_right_bco, nxDGREEN);
+    nextionSet(nf_right_lim, leadStr(right_limit, lead));
+  }
+  lead_update = true;
+}
+
+void journalCheck(void) {
+  //Called on the UI tick.  Once nothing has changed for JOURNAL_SETTLE ms
+  //with the spindle stopped, start writing the first field that's different,
+  //or carry on with the group it's part of.
+
+  static long last_sum = 0L;
+  static unsigned long settle_time = 0UL;
+  long sum = 0L;
+  long value;
+  byte id, found = JOURNAL_FIELDS;
+
+  for (id = 0; id < JOURNAL_FIELDS; id++) {
+    value = journalGet(id);
+    sum += value;
+    if (found == JOURNAL_FIELDS && value != journal_value[id])
+      found = id;
+  }
+  if (sum != last_sum || spinRateGet() != SPINDLE_STOPPED || jogging || cycle_state != cycle_idle) {
+    //Still changing, or not a good time
+    last_sum = sum;
+    settle_time = millis();
+    return;
+  }
+  if (journal_write_slot >= 0 || millis() - settle_time < JOURNAL_SETTLE)
+    return;
+
+  if (journal_group_next < JOURNAL_FIELDS) {
+    //Part way through a group.  If what's gone out has changed since, start it again.
+    for (id = journal_group_first; id < journal_group_next; id++) {
+      if (journalGet(id) != journal_value[id]) {
+        journal_group_next = JOURNAL_FIELDS;
+        break;
+      }
+    }
+  }
+  if (journal_group_next >= JOURNAL_FIELDS) {
+    if (found == JOURNAL_FIELDS)
+      return;
+    journal_group_first = journalGroup(found, &journal_group_last);
+    journal_group_next = journal_group_first;
+  }
+  id = journal_group_next++;
+
+  journal_write.seq = journal_seq++;
+  journal_write.value = journalGet(id);
+  journal_write.id = id == journal_group_last ? id : id | JOURNAL_MORE;
+  journal_write.crc = journalCrc(journal_write);
+  journal_write_slot = journal_head = journalFree(journal_head);
+  journal_group_slot[id - journal_group_first] = journal_head++;
+  journal_write_step = 0;
+}
+
+void journalCommit(void) {
+  //The group's last slot is in, so its slots are now the fields' latest values
+
+  byte id;
+
+  for (id = journal_group_first; id <= journal_group_last; id++)
+    journal_slot[id] = journal_group_slot[id - journal_group_first];
+  journal_group_next = JOURNAL_FIELDS;
+}
+
+void journalFlush(void) {
+  //Called from loop() every pass.  Write one byte if the EEPROM isn't busy.
+  //The id goes to JOURNAL_BLANK first and gets its real value last, so until
+  //that one byte is written the slot doesn't count, however much of it is in.
+  //If power fails during that byte the CRC, which covers the id, catches it.
+
+  const byte *p = (const byte *)&journal_write;
+  int addr = journal_write_slot * sizeof(JOURNAL_SLOT);
+  byte step = journal_write_step;
+
+  if (journal_write_slot < 0 || !eeprom_is_ready())
+    return;
+
+  if (step == 0) {
+    EEPROM.update(addr + offsetof(JOURNAL_SLOT, id), JOURNAL_BLANK);
+  } else if (step <= offsetof(JOURNAL_SLOT, id)) {
+    EEPROM.update(addr + step - 1, p[step - 1]);              //seq and value
+  } else if (step == offsetof(JOURNAL_SLOT, id) + 1) {
+    EEPROM.update(addr + offsetof(JOURNAL_SLOT, crc), journal_write.crc);
+  } else {
+    EEPROM.update(addr + offsetof(JOURNAL_SLOT, id), journal_write.id);
+
+    //All of it is in.  It's the field's latest value once its group is.
+    journal_value[journal_write.id & ~JOURNAL_MORE] = journal_write.value;
+    journal_write_slot = -1;
+    if (!(journal_write.id & JOURNAL_MORE))
+      journalCommit();
+    return;
+  }
+  journal_write_step++;
+}
@@ -0,0 +1,63 @@
+#ifndef __MACHINE_H
+#define __MACHINE_H
+
+//================================================================================
+// Machine profile
+//================================================================================
+
+// The encoder, the stepper drive and the leadscrew are a profile in machine (see
+// MACHINE in configuration.h), so the sketch goes on a different lathe without a
+// rebuild.  It starts out as the defaults in configuration.h, can be changed over
+// the debug port, and is kept in EEPROM by the journal along with the belt speeds
+// and period_list[].
+//
+// machineLoad() works out everything that follows from the profile in one go:
+// the counts per rev and half of it, the index window, the steps per inch and per
+// mm, the RPM scale and the jog top speed.  The interrupts and the display code
+// read those rather than dividing, so a profile costs them a load from SRAM where
+// they had a constant.  The feed tables in flash hold the steps for the default
+// profile, so feedGet() works them out again from the pitch with machineSteps(),
+// a few 64-bit divides when the knob is turned.  The jog ramp is built from the
+// top speed by planInit(), which is floating point and too slow to run with
+// interrupts off the way machineApply() calls machineLoad(), so setup() calls it
+// once the journal has put the profile back, and machineApply() afterwards.
+//
+// machineCheck() has to pass before a profile is used.  It refuses an encoder
+// with more counts than step_table[] has room for, and any profile where a feed
+// in the tables would come to more steps per rev than an int holds, or more steps
+// per spindle tick than period_list[] covers (which is also what keeps
+// step_table[]'s bytes from saturating).  tools/els_profile.cpp does the same
+// checks on the PC, and prints the top spindle speed for every feed, so a profile
+// can be tried out before it's sent.
+//
+// Commands, one per line, on the debug port:
+//   show              the profile being edited, and whether it would load
+//   ppr N             encoder pulses per revolution on each phase
+//   microsteps N      driver microsteps per stepper revolution
+//   ratio N           stepper:leadscrew ratio
+//   ltpi N            leadscrew threads per inch
+//   limit N           stepper steps per minute
+//   rpm I N           belt speed I (0 to 11) in rpm
+//   period I N        period_list[I] in TC4 counts
+//   defaults          start again from the defaults in configuration.h
+//   apply             check the edits and load them, with the spindle stopped
+// Nothing changes until apply.  SPINDLE_X4 and STEP_DDA are still compile time
+// choices.  With ELS_TELEMETRY the replies are mixed in with the telemetry, which
+// the decoder skips over.  With CROSS_SLIDE the cross-slide's commands (see
+// Cross.h) are taken on the same port, and with ELS_PROFILE the profiler's
+// (see Profile.h).
+
+#define MACHINE_LINE    24          //Longest command line
+#define SCPR_LIMIT      8192        //Most counts per rev, the pickup keeps spin_index in 15 bits
+#define LSPI_LIMIT      1000000L    //Most leadscrew steps per inch, so lspi * 100 and lead * 10 fit a long
+
+static_assert(T3CPM / 20 / SCPR_EDGES <= (unsigned long long)(decltype(MACHINE::rpm20))~0ULL,
+              "rpm20 doesn't hold the slowest encoder's");
+
+MACHINE machine_edit;               //The profile being edited over the debug port
+unsigned int machine_rpm[12];       //and its belt speeds
+int machine_period[12];             //and step periods
+char machine_line[MACHINE_LINE + 1];
+byte machine_len = 0;
+
+#endif
@@ -0,0 +1,305 @@
+// Copyright (c) 2020 Jon Bryan
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+//================================================================================
+//
+//  Machine profile
+//
+//  See Machine.h.  The checks here and in tools/els_profile.cpp have to agree,
+//  so change them both.
+//
+//================================================================================
+
+void machineDerive(MACHINE &m) {
+  //Work out everything that follows from the profile.  Only for a profile
+  //that has passed machineCheck(), or nearly: the sizes are checked first.
+
+  m.scpr = m.encoder_ppr * SCPR_EDGES;
+  m.scpr_half = m.scpr / 2;
+  m.index_window = m.scpr / 64;
+  m.lspi = (long)m.ltpi * m.microsteps * m.step_ratio;
+  m.lspm10 = m.lspi / 100;
+  m.lspmm10 = (m.lspi * 100 + 127) / 254;
+  m.rpm20 = T3CPM / 20 / m.scpr;
+  m.rpm_scale = T3CPM / m.scpr;
+  m.plan_min_period = T4CPM / m.stepper_limit;
+  if (m.plan_min_period < ICR4_MIN)
+    m.plan_min_period = ICR4_MIN;
+}
+
+void machineLoad(void) {
+  //Start using machine.  The caller sorts out the feed afterwards.
+
+  machineDerive(machine);
+#ifdef STEP_DDA
+  dda_den = SCPR;
+#endif
+#ifdef CROSS_SLIDE
+  crossRatio();                     //Which is in leadscrew steps
+#endif
+}
+
+bool machineSteps(byte kind, unsigned long thou, const MACHINE &m, unsigned int *steps, long *error) {
+  //Steps per rev for a table pitch in thousandths, the same sums as tables.h
+  //but with the profile's steps per inch.  False if it won't fit an int.
+
+  unsigned long long num, den, q;
+
+  switch (kind) {
+    case inch_feed:
+      num = m.lspi * 1000ULL;
+      den = thou;
+      break;
+    case metric_feed:
+      num = (unsigned long long)thou * m.lspi * 10;
+      den = 254000ULL;
+      break;
+    case diametral_feed:
+      num = PI_NUM * m.lspi * 1000;
+      den = PI_DEN * thou;
+      break;
+    default:
+      num = PI_NUM * thou * m.lspi * 10;
+      den = PI_DEN * 254000;
+      break;
+  }
+  q = (num + den / 2) / den;
+  if (q == 0 || q > 32767)
+    return false;
+  *steps = q;
+  *error = ((long long)q * (long long)den - (long long)num) * 1000000LL / (long long)num;
+  return true;
+}
+
+const __FlashStringHelper *machineCheck(const MACHINE &m, const unsigned int *rpms, const int *periods) {
+  //NULL if the profile can be loaded, or what's wrong with it
+
+  const FEED_TABLE *tables[4] = {inch, metric, diametral, module};
+  const int sizes[4] = {INCHES, METRICS, DIAMETRALS, MODULES};
+  MACHINE p = m;
+  unsigned int steps;
+  long error;
+  byte kind;
+  int i;
+
+  if (m.encoder_ppr == 0 || (long)m.encoder_ppr * SCPR_EDGES > SCPR_LIMIT)
+    return F("encoder ppr out of range");
+#ifndef STEP_DDA
+  if (m.encoder_ppr > ENCODER_PPR_MAX)
+    return F("encoder ppr is more than step_table[] holds");
+#endif
+  if (m.microsteps == 0 || m.step_ratio == 0 || m.ltpi == 0)
+    return F("microsteps, ratio and ltpi can't be 0");
+  if ((unsigned long long)m.ltpi * m.microsteps * m.step_ratio > LSPI_LIMIT)
+    return F("too many leadscrew steps per inch");
+  if (m.stepper_limit < T4CPM / ICR4_MAX)
+    return F("stepper limit is slower than the slowest jog");
+  for (i = 0; i < 12; i++) {
+    if (rpms[i] == 0)
+      return F("belt speed of 0");
+    if (periods[i] < STP_MIN || periods[i] > ICR4_MAX)
+      return F("period out of range");
+  }
+
+  machineDerive(p);
+  if (p.lspm10 == 0)
+    return F("too few leadscrew steps per inch");
+  for (kind = inch_feed; kind <= module_feed; kind++) {
+    for (i = 0; i < sizes[kind]; i++) {
+      if (!machineSteps(kind, pgm_read_dword(&tables[kind][i].thou), p, &steps, &error))
+        return F("a feed comes to under a step per rev, or more than an int holds");
+      if ((steps + p.scpr - 1) / p.scpr > CUSTOM_MAX_TICK)
+        return F("a feed needs more steps per spindle tick than period_list[] has");
+    }
+  }
+  return NULL;
+}
+
+void machineEdit(void) {
+  //Start editing from what's loaded
+
+  machine_edit = machine;
+  memcpy(machine_rpm, rpm_table, sizeof(machine_rpm));
+  memcpy(machine_period, period_list, sizeof(machine_period));
+}
+
+void machineDefaults(MACHINE &m, unsigned int *rpms, int *periods) {
+  //The profile, belt speeds and periods from configuration.h
+
+  const unsigned int rpm_default[12] { RPM_TABLE };
+  const int period_default[12] { PERIOD_LIST };
+
+  m.encoder_ppr = ENCODER_PPR;
+  m.microsteps = MICROSTEPS;
+  m.step_ratio = STEP_RATIO;
+  m.ltpi = LTPI;
+  m.stepper_limit = STEPPER_LIMIT;
+  memcpy(rpms, rpm_default, sizeof(rpm_default));
+  memcpy(periods, period_default, sizeof(period_default));
+}
+
+void machineApply(void) {
+  //Load the edited profile, if it checks out and nothing is moving
+
+  const __FlashStringHelper *err;
+  bool moved;                       //Positions in counts or steps mean something else now
+
+  if (spinRateGet() != SPINDLE_STOPPED || jogging || cycle_state != cycle_idle) {
+    Serial.println(F("stop the spindle first"));
+    return;
+  }
+  if ((err = machineCheck(machine_edit, machine_rpm, machine_period)) != NULL) {
+    Serial.println(err);
+    return;
+  }
+
+  moved = machine_edit.encoder_ppr != machine.encoder_ppr ||
+          (long)machine_edit.ltpi * machine_edit.microsteps * machine_edit.step_ratio != machine.lspi;
+  noInterrupts();
+  machine = machine_edit;
+  memcpy(rpm_table, machine_rpm, sizeof(rpm_table));
+  memcpy(period_list, machine_period, sizeof(period_list));
+  machineLoad();
+  if (moved) {
+    //Start the index over, and forget the pickup
+    indexed = false;
+    spin_index = 0;
+    pickup_valid = false;
+    pickup_armed = false;
+  }
+  interrupts();
+
+  planInit();
+  if (moved)
+    zeroSet();                      //Which also puts spin_count back in range
+  if (feed_mode == custom_feed && !customRatio(custom_kind, custom_value))
+    feed_mode = inch_feed;
+  feedSelect(feed_mode);
+  Serial.println(F("loaded"));
+}
+
+void machineShow(void) {
+  //Print the profile being edited
+
+  MACHINE p = machine_edit;
+  const __FlashStringHelper *err = machineCheck(machine_edit, machine_rpm, machine_period);
+  int i;
+
+  Serial.print(F("ppr "));
+  Serial.println(p.encoder_ppr);
+  Serial.print(F("microsteps "));
+  Serial.println(p.microsteps);
+  Serial.print(F("ratio "));
+  Serial.println(p.step_ratio);
+  Serial.print(F("ltpi "));
+  Serial.println(p.ltpi);
+  Serial.print(F("limit "));
+  Serial.println(p.stepper_limit);
+  for (i = 0; i < 12; i++) {
+    Serial.print(F("rpm "));
+    Serial.print(i);
+    Serial.print(' ');
+    Serial.println(machine_rpm[i]);
+  }
+  for (i = 0; i < 12; i++) {
+    Serial.print(F("period "));
+    Serial.print(i);
+    Serial.print(' ');
+    Serial.println(machine_period[i]);
+  }
+  if (err) {
+    Serial.println(err);
+  } else {
+    machineDerive(p);
+    Serial.print(F("ok, counts per rev "));
+    Serial.print(p.scpr);
+    Serial.print(F(", steps per inch "));
+    Serial.println(p.lspi);
+  }
+}
+
+void machineCommand(char *line) {
+  //One line from the debug port
+
+  char *cmd = strtok(line, " \t");
+  char *arg1 = strtok(NULL, " \t");
+  char *arg2 = strtok(NULL, " \t");
+  long a = arg1 ? atol(arg1) : -1L;
+  long b = arg2 ? atol(arg2) : -1L;
+
+  if (cmd == NULL)
+    return;
+#ifdef CROSS_SLIDE
+  if (crossCommand(cmd, arg1, arg2))
+    return;                         //It has replied, see Cross.h
+#endif
+#ifdef ELS_PROFILE
+  if (profCommand(cmd))
+    return;                         //See Profile.h
+#endif
+  if (strcmp(cmd, "show") == 0) {
+    machineShow();
+    return;
+  }
+  if (strcmp(cmd, "defaults") == 0) {
+    machineDefaults(machine_edit, machine_rpm, machine_period);
+  } else if (strcmp(cmd, "apply") == 0) {
+    machineApply();
+    return;
+  } else if (a < 0) {
+    //Everything else needs a number, and none of them are negative
+  } else if (strcmp(cmd, "ppr") == 0 && a <= 0xFFFF) {
+    machine_edit.encoder_ppr = a;
+  } else if (strcmp(cmd, "microsteps") == 0 && a <= 0xFFFF) {
+    machine_edit.microsteps = a;
+  } else if (strcmp(cmd, "ratio") == 0 && a <= 0xFF) {
+    machine_edit.step_ratio = a;
+  } else if (strcmp(cmd, "ltpi") == 0 && a <= 0xFF) {
+    machine_edit.ltpi = a;
+  } else if (strcmp(cmd, "limit") == 0) {
+    machine_edit.stepper_limit = a;
+  } else if (strcmp(cmd, "rpm") == 0 && a < 12 && b >= 0 && b <= 0xFFFF) {
+    machine_rpm[a] = b;
+  } else if (strcmp(cmd, "period") == 0 && a < 12 && b >= 0 && b <= 0x7FFF) {
+    machine_period[a] = b;
+  } else {
+    Serial.println(F("?"));
+    return;
+  }
+  Serial.println(F("ok"));
+}
+
+void machineSerial(void) {
+  //Called on every pass of loop() to collect command lines from the debug port
+
+  char c;
+
+  while (Serial.available() > 0) {
+    c = Serial.read();
+    if (c == '\r' || c == '\n') {
+      machine_line[machine_len] = '\0';
+      if (machine_len)
+        machineCommand(machine_line);
+      machine_len = 0;
+    } else if (machine_len < MACHINE_LINE) {
+      machine_line[machine_len++] = c;
+    }
+  }
+}
@@ -0,0 +1,91 @@
+#ifndef __PINS_H
+#define __PINS_H
+
+//================================================================================
+// Compile-time pin bindings
+//================================================================================
+
+// digitalRead() looks the pin up in three PROGMEM tables every call, and
+// attachInterrupt() sends every interrupt through a function pointer from a
+// handler that has to save every register the called function might use.
+// That's fine in loop(), but not in interrupts that run at 20khz or more.
+//
+// FastPin<pin> resolves an Arduino Mega pin number to its port and bit when the
+// sketch compiles, so FastPin<SPINDLE_B>::read() is a single SBIS instruction.
+// Only the pins the sketch uses are bound, so moving one of the #defines in
+// configuration.h to an unbound pin is a compile error rather than a silent
+// misread.  Add a FAST_PIN() line from the Mega 2560 pin mapping if that happens.
+
+template <byte pin> struct FastPin;
+
+#define FAST_PIN(pin, p, b) \
+  template <> struct FastPin<pin> { \
+    static const char port = #p[0]; \
+    static const byte bit = b; \
+    static inline byte in(void) { return PIN##p; } \
+    static inline bool read(void) { return PIN##p & _BV(b); } \
+  }
+
+FAST_PIN(2,  E, 4);     //SPINDLE_B
+FAST_PIN(3,  E, 5);     //SPINDLE_A
+FAST_PIN(12, B, 6);     //SPINDLE_Z
+FAST_PIN(13, B, 7);     //ALARM
+FAST_PIN(18, D, 3);     //LEFT_MOM
+FAST_PIN(19, D, 2);     //RIGHT_MOM
+FAST_PIN(20, D, 1);     //KNOB_B
+FAST_PIN(21, D, 0);     //KNOB_A
+FAST_PIN(48, L, 1);     //SPINDLE_A with SPINDLE_ICP
+
+// External interrupt number (INTn, not the Arduino interrupt number) for the
+// pins that have one.  EXT_VECT(SPINDLE_A) becomes INT5_vect, so handlers are
+// bound straight to the vector, with no attachInterrupt() in between.
+// The pin has to be #defined as a plain number for the token pasting to work.
+
+#define EXT_INT_2     4
+#define EXT_INT_3     5
+#define EXT_INT_18    3
+#define EXT_INT_19    2
+#define EXT_INT_20    1
+#define EXT_INT_21    0
+
+#define EXT_INT(pin)        EXT_INT_X(pin)
+#define EXT_INT_X(pin)      EXT_INT_##pin
+#define EXT_VECT(pin)       EXT_VECT_X(EXT_INT(pin))
+#define EXT_VECT_X(n)       EXT_VECT_Y(n)
+#define EXT_VECT_Y(n)       INT##n##_vect
+
+// Interrupt sense control values for EICRA/EICRB
+#define EXT_CHANGE    1
+#define EXT_FALLING   2
+#define EXT_RISING    3
+
+inline void extAttach(byte n, byte sense) {
+  //Set the sense for INTn and enable it
+
+  if (n < 4) {
+    EICRA = (EICRA & ~(3 << (2 * n))) | (sense << (2 * n));
+  } else {
+    EICRB = (EICRB & ~(3 << (2 * (n - 4)))) | (sense << (2 * (n - 4)));
+  }
+  EIMSK |= _BV(n);
+}
+
+inline void extDetach(byte n) {
+  //Disable INTn, leaving the sense alone
+
+  EIMSK &= ~_BV(n);
+}
+
+#ifdef SPINDLE_X4
+//Both phases are on the same port with A just above B, so one read gets the state
+static_assert(FastPin<SPINDLE_A>::port == FastPin<SPINDLE_B>::port &&
+              FastPin<SPINDLE_A>::bit == FastPin<SPINDLE_B>::bit + 1,
+              "SPINDLE_X4 needs SPINDLE_A and SPINDLE_B on adjacent bits of one port");
+
+inline byte quadState(void) {
+  //Spindle encoder state as (A << 1) | B
+  return (FastPin<SPINDLE_B>::in() >> FastPin<SPINDLE_B>::bit) & 3;
+}
+#endif
+
+#endif
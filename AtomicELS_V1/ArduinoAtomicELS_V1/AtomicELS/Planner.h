@@ -0,0 +1,68 @@
+#ifndef __PLANNER_H
+#define __PLANNER_H
+
+//================================================================================
+// Jog and rapid traverse motion planner
+//================================================================================
+
+// Moves with the spindle stopped are planned as a trapezoid: constant acceleration
+// at JOG_ACCEL from ICR4_MAX up to the stepper's top speed, cruise, and constant
+// deceleration back down.  A jog first creeps at ICR4_MAX for fine positioning;
+// a move with a count, a rapid or the threading cycle's return, starts on the ramp.
+//
+// The ramp is worked out once by planInit() as PLAN_LEVELS speeds evenly spaced
+// between ICR4_MAX and the top speed.  plan_edge[] is how far into the ramp, in
+// steps, each speed starts, so the slow levels last a few steps and the fast
+// ones a few hundred.  The TIMER4 interrupt calls planStep() after every step
+// pulse, which moves plan_ramp up or down one step and picks the period for it.
+// It starts slowing down as soon as the steps left are no more than the steps
+// it took to get up to speed, so it stops right on the target.
+//
+// A jog has no target until the button is released, when planStop() sets one
+// just far enough away to stop smoothly.
+//
+// The threading cycle's return to the start limit is the one move made with the
+// spindle turning.  The spindle interrupt stays attached and keeps counting,
+// but leaves the timer alone while jogging is set.
+
+#define JOG_ACCEL     10000L        //Steps/s/s, about 0.4"/s/s on the carriage
+#define JOG_CREEP     48            //Steps at ICR4_MAX before a jog accelerates, about 0.002"
+#define PLAN_LEVELS   32            //Speeds in the ramp
+#define PLAN_FOREVER  0x7FFFFFFFL   //Steps left for a jog until it's released
+
+// The top speed is the stepper limit, or ICR4_MIN if that is slower (see machineDerive())
+#define PLAN_MIN_PERIOD machine.plan_min_period
+
+unsigned int plan_period[PLAN_LEVELS];  //ICR4 for each speed
+unsigned int plan_edge[PLAN_LEVELS];    //Ramp steps at which each speed starts
+
+volatile long plan_left;      //Steps left in the move
+unsigned int plan_ramp;       //Steps into the ramp, which is also the steps needed to stop
+byte plan_level;              //Current index into plan_period[]
+byte plan_creep;              //Creep steps left before accelerating
+
+inline bool planStep(void) {
+  //Called from the TIMER4 interrupt after each step while jogging.
+  //Sets the period for the next step, and returns true when the move is done.
+
+  if (--plan_left <= 0)
+    return true;
+  if (plan_left <= plan_ramp) {
+    //Slow down
+    if (plan_ramp)
+      --plan_ramp;
+    if (plan_ramp < plan_edge[plan_level])
+      --plan_level;
+  } else if (plan_creep) {
+    --plan_creep;
+  } else if (plan_ramp < plan_edge[PLAN_LEVELS - 1]) {
+    //Speed up, or stay at the top speed
+    ++plan_ramp;
+    if (plan_level < PLAN_LEVELS - 1 && plan_ramp >= plan_edge[plan_level + 1])
+      ++plan_level;
+  }
+  ICR4 = plan_period[plan_level];
+  return false;
+}
+
+#endif
@@ -0,0 +1,98 @@
+// Copyright (c) 2020 Jon Bryan
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+//================================================================================
+//
+//  Jog and rapid traverse motion planner
+//
+//  loop() side of the planner in Planner.h.  The ramp is calculated in floating
+//  point once at startup, so the interrupt only has to look periods up.
+//
+//================================================================================
+
+void planInit(void) {
+  //Work out the ramp from ICR4_MAX to PLAN_MIN_PERIOD at JOG_ACCEL
+
+  int j;
+  float v0 = 2000000.0 / ICR4_MAX;          //Steps per second, TC4 runs at 2Mhz
+  float v1 = 2000000.0 / PLAN_MIN_PERIOD;
+  float v;
+  unsigned int edge;
+
+  for (j = 0; j < PLAN_LEVELS; j++) {
+    v = v0 + (v1 - v0) * j / (PLAN_LEVELS - 1);
+    plan_period[j] = 2000000.0 / v + 0.5;
+    //Steps to get from v0 to v is (v^2 - v0^2) / 2a
+    edge = (v * v - v0 * v0) / (2.0 * JOG_ACCEL) + 0.5;
+    if (j > 0 && edge <= plan_edge[j - 1])
+      edge = plan_edge[j - 1] + 1;          //At least one step at each speed
+    plan_edge[j] = edge;
+  }
+  plan_period[PLAN_LEVELS - 1] = PLAN_MIN_PERIOD;   //No rounding past the limit
+}
+
+void planMove(bool feed, long count) {
+  //Start a move of count steps, or PLAN_FOREVER for a jog.
+  //The caller has already detached the spindle and saved the timer.
+
+  plan_left = count;
+  plan_ramp = 0;
+  plan_level = 0;
+  plan_creep = count == PLAN_FOREVER ? JOG_CREEP : 0;
+
+  ICR4 = plan_period[0];
+  TCNT4 = plan_period[0] - PUL_MIN;         //First pulse right away
+  jogging = true;
+  pwmOn(feed);
+}
+
+void planStop(void) {
+  //Slow down and stop as soon as possible.
+  //The interrupt posts ev_move_done when it has.
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if (plan_left > (long)plan_ramp + 1)
+      plan_left = plan_ramp + 1;
+  }
+}
+
+void rapidTo(bool feed) {
+  //Traverse to the left or right limit at full speed, if it's set
+  //and the spindle isn't turning
+
+  long lead = leadscrewGet();
+  long count;
+
+  if (jogging || spinRateGet() != SPINDLE_STOPPED)
+    return;
+  if (feed) {
+    if (!left_limited)
+      return;
+    count = lead - left_limit;              //Feeding left counts down
+  } else {
+    if (!right_limited)
+      return;
+    count = right_limit - lead;
+  }
+  if (count <= 0)
+    return;                                 //Already there, or past it
+
+  jogStart(feed, count);
+}
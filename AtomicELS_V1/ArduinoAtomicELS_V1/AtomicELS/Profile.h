@@ -0,0 +1,138 @@
+#ifndef __PROFILE_H
+#define __PROFILE_H
+
+//================================================================================
+// Profiler
+//================================================================================
+
+// With ELS_PROFILE the interrupts, the masked section of pwmPeriodSet() and
+// loop() time themselves against the spindle timebase (see Timebase.h), which
+// counts at 16Mhz, so a count is 1/16us and the 50us a tick gets at the top
+// speed is 800 counts.  Each site keeps how many times it ran, the shortest,
+// longest and total, and a histogram of log2 buckets: bucket i counts times from
+// 2^i up to 2^(i+1) counts, with 0 and 1 in bucket 0 and anything from
+// 2^(PROF_BUCKETS-1) up in the last.
+//
+// The interrupts record how long they took, from the first thing they do to the
+// last, and where it's known, the latency from the event that set their flag to
+// the first thing they do.  That includes the prologue and whatever held them
+// off, another interrupt or a masked section.  The TIMER4 and TIMER1 compares are
+// known from the counter and OCRnA, to 1/2us, and with SPINDLE_ICP the spindle
+// edge is in ICR5.  Without it the spindle interrupt reads the time on entry, so
+// there's no latency to record.  loop is the time from the start of one pass to
+// the start of the next, and ui is the UI_TICK work on its own.
+//
+// The debug port commands (see Machine.h):
+//   prof              print every site that has run since the last reset
+//   profreset         clear them all
+// The pass that prints is left out of loop, since it's long because of the
+// printing.
+//
+// Without ELS_PROFILE the PROF_ macros are empty and none of this is compiled.
+// With it, the recording isn't in the times, but it does make each interrupt
+// that's profiled longer, by something like 100 cycles per record.
+
+#ifdef ELS_PROFILE
+
+#define PROF_BUCKETS  16          //Log2 buckets per site, the last up to 4ms for an interrupt
+
+enum profSite {
+  prof_spindle,             //Spindle interrupt
+  prof_spindle_lat,         //Edge to spindle interrupt, SPINDLE_ICP only
+  prof_timer4,              //TIMER4 interrupt
+  prof_timer4_lat,          //Compare match to TIMER4 interrupt
+  prof_knob,                //Knob interrupt
+  prof_masked,              //Interrupts off in pwmPeriodSet()
+  prof_loop,                //loop() period
+  prof_ui,                  //The UI_TICK work in loop()
+#ifdef CROSS_SLIDE
+  prof_timer1,              //TIMER1 interrupt
+  prof_timer1_lat,          //Compare match to TIMER1 interrupt
+#endif
+  prof_sites
+};
+
+struct PROFILE {
+  unsigned long n;                      //Times recorded
+  unsigned long min;
+  unsigned long max;
+  unsigned long long sum;               //For the mean
+  unsigned long bucket[PROF_BUCKETS];
+};
+
+PROFILE prof[prof_sites];
+bool prof_skip = false;                 //Leave this pass out of loop
+
+inline void profRecord(byte site, unsigned long t) {
+  //Add a time in timebase counts to a site.  From the site's own interrupt,
+  //or from loop() for the loop sites.
+
+  PROFILE *p = &prof[site];
+  byte b = 0;
+
+  if (p->n == 0 || t < p->min)
+    p->min = t;
+  if (t > p->max)
+    p->max = t;
+  p->n++;
+  p->sum += t;
+  if (t >= (1UL << (PROF_BUCKETS - 1))) {
+    b = PROF_BUCKETS - 1;
+  } else {
+    unsigned int v = t;
+
+    if (v & 0xFF00) {
+      b = 8;
+      v >>= 8;
+    }
+    while (v > 1) {
+      v >>= 1;
+      b++;
+    }
+  }
+  p->bucket[b]++;
+}
+
+inline void profCompare(byte site, unsigned int count, unsigned int match, unsigned int top) {
+  //Latency of a compare interrupt from the counter and OCRnA on entry.
+  //A counter below the compare has gone past top and round again.
+  //Timers 1 and 4 count at 2Mhz, 8 timebase counts.
+
+  unsigned int late = count >= match ? count - match : count + (top + 1 - match);
+
+  profRecord(site, (unsigned long)late << 3);
+}
+
+inline unsigned long profTime(void) {
+  //The 32-bit time for the loop sites, which can take longer than the
+  //16-bit counter holds
+
+  unsigned long t;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    t = spinTime();
+  }
+  return t;
+}
+
+//In an interrupt or with interrupts off, up to 4ms.  The difference is taken
+//in 16 bits, the counter's width, so it comes out right across the wrap.
+#define PROF_START(t)             uint16_t t = SPIN_TCNT
+#define PROF_END(site, t)         profRecord(site, (uint16_t)(SPIN_TCNT - (t)))
+//Latency of TIMERn_COMPA_vect, first thing in it
+#define PROF_COMPARE(site, n)     profCompare(site, TCNT##n, OCR##n##A, ICR##n)
+//In loop()
+#define PROF_LONG_START(t)        unsigned long t = profTime()
+#define PROF_LONG_END(site, t)    profRecord(site, profTime() - (t))
+
+#else
+
+#define PROF_START(t)
+#define PROF_END(site, t)
+#define PROF_COMPARE(site, n)
+#define PROF_LONG_START(t)
+#define PROF_LONG_END(site, t)
+
+#endif // ELS_PROFILE
+
+#endif // __PROFILE_H
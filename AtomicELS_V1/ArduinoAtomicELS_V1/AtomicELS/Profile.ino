@@ -0,0 +1,137 @@
+// Copyright (c) 2020 Jon Bryan
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+
+//================================================================================
+//
+//  Profiler
+//
+//  See Profile.h.  The loop period and the debug port commands.
+//
+//================================================================================
+
+#ifdef ELS_PROFILE
+
+#define PROF_NAME 12              //Longest site name and its terminator
+
+//In the order of profSite
+const char prof_names[prof_sites][PROF_NAME] PROGMEM = {
+  "spindle",
+  "spindle_lat",
+  "timer4",
+  "timer4_lat",
+  "knob",
+  "masked",
+  "loop",
+  "ui",
+#ifdef CROSS_SLIDE
+  "timer1",
+  "timer1_lat",
+#endif
+};
+
+void profLoop(void) {
+  //Called first thing in loop(), to time the passes
+
+  static unsigned long last = 0;
+  unsigned long now = profTime();
+
+  if (last != 0 && !prof_skip)
+    profRecord(prof_loop, now - last);
+  prof_skip = false;
+  last = now;
+}
+
+void profShow(void) {
+  //Print every site that has run.  The interrupts keep going, so each
+  //site's figures are copied a few at a time with them off, and the
+  //histogram can be a count or two ahead of n.
+
+  PROFILE p;
+  byte site;
+  byte b;
+
+  for (site = 0; site < prof_sites; site++) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      p.n = prof[site].n;
+      p.min = prof[site].min;
+      p.max = prof[site].max;
+      p.sum = prof[site].sum;
+    }
+    if (p.n == 0)
+      continue;
+    for (b = 0; b < PROF_BUCKETS; b++) {
+      ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        p.bucket[b] = prof[site].bucket[b];
+      }
+    }
+    Serial.print((const __FlashStringHelper *)prof_names[site]);
+    Serial.print(F(" n "));
+    Serial.print(p.n);
+    Serial.print(F(" min "));
+    Serial.print(p.min);
+    Serial.print(F(" max "));
+    Serial.print(p.max);
+    Serial.print(F(" mean "));
+    Serial.println((unsigned long)(p.sum / p.n));
+    //Each bucket that has anything in it, as its lowest time and count
+    for (b = 0; b < PROF_BUCKETS; b++) {
+      if (p.bucket[b] == 0)
+        continue;
+      Serial.print(' ');
+      Serial.print(b ? 1UL << b : 0UL);
+      Serial.print(':');
+      Serial.print(p.bucket[b]);
+    }
+    Serial.println();
+  }
+  Serial.println(F("ok"));
+  prof_skip = true;             //This pass is long because of all that
+}
+
+void profReset(void) {
+  //Clear every site
+
+  byte site;
+
+  for (site = 0; site < prof_sites; site++) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      memset(&prof[site], 0, sizeof(PROFILE));
+    }
+  }
+  prof_skip = true;
+}
+
+bool profCommand(char *cmd) {
+  //Called by machineCommand().  False if it isn't a profiler command.
+
+  if (strcmp(cmd, "prof") == 0) {
+    profShow();
+  } else if (strcmp(cmd, "profreset") == 0) {
+    profReset();
+    Serial.println(F("ok"));
+  } else {
+    return false;
+  }
+  return true;
+}
+
+#endif // ELS_PROFILE
@@ -0,0 +1,31 @@
+#ifndef __RATIO_H
+#define __RATIO_H
+
+//================================================================================
+// Custom pitch entry
+//================================================================================
+
+// Any TPI, mm pitch, diametral pitch or module can be typed in on the display's
+// CUSTOM page, as a number with three decimals.  One of the four unit buttons
+// asks for the number with "get", and it comes back as a 0x71 numeric frame.
+//
+// The pitch is turned into leadscrew steps per spindle count as a fraction of
+// integers, reduced, and fed to the STEP_DDA accumulator, which carries the
+// remainder from count to count, so there is no drift however long the thread.
+// If the reduced fraction doesn't fit the accumulator it is replaced by the
+// closest one that does, and the difference is shown as the pitch error.
+// Without STEP_DDA the steps per revolution have to be a whole number.
+
+#define CUSTOM_VALUE    "custom.pitch.val"  //Nextion number (x-float, 3 decimals)
+#define DDA_DEN_MAX     0x10000000UL        //dda_acc + dda_rem and the numerator have to fit in a long
+#define CUSTOM_MAX_TICK 11                  //Most steps per spindle tick, the size of period_list[]
+
+byte custom_kind = inch_feed;       //What the entered number is, using the table feed modes
+unsigned long custom_value = 0;     //Entered pitch in thousandths
+bool custom_pending = false;        //Waiting for the reply to "get"
+
+unsigned long custom_num;           //Steps per spindle count is custom_num / custom_den
+unsigned long custom_den;
+FEED_TABLE custom;                  //Display strings, rounded steps and the error for the entry
+
+#endif
@@ -0,0 +1,245 @@
+// Copyright (c) 2020 Jon Bryan
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+//================================================================================
+//
+//  Custom pitch entry
+//
+//  The ratio is worked out with 64-bit integers.  That's slow on an AVR, but it
+//  only happens when a number is entered.  The same fractions as the tables are
+//  used: 25.4mm per inch, and 355/113 for pi.
+//
+//================================================================================
+
+void customRequest(byte kind) {
+  //One of the unit buttons on the CUSTOM page was pressed, so ask for the number
+
+  custom_kind = kind;
+  custom_pending = true;
+  nextionSend(F("get " CUSTOM_VALUE "\xFF\xFF\xFF"));
+}
+
+void customNumber(const byte *buf) {
+  //Numeric frame from the display
+
+  long value;
+
+  if (!custom_pending)
+    return;             //Not ours
+  custom_pending = false;
+
+  value = (long)buf[1] | ((long)buf[2] << 8) | ((long)buf[3] << 16) | ((long)buf[4] << 24);
+  if (value > 0 && customRatio(custom_kind, value)) {
+    custom_value = value;
+    feed_mode = custom_feed;
+  }
+  //Otherwise the last custom pitch, or the table feed, stays in effect
+  feedSelect(feed_mode);
+}
+
+bool customRatio(byte kind, unsigned long value) {
+  //Work out steps per spindle count for a pitch in thousandths.
+  //Fills in custom_num, custom_den and custom, or returns false if the pitch
+  //is too fine or too coarse to cut.
+
+  unsigned long long num, den;
+  unsigned long long g;
+  unsigned long p, q;
+
+  switch (kind) {
+    case inch_feed:       //LSPI / tpi
+      num = machine.lspi * 1000ULL;
+      den = value;
+      break;
+    case metric_feed:     //mm * LSPI / 25.4
+      num = (unsigned long long)value * machine.lspi;
+      den = 25400ULL;
+      break;
+    case diametral_feed:  //pi * LSPI / dp
+      num = 355ULL * machine.lspi * 1000;
+      den = 113ULL * value;
+      break;
+    case module_feed:     //pi * module * LSPI / 25.4
+      num = 355ULL * value * machine.lspi;
+      den = 113ULL * 25400;
+      break;
+    default:
+      return false;
+  }
+  den *= SCPR;            //Per spindle count rather than per revolution
+
+  //At least one step per revolution, no more steps per tick than the periods cover,
+  //and steps_per_rev has to fit in an int
+  if (num * SCPR < den || num >= CUSTOM_MAX_TICK * den || num * SCPR >= 32767ULL * den)
+    return false;
+
+  g = ratioGcd(num, den);
+  num /= g;
+  den /= g;
+
+#ifdef STEP_DDA
+  if (den > DDA_DEN_MAX) {
+    ratioApprox(num, den, DDA_DEN_MAX, &p, &q);
+    custom.error = ratioError(p, q, num, den);
+  } else {
+    p = num;
+    q = den;
+    custom.error = 0;
+  }
+#else
+  //The step table repeats every revolution
+  p = (num * SCPR + den / 2) / den;
+  q = SCPR;
+  custom.error = ratioError(p, q, num, den);
+#endif
+
+  custom_num = p;
+  custom_den = q;
+  custom.steps = ((unsigned long long)p * SCPR + q - 1) / q;   //Rounded up for maxRPM()
+  customStrings(kind, value);
+  return true;
+}
+
+void customStrings(byte kind, unsigned long value) {
+  //Rate and pitch strings for the display, in the same style as the tables
+
+  unsigned long rate;
+
+  switch (kind) {
+    case inch_feed:
+      rate = (100000000UL / value + 5) / 10;    //Inches per revolution in 0.0001"
+      break;
+    case diametral_feed:
+      rate = (314159265UL / value + 5) / 10;
+      break;
+    case metric_feed:
+      rate = (value + 5) / 10;                  //mm per revolution in 0.01mm
+      break;
+    case module_feed:
+      rate = (value * 31416UL / 10000 + 5) / 10;
+      break;
+    default:
+      rate = 0;                                 //customRatio() has already refused it
+      break;
+  }
+
+  if (kind == inch_feed || kind == diametral_feed) {
+    snprintf(custom.rate, sizeof(custom.rate), "%lu.%04lu", rate / 10000, rate % 10000);
+    //The pitch column shows the threads per inch or diametral pitch,
+    //with as many decimals as fit in four characters
+    if (value % 1000 == 0 || value >= 99500) {
+      snprintf(custom.pitch, sizeof(custom.pitch), "%4lu", (value + 500) / 1000);
+    } else if (value >= 9950) {
+      value = (value + 50) / 100;
+      snprintf(custom.pitch, sizeof(custom.pitch), "%2lu.%lu", value / 10, value % 10);
+    } else {
+      value = (value + 5) / 10;
+      snprintf(custom.pitch, sizeof(custom.pitch), "%lu.%02lu", value / 100, value % 100);
+    }
+  } else {
+    snprintf(custom.rate, sizeof(custom.rate), "%3lu.%02lu", rate / 100, rate % 100);
+    strcpy(custom.pitch, "cust");
+  }
+}
+
+void customSet(void) {
+  //Switch to the custom pitch, like feedSet() does for a table entry
+
+  feedRatio(custom_num, custom_den);
+  customShow();
+}
+
+void customShow(void) {
+  //Show the custom pitch and its error
+
+  char str[NX_VALUE];
+
+  nextionFeed(&custom);
+  if (labs(custom.error) < 100000L) {
+    snprintf(str, sizeof(str), "%ldppm", custom.error);
+  } else {
+    //Without STEP_DDA it can be a third off, too long for ppm
+    snprintf(str, sizeof(str), "%ld%%", custom.error / 10000);
+  }
+  nextionSet(nf_custom_err, str);
+  nextionUseRPM();
+}
+
+unsigned long long ratioGcd(unsigned long long a, unsigned long long b) {
+  //Euclid
+
+  unsigned long long t;
+
+  while (b) {
+    t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+void ratioApprox(unsigned long long num, unsigned long long den, unsigned long max_den,
+                 unsigned long *p, unsigned long *q) {
+  //Closest fraction to num/den with a denominator no bigger than max_den.
+  //That's the last continued fraction convergent that fits, or the
+  //semiconvergent between it and the one before with the most of the next
+  //term that fits, whichever is closer.
+
+  unsigned long long p0 = 0, q0 = 1, p1 = 1, q1 = 0;
+  unsigned long long a, k, t;
+
+  while (den) {
+    a = num / den;
+    if (q0 + a * q1 > max_den)
+      break;
+    t = p0 + a * p1;
+    p0 = p1;
+    p1 = t;
+    t = q0 + a * q1;
+    q0 = q1;
+    q1 = t;
+    t = num - a * den;
+    num = den;
+    den = t;
+  }
+  *p = p1;
+  *q = q1;
+  if (den == 0)
+    return;             //Exact
+
+  //num/den is what's left of the continued fraction.  p1/q1 is off by
+  //1/(q1 * (q1 * num/den + q0)) and the semiconvergent with k by
+  //(num/den - k)/(qk * (q1 * num/den + q0)), and q1 * num is no more than
+  //the den that came in, so this can't overflow.
+  k = (max_den - q0) / q1;
+  if (k > 0 && (num - k * den) * q1 < (q0 + k * q1) * den) {
+    *p = p0 + k * p1;
+    *q = q0 + k * q1;
+  }
+}
+
+long ratioError(unsigned long p, unsigned long q, unsigned long long num, unsigned long long den) {
+  //Relative error of p/q against num/den, in parts per million.
+  //A float is good to about 0.2ppm here, which is plenty.
+
+  float ppm = ((float)p * (float)den / ((float)num * (float)q) - 1.0) * 1000000.0;
+
+  return (long)(ppm < 0 ? ppm - 0.5 : ppm + 0.5);
+}
@@ -0,0 +1,115 @@
+#ifndef __SPEED_H
+#define __SPEED_H
+
+//================================================================================
+// Spindle speed estimate and overspeed hold
+//================================================================================
+
+// This keeps the spindle from outrunning maxRPM() for the pitch.  Above the
+// stepper's limit the motor stalls without the step accounting knowing, so the
+// feed has to be held before the spindle gets there, not after the steps have
+// fallen behind.
+//
+// speedEdge() runs an alpha-beta filter on every spindle edge, from the spindle
+// interrupt.  speed_period is the estimated tick period in timebase counts and
+// speed_change is how much it changes per tick, both in 1/256ths of a count.
+// Each edge's period is predicted from them, and the difference from the measured
+// one corrects both, by 1/2^SPEED_ALPHA and 1/2^SPEED_BETA.  With SPINDLE_X4 the
+// measured period is the average over the last quadrature cycle, since the four
+// edges of a cycle aren't evenly spaced.
+//
+// The first edge after the spindle was stopped has no period, since spin_rate is
+// only how long it was stopped for, clipped to 16 bits.  The estimate starts
+// again from the first real period after that, with no change, so a spindle
+// started from rest doesn't look like it's speeding up without limit.
+//
+// Every tick while a feed is engaged, the speed SPEED_AHEAD ticks from now is
+// predicted from the estimate.  If it's faster than speed_limit allows, the
+// period at maxRPM() for the pitch, the feed is held (see Steps.h) before the
+// spindle gets there, and stepResume() picks the thread back up once the
+// prediction is back under the limit by 1/2^SPEED_MARGIN, so the hold and
+// resume don't chatter.  The prediction is of the rate and not the period: a
+// spindle speeding up evenly has a rate that goes up in a straight line and a
+// period that doesn't, and a straight line through the period soon comes to
+// zero or less, which would be past any limit.
+// Since the hold comes from the speed and not from steps falling behind, it
+// happens even when the stepper limit is the lower one, and STEPPER_LIMIT can be
+// set to what the motor really manages rather than leaving room for run-up.
+//
+// The RPM display uses the estimate too, which is filtered already.
+
+#define SPEED_ALPHA   2         //Period gain 1/4
+#define SPEED_BETA    5         //Change gain 1/32, about alpha^2/(2-alpha) for a quick settle
+#define SPEED_AHEAD   16        //Ticks ahead to look for the limit
+#define SPEED_MARGIN  5         //Resume 1/32 under the limit
+#define SPEED_LIMIT_MAX 0x7FFFFFL   //Longest speed_limit, so it still fits a long * 256
+
+long speed_period;              //Estimated tick period, timebase counts * 256
+long speed_change;              //Estimated change in it per tick, timebase counts * 256
+long speed_limit;               //Shortest tick period for the pitch, set by pwmPeriodSet()
+
+inline void speedEdge(void) {
+  //Called from the spindle interrupt after spinEdge()
+
+  long measured;
+  long predicted;
+#ifdef SPINDLE_X4
+  unsigned long cycle;
+#endif
+
+  if (spin_edge_count <= SCPR_EDGES) {
+    //Just started, so there's no period yet, only one for the RPM
+    speed_period = (long)spin_rate << 8;
+    speed_change = 0;
+    return;
+  }
+#ifdef SPINDLE_X4
+  cycle = spin_edges[spin_edge_head] - spin_edges[(spin_edge_head - SCPR_EDGES) & (SPIN_EDGES - 1)];
+  if (cycle > SCPR_EDGES * (SPINDLE_STOPPED - 1UL))
+    cycle = SCPR_EDGES * (SPINDLE_STOPPED - 1UL);
+  measured = (cycle << 8) / SCPR_EDGES;
+#else
+  measured = (long)spin_rate << 8;
+#endif
+  if (spin_edge_count == SCPR_EDGES + 1) {
+    //The first real period since the spindle was stopped
+    speed_period = measured;
+    speed_change = 0;
+    return;
+  }
+  predicted = speed_period + speed_change;
+  measured -= predicted;
+  speed_period = predicted + (measured >> SPEED_ALPHA);
+  speed_change += measured >> SPEED_BETA;
+}
+
+inline bool speedOver(byte margin) {
+  //True if the spindle will be too fast for the pitch SPEED_AHEAD ticks from
+  //now, less 1/2^margin of the limit.  From the spindle interrupt, or with
+  //interrupts off.
+
+  unsigned long limit = speed_limit;
+  long period = speed_period >> 8;
+  long ahead;
+
+  if (spin_rate == SPINDLE_STOPPED || spin_edge_count <= SCPR_EDGES)
+    return false;
+  if (margin)
+    limit += limit >> margin;
+  if (period < (long)limit)
+    return true;                  //Too fast already
+  //How far the period has to come down, and how far it will in rate terms:
+  //at a rate going up by as much as it is now, the period ahead is
+  //period^2 / (period + ahead), which is under limit if
+  //limit * ahead > period * (period - limit).  Both fit 32 bits.
+  ahead = -(speed_change * SPEED_AHEAD) >> 8;
+  if (ahead <= 0)
+    return false;                 //Steady or slowing down
+  if (ahead > 0xFFFF)
+    ahead = 0xFFFF;
+  if (period > 0xFFFF)
+    period = 0xFFFF;
+  return limit * ahead > period * (period - limit);
+}
+
+#endif
@@ -0,0 +1,47 @@
+// Copyright (c) 2020 Jon Bryan
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+//================================================================================
+//
+//  Spindle speed
+//
+//  See Speed.h
+//
+//================================================================================
+
+unsigned int speedRateGet(void) {
+  //The estimated spindle tick period, for the RPM
+
+  unsigned int rate;
+  long period;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    rate = spin_rate;
+    period = speed_period;
+  }
+
+  if (rate == SPINDLE_STOPPED)
+    return SPINDLE_STOPPED;
+  period >>= 8;
+  if (period < 1)
+    period = 1;                     //A wild estimate just after starting
+  return period < SPINDLE_STOPPED ? period : SPINDLE_STOPPED - 1;
+}
@@ -0,0 +1,106 @@
+#ifndef __STEPS_H
+#define __STEPS_H
+
+//================================================================================
+// Step accounting and feed hold
+//================================================================================
+
+// Every spindle tick calls for TICK_STEPS steps, and they're supposed to be out
+// before the next tick comes.  When they aren't, the spindle is turning faster
+// than the pitch allows, and the steps still to go are how far the leadscrew is
+// behind where spin_count and the ratio say it should be.  The new tick's steps
+// are added to the end of the train, so the leadscrew catches back up as fast as
+// the step period allows and the thread only lags while it does.  The steps that
+// did go out are counted into leadscrew when the train is extended, and burst
+// holds the rest, so leadscrew stays the real position.  step_lag_worst keeps the
+// most steps ever left over, which shows how close to the limit a feed is
+// running, and step_holds counts the holds below.  ELS_BENCHMARK prints both with
+// the RPM.
+//
+// If the steps left over are more than STEP_LAG_TICKS ticks' worth, or the train
+// is going the other way (the spindle reversed in the middle of it), the feed is
+// held rather than catching up: the train finishes, nothing more is loaded, and
+// nothing engages.  Once the steps are out and the spindle is slow enough for the
+// pitch, stepResume() works out where the spindle has to be for the carriage,
+// wherever it stopped, to land back in the groove it was cutting, the same way as
+// the thread pickup (see Index.h), and the feed engages there by itself.
+//
+// The driver's ALARM output means it has stopped following the steps, so it stops
+// the train at once and holds the feed until ALARM clears.  A jog is the
+// operator's and carries on.  The groove is picked up again from leadscrew, so if
+// the driver lost position the carriage should be checked before it re-engages.
+// ALARM shares the PORTB pin change interrupt with SPINDLE_Z.
+//
+// While a feed is held the RPM background is yellow, and it goes back to red
+// afterwards, until the rate is changed.
+
+#define STEP_LAG_TICKS  4       //Ticks of steps the leadscrew can fall behind before the feed is held
+#define ALARM_ACTIVE    LOW     //Level on ALARM when the driver has faulted, it depends on the driver's setup
+
+enum {
+  hold_none,
+  hold_lag,                     //Fell too far behind, or the spindle reversed mid-train
+  hold_speed,                   //About to be too fast for the pitch, see Speed.h
+  hold_cross,                   //The cross-slide would pass a limit, or is behind, see Cross.h
+  hold_alarm                    //The driver's ALARM output
+};
+
+volatile byte step_hold = hold_none;
+byte step_lag_max;                        //STEP_LAG_TICKS * max_steps, set by pwmPeriodSet()
+volatile byte step_lag_worst = 0;         //Most steps left over when a tick came
+volatile unsigned int step_holds = 0;     //Feeds held since power up
+byte pinb_last;                           //PINB at the last pin change interrupt
+
+inline bool alarmActive(byte pins) {
+  //pins is PINB
+  return ((pins & _BV(FastPin<ALARM>::bit)) != 0) == (ALARM_ACTIVE == HIGH);
+}
+
+inline void stepLag(byte left) {
+  //Called from the spindle interrupt with the steps left over from the last tick
+
+  if (left > step_lag_worst)
+    step_lag_worst = left;
+}
+
+inline void stepHold(byte why) {
+  //Called from the interrupts to stop the feed, and keep it from engaging
+  //until stepResume() says where
+
+  synced = false;
+  sync_count = -1;              //spin_count is never -1
+  lsync_count = -1;
+  rsync_count = -1;
+  if (step_hold != hold_alarm)  //Only ALARM clearing ends an ALARM hold
+    step_hold = why;
+  step_holds++;
+  fault = true;
+  eventPut(ev_hold);
+}
+
+inline void stepStop(void) {
+  //Stop a feed's step train part way, and move leadscrew by the steps that
+  //went out, as the TIMER4 interrupt does at the end of a train
+
+  if (steps == 0 || jogging)
+    return;
+  TCCR4B = _BV(WGM43) | _BV(WGM42);       //pwmOff()
+  if (TIFR4 & _BV(OCF4A)) {
+    //A step went out but its interrupt hasn't run, and now it won't
+    TIFR4 = _BV(OCF4A);
+    steps--;
+#ifdef CROSS_SLIDE
+    if (cross_mode == cross_taper)
+      crossStep(PORTH & _BV(DIR_N));      //Which the interrupt would have done
+#endif
+  }
+  if (PORTH & _BV(DIR_N))
+    leadscrew -= burst - steps;
+  else
+    leadscrew += burst - steps;
+  steps = 0;
+  TCNT4 = period_list[max_steps] - PUL_MIN;
+  eventSteps();
+}
+
+#endif
@@ -0,0 +1,97 @@
+// Copyright (c) 2020 Jon Bryan
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+//================================================================================
+//
+//  Feed hold
+//
+//  loop() side of the step accounting in Steps.h: the ALARM input, and picking
+//  a held feed back up in the same groove.
+//
+//================================================================================
+
+void alarmInit(void) {
+  //Enable the ALARM pin change interrupt, after indexInit()
+
+  pinMode(ALARM, INPUT_PULLUP);       //ALM+ open collector output from the driver
+
+  //Pin change interrupts come in groups, and PCINT[7:0] is PORTB
+  static_assert(FastPin<ALARM>::port == 'B', "ALARM must be on PORTB, which is PCINT[7:0]");
+  pinb_last = FastPin<ALARM>::in();
+  PCICR |= _BV(PCIE0);
+  PCMSK0 |= _BV(FastPin<ALARM>::bit);
+  if (alarmActive(pinb_last)) {
+    //Already faulted at power up.  synced starts out true, so hold it the same
+    //way as the interrupt would, or the first feed would engage regardless.
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      stepHold(hold_alarm);
+    }
+  }
+}
+
+void stepResume(void) {
+  //Called on the UI tick.  Once a held feed can carry on, point the sync counts
+  //at the groove it was cutting, from wherever the carriage stopped.
+
+  PICKUP held;
+  bool over;
+  int count;
+
+  if (step_hold == hold_none || jogging)
+    return;
+  if (step_hold == hold_alarm && alarmActive(FastPin<ALARM>::in()))
+    return;                           //Still faulted
+
+  if (feed_left != engage_rh || steps_per_rev != engage_steps) {
+    //The direction or the rate was changed, so it's a new feed and not the held one.
+    //A direction change already set sync_count, otherwise engage a turn from now.
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      if (sync_count < 0) {
+        count = spin_count;
+        sync_count = count;
+        lsync_count = count;
+        rsync_count = count;
+      }
+      step_hold = hold_none;
+    }
+    return;
+  }
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    over = speedOver(SPEED_MARGIN);
+#ifdef CROSS_SLIDE
+    //The cross-slide has to have caught up, and be clear of its limit
+    if (cross_mode != cross_off && (cross != cross_target || crossBlocked(FEEDING_LEFT, max_steps)))
+      over = true;
+#endif
+  }
+  if (steps != 0 || over)
+    return;                           //Steps still going out, or still too fast
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    held.index = engage_index;
+    held.lead = engage_lead;
+    held.rh = engage_rh;
+  }
+  held.steps_per_rev = steps_per_rev;
+  pickupSync(held);
+  step_hold = hold_none;
+  nextionSet(nf_rpm_bco, "RED");      //Until the rate is changed
+}
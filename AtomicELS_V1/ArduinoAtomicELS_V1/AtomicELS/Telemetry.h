@@ -0,0 +1,110 @@
+#ifndef __TELEMETRY_H
+#define __TELEMETRY_H
+
+#include <util/crc16.h>
+
+//================================================================================
+// Binary telemetry
+//================================================================================
+
+// With ELS_TELEMETRY defined, the spindle interrupt writes a record of every tick
+// into a ring buffer, and the encoder diagnostics write one for every timing
+// error instead of setting a flag that the next error overwrites.  loop() sends
+// them on the debug port as packets:
+//
+//   0xA5 0x5A  seq  count  drops(2)  count * TLM_BYTES  crc8
+//
+// seq goes up by one for every packet, so a lost packet shows up as a gap.
+// drops is the running total of records that didn't fit in the ring, which is
+// what happens when the spindle ticks faster than the port can send them.
+// A record goes as its fields in order with no padding, 14 bytes.  Everything
+// is little-endian, like the AVR, and the CRC is _crc8_ccitt_update() over
+// everything after the sync bytes.  Any text printed on the same port,
+// like the diagnostics' startup report, is skipped by the decoder.
+//
+// The ring works like the event ring in Events.h: the interrupts together are the
+// single producer and loop() the single consumer, each owning one byte index.
+
+#ifdef ELS_TELEMETRY
+
+#define TLM_RING      32        //Records, must be a power of two
+#define TLM_BAUD      1000000L  //Exact at 16Mhz, and about 6000 records/s
+#define TLM_DECIMATE  1         //Record every Nth spindle tick
+#define TLM_SYNC0     0xA5
+#define TLM_SYNC1     0x5A
+#define TLM_HEADER    6         //Sync, seq, count and drops
+#define TLM_BYTES     14        //A record in a packet
+#define TLM_PACKET    4         //Most records per packet, to fit Serial's 64-byte buffer
+
+enum tlmType {
+  tlm_tick = 1,             //Spindle tick
+  tlm_a_err,                //Channel A edge outside the expected timing
+  tlm_b_err                 //Channel B edge outside the expected timing
+};
+
+//Flags
+#define TLM_SYNCED    0x01      //Leadscrew engaged with the spindle
+#define TLM_FAULT     0x02      //Steps were left over from the last tick
+#define TLM_LEFT      0x04      //Feeding left
+#define TLM_CCW       0x08      //Spindle turning CCW
+#define TLM_JOGGING   0x10      //The planner has the leadscrew
+
+//For tlm_tick, interval is the timebase counts since the last tick and value is the leadscrew.
+//For the errors, interval is the signed microseconds early (-) or late (+),
+//and value is the count into the rev.
+struct TLM_RECORD {          //TLM_BYTES in a packet
+  byte type;
+  byte flags;
+  byte steps;               //Steps loaded on this tick
+  byte count;               //Low byte of spin_count
+  unsigned long time;       //Timebase counts at 16Mhz, see Timebase.h
+  unsigned int interval;
+  long value;
+};
+
+TLM_RECORD tlm_ring[TLM_RING];
+volatile byte tlm_head = 0;           //Next slot to write, interrupts only
+volatile byte tlm_tail = 0;           //Next slot to read, loop() only
+volatile unsigned int tlm_drops = 0;  //Records lost, interrupts only
+byte tlm_seq = 0;                     //Packet sequence number
+
+inline void tlmPut(byte type, byte flags, unsigned int interval, long value) {
+  //Called from interrupt handlers only
+
+  byte next = (tlm_head + 1) & (TLM_RING - 1);
+  TLM_RECORD *rec;
+
+  if (next == tlm_tail) {
+    tlm_drops++;
+    return;
+  }
+  rec = &tlm_ring[tlm_head];
+  rec->type = type;
+  rec->flags = flags;
+  rec->steps = steps;
+  rec->count = spin_count;
+  rec->time = spin_edge;
+  rec->interval = interval;
+  rec->value = value;
+  tlm_head = next;
+}
+
+inline void tlmTick(bool overrun) {
+  //Spindle tick record, from the end of the spindle interrupt
+
+#if TLM_DECIMATE > 1
+  static byte n = 0;
+
+  if (++n < TLM_DECIMATE)
+    return;
+  n = 0;
+#endif
+  tlmPut(tlm_tick,
+         (synced ? TLM_SYNCED : 0) | (overrun ? TLM_FAULT : 0) | (FEEDING_LEFT ? TLM_LEFT : 0) |
+         (spin_ccw ? TLM_CCW : 0) | (jogging ? TLM_JOGGING : 0),
+         spin_rate, leadscrew);
+}
+
+#endif // ELS_TELEMETRY
+
+#endif // __TELEMETRY_H
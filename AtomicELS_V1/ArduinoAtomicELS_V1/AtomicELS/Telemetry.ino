@@ -0,0 +1,103 @@
+// Copyright (c) 2020 Jon Bryan
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+//================================================================================
+//
+//  Binary telemetry
+//
+//  loop() side of the telemetry ring in Telemetry.h.  A packet is only put
+//  together when Serial has room for all of it, so loop() never waits on the
+//  port, and records just pile up in the ring (and then get dropped and counted)
+//  when it can't keep up.
+//
+//================================================================================
+
+#ifdef ELS_TELEMETRY
+
+void telemetryInit(void) {
+  //Switch the debug port up to the telemetry rate, after the diagnostics' startup report
+
+  Serial.flush();
+  Serial.begin(TLM_BAUD);
+}
+
+inline void tlmPack(byte *p, const TLM_RECORD *rec) {
+  //A record into a packet, field by field, so it's the same whatever the
+  //compiler does with the struct
+
+  byte i;
+
+  *p++ = rec->type;
+  *p++ = rec->flags;
+  *p++ = rec->steps;
+  *p++ = rec->count;
+  for (i = 0; i < 4; i++)
+    *p++ = rec->time >> (8 * i);
+  *p++ = rec->interval;
+  *p++ = rec->interval >> 8;
+  for (i = 0; i < 4; i++)
+    *p++ = rec->value >> (8 * i);
+}
+
+void telemetryFlush(void) {
+  //Send as many records as will fit in Serial's buffer as one packet
+
+  byte packet[TLM_HEADER + TLM_PACKET * TLM_BYTES + 1];
+  byte count, i;
+  byte crc = 0;
+  unsigned int drops;
+  int len, room;
+
+  count = (tlm_head - tlm_tail) & (TLM_RING - 1);
+  if (count == 0)
+    return;
+  room = (Serial.availableForWrite() - TLM_HEADER - 1) / TLM_BYTES;
+  if (room <= 0)
+    return;             //Next time
+  if (count > room)
+    count = room;
+  if (count > TLM_PACKET)
+    count = TLM_PACKET;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    drops = tlm_drops;
+  }
+
+  packet[0] = TLM_SYNC0;
+  packet[1] = TLM_SYNC1;
+  packet[2] = tlm_seq++;
+  packet[3] = count;
+  packet[4] = drops;
+  packet[5] = drops >> 8;
+  len = TLM_HEADER;
+  for (i = 0; i < count; i++) {
+    //The interrupts don't touch a record again until the tail has passed it
+    tlmPack(&packet[len], &tlm_ring[tlm_tail]);
+    tlm_tail = (tlm_tail + 1) & (TLM_RING - 1);
+    len += TLM_BYTES;
+  }
+  for (i = 2; i < len; i++)
+    crc = _crc8_ccitt_update(crc, packet[i]);
+  packet[len++] = crc;
+
+  Serial.write(packet, len);
+}
+
+#endif // ELS_TELEMETRY
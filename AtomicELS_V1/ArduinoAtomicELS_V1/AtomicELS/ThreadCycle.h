@@ -0,0 +1,72 @@
+#ifndef __THREADCYCLE_H
+#define __THREADCYCLE_H
+
+//================================================================================
+// Multi-pass threading cycle
+//================================================================================
+
+// With both limits set, the CYCLE button on the SHOULDER page asks the display
+// for the thread depth and the number of passes, then runs the passes by itself.
+// Each pass feeds from the start limit to the end limit in the direction that was
+// selected when the cycle started.  At the end limit the cycle waits, showing
+// RETRACT, until the operator has backed the tool out and pressed CYCLE again.
+// Only then does the leadscrew go back to the start limit at rapid speed through
+// the planner, or it would drag the tool back through the thread.  While it waits
+// and while it returns, the spindle keeps turning and the spindle interrupt keeps
+// counting, but doesn't step.
+// Back at the start limit the spindle interrupt waits for the same spin_count
+// that the first pass started on, exactly as it does after a limit stop by hand,
+// so every pass follows the same groove.
+//
+// There's no cross slide axis, so the infeed is up to the operator.  The
+// display shows the pass number and how far in the cross slide should be for
+// it, using a constant chip area schedule (depth * sqrt(pass / passes)) so the
+// first passes, which cut a narrow chip, take the biggest bites.  The depth is
+// in whatever units the operator likes, with three decimals.
+//
+// Any touch on the display ends the cycle, and stops a return in progress, except
+// CYCLE while it's waiting at the end limit.
+
+#define CYCLE_DEPTH       "shoulder.depth.val"    //Nextion numbers (x-float, 3 decimals)
+#define CYCLE_PASSES      "shoulder.passes.val"   //and a plain number
+#define CYCLE_PASSES_MAX  99
+
+enum {
+  cycle_idle,
+  cycle_setup,      //Waiting for the depth and passes from the display
+  cycle_feed,       //Waiting for the spindle phase, or cutting a pass
+  cycle_retract,    //At the end limit, waiting for CYCLE to say the tool is out
+  cycle_return      //Rapid back to the start limit
+} cycle_state = cycle_idle;
+
+bool cycle_left;                //Direction of the cutting passes
+bool cycle_moving = false;      //The planner is running the cycle's return
+byte cycle_pending = 0;         //Numbers still to come back from the display
+long cycle_depth;               //Total depth in thousandths
+byte cycle_passes;
+byte cycle_pass;                //Passes finished
+#ifdef STEP_DDA
+long cycle_acc;                 //dda_acc when the first pass started
+bool cycle_acc_set;
+#endif
+
+inline void cycleEngage(void) {
+  //Called by the spindle interrupt when the feed starts from a limit.
+  //The spindle count is the same for every pass, but when the steps per
+  //revolution aren't a whole number the DDA remainder isn't, so put it back
+  //the way it was for the first pass.  Otherwise each pass could start up to
+  //a step away from the last.
+
+#ifdef STEP_DDA
+  if (cycle_state == cycle_feed) {
+    if (cycle_acc_set) {
+      dda_acc = cycle_acc;
+    } else {
+      cycle_acc = dda_acc;
+      cycle_acc_set = true;
+    }
+  }
+#endif
+}
+
+#endif
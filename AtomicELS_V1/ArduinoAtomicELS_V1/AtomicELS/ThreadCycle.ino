@@ -0,0 +1,195 @@
+// Copyright (c) 2020 Jon Bryan
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+//================================================================================
+//
+//  Multi-pass threading cycle
+//
+//  Driven from loop() by the limit and move-done events.  The timing-critical
+//  part, waiting for the spindle phase at the start limit, is the same code in
+//  the spindle interrupt that a pass started by hand uses.
+//
+//================================================================================
+
+void cycleStart(void) {
+  //The CYCLE button was pressed, so ask for the depth and number of passes
+
+  if (jogging || !left_limited || !right_limited || left_limit >= right_limit) {
+    nextionSend(F("shoulder.cycle_btn.bco2=RED\xFF\xFF\xFF"));
+    uiHold(F("shoulder.cycle_btn.bco2=1024\xFF\xFF\xFF"));
+    return;
+  }
+  cycle_state = cycle_setup;
+  cycle_pending = 2;
+  nextionSend(F("get " CYCLE_DEPTH "\xFF\xFF\xFF"));
+  nextionSend(F("get " CYCLE_PASSES "\xFF\xFF\xFF"));
+}
+
+void cycleNumber(const byte *buf) {
+  //Numeric frame from the display, the depth and then the passes
+
+  long value;
+
+  if (cycle_state != cycle_setup || !cycle_pending)
+    return;             //Not ours, or the cycle was cancelled
+
+  value = (long)buf[1] | ((long)buf[2] << 8) | ((long)buf[3] << 16) | ((long)buf[4] << 24);
+  if (--cycle_pending) {
+    cycle_depth = value;
+    return;
+  }
+  if (cycle_depth <= 0 || value < 1 || value > CYCLE_PASSES_MAX) {
+    cycleStop();
+    return;
+  }
+  cycle_passes = value;
+  cycleBegin();
+}
+
+void cycleBegin(void) {
+  //Start the first pass from wherever the carriage is
+
+  long start;
+
+  cycle_left = FEEDING_LEFT;
+  cycle_pass = 0;
+#ifdef STEP_DDA
+  cycle_acc_set = false;
+#endif
+  start = cycle_left ? right_limit : left_limit;
+
+  if (synced && spinRateGet() != SPINDLE_STOPPED && leadscrewGet() != start) {
+    //It's in the middle of a pass, and the leadscrew can't be taken away from the spindle
+    //until the pass reaches the limit, so let that one finish first.
+    cycleStop();
+    nextionSend(F("shoulder.cycle_btn.bco2=RED\xFF\xFF\xFF"));
+    uiHold(F("shoulder.cycle_btn.bco2=1024\xFF\xFF\xFF"));
+    return;
+  }
+  cycleReturn();
+}
+
+void cycleReturn(void) {
+  //Rapid back to the start limit, or straight on to the next pass if it's already there
+
+  long count;
+
+  if (!left_limited || !right_limited) {
+    cycleStop();        //A limit was cleared under us
+    return;
+  }
+  if (cycle_left) {
+    count = right_limit - leadscrewGet();
+  } else {
+    count = leadscrewGet() - left_limit;
+  }
+
+  cycle_state = cycle_feed;
+  if (count > 0) {
+    //Make the spindle interrupt wait for the phase at the start limit.
+    //It isn't stepping, because the feed is either at the end limit or the spindle is stopped.
+    synced = false;
+    jog_icr4 = ICR4;
+    jog_tcnt4 = TCNT4;
+    cycle_moving = true;
+    cycle_state = cycle_return;
+    planMove(!cycle_left, count);
+  }
+  cycleShow();
+}
+
+void cycleLimit(bool left) {
+  //The feed stopped at a limit (ev_left_limit or ev_right_limit)
+
+  if (cycle_state != cycle_feed)
+    return;
+  if (left != cycle_left) {
+    cycleStop();        //The direction was changed by hand
+    return;
+  }
+  if (++cycle_pass >= cycle_passes) {
+    cycle_state = cycle_idle;
+    nextionSet(nf_cycle, "DONE");
+    return;
+  }
+  //The tool is still in the thread, so wait for the operator to take it out
+  cycle_state = cycle_retract;
+  nextionSet(nf_cycle, "RETRACT");
+}
+
+bool cycleConfirm(void) {
+  //The CYCLE button.  If the cycle is waiting at the end limit, the tool is out,
+  //so go back for the next pass.  False if it wasn't waiting.
+
+  if (cycle_state != cycle_retract)
+    return false;
+  if (FEEDING_LEFT != cycle_left) {
+    cycleStop();        //The direction was changed by hand while it waited
+    return true;
+  }
+  cycleReturn();
+  return true;
+}
+
+bool cycleMoveDone(void) {
+  //ev_move_done.  Returns false if it was a jog or rapid rather than the cycle's return.
+
+  if (!cycle_moving)
+    return false;
+  cycle_moving = false;
+
+  //The spindle interrupt takes over again as soon as jogging is cleared
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    TCNT4 = jog_tcnt4;
+    ICR4 = jog_icr4;
+    jogging = false;
+  }
+  //No jogAdjust(), because the spindle interrupt counted the spindle all the way back
+  if (cycle_state == cycle_return) {
+    cycle_state = cycle_feed;
+    cycleShow();
+  }
+  return true;
+}
+
+bool cycleStop(void) {
+  //End the cycle.  A return in progress slows to a stop, and cycleMoveDone() tidies up.
+  //Returns true if there was a cycle to end.
+
+  if (cycle_state == cycle_idle)
+    return false;
+  if (cycle_moving)
+    planStop();
+  cycle_state = cycle_idle;
+  cycle_pending = 0;
+  nextionSet(nf_cycle, "-----");
+  return true;
+}
+
+void cycleShow(void) {
+  //Show the pass and the total infeed for it
+
+  char str[24];         //"256/255 -2147483.-648" at worst
+  long infeed;
+
+  infeed = cycle_depth * sqrt((float)(cycle_pass + 1) / cycle_passes) + 0.5;
+  snprintf(str, sizeof str, "%d/%d %ld.%03ld", cycle_pass + 1, cycle_passes, infeed / 1000, infeed % 1000);
+  nextionSet(nf_cycle, str);
+}
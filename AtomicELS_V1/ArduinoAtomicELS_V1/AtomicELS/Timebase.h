@@ -0,0 +1,106 @@
+#ifndef __TIMEBASE_H
+#define __TIMEBASE_H
+
+//================================================================================
+// Spindle timebase
+//================================================================================
+
+// Spindle edges are timed with a 16Mhz counter, extended to 32 bits by counting
+// its overflows in spin_high.  The spindle interrupt reads the counter first
+// thing, before any of the branching for the feed, so the path it takes doesn't
+// show up as jitter in spin_rate and the RPM, and spinExtend() adds the upper
+// word.  If TOVn is set the overflow has happened but its interrupt hasn't run
+// yet, and a low word in the bottom half was read after it, so it belongs to the
+// next upper word.  That holds as long as the time is less than half an overflow
+// (2ms) old when it's extended, and interrupts are off.
+//
+// With SPINDLE_ICP, the input capture unit of TC5 latches the count on the falling
+// edge of SPINDLE_A in hardware, so the latency of the interrupt doesn't matter
+// at all, and TC5 takes over from TC3 as the timebase.  SPINDLE_A has to be on
+// pin 48 (ICP5) for that.  It can't be used with SPINDLE_X4, which needs every
+// edge of both phases and the capture unit only sees one pin.
+//
+// The edge times go in spin_edges[], newest at spin_edge_head:
+//  spin_rate is the last period, for the step timing and the spindle position,
+//  the speed estimate in Speed.h is fed from them, for the RPM display and the
+//  overspeed hold, and with SPINDLE_X4 the step period for STEP_CONTINUOUS comes
+//  from the same edge one quadrature cycle ago, since the four edges of a cycle
+//  aren't evenly spaced.
+
+#define SPIN_EDGES  8     //Edge times kept, a power of 2 more than SCPR_EDGES
+
+#ifdef SPINDLE_ICP
+static_assert(FastPin<SPINDLE_A>::port == 'L' && FastPin<SPINDLE_A>::bit == 1,
+              "SPINDLE_ICP needs SPINDLE_A on ICP5, pin 48");
+
+#define SPIN_TCNT       TCNT5
+#define SPIN_TIFR       TIFR5
+#define SPIN_TOV        TOV5
+#define SPIN_OVF_vect   TIMER5_OVF_vect
+#define SPINDLE_VECT    TIMER5_CAPT_vect
+#else
+#define SPIN_TCNT       TCNT3
+#define SPIN_TIFR       TIFR3
+#define SPIN_TOV        TOV3
+#define SPIN_OVF_vect   TIMER3_OVF_vect
+#define SPINDLE_VECT    EXT_VECT(SPINDLE_A)
+#endif
+
+volatile unsigned int spin_high = 0;    //Upper word of the timebase, counted by the overflow interrupt
+unsigned long spin_edge = 0;            //Time of the last spindle edge
+unsigned long spin_edges[SPIN_EDGES];   //And the ones before it
+byte spin_edge_head = 0;                //Index of the newest
+byte spin_edge_count = 0;               //Edges timed since the spindle was last stopped, up to SPIN_EDGES
+bool spin_idle = false;                 //No edge since the last overflow
+
+inline unsigned long spinExtend(unsigned int low) {
+  //32-bit time for a count read from the timer less than 2ms ago.
+  //Only with interrupts off.
+
+  unsigned int high = spin_high;
+
+  if ((SPIN_TIFR & _BV(SPIN_TOV)) && low < 0x8000)
+    high++;             //Overflowed, but the interrupt hasn't run yet
+  return ((unsigned long)high << 16) | low;
+}
+
+inline unsigned long spinTime(void) {
+  //The time now, only with interrupts off
+
+  return spinExtend(SPIN_TCNT);
+}
+
+inline void spinEdge(unsigned int low) {
+  //Called from the spindle interrupt with the timer's count at the edge
+
+  unsigned long now = spinExtend(low);
+  unsigned long period = now - spin_edge;
+
+  spin_edge = now;
+  spin_edge_head = (spin_edge_head + 1) & (SPIN_EDGES - 1);
+  spin_edges[spin_edge_head] = now;
+  if (spin_edge_count < SPIN_EDGES)
+    spin_edge_count++;
+  spin_idle = false;
+
+  //Slower than 16 bits holds is still turning, just very slowly
+  spin_rate = period < SPINDLE_STOPPED ? period : SPINDLE_STOPPED - 1;
+}
+
+inline unsigned int spinNext(void) {
+  //Best guess at the spindle period starting at the last edge,
+  //from the spindle interrupt
+
+#ifdef SPINDLE_X4
+  unsigned long period;
+
+  if (spin_rate != SPINDLE_STOPPED && spin_edge_count > SCPR_EDGES) {
+    period = spin_edges[(spin_edge_head - SCPR_EDGES + 1) & (SPIN_EDGES - 1)] -
+             spin_edges[(spin_edge_head - SCPR_EDGES) & (SPIN_EDGES - 1)];
+    return period < SPINDLE_STOPPED ? period : SPINDLE_STOPPED - 1;
+  }
+#endif
+  return spin_rate;
+}
+
+#endif
@@ -0,0 +1,51 @@
+// Copyright (c) 2020 Jon Bryan
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+//================================================================================
+//
+//  Spindle timebase
+//
+//  See Timebase.h
+//
+//================================================================================
+
+void timebaseInit(void) {
+  //Configure the timer for timing the spindle edges
+
+#ifdef SPINDLE_ICP
+  TCCR5A  = 0;                            //Normal mode, pins 44-46 left alone
+  TCCR5B  = _BV(ICNC5) | _BV(CS50);       //16Mhz, capture on the falling edge of ICP5 with the noise canceller
+#else
+  TCCR3A  = _BV(COM3A0);    //Because the high byte doesn't increment in '00' mode
+  TCCR3B  = _BV(CS30);      //Run TCNT3 at 16Mhz to get better RPM resolution at high speed
+#endif
+  spin_edge = SPIN_TCNT;    //Initialize to the current value of the counter
+}
+
+void timebaseEnab(void) {
+  //Enable the overflow interrupt.  The capture interrupt is the spindle's,
+  //and spindleAttach() enables that.
+
+#ifdef SPINDLE_ICP
+  TIMSK5  = _BV(TOIE5);
+#else
+  TIMSK3  = _BV(TOIE3);
+#endif
+}
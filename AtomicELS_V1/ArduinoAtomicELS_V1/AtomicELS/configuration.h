@@ -32,6 +32,8 @@
 
 #define PUL_N         PORTH3  //Stepper PUL- is on Pin 6, active low, with PUL+ tied to +5V
 #define DIR_N         PORTH4  //Stepper DIR- is on Pin 7, active low, with DIR+ tied to +5V
+#define X_PUL_N       PORTB5  //Cross-slide PUL- on Pin 11 (OC1A) with CROSS_SLIDE, wired the same way
+#define X_DIR_N       PORTB4  //Cross-slide DIR- on Pin 10
 
 
 
@@ -39,6 +41,8 @@
 // Nextion miscellaneous
 //================================================================================
 
+#define NEXTION_BAUD  38400   //Must match the "bauds" setting in the Nextion configuration
+
 #define nxPBLUE "44415"   //Pale blue
 #define nxDBLUE "33816"   //Dark blue
 #define nxDGREEN "1024"   //Dark green
@@ -61,44 +65,107 @@ enum nextionID {
   zset_btn,
   rset_btn,
   lclr_btn = 27,    //Too much trouble to edit the display to keep them all in sequence
-  rclr_btn
+  rclr_btn,
+  ctpi_btn,         //CUSTOM page unit buttons, in the same order as the feed modes
+  cmm_btn,
+  cdp_btn,
+  cmod_btn,
+  lrapid_btn,       //SHOULDER page rapid traverse to the left and right limits
+  rrapid_btn,
+  cycle_btn,        //SHOULDER page threading cycle
+  pickup_btn,       //SHOULDER page thread pickup
+  xoff_btn,         //CROSS page modes, with CROSS_SLIDE
+  xtaper_btn,
+  xface_btn,
+  xminus_btn,       //CROSS page jog in and out
+  xplus_btn,
+  xzero_btn,        //CROSS page zero, and limits at where the cross-slide is
+  xmin_btn,
+  xmax_btn,
+  xfree_btn
 };
 
-//ID's for the RPM text boxes
-//These are placed in the display with the ID's in order of descending RPM
-char nxrpmID[12][4] {
-  "t3", "t4",  "t5",  "t6",  "t7",  "t8",
-  "t9", "t10", "t11", "t12", "t13", "t14"
-};
+#define NX_PAGES  5       //START, SHOULDER, SETUP, CUSTOM and CROSS send touch events
 
 
 //================================================================================
 //Input Pins
 //================================================================================
 
+// Uncomment to time the spindle edges with the input capture unit of TC5 instead
+// of reading the timer in the interrupt, see Timebase.h.  Phase A moves to pin 48.
+//#define SPINDLE_ICP
+
 // Wired to PE4/INT4 and PE5/INT5 on Mega2560 but Arduino remaps it for compatibility
 #define SPINDLE_B   2   //Encoder Phase B pin (PORTE4) pulled up with 2k
+#ifdef SPINDLE_ICP
+#define SPINDLE_A   48  //Encoder Phase A pin (PORTL1/ICP5) pulled up with 2k
+#else
 #define SPINDLE_A   3   //Encoder Phase A pin (PORTE5) pulled up with 2k
+#endif
+#define SPINDLE_Z   12  //Encoder index pin (PORTB6/PCINT6), once per revolution
 
 #define LEFT_MOM    18  //Direction toggle switch
 #define RIGHT_MOM   19  //Direction toggle switch
 #define KNOB_B      20  //Knob Phase B pin (PORTD1) through 1k/0.1uf RC filter
 #define KNOB_A      21  //Knob Phase A pin (PORTD0) through 1k/0.1uf RC filter
-#define ALARM       13  //Microstepper controller ALARM open collector (not yet implemented)
+#define ALARM       13  //Microstepper controller ALARM open collector (PORTB7/PCINT7), see Steps.h
 
 //================================================================================
 // Scaler magic numbers
 //================================================================================
 
-#define SCPR        800     //Spindle encoder Counts Per Revolution
+// These are the defaults for the machine profile, and the feed tables are checked
+// against them when the sketch compiles.  The running values are in machine, and
+// can be changed over the debug port without a rebuild (see Machine.h), so apart
+// from tables.h the code uses machine.lspi and so on, never LSPI.
+
+#define ENCODER_PPR 800     //Spindle encoder Pulses Per Revolution on each phase
+#define ENCODER_PPR_MAX ENCODER_PPR   //Largest a profile can have without STEP_DDA, the size of step_table[]
+
+// step_table[] takes a byte of SRAM for every count of ENCODER_PPR_MAX, so it's
+// sized for the default encoder.  Raise it to try a bigger one from the debug
+// port without another rebuild, or build with STEP_DDA, which has no table.
+
+// Uncomment to count every edge of both spindle encoder phases (x4 quadrature)
+// instead of only the falling edges of phase A.  Everything that works in spindle
+// counts, including the sync counts, gets four times the resolution.
+// The lookup table would be four times the size too, so this needs STEP_DDA.
+// The spindle interrupt comes four times as often, which lowers the top speed
+// the CPU keeps up with (tools/els_sim.cpp built with it shows by how much).
+//#define SPINDLE_X4
+
+#ifdef SPINDLE_X4
+#define SCPR_EDGES  4       //Spindle encoder counts per pulse
+#else
+#define SCPR_EDGES  1
+#endif
 #define MICROSTEPS  400     //Driver microsteps per revolution
 #define STEP_RATIO  8       //Stepper:Leadscrew ratio
 #define LTPI        8       //Leadscrew Threads Per Inch
-#define LSPI        25600   //Leadscrew Steps Per Inch (LTPI*MICROSTEPS*STEP_RATIO)
-#define LSPM10      256     //Leadscrew Steps Per Mil (0.001") * 10
-#define LSPMM10     10079   //Leadscrew Steps Per MilliMeter (LSPI / 25.4 * 10)
-
-
+#define LSPI        (LTPI * MICROSTEPS * (long)STEP_RATIO)   //Leadscrew Steps Per Inch (25600)
+
+#define SCPR        machine.scpr        //Spindle encoder Counts Per Revolution
+
+struct MACHINE {
+  //The profile itself
+  unsigned int encoder_ppr;
+  unsigned int microsteps;
+  byte step_ratio;
+  byte ltpi;
+  long stepper_limit;       //Steps per minute, see STEPPER_LIMIT
+
+  //Worked out from it by machineLoad(), so nothing divides by them on the fly
+  int scpr;                 //ENCODER_PPR * SCPR_EDGES
+  int scpr_half;
+  int index_window;         //Largest Z pulse error believed, see Index.h
+  long lspi;                //Leadscrew Steps Per Inch
+  long lspm10;              //Leadscrew Steps Per Mil (0.001") * 10
+  long lspmm10;             //Leadscrew Steps Per MilliMeter * 10 (LSPI / 25.4 * 10)
+  unsigned long rpm20;      //16Mhz clock ticks per spindle count at 20rpm, past 16 bits under 733 counts
+  long rpm_scale;           //T3CPM / scpr, divided by the tick period for the RPM
+  unsigned int plan_min_period;   //Fastest jog, in TC4 counts
+};
 
 //================================================================================
 // Timing
@@ -106,10 +173,16 @@ char nxrpmID[12][4] {
 
 #define STP_MIN   60      //30us period minimum to accommodate jitter (2Mhz clock)
 #define PUL_MIN   6       //3us pulse minimum for stepper drive
-#define RPM20     60000   //16Mhz clock ticks at 20rpm
+
+#define UI_TICK   25UL    //ms between passes of the user interface scheduler
+#define RPM_TICKS 4       //UI ticks between RPM updates, so the flicker isn't so distracting
+#define JOG_HOLD  500UL   //ms a direction button must be held before jogging starts
 
 // Timer 3 Counts Per Minute for calculating spindle RPM
-#define T3CPM     (16000000L * 60L)     //TC3 counts per minute, 16Mhz * 60 seconds
+#define T3CPM     (16000000L * 60L)     //Timebase counts per minute, 16Mhz * 60 seconds (TC3, or TC5 with SPINDLE_ICP)
+
+// Timer 4 Counts Per Minute for calculating the step burst speed limit
+#define T4CPM     (2000000L * 60L)      //TC4 counts per minute, 2Mhz * 60 seconds
 
 
 
@@ -119,7 +192,6 @@ char nxrpmID[12][4] {
 
 #define ICR4_MAX    0x8000    //Slow enough to adjust by thousandths
 #define ICR4_MIN    0x100     //Any faster can cause the microstepper to error out
-#define ICR4_ACCEL  0x200     //Initial increment for acceleration
 
 
 
@@ -142,6 +214,92 @@ char nxrpmID[12][4] {
 
 #define STEPPER_LIMIT     600000L
 
+MACHINE machine = {
+  .encoder_ppr = ENCODER_PPR,
+  .microsteps = MICROSTEPS,
+  .step_ratio = STEP_RATIO,
+  .ltpi = LTPI,
+  .stepper_limit = STEPPER_LIMIT,
+
+  //machineLoad() fills in the rest
+  .scpr = 0,
+  .scpr_half = 0,
+  .index_window = 0,
+  .lspi = 0,
+  .lspm10 = 0,
+  .lspmm10 = 0,
+  .rpm20 = 0,
+  .rpm_scale = 0,
+  .plan_min_period = 0,
+};
+
+
+
+//================================================================================
+// Step generation
+//================================================================================
+
+// Uncomment to work out the steps for each spindle tick in the spindle interrupt
+// from a remainder accumulator rather than looking them up in step_table[].
+// The result is identical, but a pitch change doesn't have to refill the table,
+// and the ENCODER_PPR_MAX bytes of SRAM for the table are freed.
+//#define STEP_DDA
+
+// Uncomment to spread the steps for each spindle tick evenly over the tick
+// instead of outputting them as a burst at the period_list[] rate.
+// The step period is worked out on every tick from the measured spindle period,
+// and steps left over when the next tick arrives are carried into it.
+//#define STEP_CONTINUOUS
+
+
+
+//================================================================================
+// Cross-slide
+//================================================================================
+
+// Uncomment to drive the cross-slide with a second stepper, geared to the
+// leadscrew for tapers or to the spindle for facing, see Cross.h.
+//#define CROSS_SLIDE
+
+#define X_MICROSTEPS    400     //Cross-slide driver microsteps per revolution
+#define X_STEP_RATIO    2       //Stepper:Cross feed screw ratio
+#define X_LTPI          10      //Cross feed screw Threads Per Inch
+#define X_LSPI          (X_LTPI * X_MICROSTEPS * (long)X_STEP_RATIO)   //Cross-slide Steps Per Inch (8000)
+#define X_STEPPER_LIMIT 600000L //Cross-slide steps per minute, as STEPPER_LIMIT
+#define X_PERIOD        (T4CPM / X_STEPPER_LIMIT)   //TC1 counts per step when following (2Mhz clock)
+#define X_JOG_PERIOD    1000    //And for xjog, slow enough not to need a ramp
+#define CROSS_LAG_MAX   64      //Steps the cross-slide can fall behind before the feed is held
+
+
+
+//================================================================================
+// Benchmarking
+//================================================================================
+
+// Uncomment to print the per-pitch tick budget and speed limits at startup,
+// and the running step overrun count with the RPM on the debug port.
+//#define ELS_BENCHMARK
+
+
+
+//================================================================================
+// Telemetry
+//================================================================================
+
+// Uncomment to stream binary records of every spindle tick and encoder timing
+// error on the debug port, see Telemetry.h.  tools/els_telemetry.cpp decodes them.
+//#define ELS_TELEMETRY
+
+
+
+//================================================================================
+// Profiling
+//================================================================================
+
+// Uncomment to time the interrupts and loop() against the spindle timebase, and
+// print the figures with "prof" on the debug port, see Profile.h.
+//#define ELS_PROFILE
+
 
 
 //================================================================================
@@ -151,15 +309,15 @@ char nxrpmID[12][4] {
 bool feed_left = true;        //Feed toward the headstock
 bool spin_ccw = true;         //Spindle direction
 bool fault = false;           //Step overrun flag
-bool jogging = false;         //Flag to control timer interrupt behavior
+volatile unsigned int fault_count = 0; //Step overruns since the feed rate was last changed
+bool jogging = false;         //Flag to control timer and spindle interrupt behavior
 bool right_limited = false;   //Flag to control feed limits
 bool left_limited = false;    //Flag to control feed limits
 bool synced = true;           //Flag for synchronizing the leadscrew with the spindle
-bool waitSerial2 = true;      //For zeroSet()
 
-int knob_count;               //Knob counts (really just direction)
+int knob_count;               //Knob counts (really just direction), from ev_knob events
 
-int spin_count = 0;           //Value from 0-799 (counts per rev)
+int spin_count = 0;           //Value from 0 to SCPR-1 (counts per rev)
 
 int sync_count = 0;           //On-the-fly spindle count for synchronizing
 int lsync_count = 0;          //Spindle count upon reaching the left limit
@@ -167,12 +325,11 @@ int rsync_count = 0;          //Likewise for the right
 
 int steps_per_rev;            //Steps per spindle revolution for the current pitch
 
-long leadscrew;               //Leadscrew counts
+volatile long leadscrew;      //Leadscrew counts, read with leadscrewGet() outside interrupts
 long left_limit = 0L;         //Leadscrew value for left limit when enabled
 long right_limit = 0L;        //Leadscrew value for right limit
 
-unsigned int spin_rate = SPINDLE_STOPPED;
-unsigned int last_spin;
+volatile unsigned int spin_rate = SPINDLE_STOPPED;   //Read with spinRateGet() outside interrupts
 
 
 
@@ -188,37 +345,105 @@ unsigned int last_spin;
 // Feed modes
 //================================================================================
 
-enum {
+enum feedMode {
   inch_feed,
   metric_feed,
   diametral_feed,
-  module_feed
+  module_feed,
+  custom_feed       //Entered on the CUSTOM page, see Ratio.h
 } feed_mode = inch_feed ;
 
+int feed_index[4];  //Table entry for each of the table feed modes, defaults set in setup()
+
 
 
 //================================================================================
-// Timers
+// User interface states
 //================================================================================
 
-union {
-  // Used to extend the resolution of TC3
-  unsigned long count;
-  unsigned int low, high;
-} tc3 ;
+// The touchscreen buttons that do something while they're held are handled by
+// uiTick() on every scheduler pass, and finished by uiRelease() when the display
+// reports that the button was let go.  Nothing waits for the release.
+
+enum uiState {
+  ui_idle,          //Nothing held
+  ui_jog_wait,      //Direction button held, waiting JOG_HOLD to see if it's a jog
+  ui_jogging,       //Jogging, until the button is released
+  ui_nojog,         //Jog refused because the spindle is turning
+  ui_release        //Limit or zero button held, restore its color on release
+} ui_state = ui_idle;
+
+bool ui_feed;                             //Direction of the button being held
+unsigned long ui_timer;                   //When the current state started
+const __FlashStringHelper *ui_restore;    //Sent on release in the ui_release state
+
 
-unsigned long last_tc3 = 0;   //This is used to calculate spindle RPM.
+
+//================================================================================
+// Timers
+//================================================================================
 
 unsigned int last_step = 0;   //For determining pulse rate
 
-unsigned int _icr4;           //Buffered value for ICR4 used during jogging
+// Jogging state, kept until the planner reports that the move is done
+long jog_lead;                //Leadscrew position when the jog started
+unsigned int jog_icr4;        //Timer registers saved while jogging
+unsigned int jog_tcnt4;
 
 byte steps;                   //Steps per spindle tick
-byte step_table[SCPR];        //Lookup table for precalculated feed rate
+byte burst;                   //Steps loaded and not yet counted in leadscrew, including carries
 int max_steps;                //Maximum steps per spindle tick, used in several ways
 
+#if defined(SPINDLE_X4) && !defined(STEP_DDA)
+#error "SPINDLE_X4 needs STEP_DDA, the step table would take SCPR bytes of SRAM"
+#endif
+
+#if defined(SPINDLE_X4) && defined(SPINDLE_ICP)
+#error "SPINDLE_ICP can only time one phase, so it can't be used with SPINDLE_X4"
+#endif
+
+#ifdef SPINDLE_X4
+// x4 decoding.  The state is (A << 1) | B, and a falling A edge with B high,
+// which is what the x1 decoding counts as CCW, goes from 3 to 1.
+// Changes of both bits at once are impossible, and are counted as glitches.
+const signed char quad_table[16] = {
+//  to:  0   1   2   3        from:
+         0, -1,  1,  0,     // 0
+         1,  0,  0, -1,     // 1
+        -1,  0,  0,  1,     // 2
+         0,  1, -1,  0      // 3
+};
+byte quad_last;                       //Encoder state at the last edge
+volatile unsigned int quad_glitches;  //Impossible transitions seen
+#endif
+
+#ifdef STEP_DDA
+// Bresenham-style accumulator locked to spin_count.
+// For the feed tables dda_den is SCPR, and dda_acc is always (spin_count * dda_rem) % SCPR,
+// so the steps for any spindle count come out exactly the same as the step_table[]
+// entry would have been.  A custom pitch can have any denominator up to DDA_DEN_MAX.
+byte dda_whole;               //Whole steps per spindle tick
+long dda_rem;                 //Remainder steps per tick in 1/dda_den (0 to dda_den-1)
+long dda_den;                 //Denominator of the steps per tick
+long dda_acc;                 //Accumulated remainder at the current spin_count
+
+#define TICK_STEPS  (dda_whole + (dda_acc + dda_rem >= dda_den))
+#else
+byte step_table[ENCODER_PPR_MAX];   //Lookup table for precalculated feed rate, SCPR entries used
+
+#define TICK_STEPS  step_table[spin_count]
+#endif
+
+#ifdef STEP_CONTINUOUS
+// The step period is spin_rate (16Mhz) / 8 (2Mhz) * 3/4 of the tick / max_steps,
+// done as a multiply and shift with the reciprocal worked out when the rate changes.
+#define STEP_SPREAD   6144U   //65536 * 3 / 32
+unsigned int step_recip;      //STEP_SPREAD / max_steps
+#endif
+
 //The measured spindle speeds on my lathe with a 1720rpm motor
-unsigned int rpm_table[12] { 1430, 812, 648, 463, 368, 238, 210, 135, 108, 77, 61, 34 };
+#define RPM_TABLE   1430, 812, 648, 463, 368, 238, 210, 135, 108, 77, 61, 34
+unsigned int rpm_table[12] { RPM_TABLE };
 
 //        "Official" values: 1450, 780, 620, 420, 334, 244, 179, 131, 104, 70, 56, 30
 
@@ -263,9 +488,10 @@ unsigned int rpm_table[12] { 1430, 812, 648, 463, 368, 238, 210, 135, 108, 77, 6
 
 //So after all that I wound up looking at it on the oscilloscope and picking arbitrary values.
 //Maybe I'll revisit this at a later date:
-int period_list[12] {
-  STP_MIN, STP_MIN, STP_MIN, STP_MIN, STP_MIN, STP_MIN,
-  STP_MIN, STP_MIN,      83,     104,     155,     194 };
+#define PERIOD_LIST \
+  STP_MIN, STP_MIN, STP_MIN, STP_MIN, STP_MIN, STP_MIN, \
+  STP_MIN, STP_MIN,      83,     104,     155,     194
+int period_list[12] { PERIOD_LIST };
 
 
 #endif // __CONFIGURATION_H
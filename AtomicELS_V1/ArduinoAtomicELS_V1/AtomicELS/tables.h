@@ -33,22 +33,51 @@
 //================================================================================
 
 struct FEED_TABLE {
+  unsigned long thou;     //The pitch in thousandths, for working the steps out again (see Machine.h)
   unsigned int steps;     //Encoder steps per spindle revolution for a given pitch
+  long error;             //Rounding error of steps in parts per million, + is long
   char rate[7];           //Feed rate in inches or millimeters
   char pitch[5];          //Threads per inch or special designations like "10BA"
 };
 
+// The tables are generated when the sketch compiles from the machine parameters in
+// configuration.h, so changing MICROSTEPS, STEP_RATIO or LTPI can't leave them stale.
+// They live in flash, and have to be read with feedGet(), which works the steps
+// out again when the machine profile loaded isn't the default one.
+//
+// Each entry is worked out as an exact fraction of integers and rounded once.
+// The pitches are written as decimals and scaled to thousandths, which is exact
+// for every entry.  Pi is 355/113, which is within 0.1ppm.
+
+#define THOU(x)   ((unsigned long long)((x) * 1000.0 + 0.5))
+#define PI_NUM    355ULL
+#define PI_DEN    113ULL
+
+constexpr unsigned int feedSteps(unsigned long long num, unsigned long long den) {
+  return (num + den / 2) / den;
+}
+
+constexpr long feedError(unsigned long long num, unsigned long long den) {
+  return ((long long)feedSteps(num, den) * (long long)den - (long long)num) * 1000000LL / (long long)num;
+}
+
+#define FEED(num, den)  feedSteps(num, den), feedError(num, den)
+
 // INCH mode steps per revolution = leadscrew steps per inch / pitch
-#define INCH_STEPS(tpi) ((unsigned int) round((float)LSPI/(tpi)))
+#define INCH_STEPS(tpi) THOU(tpi), FEED(LSPI * 1000ULL, THOU(tpi))
 
 // METRIC mode steps per revolution = rate_mm * leadscrew steps per inch / 25.4
-#define MM_STEPS(mm) ((unsigned int) round((float)(mm)*LSPI/25.4))
+#define MM_STEPS(mm) THOU(mm), FEED(THOU(mm) * LSPI * 10, 254000ULL)
 
 // DIAMETRAL mode steps per revolution = pi * leadscrew steps per inch / diametral pitch
-#define DIAM_STEPS(dpi) ((unsigned int) round(PI*(float)LSPI/(dpi)))
+#define DIAM_STEPS(dpi) THOU(dpi), FEED(PI_NUM * LSPI * 1000, PI_DEN * THOU(dpi))
 
 // MODULE mode steps per revolution = pi * rate_mm * LSPI / 25.4
-#define MOD_STEPS(mm) ((unsigned int) round(PI*(float)(mm)*LSPI/25.4))
+#define MOD_STEPS(mm) THOU(mm), FEED(PI_NUM * THOU(mm) * LSPI * 10, PI_DEN * 254000)
+
+// Largest pitch error allowed for a thread, as opposed to a plain feed ("----").
+// 216tpi is the worst at about 4000ppm, which is 0.004" in an inch of thread.
+#define THREAD_ERROR_PPM  5000L
 
 //***********************************************************************************
 // Following are the lookup tables for the number of steps per spindle tick.        *
@@ -57,7 +86,7 @@ struct FEED_TABLE {
 
 const int INCHES = 76;    //Number of entries in the inch feed table
 
-FEED_TABLE inch[INCHES] = {
+constexpr FEED_TABLE inch[INCHES] PROGMEM = {
   {INCH_STEPS(2000),  "0.0005", "----"}, /* 0  */
   {INCH_STEPS(1000),  "0.001 ", "----"}, /* 1  */
   {INCH_STEPS(667),   "0.0015", "----"}, /* 2  */
@@ -138,7 +167,7 @@ FEED_TABLE inch[INCHES] = {
 
 const int METRICS = 56 ;
 
-FEED_TABLE metric[METRICS] = {
+constexpr FEED_TABLE metric[METRICS] PROGMEM = {
   {MM_STEPS(0.01),  "  0.01", "----"}, /* 0  */
   {MM_STEPS(0.02),  "  0.02", "----"}, /* 1  */
   {MM_STEPS(0.03),  "  0.03", "----"}, /* 2  */
@@ -199,7 +228,7 @@ FEED_TABLE metric[METRICS] = {
 
 const int DIAMETRALS = 38;
 
-FEED_TABLE diametral[DIAMETRALS] = {
+constexpr FEED_TABLE diametral[DIAMETRALS] PROGMEM = {
   {DIAM_STEPS(120),  "0.0262", " 120"}, /* 0  */
   {DIAM_STEPS(112),  "0.0280", " 112"}, /* 1  */
   {DIAM_STEPS(108),  "0.0291", " 108"}, /* 2  */
@@ -242,7 +271,7 @@ FEED_TABLE diametral[DIAMETRALS] = {
 
 const int MODULES = 26;
 
-FEED_TABLE module[MODULES] = {
+constexpr FEED_TABLE module[MODULES] PROGMEM = {
   {MOD_STEPS(0.20), "  0.2 ", "----"}, /* 0  */
   {MOD_STEPS(0.25), "  0.25", "----"}, /* 1  */
   {MOD_STEPS(0.30), "  0.3 ", "----"}, /* 2  */
@@ -272,4 +301,22 @@ FEED_TABLE module[MODULES] = {
 };
 
 
+constexpr bool feedOK(const FEED_TABLE &f) {
+  //Every entry has to round to within half a step, which also catches steps
+  //overflowing, and threads have to be within THREAD_ERROR_PPM
+  return f.steps > 0 &&
+         f.error < 500000L / f.steps + 1 && f.error > -(500000L / f.steps + 1) &&
+         (f.pitch[0] == '-' || (f.error < THREAD_ERROR_PPM && f.error > -THREAD_ERROR_PPM));
+}
+
+constexpr bool feedCheck(const FEED_TABLE *table, int n) {
+  return n == 0 || (feedOK(table[n - 1]) && feedCheck(table, n - 1));
+}
+
+static_assert(feedCheck(inch, INCHES), "inch table pitch error out of range");
+static_assert(feedCheck(metric, METRICS), "metric table pitch error out of range");
+static_assert(feedCheck(diametral, DIAMETRALS), "diametral table pitch error out of range");
+static_assert(feedCheck(module, MODULES), "module table pitch error out of range");
+
+
 #endif // __TABLES_H
@@ -0,0 +1,284 @@
+// Copyright (c) 2020 Jon Bryan
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+//================================================================================
+//
+//  ELS machine profile checker
+//
+//  Runs on the PC, not the Arduino.  Reads a machine profile written as the
+//  commands the sketch takes on its debug port (see AtomicELS/Machine.h), one per
+//  line, starting from the defaults in configuration.h.  It makes the same checks
+//  as machineCheck() in the sketch, so a profile it passes will load, and prints
+//  the steps per rev, steps per spindle tick and top spindle speed for every feed
+//  in the tables.  Threads that come out further off pitch than the compiled
+//  tables allow, and feeds too fast for even the slowest belt speed, are warned
+//  about but don't stop the profile loading.
+//
+//  -x4, -dda and -continuous match SPINDLE_X4, STEP_DDA and STEP_CONTINUOUS in
+//  the sketch.  With -v every feed is printed, otherwise only the ones with
+//  something wrong.  The exit status is 1 if the sketch would refuse it.
+//
+//  Build:    g++ -O2 -Ihost -I../AtomicELS_V1/ArduinoAtomicELS_V1/AtomicELS -o els_profile els_profile.cpp
+//  Check:    ./els_profile -v lathe.txt
+//  Load:     stty -F /dev/ttyACM0 115200 raw -echo; cat lathe.txt > /dev/ttyACM0
+//            (with "apply" as the last line, and the spindle stopped)
+//
+//  The debug port ends up at BAUD_RATE (EncoderDiagnostics.h) once setup() is
+//  done, or at TLM_BAUD, 1000000, with ELS_TELEMETRY.
+//
+//================================================================================
+
+//The sketch's own headers, against the host tests' stand-in for the Arduino
+//core, so the defaults, the limits and the tables are the ones it compiles
+//with.  The steps in the tables are for the default profile, and are worked
+//out again here for the one being checked.
+#include <Arduino.h>
+#include "configuration.h"
+#include "tables.h"
+#include "Ratio.h"
+#include "Machine.h"
+
+struct Profile {
+  MACHINE m;                        //Only the profile itself, not what machineLoad() works out
+  unsigned int rpm[12];             //rpm_table[]
+  int period[12];                   //period_list[]
+};
+
+struct Table {
+  const char *name;
+  const FEED_TABLE *feeds;
+  int size;
+  bool inch;                //Pitches in threads per inch rather than mm
+  unsigned long long pi_num, pi_den;
+};
+
+static const Table tables[4] = {
+  {"inch", inch, INCHES, true, 1, 1},
+  {"metric", metric, METRICS, false, 1, 1},
+  {"diametral", diametral, DIAMETRALS, true, PI_NUM, PI_DEN},
+  {"module", module, MODULES, false, PI_NUM, PI_DEN}
+};
+
+static int edges = 1;               //SPINDLE_X4
+static bool dda = false;            //STEP_DDA
+static bool continuous = false;     //STEP_CONTINUOUS
+static bool verbose = false;
+
+static void defaults(Profile &p) {
+  p.m = machine;
+  memcpy(p.rpm, rpm_table, sizeof(p.rpm));
+  memcpy(p.period, period_list, sizeof(p.period));
+}
+
+static bool command(Profile &p, char *line) {
+  //One line of the profile, the same commands as machineCommand()
+
+  char *cmd = strtok(line, " \t\r\n");
+  char *arg1 = strtok(NULL, " \t\r\n");
+  char *arg2 = strtok(NULL, " \t\r\n");
+  long a = arg1 ? atol(arg1) : -1L;
+  long b = arg2 ? atol(arg2) : -1L;
+
+  if (cmd == NULL || cmd[0] == '#' || strcmp(cmd, "show") == 0 || strcmp(cmd, "apply") == 0)
+    return true;
+  if (strcmp(cmd, "defaults") == 0)
+    defaults(p);
+  else if (a < 0)
+    return false;
+  else if (strcmp(cmd, "ppr") == 0 && a <= 0xFFFF)
+    p.m.encoder_ppr = a;
+  else if (strcmp(cmd, "microsteps") == 0 && a <= 0xFFFF)
+    p.m.microsteps = a;
+  else if (strcmp(cmd, "ratio") == 0 && a <= 0xFF)
+    p.m.step_ratio = a;
+  else if (strcmp(cmd, "ltpi") == 0 && a <= 0xFF)
+    p.m.ltpi = a;
+  else if (strcmp(cmd, "limit") == 0)
+    p.m.stepper_limit = a;
+  else if (strcmp(cmd, "rpm") == 0 && a < 12 && b >= 0 && b <= 0xFFFF)
+    p.rpm[a] = b;
+  else if (strcmp(cmd, "period") == 0 && a < 12 && b >= 0 && b <= 0x7FFF)
+    p.period[a] = b;
+  else
+    return false;
+  return true;
+}
+
+static bool tableSteps(const Table &t, unsigned long thou, long lspi, unsigned long long *q, long *error) {
+  //Steps per rev for a table pitch, the same sums as machineSteps()
+
+  unsigned long long num, den;
+
+  if (t.inch) {
+    num = t.pi_num * lspi * 1000;
+    den = t.pi_den * thou;
+  } else {
+    num = t.pi_num * thou * lspi * 10;
+    den = t.pi_den * 254000;
+  }
+  *q = (num + den / 2) / den;
+  *error = ((long long)*q * (long long)den - (long long)num) * 1000000LL / (long long)num;
+  return *q > 0 && *q <= 32767;
+}
+
+static long maxRPM(const Profile &p, long scpr, long steps_per) {
+  //Highest spindle speed for a feed, as maxRPM() in the sketch
+
+  long spt = (steps_per + scpr - 1) / scpr;
+  long limit = p.m.stepper_limit / steps_per;
+  long burst;
+
+  if (continuous)
+    burst = T4CPM / 4 * 3 / (scpr * spt * STP_MIN);
+  else
+    burst = T4CPM / (scpr * spt * p.period[spt]);
+  return burst < limit ? burst : limit;
+}
+
+static int check(const Profile &p) {
+  //Print what's wrong with the profile, and return the number of errors
+
+  long scpr = (long)p.m.encoder_ppr * edges;
+  long lspi = (long)p.m.ltpi * p.m.microsteps * p.m.step_ratio;
+  unsigned int slowest = 0xFFFF;
+  unsigned long long q;
+  long error, rpm, spt;
+  int errors = 0, warnings = 0;
+  int i, k;
+
+  if (p.m.encoder_ppr == 0 || scpr > SCPR_LIMIT) {
+    printf("error: encoder ppr %u out of range, at most %ld counts per rev\n", p.m.encoder_ppr, (long)SCPR_LIMIT);
+    errors++;
+  }
+  if (!dda && p.m.encoder_ppr > ENCODER_PPR_MAX) {
+    printf("error: encoder ppr %u is more than step_table[] holds (%d), unless it's built with STEP_DDA\n",
+           p.m.encoder_ppr, ENCODER_PPR_MAX);
+    errors++;
+  }
+  if (p.m.microsteps == 0 || p.m.step_ratio == 0 || p.m.ltpi == 0) {
+    printf("error: microsteps, ratio and ltpi can't be 0\n");
+    errors++;
+  }
+  if (lspi > LSPI_LIMIT || lspi < 100) {
+    printf("error: %ld leadscrew steps per inch, has to be 100 to %ld\n", lspi, LSPI_LIMIT);
+    errors++;
+  }
+  if (p.m.stepper_limit < T4CPM / ICR4_MAX) {
+    printf("error: stepper limit %ld is slower than the slowest jog, %ld\n", p.m.stepper_limit, T4CPM / ICR4_MAX);
+    errors++;
+  }
+  for (i = 0; i < 12; i++) {
+    if (p.rpm[i] == 0) {
+      printf("error: belt speed %d is 0\n", i);
+      errors++;
+    } else if (p.rpm[i] < slowest) {
+      slowest = p.rpm[i];
+    }
+    if (p.period[i] < STP_MIN || p.period[i] > ICR4_MAX) {
+      printf("error: period %d is %d, has to be %d to %d\n", i, p.period[i], STP_MIN, ICR4_MAX);
+      errors++;
+    }
+  }
+  if (errors)
+    return errors;
+
+  printf("%ld counts per rev, %ld leadscrew steps per inch, slowest belt speed %u rpm\n", scpr, lspi, slowest);
+  for (k = 0; k < 4; k++) {
+    const Table &t = tables[k];
+    long worst_spt = 0, worst_rpm = 0x7FFFFFFFL;
+
+    for (i = 0; i < t.size; i++) {
+      const FEED_TABLE &f = t.feeds[i];
+      bool thread = f.pitch[0] != '-';
+      const char *problem = NULL;
+      bool bad = true;              //No speed to print
+
+      if (!tableSteps(t, f.thou, lspi, &q, &error)) {
+        problem = "error: steps per rev out of range";
+        errors++;
+      } else if ((spt = (q + scpr - 1) / scpr) > CUSTOM_MAX_TICK) {
+        problem = "error: more steps per spindle tick than period_list[] has";
+        errors++;
+      } else {
+        bad = false;
+        rpm = maxRPM(p, scpr, q);
+        if (spt > worst_spt)
+          worst_spt = spt;
+        if (rpm < worst_rpm)
+          worst_rpm = rpm;
+        if (thread && (error >= THREAD_ERROR_PPM || error <= -THREAD_ERROR_PPM)) {
+          problem = "warning: thread pitch error";
+          warnings++;
+        } else if (rpm < slowest) {
+          problem = "warning: too fast for any belt speed";
+          warnings++;
+        }
+      }
+      if (problem || verbose) {
+        if (bad)
+          printf("%-9s %-6.6s %-4.4s steps %llu  %s\n", t.name, f.rate, f.pitch, q, problem);
+        else
+          printf("%-9s %-6.6s %-4.4s steps %5llu spt %2llu error %+6ldppm max %5ld rpm%s%s\n",
+                 t.name, f.rate, f.pitch, q, (q + scpr - 1) / scpr, error, maxRPM(p, scpr, q),
+                 problem ? "  " : "", problem ? problem : "");
+      }
+    }
+    printf("%-9s %d feeds, most steps per tick %ld, lowest top speed %ld rpm\n",
+           t.name, t.size, worst_spt, worst_rpm);
+  }
+  printf("%d errors, %d warnings\n", errors, warnings);
+  return errors;
+}
+
+int main(int argc, char **argv) {
+  FILE *in = stdin;
+  char line[128];
+  Profile p;
+  int n = 0;
+  int i;
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-x4") == 0) {
+      edges = 4;
+    } else if (strcmp(argv[i], "-dda") == 0) {
+      dda = true;
+    } else if (strcmp(argv[i], "-continuous") == 0) {
+      continuous = true;
+    } else if (strcmp(argv[i], "-v") == 0) {
+      verbose = true;
+    } else if (argv[i][0] == '-') {
+      fprintf(stderr, "usage: %s [-x4] [-dda] [-continuous] [-v] [profile]\n", argv[0]);
+      return 2;
+    } else if ((in = fopen(argv[i], "r")) == NULL) {
+      perror(argv[i]);
+      return 2;
+    }
+  }
+
+  defaults(p);
+  while (fgets(line, sizeof(line), in)) {
+    n++;
+    if (!command(p, line)) {
+      fprintf(stderr, "line %d: the sketch won't take that\n", n);
+      return 1;
+    }
+  }
+  return check(p) ? 1 : 0;
+}
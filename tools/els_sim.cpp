@@ -0,0 +1,351 @@
+// Copyright (c) 2020 Jon Bryan
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+//================================================================================
+//
+//  ELS step pipeline simulator
+//
+//  Runs on the PC, not the Arduino.  The sketch itself is compiled against the
+//  machine model in host/host.h, and for every entry in the inch, metric,
+//  diametral and module tables the spindle is turned at each speed from -rpm,
+//  100 to 3000 by 100 unless told otherwise, with the feed engaged for -revs
+//  revolutions.  A speed is clean if the feed wasn't held, no step was left over
+//  at a spindle tick (fault_count), no interrupt was lost, TIMER4 always wrote
+//  the next period before the pulse it was for was due, and the driver got
+//  exactly the steps leadscrew says, which are all but a turn's worth at most.  For each feed it prints the speed maxRPM() allows, the fastest clean
+//  speed and what stopped the next one, and at the clean speed the cycles between
+//  spindle interrupts, the least slack TIMER4 left and how busy the CPU was.
+//
+//  Cycle accuracy is only as good as the interrupt costs, which are estimates
+//  for a -Os build (see cost below), not counts.  ELS_PROFILE in the sketch
+//  measures the real ones on the lathe: the max column of "prof" for spindle and
+//  timer4 is in 16Mhz cycles, and -cost takes them, as spindle=N, timer4=N
+//  (a step in the middle of a train), timer4end=N (the last one), jog=N,
+//  phaseb=N (SPINDLE_B's interrupt, without SPINDLE_X4), ovf=N, pcint=N and
+//  timer1=N.  spindlehead=N, timer4head=N and joghead=N say how far
+//  into those the step timer is started, stopped or given its next period.  The
+//  encoder's edges are jittered by -jitter, a fraction of the gap between them.
+//
+//  -check makes it a regression test: the exit status is 1 if any feed isn't
+//  clean at 98% of the speed maxRPM() allows (or the top of -rpm, if that's
+//  lower), which is the sketch promising a speed it can't do.  run_tests.sh
+//  runs it that way over a few feeds.
+//
+//  Build it with the same flags as the sketch to see a configuration, so with
+//  -DSPINDLE_X4 -DSTEP_DDA the spindle interrupt runs four times as often, and
+//  the load column shows what that costs at each feed's top speed.
+//
+//  Build:    python3 host/sketch.py > sketch.cpp
+//            g++ -std=gnu++17 -O2 -Ihost -I. -I../AtomicELS_V1/ArduinoAtomicELS_V1/AtomicELS
+//                -o els_sim els_sim.cpp
+//  Run:      ./els_sim [-table inch|metric|diametral|module] [-index n]
+//                [-rpm lo:hi:step] [-revs n] [-jitter f] [-cost name=cycles,...]
+//                [-check] [-v]
+//
+//================================================================================
+
+#include "host.h"
+#include "sketch.cpp"
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+struct TABLE {
+  const char *name;
+  int mode;
+  const FEED_TABLE *feeds;
+  int size;
+};
+
+const TABLE sim_tables[] = {
+  { "inch", inch_feed, inch, INCHES },
+  { "metric", metric_feed, metric, METRICS },
+  { "diametral", diametral_feed, diametral, DIAMETRALS },
+  { "module", module_feed, module, MODULES },
+};
+
+//Interrupt costs in cycles, from the entry to the RETI, and how far in the part
+//that touches the step timer is (see host.h)
+struct COST {
+  unsigned spindle = 600;       //A spindle tick, with stepLoad()
+  unsigned spindle_head = 480;  //To pwmOn(), after which there's the diagnostics and the epilogue
+  unsigned timer4 = 70;         //A step in the middle of a train
+  unsigned timer4end = 170;     //The last step, which stops the clock
+  unsigned timer4_head = 40;    //To pwmOff(), which is first
+  unsigned jog = 200;           //A jog step, with planStep()
+  unsigned jog_head = 170;      //To the ICR4 write at the end of planStep()
+  unsigned phase_b = 60;        //SPINDLE_B without SPINDLE_X4
+  unsigned ovf = 40;
+  unsigned pcint = 90;
+  unsigned timer1 = 100;
+} cost;
+
+double jitter = 0.02;           //Encoder edges off by up to 2% of the gap either way
+
+struct RESULT {
+  bool ran;                     //The child got to the end
+  unsigned long faults;
+  unsigned long holds;
+  unsigned long lost;
+  long long slack;              //Least cycles from TIMER4's head to the pulse that was next
+  long pulses;                  //Steps the driver got while feeding
+  long lead;                    //And how far leadscrew says it went
+  long want;                    //Steps for revs turns, less one
+  double load;                  //Fraction of the CPU in interrupts while feeding
+};
+
+const char *resultWhy(const RESULT &r) {
+  //What stopped a speed being clean, or NULL
+
+  if (!r.ran)
+    return "crashed";
+  if (r.holds)
+    return "held";
+  if (r.faults)
+    return "fault";
+  if (r.lost)
+    return "lost irq";
+  if (r.slack < 0)
+    return "timer4 late";
+  if (r.pulses != r.lead)
+    return "steps off";
+  if (labs(r.lead) < r.want)
+    return "no feed";
+  return NULL;
+}
+
+void costSet(void) {
+  //The model asks these as each interrupt is taken
+
+  for (int i : { irq_int4, irq_int5, irq_timer5_capt }) {
+    host_irq[i].cost = [] { return cost.spindle; };
+    host_irq[i].head = [] { return cost.spindle_head; };
+  }
+#ifndef SPINDLE_X4
+  host_irq[irq_int4].cost = [] { return cost.phase_b; };   //Only the diagnostics' SPINDLE_B count
+  host_irq[irq_int4].head = NULL;
+#endif
+  host_irq[irq_timer4].cost = [] { return jogging ? cost.jog : steps == 1 ? cost.timer4end : cost.timer4; };
+  host_irq[irq_timer4].head = [] { return jogging ? cost.jog_head : cost.timer4_head; };
+  host_irq[irq_timer3_ovf].cost = [] { return cost.ovf; };
+  host_irq[irq_timer5_ovf].cost = [] { return cost.ovf; };
+  host_irq[irq_pcint0].cost = [] { return cost.pcint; };
+  host_irq[irq_timer1].cost = [] { return cost.timer1; };
+}
+
+void runFeed(const TABLE &t, int index, double rpm, int revs, RESULT *r) {
+  //Turn the spindle at rpm and feed for revs revolutions, in this process
+
+  unsigned long long busy = 0, start;
+  unsigned long holds, faults;
+  long pos, lead;
+
+  costSet();
+  setup();
+  feed_index[t.mode] = index;
+  feed_mode = (decltype(feed_mode))t.mode;
+  feedSelect(t.mode);
+  hostLoop(HOST_MS(300));
+
+  host_spindle.ppr = machine.encoder_ppr;
+  host_spindle.rpm = rpm;
+  host_spindle.jitter = jitter;
+  host_spindle.start();
+  hostPin(reg_PIND, 3, LOW);                            //Feed left
+  hostLoop(HOST_MS(100) + HOST_SEC(3 * 60.0 / rpm));    //A few turns so the speed is known
+
+  //The feed has been going right since setup(), and the change of direction waits
+  //for the pickup.  Start between trains, so leadscrew has all the steps that
+  //went out, and after any hold from spinning up has been resumed, which isn't
+  //what's being measured.
+  hostLoopUntil([] { return synced && step_hold == hold_none; }, HOST_SEC(1));
+  for (unsigned long long end = host_now + HOST_MS(100); steps && host_now < end; )
+    hostFor(HOST_US(5));
+  hostResetStats();
+  host_t4.slack_min = 1LL << 40;
+  start = host_now;
+  holds = step_holds - (step_hold != hold_none);     //Still held from spinning up counts
+  faults = faultCountGet();
+  pos = host_t4.pos;
+  lead = leadscrew;
+  hostLoop(HOST_SEC(revs * 60.0 / rpm));
+  for (const HostIrq &q : host_irq)
+    busy += q.busy;
+  r->load = (double)busy / (host_now - start);
+
+  host_spindle.rpm = 0;                                 //Let the last train finish
+  hostLoop(HOST_MS(50));
+  r->faults = faultCountGet() - faults;
+  r->holds = step_holds - holds;
+  r->lost = 0;
+  for (const HostIrq &q : host_irq)
+    r->lost += q.lost;
+  r->slack = host_t4.slack_min;
+  r->pulses = host_t4.pos - pos;
+  r->lead = leadscrew - lead;
+  r->want = (revs - 1) * (long)steps_per_rev;
+  r->ran = true;
+}
+
+RESULT run(const TABLE &t, int index, double rpm, int revs) {
+  //A fresh sketch for every run, so nothing carries over
+
+  RESULT r = {};
+  int fd[2];
+  pid_t pid;
+
+  if (pipe(fd) != 0 || (pid = fork()) < 0) {
+    perror("els_sim");
+    exit(2);
+  }
+  if (pid == 0) {
+    close(fd[0]);
+    runFeed(t, index, rpm, revs, &r);
+    if (write(fd[1], &r, sizeof(r)) != sizeof(r))
+      _exit(1);
+    _exit(0);
+  }
+  close(fd[1]);
+  if (read(fd[0], &r, sizeof(r)) != sizeof(r))
+    r.ran = false;
+  close(fd[0]);
+  waitpid(pid, NULL, 0);
+  return r;
+}
+
+bool costParse(char *arg) {
+  //-cost name=cycles,...
+
+  for (char *s = strtok(arg, ","); s; s = strtok(NULL, ",")) {
+    char *eq = strchr(s, '=');
+    unsigned *c = NULL;
+
+    if (!eq)
+      return false;
+    *eq = 0;
+    if (!strcmp(s, "spindle")) c = &cost.spindle;
+    else if (!strcmp(s, "spindlehead")) c = &cost.spindle_head;
+    else if (!strcmp(s, "timer4")) c = &cost.timer4;
+    else if (!strcmp(s, "timer4end")) c = &cost.timer4end;
+    else if (!strcmp(s, "timer4head")) c = &cost.timer4_head;
+    else if (!strcmp(s, "jog")) c = &cost.jog;
+    else if (!strcmp(s, "joghead")) c = &cost.jog_head;
+    else if (!strcmp(s, "phaseb")) c = &cost.phase_b;
+    else if (!strcmp(s, "ovf")) c = &cost.ovf;
+    else if (!strcmp(s, "pcint")) c = &cost.pcint;
+    else if (!strcmp(s, "timer1")) c = &cost.timer1;
+    if (!c)
+      return false;
+    *c = atoi(eq + 1);
+  }
+  return true;
+}
+
+int usage(void) {
+  fprintf(stderr, "usage: els_sim [-table inch|metric|diametral|module] [-index n] [-rpm lo:hi:step]\n"
+                  "               [-revs n] [-jitter f] [-cost name=cycles,...] [-check] [-v]\n");
+  return 2;
+}
+
+int main(int argc, char **argv) {
+  const char *only = NULL;
+  int index = -1;
+  int lo = 100, hi = 3000, step = 100;
+  int revs = 20;
+  bool check = false, verbose = false;
+  int bad = 0;
+
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-table") && i + 1 < argc)
+      only = argv[++i];
+    else if (!strcmp(argv[i], "-index") && i + 1 < argc)
+      index = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-rpm") && i + 1 < argc) {
+      if (sscanf(argv[++i], "%d:%d:%d", &lo, &hi, &step) != 3 || lo <= 0 || hi < lo || step <= 0)
+        return usage();
+    } else if (!strcmp(argv[i], "-revs") && i + 1 < argc)
+      revs = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-cost") && i + 1 < argc) {
+      if (!costParse(argv[++i]))
+        return usage();
+    } else if (!strcmp(argv[i], "-jitter") && i + 1 < argc)
+      jitter = atof(argv[++i]);
+    else if (!strcmp(argv[i], "-check"))
+      check = true;
+    else if (!strcmp(argv[i], "-v"))
+      verbose = true;
+    else
+      return usage();
+  }
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  machineLoad();                //For the steps, each run's setup() does it again
+
+  printf("costs: spindle %u (%u) timer4 %u/%u (%u) jog %u (%u) ovf %u pcint %u timer1 %u cycles, "
+         "SCPR %d, jitter %g\n", cost.spindle, cost.spindle_head, cost.timer4, cost.timer4end, cost.timer4_head,
+         cost.jog, cost.jog_head, cost.ovf, cost.pcint, cost.timer1, SCPR, jitter);
+  printf("table     pitch    rate  steps max  limit  clean  stopped by     tick  slack  load\n");
+  for (const TABLE &t : sim_tables) {
+    if (only && strcmp(only, t.name))
+      continue;
+    for (int i = 0; i < t.size; i++) {
+      FEED_TABLE f;
+      unsigned limit;
+      int clean = 0;
+      const char *why = "-";
+      RESULT last = {};
+
+      if (index >= 0 && i != index)
+        continue;
+      feedGet(t.feeds, i, &f);
+      limit = maxRPM(f.steps);
+      for (int rpm = lo; rpm <= hi; rpm += step) {
+        RESULT r = run(t, i, rpm, revs);
+        const char *w = resultWhy(r);
+
+        if (verbose)
+          printf("  %5d rpm: faults %lu holds %lu lost %lu slack %lld pulses %ld lead %ld load %.1f%%\n",
+                 rpm, r.faults, r.holds, r.lost, r.slack, r.pulses, r.lead, 100 * r.load);
+        if (w) {
+          why = w;
+          break;
+        }
+        clean = rpm;
+        last = r;
+      }
+
+      printf("%-9s %s %s %6u %3d %6u %6d  %-11s %6lu %6lld %4.1f%%\n",
+             t.name, f.pitch, f.rate, f.steps, (int)((f.steps + SCPR - 1) / SCPR), limit, clean, why,
+             clean ? (unsigned long)(T3CPM / ((long)clean * SCPR)) : 0UL,
+             clean ? last.slack : 0LL, 100 * last.load);
+
+      if (check) {
+        int want = min((int)(limit * 0.98), hi);
+        RESULT r = want >= lo ? run(t, i, want, revs) : RESULT{ true, 0, 0, 0, 0, 0, 0, 0, 0 };
+        const char *w = resultWhy(r);
+
+        if (w) {
+          printf("  FAIL: not clean at %d rpm, which maxRPM() allows: %s\n", want, w);
+          bad = 1;
+        }
+      }
+    }
+  }
+  return bad;
+}
@@ -0,0 +1,323 @@
+// Copyright (c) 2020 Jon Bryan
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+//================================================================================
+//
+//  ELS telemetry decoder
+//
+//  Runs on the PC, not the Arduino.  Reads what the sketch sends on the debug
+//  port with ELS_TELEMETRY defined (see AtomicELS/Telemetry.h for the format),
+//  and prints a summary of the spindle ticks, steps, faults, encoder timing
+//  errors and lost data.  With -t every record is printed too, one per line.
+//
+//  Build:    g++ -O2 -o els_telemetry els_telemetry.cpp
+//  Capture:  stty -F /dev/ttyACM0 1000000 raw -echo; cat /dev/ttyACM0 > run.bin
+//  Decode:   ./els_telemetry -t run.bin > run.txt
+//
+//  host/test_telemetry.cpp builds this in with the sketch and ELS_TELEMETRY, to
+//  decode what the sketch sends.  Then the format is the sketch's own, and
+//  there's no main().
+//
+//================================================================================
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+
+#ifndef ELS_TELEMETRY
+#define TLM_SYNC0     0xA5
+#define TLM_SYNC1     0x5A
+#define TLM_HEADER    6
+#define TLM_BYTES     14
+
+enum tlmType {
+  tlm_tick = 1,
+  tlm_a_err,
+  tlm_b_err
+};
+
+#define TLM_SYNCED    0x01
+#define TLM_FAULT     0x02
+#define TLM_LEFT      0x04
+#define TLM_CCW       0x08
+#define TLM_JOGGING   0x10
+#endif
+
+#define TLM_MOST      16        //More than the sketch sends, anything bigger is garbage
+#define TC3_HZ        16000000.0
+
+struct Record {
+  int type;
+  int flags;
+  int steps;
+  int count;
+  uint32_t time;
+  uint16_t interval;
+  int32_t value;
+};
+
+struct Stats {
+  long bytes;
+  long skipped;             //Bytes outside of good packets
+  long packets;
+  long crc_errors;
+  long lost_packets;        //Gaps in the sequence numbers
+  long records;
+  long ticks;
+  long a_errors, b_errors;
+  long worst_early, worst_late;
+  long faults;
+  long engages;             //Not synced to synced
+  long long steps;
+  unsigned long drops;      //Running total from the sketch, unwrapped
+  unsigned int min_interval, max_interval;
+  double sum_interval;
+  uint64_t first_time, last_time;
+};
+
+static Stats stats;
+static bool timeline = false;
+static int counts_per_rev = 800;
+
+static uint8_t crc8(uint8_t crc, uint8_t data) {
+  //Same as _crc8_ccitt_update() in avr-libc
+
+  int i;
+
+  crc ^= data;
+  for (i = 0; i < 8; i++)
+    crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : (crc << 1);
+  return crc;
+}
+
+static uint32_t le32(const uint8_t *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t unwrapTime(uint32_t time) {
+  //TC3 counts wrap every 268 seconds, so extend them to 64 bits
+
+  static bool first = true;
+  static uint32_t last;
+  static uint64_t high = 0;
+
+  if (first) {
+    first = false;
+  } else if (time < last && last - time > 0x80000000UL) {
+    high += 0x100000000ULL;
+  }
+  last = time;
+  return high + time;
+}
+
+static void record(const Record &rec) {
+  //Add one record to the statistics, and print it
+
+  static int last_flags = 0;
+  uint64_t time = unwrapTime(rec.time);
+  long early_late;
+
+  if (stats.records++ == 0)
+    stats.first_time = time;
+  stats.last_time = time;
+
+  switch (rec.type) {
+    case tlm_tick:
+      stats.ticks++;
+      stats.steps += rec.steps;
+      if (rec.flags & TLM_FAULT)
+        stats.faults++;
+      if ((rec.flags & TLM_SYNCED) && !(last_flags & TLM_SYNCED))
+        stats.engages++;
+      last_flags = rec.flags;
+      if (rec.interval != 0xFFFF) {   //SPINDLE_STOPPED
+        if (stats.min_interval == 0 || rec.interval < stats.min_interval)
+          stats.min_interval = rec.interval;
+        if (rec.interval > stats.max_interval)
+          stats.max_interval = rec.interval;
+        stats.sum_interval += rec.interval;
+      }
+      break;
+    case tlm_a_err:
+    case tlm_b_err:
+      if (rec.type == tlm_a_err)
+        stats.a_errors++;
+      else
+        stats.b_errors++;
+      early_late = (int16_t)rec.interval;
+      if (early_late < stats.worst_early)
+        stats.worst_early = early_late;
+      if (early_late > stats.worst_late)
+        stats.worst_late = early_late;
+      break;
+  }
+
+  if (!timeline)
+    return;
+  printf("%12.6f ", (time - stats.first_time) / TC3_HZ);
+  switch (rec.type) {
+    case tlm_tick:
+      printf("tick  count %4d steps %2d interval %5u lead %9ld %s%s%s%s%s\n",
+             rec.count, rec.steps, rec.interval, (long)rec.value,
+             (rec.flags & TLM_SYNCED) ? "synced " : "",
+             (rec.flags & TLM_FAULT) ? "FAULT " : "",
+             (rec.flags & TLM_LEFT) ? "left " : "right ",
+             (rec.flags & TLM_CCW) ? "ccw " : "cw ",
+             (rec.flags & TLM_JOGGING) ? "jogging" : "");
+      break;
+    case tlm_a_err:
+    case tlm_b_err:
+      printf("%c err %+6d us at count %ld into the rev\n",
+             rec.type == tlm_a_err ? 'A' : 'B', (int16_t)rec.interval, (long)rec.value);
+      break;
+    default:
+      printf("type %d?\n", rec.type);
+      break;
+  }
+}
+
+static void packet(const uint8_t *buf, int count) {
+  //A packet with a good CRC: buf starts at the sequence number
+
+  static bool first = true;
+  static int last_seq;
+  static unsigned int last_drops;
+  int seq = buf[0];
+  unsigned int drops = buf[2] | (buf[3] << 8);
+  Record rec;
+  const uint8_t *p;
+  int i;
+
+  stats.packets++;
+  if (first) {
+    first = false;
+    stats.drops = drops;        //Whatever was lost before the capture started
+  } else {
+    stats.lost_packets += (seq - last_seq - 1) & 0xFF;
+    stats.drops += (drops - last_drops) & 0xFFFF;
+  }
+  last_seq = seq;
+  last_drops = drops;
+
+  for (i = 0; i < count; i++) {
+    p = buf + 4 + i * TLM_BYTES;
+    rec.type = p[0];
+    rec.flags = p[1];
+    rec.steps = p[2];
+    rec.count = p[3];
+    rec.time = le32(p + 4);
+    rec.interval = p[8] | (p[9] << 8);
+    rec.value = (int32_t)le32(p + 10);
+    record(rec);
+  }
+}
+
+static void decode(FILE *in) {
+  //Hunt for sync bytes, check the length and CRC, and hand good packets on.
+  //Anything that doesn't check out is skipped a byte at a time.
+
+  static uint8_t buf[TLM_HEADER + TLM_MOST * TLM_BYTES + 1];
+  int len = 0;
+  int need, i, c;
+  uint8_t crc;
+
+  while ((c = fgetc(in)) != EOF) {
+    stats.bytes++;
+    buf[len++] = c;
+
+    while (len > 0) {
+      if (buf[0] != TLM_SYNC0 || (len > 1 && buf[1] != TLM_SYNC1) ||
+          (len > 3 && (buf[3] == 0 || buf[3] > TLM_MOST))) {
+        //Not a packet start, so drop a byte and look again
+        memmove(buf, buf + 1, --len);
+        stats.skipped++;
+        continue;
+      }
+      if (len < 4)
+        break;
+      need = TLM_HEADER + buf[3] * TLM_BYTES + 1;
+      if (len < need)
+        break;
+
+      crc = 0;
+      for (i = 2; i < need - 1; i++)
+        crc = crc8(crc, buf[i]);
+      if (crc == buf[need - 1]) {
+        packet(buf + 2, buf[3]);
+        len -= need;
+        memmove(buf, buf + need, len);
+      } else {
+        stats.crc_errors++;
+        memmove(buf, buf + 1, --len);
+        stats.skipped++;
+      }
+    }
+  }
+  stats.skipped += len;
+}
+
+static void summary(void) {
+  //Print the statistics
+
+  double seconds = (stats.last_time - stats.first_time) / TC3_HZ;
+  double mean;
+
+  printf("bytes %ld, skipped %ld, packets %ld, CRC errors %ld, lost packets %ld\n",
+         stats.bytes, stats.skipped, stats.packets, stats.crc_errors, stats.lost_packets);
+  printf("records %ld over %.3fs, dropped by the sketch %lu (%.2f%%)\n",
+         stats.records, seconds, stats.drops,
+         stats.records + stats.drops ? 100.0 * stats.drops / (stats.records + stats.drops) : 0.0);
+  printf("ticks %ld, steps %lld, faults %ld, engaged %ld times\n",
+         stats.ticks, stats.steps, stats.faults, stats.engages);
+  if (stats.max_interval) {
+    mean = stats.sum_interval / stats.ticks;
+    printf("tick interval min %u max %u mean %.1f counts, %.1f rpm at %d counts/rev\n",
+           stats.min_interval, stats.max_interval, mean,
+           TC3_HZ * 60.0 / (mean * counts_per_rev), counts_per_rev);
+  }
+  printf("encoder timing errors A %ld B %ld, worst %ldus early %ldus late\n",
+         stats.a_errors, stats.b_errors, -stats.worst_early, stats.worst_late);
+}
+
+#ifndef ELS_TELEMETRY
+int main(int argc, char **argv) {
+  FILE *in = stdin;
+  int i;
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-t") == 0) {
+      timeline = true;
+    } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+      counts_per_rev = atoi(argv[++i]);
+    } else if (argv[i][0] == '-') {
+      fprintf(stderr, "usage: %s [-t] [-c counts_per_rev] [file]\n", argv[0]);
+      return 2;
+    } else if ((in = fopen(argv[i], "rb")) == NULL) {
+      perror(argv[i]);
+      return 1;
+    }
+  }
+
+  decode(in);
+  summary();
+  return 0;
+}
+#endif // ELS_TELEMETRY
@@ -0,0 +1,242 @@
+// Copyright (c) 2020 Jon Bryan
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+//================================================================================
+//
+//  Host stand-in for the Arduino core
+//
+//  Only what the sketch uses.  The AVR registers are objects that hand every
+//  read and write to the machine model in host.h, so the timers, pins and
+//  interrupt flags behave the way the sketch expects of the hardware.  The
+//  serial ports keep what's printed and take what a test queues for them.
+//
+//  The host's int is 32 bits and its long 64, where the AVR's are 16 and 32.
+//  Everything the sketch keeps in a long still fits, and the tests check the
+//  results against the AVR's ranges where it matters.
+//
+//================================================================================
+
+#ifndef __HOST_ARDUINO_H
+#define __HOST_ARDUINO_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+#include <functional>
+#include <vector>
+#include <avr/pgmspace.h>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HIGH          1
+#define LOW           0
+#define INPUT         0
+#define OUTPUT        1
+#define INPUT_PULLUP  2
+#define CHANGE        1
+#define FALLING       2
+#define RISING        3
+#define DEC           10
+#define HEX           16
+#define PI            3.1415926535897932384626433832795
+
+#define F(s)          (reinterpret_cast<const __FlashStringHelper *>(PSTR(s)))
+#define _BV(b)        (1U << (b))
+
+#define min(a, b)     ((a) < (b) ? (a) : (b))
+#define max(a, b)     ((a) > (b) ? (a) : (b))
+#define constrain(x, lo, hi)  ((x) < (lo) ? (lo) : ((x) > (hi) ? (hi) : (x)))
+
+//Vectors are plain functions the model calls, see host.h
+#define ISR(vector, ...)      extern "C" void vector(void) __VA_ARGS__; extern "C" void vector(void)
+#define ISR_ALIASOF(target)   __attribute__((alias(HOST_STR(target))))
+#define HOST_STR(s)           HOST_STR_X(s)
+#define HOST_STR_X(s)         #s
+
+//--------------------------------------------------------------------------------
+// Registers
+//--------------------------------------------------------------------------------
+
+#define HOST_REGS(X) \
+  X(PORTB, uint8_t) X(DDRB, uint8_t) X(PINB, uint8_t) \
+  X(PORTD, uint8_t) X(DDRD, uint8_t) X(PIND, uint8_t) \
+  X(PORTE, uint8_t) X(DDRE, uint8_t) X(PINE, uint8_t) \
+  X(PORTH, uint8_t) X(DDRH, uint8_t) X(PINH, uint8_t) \
+  X(PORTL, uint8_t) X(DDRL, uint8_t) X(PINL, uint8_t) \
+  X(TCCR1A, uint8_t) X(TCCR1B, uint8_t) X(TIMSK1, uint8_t) X(TIFR1, uint8_t) \
+  X(TCNT1, uint16_t) X(ICR1, uint16_t) X(OCR1A, uint16_t) \
+  X(TCCR3A, uint8_t) X(TCCR3B, uint8_t) X(TIMSK3, uint8_t) X(TIFR3, uint8_t) \
+  X(TCNT3, uint16_t) \
+  X(TCCR4A, uint8_t) X(TCCR4B, uint8_t) X(TIMSK4, uint8_t) X(TIFR4, uint8_t) \
+  X(TCNT4, uint16_t) X(ICR4, uint16_t) X(OCR4A, uint16_t) \
+  X(TCCR5A, uint8_t) X(TCCR5B, uint8_t) X(TIMSK5, uint8_t) X(TIFR5, uint8_t) \
+  X(TCNT5, uint16_t) X(ICR5, uint16_t) \
+  X(EICRA, uint8_t) X(EICRB, uint8_t) X(EIMSK, uint8_t) X(EIFR, uint8_t) \
+  X(PCICR, uint8_t) X(PCIFR, uint8_t) X(PCMSK0, uint8_t) \
+  X(UCSR2B, uint8_t) X(SREG, uint8_t)
+
+#define HOST_REG_ID(name, type)   reg_##name,
+enum hostRegId { HOST_REGS(HOST_REG_ID) host_regs };
+#undef HOST_REG_ID
+
+//In host.h
+unsigned hostRead(int reg);
+void hostWrite(int reg, unsigned value);
+
+template <class T, int R> struct HostReg {
+  operator T() const { return hostRead(R); }
+  HostReg &operator=(unsigned v) { hostWrite(R, (T)v); return *this; }
+  HostReg &operator=(const HostReg &r) { return *this = (unsigned)(T)r; }
+  HostReg &operator|=(unsigned v) { return *this = (T)(hostRead(R) | v); }
+  HostReg &operator&=(unsigned v) { return *this = (T)(hostRead(R) & v); }
+  HostReg &operator^=(unsigned v) { return *this = (T)(hostRead(R) ^ v); }
+  HostReg &operator+=(unsigned v) { return *this = (T)(hostRead(R) + v); }
+  HostReg &operator-=(unsigned v) { return *this = (T)(hostRead(R) - v); }
+};
+
+#define HOST_REG_DEF(name, type)  inline HostReg<type, reg_##name> name;
+HOST_REGS(HOST_REG_DEF)
+#undef HOST_REG_DEF
+
+//Bit numbers, from the ATmega2560 datasheet
+enum {
+  PORTB4 = 4, PORTB5 = 5, DDB4 = 4, DDB5 = 5, PINB6 = 6, PINB7 = 7,
+  PIND0 = 0, PIND1 = 1, PIND2 = 2, PIND3 = 3,
+  PINE4 = 4, PINE5 = 5,
+  PORTH3 = 3, PORTH4 = 4, DDH3 = 3, DDH4 = 4,
+  PINL1 = 1,
+  WGM10 = 0, WGM11 = 1, COM1A0 = 6, COM1A1 = 7, WGM12 = 3, WGM13 = 4, CS10 = 0, CS11 = 1, CS12 = 2,
+  TOIE1 = 0, OCIE1A = 1, TOV1 = 0, OCF1A = 1,
+  COM3A0 = 6, CS30 = 0, TOIE3 = 0, TOV3 = 0,
+  WGM41 = 1, COM4A0 = 6, COM4A1 = 7, WGM42 = 3, WGM43 = 4, CS40 = 0, CS41 = 1, CS42 = 2,
+  TOIE4 = 0, OCIE4A = 1, TOV4 = 0, OCF4A = 1,
+  CS50 = 0, ICES5 = 6, ICNC5 = 7, TOIE5 = 0, ICIE5 = 5, TOV5 = 0, ICF5 = 5,
+  ISC00 = 0, ISC01 = 1, ISC10 = 2, ISC11 = 3, ISC40 = 0, ISC41 = 1, ISC50 = 2, ISC51 = 3,
+  INT0 = 0, INT1 = 1, INT2 = 2, INT3 = 3, INT4 = 4, INT5 = 5,
+  INTF0 = 0, INTF4 = 4, INTF5 = 5,
+  PCIE0 = 0, PCIF0 = 0, PCINT6 = 6, PCINT7 = 7,
+  UDRIE2 = 5,
+  SREG_I = 7
+};
+
+//--------------------------------------------------------------------------------
+// Core functions, in host.h
+//--------------------------------------------------------------------------------
+
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void pinMode(uint8_t pin, uint8_t mode);
+int digitalRead(uint8_t pin);
+void digitalWrite(uint8_t pin, uint8_t value);
+long random(long howbig);
+long random(long howsmall, long howbig);
+void randomSeed(unsigned long seed);
+
+inline void noInterrupts(void) { SREG &= ~_BV(SREG_I); }
+inline void interrupts(void) { SREG |= _BV(SREG_I); }
+#define cli()   noInterrupts()
+#define sei()   interrupts()
+
+//--------------------------------------------------------------------------------
+// Serial ports
+//--------------------------------------------------------------------------------
+
+// Bytes written go into out, and the port only takes as many as a real 64 byte
+// buffer draining at the baud rate would have room for (availableForWrite()).
+// write() with no room waits, like the real one, by moving the model's time on,
+// and so does polling availableForWrite() while it's 0.  waits counts both, so a
+// test can tell whether loop() ever stood waiting for a port.  A test puts bytes
+// in in for the sketch to read.
+
+class HostSerial {
+public:
+  std::string out;                    //Everything sent
+  std::string in;                     //Waiting to be read
+  long baud = 0;
+  bool echo = false;                  //Copy what's sent to stdout
+  double tx_free = 0;                 //Model time in cycles the buffer is empty
+  unsigned long waits = 0;
+
+  void begin(long b) { baud = b; }
+  void end(void) {}
+  operator bool() const { return true; }
+  int available(void) { return in.size(); }
+  int peek(void) { return in.empty() ? -1 : (byte)in[0]; }
+  int read(void) {
+    if (in.empty())
+      return -1;
+    byte c = in[0];
+    in.erase(0, 1);
+    return c;
+  }
+  size_t readBytes(char *buf, size_t n) {
+    size_t i = 0;
+    while (i < n && !in.empty())
+      buf[i++] = read();
+    return i;
+  }
+  int availableForWrite(void);
+  void flush(void);
+  size_t write(uint8_t c);
+  size_t write(const uint8_t *buf, size_t n) { for (size_t i = 0; i < n; i++) write(buf[i]); return n; }
+  size_t write(const char *buf, size_t n) { return write((const uint8_t *)buf, n); }
+  size_t write(const char *s) { return write(s, strlen(s)); }
+
+  size_t print(const char *s) { return write(s); }
+  size_t print(const __FlashStringHelper *s) { return write((const char *)s); }
+  size_t print(const std::string &s) { return write(s.data(), s.size()); }
+  size_t print(char c) { return write((uint8_t)c); }
+  size_t print(unsigned char n, int base = DEC) { return print((unsigned long)n, base); }
+  size_t print(int n, int base = DEC) { return print((long)n, base); }
+  size_t print(unsigned int n, int base = DEC) { return print((unsigned long)n, base); }
+  size_t print(long n, int base = DEC) {
+    if (base == DEC)
+      return printf_("%ld", n);
+    return print((unsigned long)(uint32_t)n, base);
+  }
+  size_t print(unsigned long n, int base = DEC) {
+    return base == HEX ? printf_("%lX", n) : printf_("%lu", n);
+  }
+  size_t print(long long n, int base = DEC) { return print((long)n, base); }
+  size_t print(unsigned long long n, int base = DEC) { return print((unsigned long)n, base); }
+  size_t print(double d, int digits = 2) { return printf_("%.*f", digits, d); }
+
+  template <class T> size_t println(T v) { return print(v) + println(); }
+  template <class T> size_t println(T v, int f) { return print(v, f) + println(); }
+  size_t println(void) { return write("\r\n"); }
+
+  //Take what's been sent so far
+  std::string take(void) { std::string s = out; out.clear(); return s; }
+
+private:
+  size_t printf_(const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+};
+
+inline HostSerial Serial;
+inline HostSerial Serial1;
+inline HostSerial Serial2;
+
+#endif
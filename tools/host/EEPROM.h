@@ -0,0 +1,65 @@
+//Host stand-in for the EEPROM library.  A byte write takes 3.3ms of model time,
+//like the real one, and eeprom_is_ready() says when it's done.  A test can make
+//the power fail at the Nth byte written, with that byte left erased or half
+//programmed, see test_journal.cpp.
+
+#ifndef __HOST_EEPROM_H
+#define __HOST_EEPROM_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define HOST_EEPROM_SIZE    4096
+#define HOST_EEPROM_WRITE   52800ULL    //Cycles for a byte, 3.3ms at 16Mhz
+
+//In host.h
+unsigned long long hostNow(void);
+
+enum hostTear {
+  tear_none,                //The byte isn't touched
+  tear_erased,              //The erase finished but not the write, 0xFF
+  tear_partial              //Only some of the bits that go to 0 got there
+};
+
+class EEPROMClass {
+public:
+  uint8_t store[HOST_EEPROM_SIZE];
+  uint8_t *mem = store;                 //A test can point it at shared memory
+  long writes = 0;                      //Bytes written
+  long cut = -1;                        //Write at which the power fails, or -1
+  hostTear tear = tear_none;
+  void (*power_fail)(void) = 0;         //What happens then, it mustn't return
+  unsigned long long busy_until = 0;
+
+  EEPROMClass() { memset(store, 0xFF, sizeof(store)); }
+  uint8_t read(int a) { return mem[a]; }
+  void write(int a, uint8_t v) {
+    if (writes == cut) {
+      if (tear == tear_erased)
+        mem[a] = 0xFF;
+      else if (tear == tear_partial)
+        mem[a] = v | 0x5A;
+      power_fail();
+    }
+    mem[a] = v;
+    writes++;
+    busy_until = hostNow() + HOST_EEPROM_WRITE;
+  }
+  void update(int a, uint8_t v) {
+    if (mem[a] != v)
+      write(a, v);
+  }
+  uint16_t length(void) { return HOST_EEPROM_SIZE; }
+  template <class T> T &get(int a, T &t) { memcpy(&t, mem + a, sizeof(T)); return t; }
+  template <class T> const T &put(int a, const T &t) {
+    for (size_t i = 0; i < sizeof(T); i++)
+      update(a + i, ((const uint8_t *)&t)[i]);
+    return t;
+  }
+};
+
+inline EEPROMClass EEPROM;
+
+inline bool eeprom_is_ready(void) { return hostNow() >= EEPROM.busy_until; }
+
+#endif
@@ -0,0 +1,34 @@
+//Host stand-in for avr/pgmspace.h.  There's one address space, so flash is RAM.
+
+#ifndef __HOST_PGMSPACE_H
+#define __HOST_PGMSPACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+class __FlashStringHelper;
+
+template <class T> inline T pgmRead(const void *a) {
+  T v;
+  memcpy(&v, a, sizeof(v));
+  return v;
+}
+
+#define PROGMEM
+#define PSTR(s)                 (s)
+#define PGM_P                   const char *
+#define pgm_read_byte(a)        (*(const uint8_t *)(a))
+#define pgm_read_word(a)        pgmRead<uint16_t>(a)
+#define pgm_read_dword(a)       pgmRead<uint32_t>(a)
+#define pgm_read_ptr(a)         pgmRead<void *>(a)
+#define memcpy_P                memcpy
+#define strcmp_P                strcmp
+#define strncmp_P               strncmp
+#define strcpy_P                strcpy
+#define strncpy_P               strncpy
+#define strlen_P                strlen
+#define sprintf_P               sprintf
+#define snprintf_P              snprintf
+
+#endif
@@ -0,0 +1,817 @@
+// Copyright (c) 2020 Jon Bryan
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+//================================================================================
+//
+//  Host machine model
+//
+//  Runs the sketch on the PC against a model of the parts of the Mega it uses:
+//  the spindle timebase (TC3, or TC5 with SPINDLE_ICP), the step timers TC4 and
+//  TC1 in Fast PWM Mode 14, the external and pin change interrupts, a quadrature
+//  encoder with an index pulse on the spindle, and the serial ports.  Time is in
+//  16Mhz cycles, and moves on event by event, so a test can run minutes of lathe
+//  time in well under a second.
+//
+//  A test includes this, then the sketch as sketch.py puts it together, then has
+//  its own main().  It calls setup() and loop() itself, turns the spindle with
+//  host_spindle, and looks at the sketch's globals and at what the model saw on
+//  the pins: host_t4.pos counts the step pulses TC4 put out, signed by the DIR
+//  pin, the way the driver would, and host_t1.pos the same for the cross-slide.
+//
+//  The sketch's own code runs in no time.  An interrupt is taken when its flag
+//  is set, it's enabled and the CPU isn't in another one, highest priority first
+//  as on the chip.  The handler keeps the CPU for its cost from HOST_ENTRY cycles
+//  after that, and its code runs head cycles into that time, all at once.  Both
+//  are 0 unless a test sets them (els_sim does).  head is where the handler does
+//  the thing whose timing matters, like starting the step timer at the end of the
+//  spindle interrupt.  Edges and compares that come while the CPU is busy set
+//  their flags and wait, and one that comes while its flag is still set is lost,
+//  which is what the lost counts are.  Nothing interrupts the sketch's loop()
+//  code part way through, so ATOMIC_BLOCK() only has to keep SREG right.
+//
+//================================================================================
+
+#ifndef __HOST_H
+#define __HOST_H
+
+#include <Arduino.h>
+#include <EEPROM.h>
+#include <stdarg.h>
+
+#define HOST_NEVER      (~0ULL)
+#define HOST_ENTRY      7                     //Cycles from the flag to the handler, with the JMP
+#define HOST_MS(ms)     ((unsigned long long)((ms) * 16000ULL))
+#define HOST_US(us)     ((unsigned long long)((us) * 16ULL))
+#define HOST_SEC(s)     ((unsigned long long)((s) * 16000000.0))
+
+//The sketch's, and whichever vectors it has
+void setup(void);
+void loop(void);
+extern "C" {
+void INT0_vect(void) __attribute__((weak));
+void INT4_vect(void) __attribute__((weak));
+void INT5_vect(void) __attribute__((weak));
+void PCINT0_vect(void) __attribute__((weak));
+void TIMER1_COMPA_vect(void) __attribute__((weak));
+void TIMER3_OVF_vect(void) __attribute__((weak));
+void TIMER4_COMPA_vect(void) __attribute__((weak));
+void TIMER5_CAPT_vect(void) __attribute__((weak));
+void TIMER5_OVF_vect(void) __attribute__((weak));
+}
+
+//--------------------------------------------------------------------------------
+// Checks
+//--------------------------------------------------------------------------------
+
+inline int host_checks = 0;
+inline int host_failures = 0;
+
+#define CHECK(cond, ...) do { \
+    host_checks++; \
+    if (!(cond)) { \
+      host_failures++; \
+      printf("%s:%d: CHECK(%s) failed: ", __FILE__, __LINE__, #cond); \
+      printf(__VA_ARGS__); \
+      printf("\n"); \
+    } \
+  } while (0)
+
+inline int hostDone(const char *name) {
+  //Report and give main() its exit status
+
+  if (host_failures)
+    printf("%s: %d of %d checks FAILED\n", name, host_failures, host_checks);
+  else
+    printf("%s: %d checks ok\n", name, host_checks);
+  return host_failures ? 1 : 0;
+}
+
+//--------------------------------------------------------------------------------
+// Time and interrupts
+//--------------------------------------------------------------------------------
+
+inline unsigned long long host_now = 0;         //Cycles since reset
+inline unsigned long long host_cpu_free = 0;    //When the handler that's running finishes
+inline unsigned long long host_next_ovf = 0x10000;  //The timebase's next overflow
+inline bool host_in_isr = false;
+inline unsigned host_reg[host_regs];
+
+inline unsigned long long hostNow(void) { return host_now; }
+
+//In priority order, as the ATmega2560 vector table
+enum hostIrqId {
+  irq_int0,                 //Knob
+  irq_int4,                 //SPINDLE_B, with SPINDLE_X4 or the encoder diagnostics
+  irq_int5,                 //SPINDLE_A
+  irq_pcint0,               //SPINDLE_Z and ALARM
+  irq_timer1,               //Cross-slide steps
+  irq_timer3_ovf,           //Timebase
+  irq_timer4,               //Leadscrew steps
+  irq_timer5_capt,          //SPINDLE_A with SPINDLE_ICP
+  irq_timer5_ovf,           //Timebase with SPINDLE_ICP
+  host_irqs
+};
+
+struct HostIrq {
+  const char *name;
+  void (*vect)(void);
+  bool flag = false;
+  unsigned long long flag_t = 0;                  //When it was set
+  std::function<unsigned(void)> cost = nullptr;   //Cycles the handler keeps the CPU
+  std::function<unsigned(void)> head = nullptr;   //Cycles into that before its code runs
+
+  unsigned long n = 0;                            //Times taken
+  unsigned long lost = 0;                         //Set again before it was taken
+  unsigned long long busy = 0;                    //Cycles spent in it
+  unsigned long long latency_max = 0;             //Flag to handler
+  unsigned cost_max = 0;
+};
+
+inline HostIrq host_irq[host_irqs] = {
+  { "INT0" ,        INT0_vect },
+  { "INT4",         INT4_vect },
+  { "INT5",         INT5_vect },
+  { "PCINT0",       PCINT0_vect },
+  { "TIMER1_COMPA", TIMER1_COMPA_vect },
+  { "TIMER3_OVF",   TIMER3_OVF_vect },
+  { "TIMER4_COMPA", TIMER4_COMPA_vect },
+  { "TIMER5_CAPT",  TIMER5_CAPT_vect },
+  { "TIMER5_OVF",   TIMER5_OVF_vect },
+};
+
+inline void hostFlag(int irq) {
+  //Hardware set an interrupt flag
+
+  HostIrq &q = host_irq[irq];
+
+  if (q.flag)
+    q.lost++;
+  q.flag = true;
+  q.flag_t = host_now;
+}
+
+inline bool hostEnabled(int irq) {
+  //The interrupt's enable bit, as the sketch left it
+
+  switch (irq) {
+    case irq_int0:          return host_reg[reg_EIMSK] & _BV(INT0);
+    case irq_int4:          return host_reg[reg_EIMSK] & _BV(INT4);
+    case irq_int5:          return host_reg[reg_EIMSK] & _BV(INT5);
+    case irq_pcint0:        return host_reg[reg_PCICR] & _BV(PCIE0);
+    case irq_timer1:        return host_reg[reg_TIMSK1] & _BV(OCIE1A);
+    case irq_timer3_ovf:    return host_reg[reg_TIMSK3] & _BV(TOIE3);
+    case irq_timer4:        return host_reg[reg_TIMSK4] & _BV(OCIE4A);
+    case irq_timer5_capt:   return host_reg[reg_TIMSK5] & _BV(ICIE5);
+    case irq_timer5_ovf:    return host_reg[reg_TIMSK5] & _BV(TOIE5);
+  }
+  return false;
+}
+
+inline void hostResetStats(void) {
+  //Clear the interrupt counts, not the flags
+
+  for (HostIrq &q : host_irq) {
+    q.n = q.lost = 0;
+    q.busy = q.latency_max = 0;
+    q.cost_max = 0;
+  }
+}
+
+//--------------------------------------------------------------------------------
+// TC1 and TC4, Fast PWM Mode 14 at 2Mhz, pulses on OCnA
+//--------------------------------------------------------------------------------
+
+// The counter runs from BOTTOM to ICRn and back to BOTTOM, or on to 0xFFFF first
+// if it's been put above TOP.  The inverted output goes low at BOTTOM, which is
+// the start of a step pulse, and high again at OCRnA, which sets the compare
+// flag.  pos counts the pulses the driver gets, down with DIR high.
+
+struct HostPwm {
+  int irq;
+  int dir_reg;
+  byte dir_bit;
+  uint16_t icr = 0, ocr = 0;
+  bool run = false;
+  unsigned long long ref_t = 0;         //The counter was ref_cnt at ref_t
+  unsigned ref_cnt = 0;
+
+  long pos = 0;                         //Pulses, signed by DIR
+  unsigned long pulses = 0;
+  unsigned long long last_pulse = HOST_NEVER;
+  unsigned long long gap_min = HOST_NEVER;  //Shortest time between pulses
+  long long slack_min = 1LL << 40;      //Least time from the handler's head to the pulse that was next
+
+  unsigned advance(unsigned c, unsigned long long k) const {
+    //The count k ticks on from c
+    if (c > icr) {
+      unsigned long long d = 0x10000 - c;
+      if (k < d)
+        return c + k;
+      k -= d;
+      c = 0;
+    }
+    return (c + k) % ((unsigned long long)icr + 1);
+  }
+
+  unsigned long long ticks(void) const {
+    return run ? (host_now - ref_t) / 8 : 0;
+  }
+
+  unsigned count(void) const {
+    return advance(ref_cnt, ticks());
+  }
+
+  void rebase(void) {
+    //Move the reference up to now, keeping the prescaler's phase
+    unsigned long long k = ticks();
+    ref_cnt = advance(ref_cnt, k);
+    ref_t = run ? ref_t + k * 8 : host_now;
+  }
+
+  unsigned long long until(unsigned c, unsigned target) const {
+    //Ticks from c until the counter next becomes target
+    if (c > icr) {
+      unsigned long long d = 0x10000 - c;
+      return target == 0 ? d : d + target;
+    }
+    if (target > c)
+      return target - c;
+    return icr + 1 - c + target;
+  }
+
+  unsigned long long due(unsigned target) const {
+    //When the counter next becomes target.  That can be the tick now, if
+    //something else happened at the same time and it hasn't been seen to yet.
+    unsigned long long k = ticks();
+    if (k == 0)
+      return ref_t + until(ref_cnt, target) * 8;
+    return ref_t + (k - 1 + until(advance(ref_cnt, k - 1), target)) * 8;
+  }
+
+  unsigned long long next(bool *bottom) const {
+    //When the next pulse starts or ends
+    if (!run)
+      return HOST_NEVER;
+    unsigned long long b = due(0), m = ocr <= icr ? due(ocr) : HOST_NEVER;
+    *bottom = b <= m;
+    return *bottom ? b : m;
+  }
+
+  unsigned long long nextPulse(void) const {
+    //When the next pulse starts
+    return run ? due(0) : HOST_NEVER;
+  }
+
+  void event(bool bottom) {
+    //The counter got to BOTTOM or OCRnA
+    ref_cnt = bottom ? 0 : ocr;
+    ref_t = host_now;
+    if (bottom) {
+      if (host_reg[dir_reg] & _BV(dir_bit))
+        pos--;
+      else
+        pos++;
+      pulses++;
+      if (last_pulse != HOST_NEVER && host_now - last_pulse < gap_min)
+        gap_min = host_now - last_pulse;
+      last_pulse = host_now;
+    } else {
+      hostFlag(irq);
+    }
+  }
+
+  void setCount(unsigned v) { rebase(); ref_cnt = v; ref_t = host_now; }
+  void setTop(unsigned v) { rebase(); icr = v; }
+  void setCompare(unsigned v) { rebase(); ocr = v; }
+  void setClock(byte tccrb) {
+    rebase();
+    run = (tccrb & 7) != 0;
+    ref_t = host_now;
+  }
+};
+
+inline HostPwm host_t4 = { irq_timer4, reg_PORTH, PORTH4 };
+inline HostPwm host_t1 = { irq_timer1, reg_PORTB, PORTB4 };
+
+//--------------------------------------------------------------------------------
+// Pins
+//--------------------------------------------------------------------------------
+
+inline int hostSense(int n) {
+  //INTn's sense bits
+  return n < 4 ? (host_reg[reg_EICRA] >> (2 * n)) & 3 : (host_reg[reg_EICRB] >> (2 * (n - 4))) & 3;
+}
+
+inline void hostExtEdge(int n, int irq, bool level) {
+  //An edge on INTn's pin
+
+  int sense = hostSense(n);
+
+  if (sense == 1 || (sense == 2 && !level) || (sense == 3 && level))
+    hostFlag(irq);
+}
+
+inline void hostPin(int reg, byte bit, bool level) {
+  //Drive an input pin from outside
+
+  unsigned was = host_reg[reg];
+
+  if (level)
+    host_reg[reg] |= _BV(bit);
+  else
+    host_reg[reg] &= ~_BV(bit);
+  if (host_reg[reg] == was)
+    return;
+
+  if (reg == reg_PINE && bit == 4)
+    hostExtEdge(4, irq_int4, level);
+  else if (reg == reg_PINE && bit == 5)
+    hostExtEdge(5, irq_int5, level);
+  else if (reg == reg_PIND && bit == 0)
+    hostExtEdge(0, irq_int0, level);
+  else if (reg == reg_PINB && (host_reg[reg_PCMSK0] & _BV(bit)))
+    hostFlag(irq_pcint0);
+  else if (reg == reg_PINL && bit == 1 && (host_reg[reg_TCCR5B] & 7) &&
+           level == ((host_reg[reg_TCCR5B] & _BV(ICES5)) != 0)) {
+    host_reg[reg_ICR5] = host_now & 0xFFFF;
+    hostFlag(irq_timer5_capt);
+  }
+}
+
+inline bool hostPinGet(int reg, byte bit) {
+  return host_reg[reg] & _BV(bit);
+}
+
+//Where the Arduino pin numbers the sketch uses are, see Pins.h
+inline bool hostPinMap(uint8_t pin, int *reg, byte *bit) {
+  switch (pin) {
+    case 2:   *reg = reg_PINE; *bit = 4; return true;
+    case 3:   *reg = reg_PINE; *bit = 5; return true;
+    case 12:  *reg = reg_PINB; *bit = 6; return true;
+    case 13:  *reg = reg_PINB; *bit = 7; return true;
+    case 18:  *reg = reg_PIND; *bit = 3; return true;
+    case 19:  *reg = reg_PIND; *bit = 2; return true;
+    case 20:  *reg = reg_PIND; *bit = 1; return true;
+    case 21:  *reg = reg_PIND; *bit = 0; return true;
+    case 48:  *reg = reg_PINL; *bit = 1; return true;
+  }
+  return false;
+}
+
+//--------------------------------------------------------------------------------
+// Spindle encoder
+//--------------------------------------------------------------------------------
+
+// q counts quadrature states, 4 to a line, up for CCW: A falls with B high.
+// The A phase is on pin 3, or pin 48 with SPINDLE_ICP, and B on pin 2.  Z is
+// low for z_width states once a revolution, from q = z_at.  rpm is signed, or
+// profile gives it against time in seconds, and with no edges due the model
+// looks at it again every millisecond so the spindle can start from rest.
+
+struct HostSpindle {
+  double rpm = 0;
+  std::function<double(double)> profile;
+  int ppr = 800;
+  double jitter = 0;                    //Each gap is off by up to this fraction either way
+  long long q = 0;
+  int z_at = 0;
+  int z_width = 2;
+  bool z_on = true;
+  unsigned long long next = HOST_NEVER;
+  unsigned long edges = 0;
+  unsigned long seed = 1;
+
+  int a_reg(void) const {
+#ifdef SPINDLE_ICP
+    return reg_PINL;
+#else
+    return reg_PINE;
+#endif
+  }
+  byte a_bit(void) const {
+#ifdef SPINDLE_ICP
+    return 1;
+#else
+    return 5;
+#endif
+  }
+
+  double rand1(void) {
+    seed = seed * 1103515245UL + 12345UL;
+    return ((seed >> 8) & 0xFFFFFF) / 16777216.0;
+  }
+
+  void drive(void) {
+    //Put the pins where q says
+    static const byte a[4] = { 1, 0, 0, 1 }, b[4] = { 1, 1, 0, 0 };
+    int s = (int)(((q % 4) + 4) % 4);
+    long long rev = 4LL * ppr;
+    long long at = ((q - z_at) % rev + rev) % rev;
+
+    hostPin(reg_PINE, 4, b[s]);
+    hostPin(a_reg(), a_bit(), a[s]);
+    hostPin(reg_PINB, 6, !(z_on && at < z_width));
+  }
+
+  void schedule(void) {
+    //When the next edge is, or when to look at the speed again
+    double r = profile ? profile(host_now / 16e6) : rpm;
+    if (fabs(r) < 0.01) {
+      next = host_now + HOST_MS(1);
+      return;
+    }
+    double gap = 16e6 * 60.0 / (fabs(r) * ppr * 4);
+    if (jitter)
+      gap *= 1 + jitter * (2 * rand1() - 1);
+    next = host_now + (unsigned long long)(gap < 1 ? 1 : gap);
+  }
+
+  void start(void) {
+    drive();
+    schedule();
+  }
+
+  void event(void) {
+    double r = profile ? profile(host_now / 16e6) : rpm;
+    if (fabs(r) >= 0.01) {
+      q += r > 0 ? 1 : -1;
+      edges++;
+      drive();
+    }
+    schedule();
+  }
+};
+
+inline HostSpindle host_spindle;
+
+//--------------------------------------------------------------------------------
+// Scheduled actions
+//--------------------------------------------------------------------------------
+
+struct HostAt {
+  unsigned long long t;
+  std::function<void(void)> fn;
+};
+
+inline std::vector<HostAt> host_at;
+
+inline void hostAt(unsigned long long t, std::function<void(void)> fn) {
+  //Do something to the hardware at t, like glitching a pin
+  host_at.push_back({ t, fn });
+}
+
+//--------------------------------------------------------------------------------
+// The event loop
+//--------------------------------------------------------------------------------
+
+enum hostEventKind { ev_none, ev_spindle, ev_overflow, ev_t4, ev_t1, ev_at };
+
+inline unsigned long long hostNext(int *kind, bool *bottom, size_t *at) {
+  //The next hardware event
+
+  unsigned long long t = HOST_NEVER, e;
+  bool b;
+
+  *kind = ev_none;
+  if (host_spindle.next < t) {
+    t = host_spindle.next;
+    *kind = ev_spindle;
+  }
+  if (host_next_ovf < t) {
+    t = host_next_ovf;
+    *kind = ev_overflow;
+  }
+  if ((e = host_t4.next(&b)) < t) {
+    t = e;
+    *kind = ev_t4;
+    *bottom = b;
+  }
+  if ((e = host_t1.next(&b)) < t) {
+    t = e;
+    *kind = ev_t1;
+    *bottom = b;
+  }
+  for (size_t i = 0; i < host_at.size(); i++)
+    if (host_at[i].t < t) {
+      t = host_at[i].t;
+      *kind = ev_at;
+      *at = i;
+    }
+  return t;
+}
+
+inline void hostAdvance(unsigned long long until) {
+  //Let the hardware run up to until without taking interrupts
+
+  int kind;
+  bool bottom = false;
+  size_t at = 0;
+  unsigned long long t;
+
+  while ((t = hostNext(&kind, &bottom, &at)) <= until) {
+    if (t > host_now)
+      host_now = t;
+    switch (kind) {
+      case ev_spindle:
+        host_spindle.event();
+        break;
+      case ev_overflow:
+        host_next_ovf += 0x10000;
+        if (host_reg[reg_TCCR3B] & 7)
+          hostFlag(irq_timer3_ovf);
+        if (host_reg[reg_TCCR5B] & 7)
+          hostFlag(irq_timer5_ovf);
+        break;
+      case ev_t4:
+        host_t4.event(bottom);
+        break;
+      case ev_t1:
+        host_t1.event(bottom);
+        break;
+      case ev_at: {
+        std::function<void(void)> fn = host_at[at].fn;
+        host_at.erase(host_at.begin() + at);
+        fn();
+        break;
+      }
+    }
+  }
+  if (until > host_now && until != HOST_NEVER)
+    host_now = until;
+}
+
+inline void hostSlack(HostPwm &p, unsigned long long n, unsigned long long head) {
+  //How long before the pulse that was next when its handler was taken the
+  //handler got to the step timer.  Negative is a period written too late.
+
+  if (n != HOST_NEVER && (long long)(n - head) < p.slack_min)
+    p.slack_min = (long long)(n - head);
+}
+
+inline bool hostDispatch(void) {
+  //Take the highest priority interrupt that's waiting, if the CPU is free
+
+  if (host_in_isr || host_cpu_free > host_now || !(host_reg[reg_SREG] & _BV(SREG_I)))
+    return false;
+  for (int i = 0; i < host_irqs; i++) {
+    HostIrq &q = host_irq[i];
+
+    if (!q.flag || !hostEnabled(i))
+      continue;
+    q.flag = false;
+    if (host_now - q.flag_t > q.latency_max)
+      q.latency_max = host_now - q.flag_t;
+    unsigned long long entry = host_now + HOST_ENTRY;
+    unsigned cost = q.cost ? q.cost() : 0;
+    unsigned head = q.head ? min(q.head(), cost) : 0;
+    unsigned long long pulse = i == irq_timer4 ? host_t4.nextPulse() :
+                               i == irq_timer1 ? host_t1.nextPulse() : HOST_NEVER;
+    hostAdvance(entry + head);
+    host_in_isr = true;
+    host_reg[reg_SREG] &= ~_BV(SREG_I);
+    if (q.vect)
+      q.vect();
+    host_reg[reg_SREG] |= _BV(SREG_I);
+    host_in_isr = false;
+    q.n++;
+    q.busy += HOST_ENTRY + cost;
+    if (cost > q.cost_max)
+      q.cost_max = cost;
+    host_cpu_free = entry + cost;
+    if (i == irq_timer4)
+      hostSlack(host_t4, pulse, entry + head);
+    else if (i == irq_timer1)
+      hostSlack(host_t1, pulse, entry + head);
+    return true;
+  }
+  return false;
+}
+
+inline void hostRun(unsigned long long until) {
+  //Run the hardware and the interrupts up to until
+
+  int kind;
+  bool bottom;
+  size_t at;
+
+  for (;;) {
+    while (hostDispatch())
+      ;
+    unsigned long long t = hostNext(&kind, &bottom, &at);
+    if (host_cpu_free > host_now && host_cpu_free < t)
+      t = host_cpu_free;
+    if (t > until)
+      break;
+    hostAdvance(t);
+  }
+  if (until > host_now)
+    host_now = until;
+}
+
+inline void hostFor(unsigned long long cycles) {
+  hostRun(host_now + cycles);
+}
+
+inline void hostLoop(unsigned long long cycles, unsigned long long pass = HOST_US(200)) {
+  //Run loop() every pass cycles for a while, with everything else going on
+
+  unsigned long long end = host_now + cycles;
+
+  while (host_now < end) {
+    hostRun(min(host_now + pass, end));
+    while (host_cpu_free > host_now)
+      hostRun(host_cpu_free);
+    loop();
+  }
+}
+
+inline void hostLoopUntil(std::function<bool(void)> done, unsigned long long limit,
+                          unsigned long long pass = HOST_US(200)) {
+  //Run loop() until done() or limit cycles have gone by
+
+  unsigned long long end = host_now + limit;
+
+  while (!done() && host_now < end)
+    hostLoop(pass, pass);
+}
+
+//--------------------------------------------------------------------------------
+// Registers
+//--------------------------------------------------------------------------------
+
+inline unsigned hostRead(int reg) {
+  switch (reg) {
+    case reg_TCNT1:   return host_t1.count();
+    case reg_ICR1:    return host_t1.icr;
+    case reg_OCR1A:   return host_t1.ocr;
+    case reg_TCNT4:   return host_t4.count();
+    case reg_ICR4:    return host_t4.icr;
+    case reg_OCR4A:   return host_t4.ocr;
+    case reg_TCNT3:
+    case reg_TCNT5:   return host_now & 0xFFFF;
+    case reg_TIFR1:   return host_irq[irq_timer1].flag ? _BV(OCF1A) : 0;
+    case reg_TIFR3:   return host_irq[irq_timer3_ovf].flag ? _BV(TOV3) : 0;
+    case reg_TIFR4:   return host_irq[irq_timer4].flag ? _BV(OCF4A) : 0;
+    case reg_TIFR5:
+      return (host_irq[irq_timer5_ovf].flag ? _BV(TOV5) : 0) |
+             (host_irq[irq_timer5_capt].flag ? _BV(ICF5) : 0);
+    case reg_EIFR:
+      return (host_irq[irq_int0].flag ? _BV(INTF0) : 0) |
+             (host_irq[irq_int4].flag ? _BV(INTF4) : 0) |
+             (host_irq[irq_int5].flag ? _BV(INTF5) : 0);
+    case reg_PCIFR:   return host_irq[irq_pcint0].flag ? _BV(PCIF0) : 0;
+  }
+  return host_reg[reg];
+}
+
+inline void hostWrite(int reg, unsigned v) {
+  switch (reg) {
+    case reg_TCNT1:   host_t1.setCount(v); return;
+    case reg_ICR1:    host_t1.setTop(v); return;
+    case reg_OCR1A:   host_t1.setCompare(v); return;
+    case reg_TCCR1B:  host_reg[reg] = v; host_t1.setClock(v); return;
+    case reg_TCNT4:   host_t4.setCount(v); return;
+    case reg_ICR4:    host_t4.setTop(v); return;
+    case reg_OCR4A:   host_t4.setCompare(v); return;
+    case reg_TCCR4B:  host_reg[reg] = v; host_t4.setClock(v); return;
+    case reg_TCNT3:
+    case reg_TCNT5:
+    case reg_PINB:
+    case reg_PIND:
+    case reg_PINE:
+    case reg_PINH:
+    case reg_PINL:    return;
+    //Writing a one clears a flag
+    case reg_TIFR1:   if (v & _BV(OCF1A)) host_irq[irq_timer1].flag = false; return;
+    case reg_TIFR3:   if (v & _BV(TOV3)) host_irq[irq_timer3_ovf].flag = false; return;
+    case reg_TIFR4:   if (v & _BV(OCF4A)) host_irq[irq_timer4].flag = false; return;
+    case reg_TIFR5:
+      if (v & _BV(TOV5))
+        host_irq[irq_timer5_ovf].flag = false;
+      if (v & _BV(ICF5))
+        host_irq[irq_timer5_capt].flag = false;
+      return;
+    case reg_EIFR:
+      if (v & _BV(INTF0))
+        host_irq[irq_int0].flag = false;
+      if (v & _BV(INTF4))
+        host_irq[irq_int4].flag = false;
+      if (v & _BV(INTF5))
+        host_irq[irq_int5].flag = false;
+      return;
+    case reg_PCIFR:   if (v & _BV(PCIF0)) host_irq[irq_pcint0].flag = false; return;
+  }
+  host_reg[reg] = v;
+}
+
+//--------------------------------------------------------------------------------
+// The Arduino core
+//--------------------------------------------------------------------------------
+
+inline unsigned long host_random = 1;
+
+unsigned long millis(void) { return host_now / 16000; }
+unsigned long micros(void) { return host_now / 16; }
+void delay(unsigned long ms) { hostRun(host_now + HOST_MS(ms)); }
+void delayMicroseconds(unsigned int us) { hostRun(host_now + HOST_US(us)); }
+void pinMode(uint8_t, uint8_t) {}
+void digitalWrite(uint8_t, uint8_t) {}
+int digitalRead(uint8_t pin) {
+  int reg;
+  byte bit;
+
+  return hostPinMap(pin, &reg, &bit) && hostPinGet(reg, bit) ? HIGH : LOW;
+}
+long random(long howbig) {
+  host_random = host_random * 1103515245UL + 12345UL;
+  return howbig > 0 ? (long)((host_random >> 16) % howbig) : 0;
+}
+long random(long howsmall, long howbig) {
+  return howsmall >= howbig ? howsmall : howsmall + random(howbig - howsmall);
+}
+void randomSeed(unsigned long seed) { host_random = seed; }
+
+inline unsigned long long hostByte(const HostSerial *s) {
+  //Cycles to send a byte, 10 bits
+  return s->baud ? 160000000ULL / s->baud : 0;
+}
+
+int HostSerial::availableForWrite(void) {
+  //Something polling a full buffer is waiting for it, so time goes by
+
+  unsigned long long b = hostByte(this);
+  long queued = b && tx_free > host_now ? (long)((tx_free - host_now + b - 1) / b) : 0;
+
+  if (queued >= 63 && !host_in_isr) {
+    waits++;
+    hostRun(host_now + HOST_US(10));
+  }
+  return queued >= 63 ? 0 : 63 - queued;
+}
+
+void HostSerial::flush(void) {
+  if (tx_free > host_now && !host_in_isr)
+    hostRun((unsigned long long)tx_free);
+}
+
+size_t HostSerial::write(uint8_t c) {
+  unsigned long long b = hostByte(this);
+
+  if (b && !host_in_isr && tx_free > host_now + 62 * b) {
+    waits++;
+    hostRun((unsigned long long)tx_free - 62 * b);
+  }
+  if (b)
+    tx_free = (tx_free > host_now ? tx_free : host_now) + b;
+  out += (char)c;
+  if (echo)
+    putchar(c);
+  return 1;
+}
+
+size_t HostSerial::printf_(const char *fmt, ...) {
+  char buf[64];
+  va_list ap;
+
+  va_start(ap, fmt);
+  int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+  return write(buf, n);
+}
+
+//--------------------------------------------------------------------------------
+// Power on
+//--------------------------------------------------------------------------------
+
+inline void hostReset(void) {
+  //Pins where the pullups leave them, the spindle stopped, interrupts on
+
+  host_reg[reg_PINB] = 0xFF;
+  host_reg[reg_PIND] = 0xFF;
+  host_reg[reg_PINE] = 0xFF;
+  host_reg[reg_PINL] = 0xFF;
+  host_reg[reg_SREG] = _BV(SREG_I);
+  host_spindle.drive();
+}
+
+//Before main()
+inline bool host_reset_done = (hostReset(), true);
+
+#endif
@@ -0,0 +1,89 @@
+#!/bin/bash
+#
+# Build and run the host tests, and els_sim as a regression test.
+#
+# Each test_*.cpp here is built once for every "//  Flags:" line at its top,
+# with those -D flags (an empty line is the default build), and its exit status
+# says whether it passed.  els_sim is run with -check over the feed tables, so it
+# fails if the sketch can't do a speed maxRPM() allows with the estimated costs.
+# The speeds stop at 1200rpm, where the estimated spindle interrupt is already
+# most of a tick, and the encoder jitter is kept small, since the overspeed hold
+# looks ahead and 2% jitter is enough for it to trip within 2% of the limit.
+# els_profile is built against the sketch's headers and has to pass the default
+# profile, with and without STEP_DDA.
+#
+#   tools/host/run_tests.sh [test name ...]
+#
+# Everything is built in tools/host/build, with -Wall -Wextra, and a warning is
+# to be fixed, not left.  Only -Wformat-truncation is off: cutting the string
+# short is what snprintf is there for, and the host's 64-bit long makes the
+# worst case longer than the sketch's.  The exit status is the number of things
+# that failed.
+
+here=$(cd "$(dirname "$0")" && pwd)
+sketch=$(cd "$here/../../AtomicELS_V1/ArduinoAtomicELS_V1/AtomicELS" && pwd)
+build="$here/build"
+cxx="${CXX:-g++} -std=gnu++17 -O2 -Wall -Wextra -Wno-format-truncation -I$here -I$build -I$sketch"
+failed=0
+
+mkdir -p "$build"
+python3 "$here/sketch.py" "$sketch" > "$build/sketch.cpp" || exit 1
+
+run() {
+  #run name binary args...
+  local name=$1
+  shift
+  if "$@" > "$build/$name.log" 2>&1; then
+    echo "pass  $name"
+  else
+    echo "FAIL  $name (see $build/$name.log)"
+    failed=$((failed + 1))
+  fi
+}
+
+tests=("$@")
+if [ ${#tests[@]} -eq 0 ]; then
+  for f in "$here"/test_*.cpp; do
+    [ -e "$f" ] && tests+=("$(basename "$f" .cpp)")
+  done
+  tests+=(els_sim els_profile)
+fi
+
+for t in "${tests[@]}"; do
+  if [ "$t" = els_sim ]; then
+    if $cxx -o "$build/els_sim" "$here/../els_sim.cpp"; then
+      for table in inch metric module; do
+        run "els_sim_$table" "$build/els_sim" -table $table -rpm 100:1200:100 -revs 5 -jitter 0.005 -check
+      done
+    else
+      echo "FAIL  els_sim (doesn't build)"
+      failed=$((failed + 1))
+    fi
+    continue
+  fi
+  if [ "$t" = els_profile ]; then
+    if $cxx -o "$build/els_profile" "$here/../els_profile.cpp"; then
+      run els_profile "$build/els_profile" /dev/null
+      run els_profile_dda "$build/els_profile" -dda -x4 /dev/null
+    else
+      echo "FAIL  els_profile (doesn't build)"
+      failed=$((failed + 1))
+    fi
+    continue
+  fi
+
+  #The configurations, one per Flags: line, or just the default
+  mapfile -t configs < <(sed -n 's|^//  Flags:\s*||p' "$here/$t.cpp")
+  [ ${#configs[@]} -eq 0 ] && configs=("")
+  for flags in "${configs[@]}"; do
+    name=$t$(echo "$flags" | sed 's/-D/_/g; s/ //g' | tr 'A-Z' 'a-z')
+    if $cxx $flags -o "$build/$name" "$here/$t.cpp"; then
+      run "$name" "$build/$name"
+    else
+      echo "FAIL  $name (doesn't build)"
+      failed=$((failed + 1))
+    fi
+  done
+done
+
+exit $failed
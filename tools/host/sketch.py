@@ -0,0 +1,52 @@
+#!/usr/bin/env python3
+#
+# Put the sketch together as one C++ file, the way the Arduino builder does, for
+# the host tests and els_sim.  AtomicELS.ino goes first and the other .ino files
+# follow in name order, with a prototype for every function in them after the
+# main file's #includes, so they can be called before they're defined.
+#
+#   python3 sketch.py [sketch directory] > sketch.cpp
+#
+# The directory defaults to the sketch in this repository.
+
+import os
+import re
+import sys
+
+here = os.path.dirname(os.path.abspath(__file__))
+sketch = sys.argv[1] if len(sys.argv) > 1 else os.path.join(
+    here, '..', '..', 'AtomicELS_V1', 'ArduinoAtomicELS_V1', 'AtomicELS')
+sketch = os.path.abspath(sketch)
+
+main = os.path.join(sketch, 'AtomicELS.ino')
+others = sorted(f for f in os.listdir(sketch) if f.endswith('.ino') and f != 'AtomicELS.ino')
+
+parts = [(main, open(main).read())]
+parts += [(os.path.join(sketch, f), open(os.path.join(sketch, f)).read()) for f in others]
+
+# A function definition at the start of a line: return type, name, arguments, {
+definition = re.compile(
+    r'^((?:const\s+)?(?:(?:unsigned|signed|long|short)\s+)*[A-Za-z_]\w*(?:\s*\*)?\s+\**\s*'
+    r'([A-Za-z_]\w*)\s*\(([^;{)]*(?:\([^)]*\)[^;{)]*)*)\))\s*\{', re.M)
+keywords = {'if', 'while', 'for', 'switch', 'return', 'sizeof', 'ISR'}
+
+prototypes = []
+for path, text in parts:
+    for m in definition.finditer(text):
+        if m.group(2) in keywords or m.group(1).startswith(('static', 'inline')):
+            continue
+        #Default arguments only go in the first declaration
+        prototypes.append(re.sub(r'\s*=\s*[^,)]+', '', m.group(1).strip()) + ';')
+
+out = ['#include <Arduino.h>']
+text = parts[0][1]
+first = text.find('\n', text.rfind('#include', 0, text.find('void setup')))
+out.append('#line 1 "%s"' % main)
+out.append(text[:first + 1])
+out.extend(prototypes)
+out.append('#line %d "%s"' % (text.count('\n', 0, first + 1) + 1, main))
+out.append(text[first + 1:])
+for path, text in parts[1:]:
+    out.append('#line 1 "%s"' % path)
+    out.append(text)
+sys.stdout.write('\n'.join(out) + '\n')
@@ -0,0 +1,262 @@
+// Copyright (c) 2020 Jon Bryan
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+//================================================================================
+//
+//  Host test: cross-slide from the CROSS page
+//
+//  See Cross.h.  Everything is done the way the operator does it, with touch
+//  frames for the CROSS page buttons and number frames answering the "get"s.
+//  The cross-slide is zeroed and jogged out and back, and its pulses have to
+//  come to the position.  A taper is set, and the cross-slide has to follow the
+//  carriage at exactly the ratio while a feed is cut, and come back to where it
+//  started when the carriage is jogged back.  Limits set at the cross-slide's
+//  position have to hold the feed, and clearing them lets it go on.  Facing
+//  has to move the cross-slide at the feed per rev with the leadscrew still,
+//  and be held by the limits the same way.
+//  Buttons pressed with the spindle turning, and numbers out of range, have to
+//  be refused, turning the button red until it's let go, and the debug port
+//  commands still have to work.
+//
+//  Flags:    -DCROSS_SLIDE
+//  Flags:    -DCROSS_SLIDE -DSTEP_DDA
+//
+//================================================================================
+
+#include <climits>
+#include "host.h"
+#include "sketch.cpp"
+
+#define RPM         200
+#define CROSS_PAGE  4
+
+int xdir;                           //host_t1.pos against cross, 1 or -1
+long xpos0;                         //host_t1.pos less xdir * cross, which mustn't change
+
+std::string frame(byte id, bool press) {
+  std::string f("\x65", 1);
+  f += (char)CROSS_PAGE;
+  f += (char)id;
+  f += (char)press;
+  return f + NX_END;
+}
+
+std::string number(long value) {
+  std::string f("\x71", 1);
+  for (int i = 0; i < 4; i++)
+    f += (char)(value >> (8 * i));
+  return f + NX_END;
+}
+
+std::string sentFor(unsigned long long cycles) {
+  //What went to the display over a while, which can be behind a page's worth
+  //of fields after a touch
+  std::string sent;
+  unsigned long long end = host_now + cycles;
+
+  while (host_now < end) {
+    hostLoop(HOST_MS(1));
+    sent += Serial2.take();
+  }
+  return sent;
+}
+
+bool press(byte id, long a = LONG_MIN, long b = LONG_MIN) {
+  //Press a button, answer what it asks for, and let it go.  True if it
+  //wasn't turned red.
+
+  Serial2.take();
+  Serial2.in += frame(id, true);
+  std::string sent = sentFor(HOST_MS(300));
+  if (sent.find("get " CROSS_N) != std::string::npos)
+    Serial2.in += number(a);
+  if (sent.find("get " CROSS_D) != std::string::npos)
+    Serial2.in += number(b);
+  if (sent.find("get " CROSS_JOG) != std::string::npos)
+    Serial2.in += number(a);
+  sent += sentFor(HOST_MS(100));
+  Serial2.in += frame(id, false);
+  std::string released = sentFor(HOST_MS(100));
+  bool red = sent.find("_btn.bco2=RED") != std::string::npos;
+  CHECK(!red || released.find("_btn.bco2=1024") != std::string::npos, "button %d wasn't put back", id);
+  return !red;
+}
+
+bool shows(const char *field, const char *value) {
+  //The field was last set to value
+  for (int i = 0; i < NX_FIELDS; i++) {
+    if (strcmp(nx_fields[i].name, field) == 0)
+      return strcmp(nx_value[i], value) == 0;
+  }
+  return false;
+}
+
+long crossNow(void) {
+  long x;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    x = cross;
+  }
+  return x;
+}
+
+void settle(void) {
+  //Until the cross-slide has caught up, and check its pulses did too
+  hostLoopUntil([] { return !(TCCR1B & _BV(CS11)); }, HOST_SEC(5));
+  CHECK(!(TCCR1B & _BV(CS11)) && cross == cross_target, "the cross-slide didn't get there (%ld, %ld)", cross,
+        cross_target);
+  CHECK(host_t1.pos - xdir * cross == xpos0, "%ld pulses for a position of %ld", host_t1.pos - xpos0, cross);
+}
+
+void spindle(int rpm) {
+  host_spindle.rpm = rpm;
+  if (rpm)
+    hostLoopUntil([] { return synced && step_hold == hold_none; }, HOST_SEC(2));
+  else
+    hostLoopUntil([] { return spinRateGet() == SPINDLE_STOPPED && !synced; }, HOST_SEC(2));
+}
+
+long long ratioFloor(long long k) {
+  //Where the taper puts the cross-slide after k leadscrew steps, the accumulator
+  //being the exact fraction rounded down
+  long long num = k * cross_n * X_LSPI, den = (long long)cross_d * machine.lspi;
+  return num >= 0 ? num / den : -((-num + den - 1) / den);
+}
+
+int main(void) {
+  setup();
+  host_spindle.ppr = machine.encoder_ppr;
+  host_spindle.start();
+  feed_index[inch_feed] = INCHES / 3;
+  feedSelect(inch_feed);
+  hostLoop(HOST_MS(300));
+
+  //Zero, and jog out and back
+  CHECK(shows("cross.mode.txt", "OFF") && shows("cross.min.txt", "-----"), "the page wasn't filled in");
+  CHECK(press(xzero_btn), "ZERO refused");
+  xpos0 = host_t1.pos;
+  CHECK(press(xplus_btn, 250), "OUT refused");
+  hostLoopUntil([] { return !(TCCR1B & _BV(CS11)); }, HOST_SEC(5));
+  xdir = host_t1.pos - xpos0 > 0 ? 1 : -1;
+  settle();
+  CHECK(cross == crossSteps(250), "jogged to %ld, not %ld", cross, crossSteps(250));
+  hostLoop(HOST_MS(100));
+  CHECK(shows("cross.x.txt", " 0.250"), "the position isn't on the page");
+  CHECK(press(xminus_btn, 250), "IN refused");
+  settle();
+  CHECK(cross == 0, "jogged back to %ld", cross);
+  CHECK(!press(xplus_btn, CROSS_THOU_MAX + 1), "an over-long jog was taken");
+  CHECK(!press(xtaper_btn, 1, 0), "a taper over 0 was taken");
+  CHECK(cross_mode == cross_off, "mode %d after a refused taper", cross_mode);
+
+  //A 1:4 taper cut with a feed, and the carriage jogged back
+  CHECK(press(xtaper_btn, 1, 4), "TAPER refused");
+  CHECK(cross_mode == cross_taper && cross_n == 1 && cross_d == 4, "taper %d %d:%d", cross_mode, cross_n, cross_d);
+  CHECK(shows("cross.mode.txt", "TAPER 1:4"), "the mode isn't on the page");
+  long lead0 = leadscrewGet();
+  spindle(RPM);
+  CHECK(!press(xoff_btn), "OFF taken with the spindle turning");
+  CHECK(!press(xzero_btn), "ZERO taken with the spindle turning");
+  CHECK(cross_mode == cross_taper, "the mode changed with the spindle turning");
+  long worst = 0;
+  unsigned long long end = host_now + HOST_SEC(2);
+  while (host_now < end) {
+    hostLoop(HOST_MS(1));
+    worst = max(worst, labs(crossNow() - (long)ratioFloor(leadscrewGet() - lead0)));
+  }
+  spindle(0);
+  settle();
+  long fed = leadscrewGet() - lead0;
+  printf("taper: %ld leadscrew steps, cross-slide at %ld, %ld steps behind at worst\n", fed, cross, worst);
+  CHECK(labs(fed) > steps_per_rev, "only %ld steps fed", fed);
+  CHECK(cross == ratioFloor(fed), "taper at %ld, not %lld", cross, ratioFloor(fed));
+  CHECK(worst <= CROSS_LAG_MAX, "%ld steps behind", worst);
+  jogStart(fed > 0, labs(fed));
+  hostLoopUntil([] { return !jogging; }, HOST_SEC(10));
+  settle();
+  CHECK(leadscrewGet() == lead0 && cross == 0, "jogged back to %ld with the cross-slide at %ld",
+        leadscrewGet() - lead0, cross);
+
+  //Limits 0.010" either side hold the feed, and FREE lets it go
+  CHECK(press(xminus_btn, 10) && press(xmin_btn), "MIN refused");
+  CHECK(press(xplus_btn, 20) && press(xmax_btn), "MAX refused");
+  CHECK(press(xminus_btn, 10), "IN refused");
+  settle();
+  CHECK(cross_limited && cross_min == -crossSteps(10) && cross_max == crossSteps(10), "limits %ld %ld",
+        cross_min, cross_max);
+  CHECK(shows("cross.min.txt", "-0.010") && shows("cross.max.txt", " 0.010"), "the limits aren't on the page");
+  host_spindle.rpm = RPM;
+  hostLoopUntil([] { return step_hold == hold_cross; }, HOST_SEC(5));
+  CHECK(step_hold == hold_cross, "not held at the limit (hold %d)", step_hold);
+  hostLoop(HOST_MS(500));
+  CHECK(cross >= cross_min && cross <= cross_max && cross_target >= cross_min && cross_target <= cross_max,
+        "past a limit at %ld", cross_target);
+  CHECK(press(xfree_btn), "FREE refused");
+  CHECK(!cross_limited && shows("cross.max.txt", "-----"), "the limits weren't cleared");
+  hostLoopUntil([] { return step_hold == hold_none && synced; }, HOST_SEC(5));
+  hostLoop(HOST_SEC(1));
+  CHECK(step_hold == hold_none && labs(crossNow()) > crossSteps(20), "the feed didn't go on (hold %d, at %ld)",
+        step_hold, crossNow());
+  spindle(0);
+  settle();
+
+  //Facing, the other way
+  CHECK(press(xface_btn, -3), "FACE refused");
+  CHECK(cross_mode == cross_face && cross_n == -1, "face %d %d", cross_mode, cross_n);
+  CHECK(shows("cross.mode.txt", "FACE -"), "the mode isn't on the page");
+  long pulses = host_t4.pos;
+  spindle(RPM);
+  long long q0 = host_spindle.q;
+  long xs = crossNow();
+  hostLoop(HOST_SEC(2));
+  double revs = fabs((double)(host_spindle.q - q0)) / (4.0 * host_spindle.ppr);
+  double want = revs * steps_per_rev * X_LSPI / machine.lspi;
+  double got = labs(crossNow() - xs);
+  spindle(0);
+  settle();
+  printf("face: %.2f revs, %.0f cross-slide steps for %.0f\n", revs, got, want);
+  CHECK(host_t4.pos == pulses, "the leadscrew moved %ld steps", host_t4.pos - pulses);
+  CHECK(fabs(got - want) <= steps_per_rev * X_LSPI / machine.lspi / SCPR + CROSS_LAG_MAX, "fed %.0f steps, not %.0f",
+        got, want);
+
+  //Limits 0.010" either side hold facing too
+  CHECK(press(xminus_btn, 10) && press(xmin_btn), "MIN refused");
+  CHECK(press(xplus_btn, 20) && press(xmax_btn), "MAX refused");
+  CHECK(press(xminus_btn, 10), "IN refused");
+  settle();
+  host_spindle.rpm = RPM;
+  hostLoopUntil([] { return step_hold == hold_cross; }, HOST_SEC(5));
+  CHECK(step_hold == hold_cross, "facing not held at the limit (hold %d)", step_hold);
+  hostLoop(HOST_MS(500));
+  CHECK(cross >= cross_min && cross <= cross_max && cross_target >= cross_min && cross_target <= cross_max,
+        "faced past a limit to %ld", cross_target);
+  CHECK(press(xfree_btn), "FREE refused");
+  spindle(0);
+  settle();
+  CHECK(host_t4.pos == pulses, "the leadscrew moved %ld steps", host_t4.pos - pulses);
+
+  //And back off from the debug port
+  Serial.take();
+  Serial.in += "xoff\n";
+  hostLoop(HOST_MS(50));
+  CHECK(Serial.take().find("ok") != std::string::npos && cross_mode == cross_off, "xoff didn't work");
+  CHECK(shows("cross.mode.txt", "OFF"), "xoff isn't on the page");
+
+  return hostDone("test_cross");
+}
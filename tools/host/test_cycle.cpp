@@ -0,0 +1,210 @@
+// Copyright (c) 2020 Jon Bryan
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+//================================================================================
+//
+//  Host test: multi-pass threading cycle
+//
+//  See ThreadCycle.h.  With the spindle turning, the cycle is started from the
+//  display the way the operator does it, the depth and passes are answered, and
+//  CYCLE is pressed again each time it stops for the tool to be retracted.
+//  Every pass has to start at the same encoder position, and put out exactly
+//  the same steps over its first revolutions, which with a pitch that isn't a
+//  whole number of steps a revolution means the DDA remainder has to be put back
+//  too.  Each has to end at the limit, the return has to take no longer than the
+//  planner's trapezoid does over that distance, and the cycle has to finish
+//  after the last pass.  That's done both ways, for a
+//  table pitch and a custom one.
+//
+//  Flags:
+//  Flags:    -DSTEP_DDA
+//  Flags:    -DSTEP_DDA -DSPINDLE_X4
+//  Flags:    -DSTEP_CONTINUOUS
+//
+//================================================================================
+
+#include <vector>
+#include "host.h"
+#include "sketch.cpp"
+
+#define PASSES      4
+#define PASS_REVS   3               //Length of the thread in revolutions
+#define RPM         200
+
+struct PASS {
+  long long q;                      //Encoder position it started at, in the revolution
+  long pos;                         //Driver position then
+  long first;                       //Steps over the first revolutions
+  double feed_s, return_s;          //How long the pass and the return took
+};
+
+std::vector<PASS> passes;
+
+std::string touch(byte id) {
+  std::string f("\x65\x01", 2);
+  f += (char)id;
+  f += (char)1;
+  return f + NX_END;
+}
+
+std::string number(long value) {
+  std::string f("\x71", 1);
+  for (int i = 0; i < 4; i++)
+    f += (char)(value >> (8 * i));
+  return f + NX_END;
+}
+
+double rapidTime(long steps) {
+  //JOG_ACCEL up to the top speed and back down, or as far up as half the
+  //way allows
+  double v0 = 2000000.0 / ICR4_MAX, v1 = 2000000.0 / PLAN_MIN_PERIOD;
+  double up = (v1 * v1 - v0 * v0) / (2.0 * JOG_ACCEL);
+
+  if (steps < 2 * up)
+    return 2 * (sqrt(v0 * v0 + JOG_ACCEL * steps) - v0) / JOG_ACCEL;
+  return 2 * (v1 - v0) / JOG_ACCEL + (steps - 2 * up) / v1;
+}
+
+void runCycle(const char *what) {
+  //Start a cycle from the start limit and follow it to the end
+
+  long long rev = 4LL * host_spindle.ppr, first_q = 0;
+  unsigned long long t = host_now, returning = host_now, next_loop = host_now;
+  bool was_synced = synced, measuring = false, left = FEEDING_LEFT;
+  int state = cycle_state;
+  PASS p = {};
+
+  passes.clear();
+  Serial2.in += touch(cycle_btn);
+  hostLoop(HOST_MS(50));
+  CHECK(cycle_state == cycle_setup, "%s: the cycle didn't ask for the numbers (%d)", what, cycle_state);
+  Serial2.in += number(1234) + number(PASSES);
+
+  while (host_now - t < HOST_SEC(60)) {
+    hostFor(HOST_US(2));
+    if (synced && !was_synced) {
+      p.q = ((host_spindle.q % rev) + rev) % rev;
+      p.pos = host_t4.pos;
+      p.feed_s = host_now / 16e6;
+      first_q = host_spindle.q;
+      measuring = true;
+    }
+    was_synced = synced;
+    if (measuring && llabs(host_spindle.q - first_q) >= rev * PASS_REVS / 2) {
+      p.first = host_t4.pos - p.pos;
+      measuring = false;
+    }
+    if (cycle_state != state) {
+      if (cycle_state == cycle_retract) {
+        p.feed_s = host_now / 16e6 - p.feed_s;
+        passes.push_back(p);
+        CHECK(leadscrewGet() == (left ? left_limit : right_limit), "%s: pass %d ended at %ld", what,
+              (int)passes.size(), leadscrewGet());
+        hostLoop(HOST_MS(300));     //The operator backs the tool out
+        Serial2.in += touch(cycle_btn);
+      }
+      if (cycle_state == cycle_return)
+        returning = host_now;
+      if (state == cycle_return)
+        p.return_s = (host_now - returning) / 16e6;
+      if (cycle_state == cycle_idle && state == cycle_feed) {
+        p.feed_s = host_now / 16e6 - p.feed_s;
+        passes.push_back(p);
+        break;
+      }
+      state = cycle_state;
+    }
+    if (host_now >= next_loop) {
+      while (host_cpu_free > host_now)
+        hostRun(host_cpu_free);
+      loop();
+      next_loop = host_now + HOST_US(200);
+    }
+  }
+
+  printf("%s: %d passes of %ld steps, first at %lld, %.2fs feeding, %.2fs returning, %.2fs for a rapid\n", what,
+         (int)passes.size(), passes.empty() ? 0 : passes[0].first, passes.empty() ? 0 : passes[0].q,
+         passes.empty() ? 0 : passes[0].feed_s, passes.size() < 2 ? 0 : passes[1].return_s,
+         passes.empty() ? 0 : rapidTime(labs(passes[0].first) * PASS_REVS * 2 / 3));
+  CHECK(passes.size() == PASSES, "%s: %d passes", what, (int)passes.size());
+  CHECK(cycle_state == cycle_idle && !jogging, "%s: cycle state %d at the end", what, cycle_state);
+  CHECK(leadscrewGet() == (left ? left_limit : right_limit), "%s: finished at %ld", what, leadscrewGet());
+  for (size_t i = 1; i < passes.size(); i++) {
+    CHECK(passes[i].q == passes[0].q, "%s: pass %d started at %lld, not %lld", what, (int)i + 1, passes[i].q,
+          passes[0].q);
+    CHECK(passes[i].first == passes[0].first, "%s: pass %d put out %ld steps, not %ld", what, (int)i + 1,
+          passes[i].first, passes[0].first);
+    //The ramp's levels make it up to 15% slower than the exact acceleration,
+    //as in test_planner
+    double rapid = rapidTime(labs(passes[i].first) * PASS_REVS * 2 / 3);
+    CHECK(passes[i].return_s < 1.15 * rapid + 0.1, "%s: the return took %.2fs, a rapid %.2fs", what,
+          passes[i].return_s, rapid);
+  }
+}
+
+void toggle(bool left) {
+  //Throw the direction switch and let it go
+  hostPin(reg_PIND, left ? 3 : 2, false);
+  hostLoop(HOST_MS(100));
+  hostPin(reg_PIND, left ? 3 : 2, true);
+  hostLoop(HOST_MS(100));
+}
+
+void threadBoth(const char *what) {
+  //Limits a thread's length from here the way it's feeding, and a cycle each way
+
+  long lead = leadscrewGet(), length = (long)PASS_REVS * steps_per_rev;
+
+  host_spindle.rpm = 0;
+  hostLoop(HOST_MS(200));
+  toggle(false);
+  host_spindle.rpm = RPM;
+  hostLoop(HOST_MS(200));
+  left_limit = FEEDING_LEFT ? lead - length : lead;
+  right_limit = left_limit + length;
+  left_limited = right_limited = true;
+  hostLoop(HOST_SEC(1));
+  runCycle(what);
+
+  //And back the other way after the switch is thrown, which the cycle
+  //has to leave alone while it's stopped
+  toggle(true);
+  hostLoop(HOST_SEC(1));
+  runCycle(what);
+}
+
+int main(void) {
+  setup();
+  host_spindle.ppr = machine.encoder_ppr;
+  host_spindle.start();
+  hostLoop(HOST_MS(500));
+
+  feed_index[inch_feed] = INCHES / 3;
+  feedSelect(inch_feed);
+  threadBoth("table pitch");
+
+  CHECK(customRatio(metric_feed, 1337), "1.337mm refused");
+  custom_kind = metric_feed;
+  custom_value = 1337;
+  feedSelect(custom_feed);
+  threadBoth("1.337mm");
+
+  return hostDone("test_cycle");
+}
@@ -0,0 +1,158 @@
+// Copyright (c) 2020 Jon Bryan
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+//================================================================================
+//
+//  Host test: step accumulator against the step table
+//
+//  See TICK_STEPS in configuration.h.  For every entry in the feed tables, and
+//  steps per revolution up to CUSTOM_MAX_TICK a tick (all of them without
+//  SPINDLE_X4, DDA_STEPS spread over them with it), the steps for each spindle
+//  count have to be what the step_table[] fill in feedFill() gives, walking
+//  forward and back from anywhere ddaSync() starts it, so a revolution comes to
+//  the same total with the same biggest tick.  Without STEP_DDA that checks the
+//  table itself.
+//
+//  Then a few feeds from each table are run on the model with the spindle turning
+//  both ways, and the driver has to get exactly the steps for the revolutions.
+//
+//  Flags:
+//  Flags:    -DSTEP_DDA
+//  Flags:    -DSTEP_DDA -DSPINDLE_X4
+//
+//================================================================================
+
+#include "host.h"
+#include "sketch.cpp"
+
+#define DDA_STEPS   9000            //Most steps per revolution values to try
+
+const FEED_TABLE *tables[4] = { inch, metric, diametral, module };
+const int table_size[4] = { INCHES, METRICS, DIAMETRALS, MODULES };
+
+bool ticksMatch(int steps_per) {
+  //The steps for every spindle count, both ways from anywhere
+
+  static byte table[ENCODER_PPR_MAX * 4];
+  int i, sum = 0, total = 0, most = 0, start;
+  int spsc = steps_per / SCPR, rem = steps_per % SCPR;
+
+  //The way the table has always been filled
+  for (i = 0; i < SCPR; i++) {
+    table[i] = spsc;
+    sum += rem;
+    if (sum >= SCPR) {
+      table[i]++;
+      sum -= SCPR;
+    }
+    total += table[i];
+    most = max(most, (int)table[i]);
+  }
+  feedFill(steps_per);
+  if (total != steps_per || most != max_steps)
+    return false;
+  for (start = 0; start < SCPR; start += SCPR / 3 + 1) {
+    spin_count = start;
+    ddaSync();
+    for (i = 0; i < 2 * SCPR; i++) {
+      if (TICK_STEPS != table[spin_count])
+        return false;
+      spinModulus(true);
+    }
+    for (i = 0; i < 3 * SCPR; i++) {
+      if (TICK_STEPS != table[spin_count])
+        return false;
+      spinModulus(false);
+    }
+  }
+  return true;
+}
+
+void feedRun(int t, int i, double rpm) {
+  //Run a table feed for a few revolutions and count what the driver got
+
+  const int revs = 3;
+  FEED_TABLE f;
+  long long q, target;
+  long pos;
+  unsigned int corrections;
+
+  feedGet(tables[t], i, &f);
+  feed_index[t] = i;
+  feed_mode = (decltype(feed_mode))t;
+  feedSelect(feed_mode);
+  rpm = min(rpm, 0.5 * maxRPM(steps_per_rev));
+  hostLoop(HOST_MS(50));
+
+  //Past a Z pulse first, which puts right the count x1 decoding can gain or
+  //lose when the spindle turns round (see Index.h)
+  host_spindle.rpm = rpm;
+  hostLoop(HOST_SEC(72 / fabs(rpm)));
+  //Between trains, so every tick so far has had all its steps
+  for (unsigned long long end = host_now + HOST_MS(100); steps && host_now < end; )
+    hostFor(HOST_US(5));
+  q = host_spindle.q;
+  pos = host_t4.pos;
+  corrections = index_corrections;
+  target = q + (rpm > 0 ? 1 : -1) * 4LL * revs * host_spindle.ppr;
+
+  //Stop on the exact edge
+  hostLoopUntil([target] { return labs(target - host_spindle.q) < 8; }, HOST_SEC(revs * 60 / fabs(rpm) + 1));
+  hostLoopUntil([target] { return host_spindle.q == target; }, HOST_MS(100), HOST_US(5));
+  host_spindle.rpm = 0;
+  hostLoop(HOST_MS(100));
+
+  CHECK(host_spindle.q == target, "%s: spindle at %lld, not %lld", f.pitch, host_spindle.q, target);
+  CHECK(labs(host_t4.pos - pos) == (long)revs * steps_per_rev, "%s at %.0frpm: %ld steps in %d revolutions, not %ld",
+        f.pitch, rpm, labs(host_t4.pos - pos), revs, (long)revs * steps_per_rev);
+  CHECK(step_hold == hold_none, "%s at %.0frpm: held (%d)", f.pitch, rpm, step_hold);
+  CHECK(index_corrections == corrections, "%s at %.0frpm: the index corrected the count", f.pitch, rpm);
+}
+
+int main(void) {
+  FEED_TABLE f;
+  long n, top = (long)CUSTOM_MAX_TICK * SCPR, stride = (top + DDA_STEPS - 1) / DDA_STEPS;
+  int t, i, bad;
+
+  setup();
+
+  for (t = 0; t < 4; t++) {
+    for (i = 0; i < table_size[t]; i++) {
+      feedGet(tables[t], i, &f);
+      CHECK(ticksMatch(f.steps), "table %d entry %d (%s), %d steps", t, i, f.pitch, f.steps);
+    }
+  }
+  for (n = 1, bad = 0; n <= top; n += stride) {
+    if (!ticksMatch(n) && bad++ < 10)
+      printf("%ld steps per revolution don't match\n", n);
+  }
+  CHECK(bad == 0, "%d steps per revolution values up to %ld don't match", bad, top);
+
+  host_spindle.ppr = machine.encoder_ppr;
+  host_spindle.start();
+  for (t = 0; t < 4; t++) {
+    for (i = 0; i < table_size[t]; i += table_size[t] / 4) {
+      feedRun(t, i, 60);
+      feedRun(t, i, -60);
+    }
+  }
+
+  return hostDone("test_dda");
+}
@@ -0,0 +1,184 @@
+// Copyright (c) 2020 Jon Bryan
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+//================================================================================
+//
+//  Host test: Nextion transmit queue and field cache
+//
+//  See Display.h.  The model's Serial2 keeps every byte the sketch sends, and
+//  here they're split back into commands and played onto a pretend screen.
+//
+//  With the spindle turning at a steady speed and the leadscrew feeding, only
+//  the position goes out as it changes, with every field going out again once
+//  every NX_REFRESH, and loop() never waits for Serial2.  With Serial2 so slow
+//  that the queue fills, loop() still never waits, whole commands go out or
+//  none of it, and once things stop the screen catches up with the sketch.
+//  A touch event sends everything again.
+//
+//================================================================================
+
+#include <map>
+#include "host.h"
+#include "sketch.cpp"
+
+typedef std::map<std::string, std::string> SCREEN;
+
+SCREEN screen;                      //What the display has been told
+size_t played = 0;                  //Bytes of Serial2.out already on it
+int bad_commands = 0;
+int repeats = 0;                    //Fields sent again with the value already on the screen
+
+int play(std::map<std::string, int> *counts = NULL) {
+  //Put the commands sent since last time on the screen, and count them
+
+  std::string &out = Serial2.out;
+  size_t end;
+  int n = 0;
+
+  while ((end = out.find(NX_END, played)) != std::string::npos) {
+    std::string cmd = out.substr(played, end - played);
+    size_t eq = cmd.find('=');
+    played = end + 3;
+    n++;
+    if (cmd.find('\xFF') != std::string::npos || cmd.empty()) {
+      bad_commands++;
+      continue;
+    }
+    if (eq == std::string::npos)
+      continue;                     //page start and the like
+    std::string name = cmd.substr(0, eq), value = cmd.substr(eq + 1);
+    if (value.size() >= 2 && value.front() == '"' && value.back() == '"')
+      value = value.substr(1, value.size() - 2);
+    repeats += screen.count(name) && screen[name] == value;
+    screen[name] = value;
+    if (counts)
+      (*counts)[name]++;
+  }
+  return n;
+}
+
+unsigned long long loopRun(unsigned long long cycles) {
+  //Run loop() and return the longest any pass of it took, which is time the
+  //model went on without it, waiting for Serial2
+
+  unsigned long long end = host_now + cycles, worst = 0, start;
+
+  while (host_now < end) {
+    hostLoop(HOST_US(200), HOST_US(200));
+    start = host_now;
+    loop();
+    worst = max(worst, host_now - start);
+  }
+  return worst;
+}
+
+int fieldsSet(void) {
+  //Fields with a value, which a refresh sends again
+  int n = 0;
+
+  for (byte f = 0; f < NX_FIELDS; f++)
+    n += nx_value[f][0] != 0;
+  return n;
+}
+
+std::string leadShown(void) {
+  char str[20];
+  return leadStr(leadscrewGet(), str);
+}
+
+int main(void) {
+  std::map<std::string, int> counts;
+  unsigned long long worst;
+  size_t bytes;
+  long rate;                        //Bytes a second while feeding
+
+  setup();
+  host_spindle.ppr = machine.encoder_ppr;
+  host_spindle.start();
+  hostLoop(HOST_MS(500));
+  play();
+  CHECK(bad_commands == 0, "%d bad commands at power on", bad_commands);
+  CHECK(nx_sent == Serial2.out.size(), "%lu bytes sent, %d in Serial2", nx_sent, (int)Serial2.out.size());
+
+  //Steady speed with a feed: only what changes, and the refresh.
+  //Each refresh sends every field that has been set once more.
+  feed_index[inch_feed] = INCHES / 2;
+  feedSelect(inch_feed);
+  host_spindle.rpm = 0.5 * maxRPM(steps_per_rev);
+  hostLoop(HOST_SEC(2));
+  play();
+  bytes = Serial2.out.size();
+  repeats = 0;
+  worst = loopRun(HOST_SEC(10));
+  play(&counts);
+  rate = (Serial2.out.size() - bytes) / 10;
+  printf("feeding at %.0frpm: %.1f bytes/s, %d leadscrew updates, %d repeats\n", host_spindle.rpm,
+         (double)rate, counts["shoulder.leadscrew.txt"], repeats);
+  CHECK(repeats <= (int)(10 / (NX_REFRESH / 1000) + 1) * fieldsSet(), "%d fields sent again unchanged", repeats);
+  CHECK(counts["rpm.txt"] <= (int)(10 / (NX_REFRESH / 1000) + 1), "rpm.txt sent %d times", counts["rpm.txt"]);
+  CHECK(counts["shoulder.leadscrew.txt"] > (int)(10 * 1000 / UI_TICK / 2), "the leadscrew was only sent %d times",
+        counts["shoulder.leadscrew.txt"]);
+  CHECK(abs(atoi(screen["rpm.txt"].c_str()) - (int)host_spindle.rpm) <= 2, "the screen says %s rpm, not %.0f",
+        screen["rpm.txt"].c_str(), host_spindle.rpm);
+  CHECK(worst < HOST_US(100), "a pass waited %llu cycles", worst);
+  host_spindle.rpm = 0;
+  hostLoop(HOST_MS(200));
+  play();
+  CHECK(screen["shoulder.leadscrew.txt"] == leadShown(), "the screen says %s, not %s",
+        screen["shoulder.leadscrew.txt"].c_str(), leadShown().c_str());
+
+  //Serial2 at a tenth of what the feed needs, 10 bits to a byte, so the queue fills
+  Serial2.baud = rate;
+  host_spindle.rpm = 0.5 * maxRPM(steps_per_rev);
+  nx_peak = 0;
+  worst = loopRun(HOST_SEC(5));
+  printf("slow: queue peak %d, the longest pass %llu cycles\n", nx_peak, worst);
+  CHECK(nx_peak > NX_QUEUE - NX_SPARE - 40, "the queue only got to %d", nx_peak);
+  CHECK(worst < HOST_US(100), "a pass waited %llu cycles", worst);
+  host_spindle.rpm = 0;
+  hostLoop(HOST_SEC((NX_QUEUE + 64) / (rate / 10.0) + 3));
+  //What's already in Serial2's buffer still goes at the slow rate
+  Serial2.baud = NEXTION_BAUD;
+  hostLoopUntil([] { return nextionDepth() == 0; }, HOST_SEC(64 / (rate / 10.0) + 0.5));
+  play();
+  CHECK(nextionDepth() == 0, "%d bytes still queued", nextionDepth());
+  CHECK(bad_commands == 0, "%d commands cut short", bad_commands);
+  CHECK(nx_sent == Serial2.out.size(), "%lu bytes sent, %d in Serial2", nx_sent, (int)Serial2.out.size());
+  CHECK(screen["shoulder.leadscrew.txt"] == leadShown(), "after the queue filled the screen says %s, not %s",
+        screen["shoulder.leadscrew.txt"].c_str(), leadShown().c_str());
+  CHECK(screen["rpm.txt"] == "0", "the screen says %s rpm", screen["rpm.txt"].c_str());
+
+  //A touch sends it all again, a page may have been loaded.
+  //Stopped, the RPM only goes out on a refresh, so touch well clear of one.
+  counts.clear();
+  hostLoopUntil([&counts] { play(&counts); return counts["rpm.txt"] > 0; }, HOST_MS(NX_REFRESH + 500));
+  hostLoop(HOST_MS(NX_REFRESH / 4));
+  play();
+  counts.clear();
+  Serial2.in += std::string("\x65\x00\x63\x01" NX_END, 7);
+  hostLoop(HOST_MS(8 * UI_TICK));
+  play(&counts);
+  CHECK(counts["shoulder.leadscrew.txt"] > 0, "the leadscrew wasn't sent after a touch");
+  hostLoop(HOST_MS(UI_TICK * RPM_TICKS));
+  play(&counts);
+  CHECK(counts["rpm.txt"] > 0, "the RPM wasn't sent after a touch");
+
+  return hostDone("test_display");
+}
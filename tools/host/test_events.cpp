@@ -0,0 +1,185 @@
+// Copyright (c) 2020 Jon Bryan
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+//================================================================================
+//
+//  Host test: the interrupt to loop() event ring
+//
+//  See Events.h.  The machine model only takes interrupts between passes of
+//  loop(), so here the interrupt is a POSIX timer signal instead, which stops
+//  the sketch's code wherever it happens to be, on the same thread, the way an
+//  interrupt stops loop() on the AVR.  It's held off while SREG's I bit is clear,
+//  as in an ATOMIC_BLOCK(), and taken at the next signal after that.
+//
+//  While eventCheck() and the snapshot accessors run over and over, the signal
+//  posts bursts of knob clicks both ways, leadscrew movements and feed holds,
+//  often more than the ring holds.  Every click that eventPut() didn't count as
+//  dropped has to reach knob_count, the drops have to add up, and there's never
+//  more than one ev_steps in the ring.  The holds are flags, which are never
+//  dropped however full the ring is, so the last one always gets to loop().
+//
+//================================================================================
+
+#include <signal.h>
+#include <sys/time.h>
+#include <time.h>
+#include "host.h"
+#include "sketch.cpp"
+
+#define PREEMPTIONS   100000        //Interrupts to take
+#define PREEMPT_US    20            //Between them
+
+struct ISR_COUNTS {
+  long up, down, steps;             //Posted
+  long up_lost, down_lost, steps_lost;
+  long taken, held_off;
+  long doubled;                     //Times there were two ev_steps in the ring
+  long holds, holds_full, holds_lost;   //Feed holds posted, with the ring full, and dropped
+};
+
+volatile ISR_COUNTS isr;
+unsigned long isr_seed = 1;
+
+unsigned isrRandom(unsigned n) {
+  isr_seed = isr_seed * 1103515245UL + 12345UL;
+  return ((isr_seed >> 8) & 0xFFFFFF) % n;
+}
+
+void interrupt(int) {
+  //The interrupts, all at once
+
+  unsigned int drops;
+  int n, in_ring;
+  byte i;
+
+  if (!(host_reg[reg_SREG] & _BV(SREG_I))) {
+    isr.held_off++;
+    return;
+  }
+  isr.taken++;
+
+  for (n = 1 + isrRandom(EVENT_RING + 4); n; n--) {
+    drops = event_drops;
+    switch (isrRandom(4)) {
+      case 0:
+        eventPut(ev_knob_up);
+        isr.up++;
+        isr.up_lost += event_drops - drops;
+        break;
+      case 1:
+        eventPut(ev_knob_down);
+        isr.down++;
+        isr.down_lost += event_drops - drops;
+        break;
+      case 3:
+        eventPut(ev_hold);
+        isr.holds++;
+        isr.holds_full += ((event_head + 1) & (EVENT_RING - 1)) == event_tail;
+        isr.holds_lost += event_drops - drops;
+        break;
+      default:
+        eventSteps();
+        isr.steps++;
+        isr.steps_lost += event_drops - drops;
+        break;
+    }
+  }
+
+  for (i = event_tail, in_ring = 0; i != event_head; i = (i + 1) & (EVENT_RING - 1))
+    in_ring += event_ring[i] == ev_steps;
+  if (in_ring > 1)
+    isr.doubled++;
+}
+
+void interruptTimer(long us) {
+  //Start or stop the signal
+  struct itimerval t = { { 0, us }, { 0, us } };
+  setitimer(ITIMER_REAL, &t, NULL);
+}
+
+int main(void) {
+  struct timespec start, now;
+  long knobs = 0, holds = 0;
+  int i;
+
+  //With nothing taking them out, the ring holds one less than its size
+  for (i = 0; i < EVENT_RING + 4; i++)
+    eventPut(ev_knob_up);
+  CHECK(eventDropsGet() == 5, "%u dropped, not 5", eventDropsGet());
+  eventCheck();
+  CHECK(knob_count == EVENT_RING - 1, "knob_count %d", knob_count);
+  knob_count = 0;
+  event_drops = 0;
+
+  //A flag event still gets through when the ring is full
+  for (i = 0; i < EVENT_RING; i++)
+    eventPut(ev_knob_up);
+  eventPut(ev_hold);
+  CHECK(eventDropsGet() == 1 && event_flags, "ev_hold was dropped with the ring full");
+  eventCheck();
+  CHECK(strcmp(nx_value[nf_rpm_bco], "YELLOW") == 0 && event_flags == 0, "ev_hold didn't get to loop()");
+  nx_value[nf_rpm_bco][0] = '\0';
+  knob_count = 0;
+  event_drops = 0;
+
+  //Now with the interrupt landing anywhere in loop()'s side
+  signal(SIGALRM, interrupt);
+  interruptTimer(PREEMPT_US);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  do {
+    for (i = 0; i < 1000; i++) {
+      eventCheck();
+      knobs += knob_count;
+      knob_count = 0;
+      if (nx_value[nf_rpm_bco][0]) {
+        holds++;
+        nx_value[nf_rpm_bco][0] = '\0';
+      }
+      leadscrewGet();
+      spinRateGet();
+      faultCountGet();
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+  } while (isr.taken < PREEMPTIONS && now.tv_sec - start.tv_sec < 20);
+  interruptTimer(0);
+  signal(SIGALRM, SIG_DFL);
+  eventCheck();
+  knobs += knob_count;
+
+  holds += nx_value[nf_rpm_bco][0] != '\0';
+
+  printf("%ld interrupts, %ld held off, %ld events, %u dropped, %ld holds (%ld with the ring full) seen %ld times\n",
+         isr.taken, isr.held_off, isr.up + isr.down + isr.steps + isr.holds, event_drops, isr.holds,
+         isr.holds_full, holds);
+  CHECK(isr.taken >= PREEMPTIONS / 10, "only %ld interrupts", isr.taken);
+  CHECK(knobs == (isr.up - isr.up_lost) - (isr.down - isr.down_lost),
+        "knob_count came to %ld, not %ld", knobs, (isr.up - isr.up_lost) - (isr.down - isr.down_lost));
+  CHECK(event_drops == (unsigned)(isr.up_lost + isr.down_lost + isr.steps_lost), "drops don't add up");
+  CHECK(event_drops > 0, "the ring never filled");
+  CHECK(isr.holds_full > 0, "no hold was posted with the ring full");
+  CHECK(isr.holds_lost == 0, "%ld holds dropped", isr.holds_lost);
+  CHECK(holds > 0 && holds <= isr.holds && event_flags == 0, "holds seen %ld times, flags %02x", holds,
+        event_flags);
+  CHECK(isr.doubled == 0, "two ev_steps in the ring %ld times", isr.doubled);
+  CHECK(!steps_posted, "an ev_steps was left posted");
+  CHECK(host_reg[reg_SREG] & _BV(SREG_I), "interrupts left off");
+
+  return hostDone("test_events");
+}
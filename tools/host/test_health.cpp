@@ -0,0 +1,172 @@
+// Copyright (c) 2020 Jon Bryan
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+//================================================================================
+//
+//  Host test: encoder health monitor
+//
+//  See EncoderDiagnostics.h.  The sketch starts with the spindle stopped, which
+//  the old diagnostics wouldn't, and the spindle is then run up from 30 to
+//  600rpm with jitter, down to 150rpm and stepped between 100 and 150rpm, none
+//  of which may count as an error.  Then, a revolution apart, the A channel gets a glitch that's an
+//  extra falling edge and the interrupt for a B falling edge is lost.  Each has
+//  to be counted once against its revolution, with the timing errors it really
+//  makes: two short intervals for the extra edge, one long one for the missing
+//  edge.  With x4 decoding the spindle interrupt reads both pins, so the lost B
+//  edge turns up late at the next A edge, as a glitch: the count is right, and
+//  it's a late edge followed by an early one.  The display and the fault flag
+//  have to show it, and then go back to OK.
+//
+//  Flags:
+//  Flags:    -DSTEP_DDA -DSPINDLE_X4
+//
+//================================================================================
+
+#include "host.h"
+#include "sketch.cpp"
+
+#define FAULTS      5               //Of each kind
+
+unsigned long long gap(void) {
+  //Cycles between quadrature states
+  return (unsigned long long)(16e6 * 60.0 / (fabs(host_spindle.rpm) * host_spindle.ppr * 4));
+}
+
+void bFell(void) {
+  //Run until a B falling edge has just gone by
+  bool b = true;
+  hostLoopUntil([&b] {
+    bool was = b;
+    b = hostPinGet(reg_PINE, 4);
+    return was && !b;
+  }, HOST_MS(100), HOST_US(2));
+}
+
+void extraA(void) {
+  //A 10us glitch while A is high, half way between it rising and falling,
+  //long enough for the spindle interrupt to see it with x4 decoding.
+  //B falls, A rises a state later and falls three states later.
+  unsigned long long t;
+
+  bFell();
+  t = host_now + gap() * 3 / 2;
+  hostAt(t, [] { hostPin(host_spindle.a_reg(), host_spindle.a_bit(), false); });
+  hostAt(t + HOST_US(10), [] { hostPin(host_spindle.a_reg(), host_spindle.a_bit(), true); });
+}
+
+void missingB(void) {
+  //Lose the interrupt for the next B falling edge, four states on,
+  //masking it for only that edge
+  unsigned long long t;
+
+  bFell();
+  t = host_now + 4 * gap();
+  hostAt(t - gap() / 2, [] { host_reg[reg_EIMSK] &= ~_BV(INT4); });
+  hostAt(t + gap() / 2, [] {
+    host_irq[irq_int4].flag = false;
+    host_reg[reg_EIMSK] |= _BV(INT4);
+  });
+}
+
+std::string shown(void) {
+  //What the display was last told for the encoder's health
+  const std::string field("setup.encoder.txt=\"");
+  size_t at = Serial2.out.rfind(field);
+
+  if (at == std::string::npos)
+    return "";
+  at += field.size();
+  return Serial2.out.substr(at, Serial2.out.find('"', at) - at);
+}
+
+void clean(const char *what) {
+  //No errors of any kind so far
+  CHECK(AHealth.uiErrors == 0 && BHealth.uiErrors == 0, "%s: %u/%u timing errors", what,
+        AHealth.uiErrors, BHealth.uiErrors);
+  CHECK(uiACountErrors == 0 && uiBCountErrors == 0, "%s: %u/%u count errors", what, uiACountErrors, uiBCountErrors);
+  CHECK(!fault, "%s: fault", what);
+}
+
+int main(void) {
+  unsigned long long rev;
+  unsigned long revs;
+  int i;
+
+  setup();
+  hostLoop(HOST_MS(500));
+  CHECK(true, "started with the spindle stopped");
+
+  //Ramps, with some jitter on every edge
+  host_spindle.ppr = machine.encoder_ppr;
+  host_spindle.jitter = 0.02;
+  host_spindle.start();
+  double t0 = host_now / 16e6;
+  host_spindle.profile = [t0](double t) {
+    t -= t0;
+    if (t < 3)
+      return 30 + t / 3 * 570;
+    if (t < 6)
+      return 600 - (t - 3) / 3 * 450;
+    return 150.0;
+  };
+  hostLoop(HOST_SEC(7));
+  clean("ramps");
+  host_spindle.profile = NULL;
+  for (i = 0; i < 4; i++) {
+    host_spindle.rpm = i % 2 ? 150 : 100;
+    hostLoop(HOST_SEC(1.5));
+  }
+  clean("steps");
+  CHECK(shown() == "OK", "the display says %s", shown().c_str());
+
+  //Faults, one a revolution
+  host_spindle.jitter = 0;
+  host_spindle.rpm = 150;
+  hostLoop(HOST_SEC(1.2));
+  revs = ulRevs;
+  rev = HOST_SEC(60 / host_spindle.rpm);
+  for (i = 0; i < FAULTS; i++) {
+    extraA();
+    hostLoop(rev);
+    missingB();
+    hostLoop(rev);
+  }
+  hostLoop(HOST_MS(HEALTH_REPORT / 2));
+  printf("%lu revs, A/B timing errors %u/%u count errors %u/%u missed %ld/%ld\n", ulRevs - revs,
+         AHealth.uiErrors, BHealth.uiErrors, uiACountErrors, uiBCountErrors, lAMissed, lBMissed);
+  CHECK(uiACountErrors == FAULTS && lAMissed == -FAULTS, "%u A count errors, %ld missed", uiACountErrors, lAMissed);
+  CHECK(AHealth.uiErrors == 2 * FAULTS, "%u A timing errors", AHealth.uiErrors);
+#ifdef SPINDLE_X4
+  CHECK(quad_glitches == FAULTS, "%u quadrature glitches", quad_glitches);
+  CHECK(uiBCountErrors == 0 && lBMissed == 0, "%u B count errors, %ld missed", uiBCountErrors, lBMissed);
+  CHECK(BHealth.uiErrors == 2 * FAULTS, "%u B timing errors", BHealth.uiErrors);
+#else
+  CHECK(uiBCountErrors == FAULTS && lBMissed == FAULTS, "%u B count errors, %ld missed", uiBCountErrors, lBMissed);
+  CHECK(BHealth.uiErrors == FAULTS, "%u B timing errors", BHealth.uiErrors);
+#endif
+  CHECK(fault, "no fault");
+  CHECK(shown()[0] == 'A', "the display says %s", shown().c_str());
+
+  //Clean again
+  hostLoop(HOST_MS(2 * HEALTH_REPORT));
+  CHECK(shown() == "OK", "afterwards the display says %s", shown().c_str());
+
+  return hostDone("test_health");
+}
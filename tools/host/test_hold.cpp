@@ -0,0 +1,217 @@
+// Copyright (c) 2020 Jon Bryan
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+//================================================================================
+//
+//  Host test: step accounting and feed hold
+//
+//  See Steps.h.  A feed is engaged with nothing limiting it, and where the
+//  carriage is against the spindle is watched the whole time it's feeding.
+//  It has to stay in the groove it started in, within what a spindle count
+//  moves the carriage, through:
+//
+//    - the spindle run well past the pitch's limit and back down,
+//    - the spindle jumping straight to three times the limit,
+//    - the spindle reversing and coming back,
+//    - the driver's ALARM going active part way through a train, which has to
+//      stop the steps at once and hold until it clears.
+//
+//  Whatever holds the feed, it has to pick the groove back up by itself once
+//  it can, and the step pulses that went out always have to come to what
+//  leadscrew says.
+//
+//  Flags:
+//  Flags:    -DSTEP_DDA
+//  Flags:    -DSTEP_CONTINUOUS
+//
+//================================================================================
+
+#include "host.h"
+#include "sketch.cpp"
+
+#define SAMPLE_US   20              //How often the carriage is looked at
+
+long long q0;                       //A point on the thread
+long pos0;
+int hand;                           //Steps against counts along the thread, 1 or -1
+int dir;                            //Pulses against leadscrew, 1 or -1
+long pulses0;                       //host_t4.pos less leadscrew, which mustn't change
+
+double offThread(void) {
+  //Steps the carriage is from the thread
+  long long rev = 4LL * host_spindle.ppr;
+  double off = (host_t4.pos - pos0) - hand * (double)(host_spindle.q - q0) * steps_per_rev / rev;
+
+  off = fmod(off, steps_per_rev);
+  if (off >= steps_per_rev / 2.0)
+    off -= steps_per_rev;
+  else if (off < -steps_per_rev / 2.0)
+    off += steps_per_rev;
+  return off;
+}
+
+double within(void) {
+  //A count's steps can still be going out
+  return (double)steps_per_rev / SCPR + 1;
+}
+
+struct WATCH {
+  double worst;                     //Furthest off the thread while feeding
+  unsigned holds;                   //Holds, and the reasons
+  byte why;
+  bool resumed;                     //Feeding again at the end
+  bool counted;                     //Pulses always came to leadscrew
+};
+
+WATCH watch(unsigned long long limit) {
+  //Run with loop() every 200us, looking at the carriage whenever it's feeding
+
+  WATCH w = { 0, step_holds, hold_none, false, true };
+  unsigned long long end = host_now + limit, next_loop = host_now;
+
+  while (host_now < end) {
+    hostFor(HOST_US(SAMPLE_US));
+    if (step_hold != hold_none)
+      w.why |= 1 << step_hold;
+    if (synced && step_hold == hold_none && spinRateGet() != SPINDLE_STOPPED)
+      w.worst = max(w.worst, fabs(offThread()));
+    if (steps == 0 && host_t4.pos - dir * leadscrewGet() != pulses0)
+      w.counted = false;
+    if (host_now >= next_loop) {
+      while (host_cpu_free > host_now)
+        hostRun(host_cpu_free);
+      loop();
+      next_loop = host_now + HOST_US(200);
+    }
+  }
+  w.holds = step_holds - w.holds;
+  w.resumed = synced && step_hold == hold_none;
+  return w;
+}
+
+void report(const char *what, const WATCH &w, bool held) {
+  printf("%s: %u holds (reasons %02x), %.2f steps off the thread at worst, %.2f allowed\n", what, w.holds, w.why,
+         w.worst, within());
+  CHECK(!held || w.holds > 0, "%s: never held", what);
+  CHECK(w.resumed, "%s: not feeding at the end (hold %d, synced %d)", what, step_hold, synced);
+  CHECK(w.worst < within(), "%s: %.2f steps off the thread", what, w.worst);
+  CHECK(w.counted, "%s: the pulses didn't come to leadscrew", what);
+}
+
+int coarsest(void) {
+  //The inch feed with the most steps a tick, for trains long enough to stop part way
+  FEED_TABLE f;
+  unsigned most = 0;
+  int best = 0;
+
+  for (int i = 0; i < INCHES; i++) {
+    feedGet(inch, i, &f);
+    if (f.steps > most) {
+      best = i;
+      most = f.steps;
+    }
+  }
+  return best;
+}
+
+int main(void) {
+  int limit;
+  long long q;
+  long pos, lead;
+
+  setup();
+  feed_index[inch_feed] = coarsest();
+  feedSelect(inch_feed);
+  hostLoop(HOST_MS(300));
+  limit = maxRPM(steps_per_rev);
+  printf("%d steps per revolution, maxRPM %d\n", steps_per_rev, limit);
+
+  //Which way the pulses count against leadscrew
+  pos = host_t4.pos;
+  lead = leadscrewGet();
+  jogStart(false, 10);
+  hostLoopUntil([] { return !jogging; }, HOST_SEC(1));
+  dir = (host_t4.pos - pos) * (leadscrewGet() - lead) > 0 ? 1 : -1;
+  pulses0 = host_t4.pos - dir * leadscrewGet();
+
+  //Engaged at half the limit, and which way the carriage goes
+  host_spindle.ppr = machine.encoder_ppr;
+  host_spindle.rpm = 0.5 * limit;
+  host_spindle.start();
+  hostLoop(HOST_SEC(1));
+  CHECK(synced && step_hold == hold_none, "the feed didn't engage");
+  q = host_spindle.q;
+  pos = host_t4.pos;
+  hostLoop(HOST_SEC(1));
+  hand = (host_t4.pos > pos) == (host_spindle.q > q) ? 1 : -1;
+  hostLoopUntil([] { return steps == 0; }, HOST_MS(10), HOST_US(2));
+  q0 = host_spindle.q;
+  pos0 = host_t4.pos;
+  report("steady", watch(HOST_SEC(1)), false);
+
+  //Past the limit and back down
+  double t0 = host_now / 16e6;
+  host_spindle.profile = [limit, t0](double t) {
+    t -= t0;
+    if (t < 1)
+      return (0.5 + t) * limit;
+    if (t < 1.5)
+      return 1.5 * limit;
+    return max(0.5, 1.5 - (t - 1.5)) * limit;
+  };
+  report("run past the limit", watch(HOST_SEC(4)), true);
+  host_spindle.profile = NULL;
+
+  //Straight to three times the limit
+  host_spindle.rpm = 3.0 * limit;
+  WATCH jump = watch(HOST_MS(300));
+  host_spindle.rpm = 0.5 * limit;
+  WATCH back = watch(HOST_SEC(2));
+  back.holds += jump.holds;
+  back.why |= jump.why;
+  back.worst = max(back.worst, jump.worst);
+  report("jump to 3x", back, true);
+
+  //Reversed at speed, and back again
+  host_spindle.rpm = -0.9 * limit;
+  WATCH reverse = watch(HOST_SEC(1));
+  report("reversed", reverse, false);
+  host_spindle.rpm = 0.9 * limit;
+  report("forward again", watch(HOST_SEC(1)), false);
+
+  //ALARM part way through a train
+  hostLoopUntil([] { return steps > 1; }, HOST_MS(100), HOST_US(1));
+  CHECK(steps > 1, "no train to stop");
+  hostPin(reg_PINB, 7, ALARM_ACTIVE);
+  hostFor(HOST_US(20));
+  unsigned long pulses = host_t4.pulses;
+  CHECK(step_hold == hold_alarm && !synced && steps == 0, "ALARM didn't stop the feed (%d, %d, %d)", step_hold,
+        synced, steps);
+  WATCH alarm = watch(HOST_MS(500));
+  CHECK(host_t4.pulses == pulses, "%lu steps with ALARM active", host_t4.pulses - pulses);
+  CHECK(step_hold == hold_alarm && !synced, "the ALARM hold let go while it was active");
+  hostPin(reg_PINB, 7, !ALARM_ACTIVE);
+  WATCH after = watch(HOST_SEC(1));
+  after.holds += alarm.holds + 1;
+  after.why |= alarm.why;
+  report("ALARM", after, true);
+
+  return hostDone("test_hold");
+}
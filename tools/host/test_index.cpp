@@ -0,0 +1,350 @@
+// Copyright (c) 2020 Jon Bryan
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+//================================================================================
+//
+//  Host test: spindle index and thread pickup
+//
+//  See Index.h.  A 10 pass threading cycle is run with two extra A edges, a lost
+//  A interrupt and a noise pulse on Z in every pass, first with the Z output
+//  disconnected, where the pass starts have to wander, and then with it, where
+//  every pass has to start at the same encoder position.  The noise pulses have
+//  to be rejected, and the bad edges corrected.
+//
+//  Then the leadscrew is zeroed, the carriage jogged off the thread, and PICKUP
+//  pressed, and the feed has to engage in the thread the cycle cut.  The power
+//  is cycled the way test_journal does it, with the spindle turned by hand while
+//  it's off, and PICKUP pressed again before the first Z pulse, which has to
+//  land in the same thread.
+//
+//  Flags:
+//  Flags:    -DSTEP_DDA
+//
+//================================================================================
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+#include "host.h"
+#include "sketch.cpp"
+
+#define PASSES      10
+#define PASS_REVS   3               //Length of the thread in revolutions
+#define RPM         200
+
+enum { extra_a, lost_a, z_noise };
+
+struct FAULT {
+  double revs;                      //After the pass engages
+  int kind;
+};
+
+static const FAULT faults[] = { { 0.3, extra_a }, { 0.8, z_noise }, { 1.4, extra_a }, { 2.2, lost_a } };
+
+struct SHARED {
+  byte image[HOST_EEPROM_SIZE];     //The EEPROM at power off
+  long long q;                      //The spindle and the carriage then
+  long pos;
+  long long q0;                     //Where the thread was first engaged
+  long pos0;
+  int hand;                         //Steps against counts along the thread, 1 or -1
+  long wander;                      //Without the index
+  int checks;                       //Made by the power ons
+};
+
+SHARED *shared;
+std::vector<long long> starts;      //Encoder position each pass engaged at, in the revolution
+int noises;                         //Z noise pulses made
+
+std::string touch(byte id) {
+  std::string f("\x65\x01", 2);
+  f += (char)id;
+  f += (char)1;
+  return f + NX_END;
+}
+
+std::string number(long value) {
+  std::string f("\x71", 1);
+  for (int i = 0; i < 4; i++)
+    f += (char)(value >> (8 * i));
+  return f + NX_END;
+}
+
+int powerOn(std::function<void(void)> run) {
+  //Start the sketch from its initial globals, do something and power off.
+  //0 if nothing failed in there.
+
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    host_failures = 0;
+    run();
+    shared->checks += host_checks;
+    fflush(stdout);
+    _exit(host_failures ? 1 : 0);
+  }
+
+  int status;
+  waitpid(pid, &status, 0);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+unsigned long long gap(void) {
+  //Cycles between quadrature states
+  return (unsigned long long)(16e6 * 60.0 / (RPM * host_spindle.ppr * 4));
+}
+
+void runCycle(bool inject) {
+  //Start a cycle from the start limit and follow it to the end, with the
+  //faults in every pass
+
+  long long rev = 4LL * host_spindle.ppr;
+  unsigned long long t = host_now, engaged = 0, next_loop = host_now, restore = 0;
+  bool was_synced = synced, a_was = hostPinGet(host_spindle.a_reg(), host_spindle.a_bit()), masked = false;
+  size_t next_fault = sizeof(faults) / sizeof(faults[0]);
+  int state = cycle_state;
+
+  starts.clear();
+  Serial2.in += touch(cycle_btn);
+  hostLoop(HOST_MS(50));
+  CHECK(cycle_state == cycle_setup, "the cycle didn't ask for the numbers (%d)", cycle_state);
+  Serial2.in += number(1234) + number(PASSES);
+
+  while (host_now - t < HOST_SEC(120)) {
+    hostFor(HOST_US(2));
+    bool a = hostPinGet(host_spindle.a_reg(), host_spindle.a_bit());
+
+    if (synced && !was_synced) {
+      starts.push_back(((host_spindle.q % rev) + rev) % rev);
+      shared->q0 = host_spindle.q;
+      shared->pos0 = host_t4.pos;
+      engaged = host_now;
+      next_fault = inject ? 0 : next_fault;
+    }
+    was_synced = synced;
+
+    //The faults are made at the next A rising edge after they're due,
+    //so that the glitch is in the middle of A being high
+    if (next_fault < sizeof(faults) / sizeof(faults[0]) &&
+        host_now - engaged >= faults[next_fault].revs * rev * gap() && a && !a_was) {
+      unsigned long long at = host_now + gap() / 2;
+      long long where = ((host_spindle.q - host_spindle.z_at) % rev + rev) % rev;
+
+      switch (faults[next_fault++].kind) {
+        case extra_a:
+          hostAt(at, [] { hostPin(host_spindle.a_reg(), host_spindle.a_bit(), false); });
+          hostAt(at + HOST_US(10), [] { hostPin(host_spindle.a_reg(), host_spindle.a_bit(), true); });
+          break;
+        case lost_a:
+          //Until A falls, two states on
+          host_reg[reg_EIMSK] &= ~_BV(INT5);
+          masked = true;
+          break;
+        case z_noise:
+          //Well away from the real Z, and only with it connected
+          if (host_spindle.z_on && where > rev / 8 && where < rev - rev / 8) {
+            hostAt(at, [] { hostPin(reg_PINB, 6, false); });
+            hostAt(at + HOST_US(5), [] { hostPin(reg_PINB, 6, true); });
+            noises++;
+          }
+          break;
+      }
+    }
+    if (masked && a_was && !a) {
+      masked = false;
+      restore = host_now + gap() / 2;
+    }
+    if (restore && host_now >= restore) {
+      restore = 0;
+      host_irq[irq_int5].flag = false;
+      host_reg[reg_EIMSK] |= _BV(INT5);
+    }
+    a_was = a;
+
+    if (cycle_state != state) {
+      if (cycle_state == cycle_retract) {
+        //Which way the carriage went as the spindle turned
+        shared->hand = (host_t4.pos > shared->pos0) == (host_spindle.q > shared->q0) ? 1 : -1;
+        hostLoop(HOST_MS(300));     //The operator backs the tool out
+        Serial2.in += touch(cycle_btn);
+      }
+      if (cycle_state == cycle_idle && state == cycle_feed)
+        break;
+      state = cycle_state;
+    }
+    if (host_now >= next_loop) {
+      while (host_cpu_free > host_now)
+        hostRun(host_cpu_free);
+      loop();
+      next_loop = host_now + HOST_US(200);
+    }
+  }
+  CHECK(starts.size() == PASSES, "%d passes", (int)starts.size());
+  CHECK(cycle_state == cycle_idle, "cycle state %d at the end", cycle_state);
+}
+
+long wander(void) {
+  //How far apart the pass starts were, in encoder counts either side of
+  //the first, which may be next to where the revolution wraps
+  long long rev = 4LL * host_spindle.ppr, lo = 0, hi = 0;
+
+  for (long long q : starts) {
+    long long d = ((q - starts[0]) % rev + rev) % rev;
+    if (d >= rev / 2)
+      d -= rev;
+    lo = min(lo, d);
+    hi = max(hi, d);
+  }
+  return (long)(hi - lo);
+}
+
+void startCycle(bool inject) {
+  //The thread, limits from here the way it's feeding, and a cycle cutting it
+
+  long lead, length;
+
+  setup();
+  host_spindle.ppr = machine.encoder_ppr;
+  host_spindle.rpm = RPM;
+  host_spindle.start();
+  feed_index[inch_feed] = INCHES / 3;
+  feedSelect(inch_feed);
+  hostLoop(HOST_MS(500));
+
+  lead = leadscrewGet();
+  length = (long)PASS_REVS * steps_per_rev;
+  left_limit = FEEDING_LEFT ? lead - length : lead;
+  right_limit = left_limit + length;
+  left_limited = right_limited = true;
+  hostLoop(HOST_SEC(1));
+  runCycle(inject);
+}
+
+bool waitSynced(void) {
+  //Run until a feed engages, and keep where the spindle and carriage were
+  hostLoopUntil([] { return synced; }, HOST_SEC(2), HOST_US(2));
+  return synced;
+}
+
+double offThread(long long q, long pos) {
+  //Steps the carriage is from the thread the cycle cut, at spindle position q
+  long long rev = 4LL * host_spindle.ppr;
+  double off = (pos - shared->pos0) - shared->hand * (double)(q - shared->q0) * steps_per_rev / rev;
+
+  off = fmod(off, steps_per_rev);
+  if (off >= steps_per_rev / 2.0)
+    off -= steps_per_rev;
+  else if (off < -steps_per_rev / 2.0)
+    off += steps_per_rev;
+  return off;
+}
+
+void spindleStop(void) {
+  host_spindle.rpm = 0;
+  hostLoopUntil([] { return spinRateGet() == SPINDLE_STOPPED; }, HOST_SEC(3));
+  hostLoop(HOST_MS(200));
+}
+
+void settle(void) {
+  //Run until everything that's changed is in EEPROM
+  hostLoopUntil([] {
+    for (byte id = 0; id < JOURNAL_FIELDS; id++)
+      if (journal_value[id] != journalGet(id))
+        return false;
+    return journal_write_slot < 0;
+  }, HOST_SEC(10), HOST_MS(1));
+}
+
+void withoutIndex(void) {
+  host_spindle.z_on = false;
+  startCycle(true);
+  shared->wander = wander();
+  CHECK(!indexed && index_corrections == 0, "an index with Z disconnected");
+}
+
+void withIndex(void) {
+  startCycle(true);
+  printf("%d passes, starts %ld counts apart, %ld without the index\n", (int)starts.size(), wander(),
+         shared->wander);
+  printf("index corrections %u, slip %ld, rejects %u of %d noise pulses\n", index_corrections, index_slip,
+         index_rejects, noises);
+  CHECK(shared->wander > 0, "the faults didn't move the starts without the index");
+  CHECK(wander() == 0, "the pass starts were %ld counts apart", wander());
+  CHECK(index_rejects == (unsigned)noises, "%u Z pulses rejected of %d noise", index_rejects, noises);
+  CHECK(index_corrections >= PASSES, "%u index corrections", index_corrections);
+  CHECK(pickup_valid, "no pickup kept");
+  left_limited = right_limited = false;
+
+  //Zeroed and moved off the thread
+  spindleStop();
+  Serial2.in += touch(zset_btn);
+  hostLoop(HOST_MS(100));
+  CHECK(leadscrewGet() == 0, "the leadscrew is at %ld after zeroing", leadscrewGet());
+  jogStart(true, 1234);
+  hostLoopUntil([] { return !jogging; }, HOST_SEC(5));
+  Serial2.in += touch(pickup_btn);
+  hostLoop(HOST_MS(100));
+  host_spindle.rpm = RPM;
+  CHECK(waitSynced(), "the feed didn't engage after zeroing");
+  printf("after zeroing, engaged %.2f steps off the thread\n", offThread(host_spindle.q, host_t4.pos));
+  CHECK(fabs(offThread(host_spindle.q, host_t4.pos)) < 1, "after zeroing, engaged %.2f steps off the thread",
+        offThread(host_spindle.q, host_t4.pos));
+
+  //Moved again, and powered off once it's saved
+  spindleStop();
+  jogStart(false, 567);
+  hostLoopUntil([] { return !jogging; }, HOST_SEC(5));
+  settle();
+  memcpy(shared->image, EEPROM.store, sizeof(shared->image));
+  shared->q = host_spindle.q;
+  shared->pos = host_t4.pos;
+}
+
+void afterPowerCycle(void) {
+  memcpy(EEPROM.store, shared->image, sizeof(shared->image));
+  host_spindle.q = shared->q + 1234;        //Turned by hand while it was off
+  host_t4.pos = shared->pos;
+  setup();
+  host_spindle.ppr = machine.encoder_ppr;
+  host_spindle.start();
+  hostLoop(HOST_MS(500));
+  CHECK(pickup_valid && !indexed, "no pickup after power up, or an index already");
+
+  Serial2.in += touch(pickup_btn);
+  hostLoop(HOST_MS(100));
+  CHECK(pickup_armed, "PICKUP didn't wait for the index");
+  host_spindle.rpm = RPM;
+  CHECK(waitSynced(), "the feed didn't engage after power up");
+  printf("after power up, engaged %.2f steps off the thread\n", offThread(host_spindle.q, host_t4.pos));
+  CHECK(fabs(offThread(host_spindle.q, host_t4.pos)) < 1, "after power up, engaged %.2f steps off the thread",
+        offThread(host_spindle.q, host_t4.pos));
+}
+
+int main(void) {
+  shared = (SHARED *)mmap(NULL, sizeof(SHARED), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+  CHECK(powerOn(withoutIndex) == 0, "the cycle without the index failed");
+  CHECK(powerOn(withIndex) == 0, "the cycle and pickup with the index failed");
+  CHECK(powerOn(afterPowerCycle) == 0, "the pickup after the power cycle failed");
+
+  host_checks += shared->checks;
+  return hostDone("test_index");
+}
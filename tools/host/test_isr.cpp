@@ -0,0 +1,259 @@
+// Copyright (c) 2020 Jon Bryan
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+//================================================================================
+//
+//  Host test: interrupt cost per spindle tick
+//
+//  The spindle turns at RPM with a feed engaged, first the finest inch feed,
+//  one step a tick at most, then the coarsest that still runs at twice RPM, and
+//  every interrupt handler is timed with the host's time stamp counter.  For
+//  each feed the spindle and TIMER4 handlers' cost a call is printed, and a
+//  tick's worth of everything, the spindle interrupt with the steps TIMER4 puts
+//  out for it and the timebase overflows.  Each call is timed less a read of
+//  the counter just before it, and each cost is the mean over TICKS ticks
+//  without the fastest and slowest calls, where the host interrupted the read or
+//  the handler, and the middle one of ROUNDS rounds of that.
+//
+//  The host's counter isn't the AVR's clock, and the register model does some
+//  of the work, so the numbers only mean something against the same test built
+//  another way, STEP_DDA's accumulator against the step table, or SPINDLE_ICP's
+//  capture against INT5, and only to within the few counts they move from one
+//  run to the next.  ELS_PROFILE measures the real thing on the lathe (see
+//  Profile.h).
+//
+//  The model's clock is the AVR's, though, with the handlers given els_sim's
+//  estimated costs, so the time the sketch gave each spindle edge is compared
+//  with when the model made it, and how late it was is printed, its mean, rms
+//  jitter and worst, in 16Mhz cycles.  The model runs a handler's code at its
+//  head, where the spindle interrupt starts the step timer, but the sketch
+//  reads TCNT first, so the head is taken off on INT5.  That's the jitter the
+//  speed estimate and the encoder health monitor see.  With the input capture
+//  unit it has to be none, and on INT5 no more than the longest other handler
+//  can hold it off.
+//  The other checks are only that every tick and every step was timed.
+//
+//  Flags:
+//  Flags:    -DSTEP_DDA
+//  Flags:    -DSPINDLE_ICP
+//
+//================================================================================
+
+#include <algorithm>
+#include <chrono>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "host.h"
+#include "sketch.cpp"
+
+#define RPM         100
+#define TICKS       20000           //Spindle ticks timed in a round
+#define ROUNDS      7               //Of them for each feed, the middle one kept
+#define TRIM        0.01            //Fraction of the calls left out at each end, the host's own interruptions
+#define SPIN_HEAD   480             //els_sim's estimate, where the spindle interrupt starts the step timer
+#define LATE_MAX    (HOST_ENTRY + 170 + HOST_ENTRY + 40)   //The last step's TIMER4, then an overflow
+
+#ifdef SPINDLE_ICP
+#define SPIN_IRQ    irq_timer5_capt
+#else
+#define SPIN_IRQ    irq_int5
+#endif
+
+void (*vects[host_irqs])(void);
+std::vector<double> calls[host_irqs];   //Time stamp counts for each handler
+bool timing = false;
+
+unsigned long edges, edge_offset;   //Edges compared, and the timebase's start in whole overflows
+double late_sum, late_sq;
+long late_max;
+
+double now(void) {
+  //The host's time stamp counter, in order with the code around it, or
+  //nanoseconds where there isn't one
+#if defined(__x86_64__) || defined(__i386__)
+  _mm_lfence();
+  double t = __rdtsc();
+  _mm_lfence();
+  return t;
+#else
+  return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+void edgeTimed(void) {
+  //What the spindle interrupt made of the edge
+
+  static unsigned long last_edge = 0;
+  unsigned long long t = host_irq[SPIN_IRQ].flag_t;
+
+  if (!timing || spin_edge == last_edge)
+    return;
+  last_edge = spin_edge;
+  if (edges == 0)
+    edge_offset = (spin_edge - (unsigned long)t + 0x8000) & 0xFFFF0000UL;
+  long late = (int32_t)(spin_edge - (unsigned long)t - edge_offset);
+#ifndef SPINDLE_ICP
+  late -= SPIN_HEAD;                //The model reads TCNT there, the sketch first
+#endif
+  late_sum += late;
+  late_sq += (double)late * late;
+  late_max = max(late_max, late);
+  edges++;
+}
+
+template <int irq> void timed(void) {
+  //Less the time to read the counter, just before
+  double t0 = now();
+  double t1 = now();
+  vects[irq]();
+  double t2 = now();
+
+  if (timing)
+    calls[irq].push_back((t2 - t1) - (t1 - t0));
+  if (irq == SPIN_IRQ)
+    edgeTimed();
+}
+
+template <int... irqs> void timeAll(std::integer_sequence<int, irqs...>) {
+  ((vects[irqs] = host_irq[irqs].vect, host_irq[irqs].vect = timed<irqs>), ...);
+}
+
+double trimmedMean(std::vector<double> v) {
+  //Without the calls the host itself got in the middle of, or of the read before
+  size_t trim = TRIM * v.size();
+  double sum = 0;
+
+  std::sort(v.begin(), v.end());
+  for (size_t i = trim; i < v.size() - trim; i++)
+    sum += v[i];
+  return v.size() > 2 * trim ? sum / (v.size() - 2 * trim) : 0;
+}
+
+double middle(std::vector<double> v) {
+  std::sort(v.begin(), v.end());
+  return v[v.size() / 2];
+}
+
+int feedWith(bool coarse) {
+  //The inch feed with the fewest steps, or the most that still runs at twice RPM
+  FEED_TABLE f;
+  int best = -1;
+  unsigned best_steps = 0;
+
+  for (int i = 0; i < INCHES; i++) {
+    feedGet(inch, i, &f);
+    if (maxRPM(f.steps) < 2 * RPM)
+      continue;
+    if (best < 0 || (coarse ? f.steps > best_steps : f.steps < best_steps)) {
+      best = i;
+      best_steps = f.steps;
+    }
+  }
+  return best;
+}
+
+void round(std::vector<double> *spindle, std::vector<double> *timer4, std::vector<double> *tick) {
+  //TICKS spindle ticks, and what each cost came to
+  long pulses;
+
+  //Between trains, so the steps counted are the ones timed
+  hostLoopUntil([] { return steps == 0; }, HOST_MS(100), HOST_US(5));
+  for (auto &c : calls)
+    c.clear();
+  pulses = host_t4.pos;
+  timing = true;
+  hostLoopUntil([] { return calls[SPIN_IRQ].size() >= TICKS; }, HOST_SEC(60), HOST_US(5));
+  hostLoopUntil([] { return steps == 0; }, HOST_MS(100), HOST_US(5));
+  timing = false;
+  pulses = labs(host_t4.pos - pulses);
+
+  double ticks = calls[SPIN_IRQ].size();
+  double all = 0;
+  for (int i = 0; i < host_irqs; i++) {
+    if (!calls[i].empty())
+      all += trimmedMean(calls[i]) * calls[i].size() / ticks;
+  }
+  spindle->push_back(trimmedMean(calls[SPIN_IRQ]));
+  timer4->push_back(trimmedMean(calls[irq_timer4]));
+  tick->push_back(all);
+  CHECK(ticks >= TICKS, "%.0f ticks timed", ticks);
+  CHECK((long)calls[irq_timer4].size() == pulses, "%d TIMER4 calls for %ld steps", (int)calls[irq_timer4].size(),
+        pulses);
+}
+
+void measure(bool coarse) {
+  FEED_TABLE f;
+  std::vector<double> spindle, timer4, tick;
+
+  feed_index[inch_feed] = feedWith(coarse);
+  feedGet(inch, feed_index[inch_feed], &f);
+  feedSelect(inch_feed);
+  hostLoopUntil([] { return synced && step_hold == hold_none; }, HOST_SEC(2));
+  CHECK(synced && step_hold == hold_none, "no feed engaged at %s", f.pitch);
+
+  long pulses = host_t4.pos;
+  unsigned long long t = host_now;
+  edges = 0;
+  late_sum = late_sq = 0;
+  late_max = 0;
+  for (int i = 0; i < ROUNDS; i++)
+    round(&spindle, &timer4, &tick);
+  double per_tick = labs(host_t4.pos - pulses) / ((host_now - t) / 16e6 * RPM / 60 * SCPR);
+  double mean = late_sum / edges, rms = sqrt(max(0.0, late_sq / edges - mean * mean));
+  printf("%-6s %-4s %4.2f steps a tick: spindle %5.1f, timer4 %5.1f a call, %5.1f a tick\n", f.rate, f.pitch,
+         per_tick, middle(spindle), middle(timer4), middle(tick));
+  printf("%-11s edge times late by %.1f, jitter %.1f rms, %ld at worst\n", "", mean, rms, late_max);
+  CHECK(edges >= (unsigned long)ROUNDS * TICKS, "%lu edges compared", edges);
+#ifdef SPINDLE_ICP
+  CHECK(late_max == 0 && rms == 0, "captured edge times %ld late", late_max);
+#else
+  CHECK(late_max <= LATE_MAX, "edge times %ld late, more than %d", late_max, LATE_MAX);
+#endif
+}
+
+int main(void) {
+  setup();
+  host_spindle.ppr = machine.encoder_ppr;
+  host_spindle.rpm = RPM;
+  host_spindle.start();
+  hostLoop(HOST_SEC(1));
+  timeAll(std::make_integer_sequence<int, host_irqs>());
+
+  //els_sim's estimates, for the model's timing
+  host_irq[SPIN_IRQ].cost = [] { return 600U; };
+  host_irq[SPIN_IRQ].head = [] { return (unsigned)SPIN_HEAD; };
+  host_irq[irq_timer4].cost = [] { return steps == 1 ? 170U : 70U; };
+  host_irq[irq_timer4].head = [] { return 40U; };
+  host_irq[irq_timer3_ovf].cost = [] { return 40U; };
+  host_irq[irq_timer5_ovf].cost = [] { return 40U; };
+
+#if defined(SPINDLE_ICP)
+  printf("SPINDLE_ICP, %d rpm, %d counts per rev, host time stamp counts\n", RPM, SCPR);
+#elif defined(STEP_DDA)
+  printf("STEP_DDA, %d rpm, %d counts per rev, host time stamp counts\n", RPM, SCPR);
+#else
+  printf("step table, %d rpm, %d counts per rev, host time stamp counts\n", RPM, SCPR);
+#endif
+  measure(false);
+  measure(true);
+
+  return hostDone("test_isr");
+}
@@ -0,0 +1,254 @@
+// Copyright (c) 2020 Jon Bryan
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+//================================================================================
+//
+//  Host test: settings journal against power failing
+//
+//  See Journal.h.  Every power on is a fork() of this process, which never runs
+//  the sketch itself, so each one starts from the sketch's initial globals with
+//  only the EEPROM, which is shared memory, carried over.
+//
+//  First the journal is filled past the end of the ring, to check a setting that
+//  never changes survives the ring coming round.  Then a run of setting changes is
+//  made from that, noting after which EEPROM write each slot was complete.  Then
+//  the same run is repeated with the power failing at every one of those writes in
+//  turn, with the byte being written left as it was, erased or half programmed.
+//  The next power on has to come up with every field as it was after the last
+//  slot that was complete, and the journal has to carry on working from there.
+//  A group's slots only count once its last one is complete, so power failing
+//  between two fields of a group, as when zeroing moves the leadscrew and the
+//  pickup together, has to bring back all of the group as it was before.
+//
+//================================================================================
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "host.h"
+#include "sketch.cpp"
+
+#define CHANGES     7               //Setting changes in the run
+#define HISTORY     200             //Changes to fill the ring, it's 170 slots on the host
+
+struct COMMIT {
+  long writes;                      //EEPROM writes when the slot was complete
+  byte id;
+  long value;
+  bool end;                         //The last slot of its group, or a field on its own
+};
+
+struct SHARED {
+  byte image[HOST_EEPROM_SIZE];     //The EEPROM before the run
+  long before[JOURNAL_FIELDS];      //Every field at power on
+  COMMIT commit[JOURNAL_FIELDS * CHANGES];
+  int commits;
+  long writes;                      //All of the run's writes
+};
+
+SHARED *shared;
+
+int powerOn(std::function<void(void)> run) {
+  //Start the sketch with what's in EEPROM, do something and power off.
+  //0 if nothing failed in there.
+
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    setup();
+    run();
+    fflush(stdout);
+    _exit(host_failures ? 1 : 0);
+  }
+
+  int status;
+  waitpid(pid, &status, 0);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+void powerFail(void) {
+  //The byte being written is as the tear left it, and nothing else happens
+  _exit(0);
+}
+
+bool settled(void) {
+  //Everything that's changed is in EEPROM
+  for (byte id = 0; id < JOURNAL_FIELDS; id++)
+    if (journal_value[id] != journalGet(id))
+      return false;
+  return journal_write_slot < 0 && journal_group_next == JOURNAL_FIELDS;
+}
+
+void settle(bool note) {
+  //Run until the journal has caught up, noting each slot as it's finished
+
+  unsigned long long end = host_now + HOST_SEC(10);
+
+  while (!settled() && host_now < end) {
+    int slot = journal_write_slot;
+    hostLoop(HOST_MS(1), HOST_MS(1));
+    if (note && slot >= 0 && journal_write_slot < 0 && shared->commits < JOURNAL_FIELDS * CHANGES)
+      shared->commit[shared->commits++] = { EEPROM.writes, (byte)(journal_write.id & ~JOURNAL_MORE),
+                                            journal_write.value, !(journal_write.id & JOURNAL_MORE) };
+  }
+  CHECK(settled(), "journal never caught up");
+}
+
+void change(int n) {
+  //The run's nth change, some of them to more than one field
+
+  switch (n) {
+    case 0:
+      feed_index[metric_feed] = METRICS - 2;
+      break;
+    case 1:
+      left_limit = 12345L;
+      left_limited = true;
+      break;
+    case 2:
+      leadscrew = -4321L;
+      break;
+    case 3:
+      rpm_table[2] = 777;
+      break;
+    case 4:
+      feed_mode = metric_feed;
+      feedSelect(metric_feed);
+      break;
+    case 5:
+      right_limit = -2000L;
+      right_limited = true;
+      break;
+    case 6:
+      //Zeroing moves the leadscrew, the limits and the pickup together
+      pickup_valid = true;
+      pickup.index = 100;
+      pickup.rh = true;
+      pickup.steps_per_rev = steps_per_rev;
+      pickup.lead = 5000L;
+      pickupShift(-4321L);
+      leadscrew = 0L;
+      left_limit += 4321L;
+      right_limit += 4321L;
+      break;
+  }
+}
+
+void changes(bool note) {
+  for (int n = 0; n < CHANGES; n++) {
+    change(n);
+    settle(note);
+  }
+}
+
+int main(void) {
+  const char *tears[] = { "left", "erased", "partial" };
+  long cut, expect[JOURNAL_FIELDS];
+  int i, tear, runs = 0, inside = 0;
+
+  shared = (SHARED *)mmap(NULL, sizeof(SHARED), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  EEPROM.mem = shared->image + 0;
+  memset(EEPROM.mem, 0xFF, HOST_EEPROM_SIZE);
+  EEPROM.power_fail = powerFail;
+
+  //Fill the ring, with one setting that's set first and then left alone
+  CHECK(powerOn([] {
+    feed_index[diametral_feed] = 3;
+    settle(false);
+    for (int n = 0; n < HISTORY; n++) {
+      leadscrew = 1000L + n;
+      settle(false);
+    }
+  }) == 0, "filling the journal");
+  CHECK(powerOn([] {
+    JOURNAL_SLOT slot;
+    int used = 0;
+    for (int i = 0; i < (int)JOURNAL_SLOTS; i++) {
+      EEPROM.get(i * sizeof(JOURNAL_SLOT), slot);
+      used += (slot.id & ~JOURNAL_MORE) < JOURNAL_FIELDS && slot.crc == journalCrc(slot);
+    }
+    CHECK(used == (int)JOURNAL_SLOTS, "%d of %d slots used", used, (int)JOURNAL_SLOTS);
+    CHECK(feed_index[diametral_feed] == 3, "lost a setting that never changed");
+    CHECK(leadscrewGet() == 1000L + HISTORY - 1, "leadscrew %ld", (long)leadscrewGet());
+  }) == 0, "after the ring came round");
+
+  //The run with no failure, noting where each slot was complete
+  static byte history[HOST_EEPROM_SIZE];
+  memcpy(history, EEPROM.mem, HOST_EEPROM_SIZE);
+  shared->commits = 0;
+  CHECK(powerOn([] {
+    for (byte id = 0; id < JOURNAL_FIELDS; id++)
+      shared->before[id] = journalGet(id);
+    long start = EEPROM.writes;
+    changes(true);
+    shared->writes = EEPROM.writes - start;
+    for (int i = 0; i < shared->commits; i++)
+      shared->commit[i].writes -= start;
+  }) == 0, "the run");
+  printf("%d slots in %ld writes\n", shared->commits, shared->writes);
+  CHECK(shared->commits >= CHANGES, "only %d slots written", shared->commits);
+
+  //And again with the power failing at each write
+  for (cut = 0; cut < shared->writes; cut++) {
+    for (tear = tear_none; tear <= tear_partial; tear++) {
+      memcpy(EEPROM.mem, history, HOST_EEPROM_SIZE);
+      EEPROM.cut = -1;
+      powerOn([cut, tear] {
+        EEPROM.cut = EEPROM.writes + cut;
+        EEPROM.tear = (hostTear)tear;
+        changes(false);
+        CHECK(false, "power didn't fail");
+      });
+      runs++;
+
+      //What should have been kept, a group at a time
+      memcpy(expect, shared->before, sizeof(expect));
+      int group = 0;
+      for (i = 0; i < shared->commits && shared->commit[i].writes <= cut; i++) {
+        if (shared->commit[i].end) {
+          for (; group <= i; group++)
+            expect[shared->commit[group].id] = shared->commit[group].value;
+        }
+      }
+      if (tear == tear_none && group < i)
+        inside++;                   //Between two fields of a group
+
+      //Every field as it was, and the journal still takes a change
+      int failed = powerOn([&expect] {
+        for (byte id = 0; id < JOURNAL_FIELDS; id++)
+          CHECK(journalGet(id) == expect[id], "field %d is %ld, not %ld", id, journalGet(id), expect[id]);
+        feed_index[module_feed] = 1;
+        settle(false);
+      });
+      if (!failed) {
+        expect[j_feed_index + module_feed] = 1;
+        failed = powerOn([&expect] {
+          for (byte id = 0; id < JOURNAL_FIELDS; id++)
+            CHECK(journalGet(id) == expect[id], "after a change, field %d is %ld, not %ld", id, journalGet(id), expect[id]);
+        });
+      }
+      CHECK(!failed, "power failed at write %ld of %ld, byte %s", cut, shared->writes, tears[tear]);
+    }
+  }
+  printf("%d power failures, %d of the cuts part way through a group\n", runs, inside);
+  CHECK(inside > 0, "power never failed part way through a group");
+
+  return hostDone("test_journal");
+}
@@ -0,0 +1,263 @@
+// Copyright (c) 2020 Jon Bryan
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+//================================================================================
+//
+//  Host test: fuzzing the Nextion return frame parser
+//
+//  See nextionFrame() in Display.ino.  Streams of every kind of frame the display
+//  sends are fed to the parser with some of them spoiled: bytes dropped, added,
+//  changed or repeated, frames cut short, and runs of noise heavy in 0xFF's and
+//  frame codes.  Every frame that comes out has to be whole, no longer than
+//  NX_FRAME and the right length for its code, no call may take more than
+//  NX_RX_BUDGET bytes, and once two good frames have gone by since the last
+//  spoiled one, every good frame has to come out just as it was sent.  Numbers
+//  with three 0xFF's in them, like -1, don't count as one of the two, since any
+//  run of them looks the same to a parser that's out of step.
+//
+//  Then the whole sketch gets random touch and number frames mixed with noise
+//  through loop() for a while, and a mode button still has to work afterwards.
+//
+//  This one is also worth building with -fsanitize=address,undefined by hand.
+//
+//================================================================================
+
+#include "host.h"
+#include "sketch.cpp"
+
+#define STREAMS     2000            //Streams of frames for the parser
+#define FRAMES      60              //Frames in each
+#define SPOIL       8               //1 in SPOIL frames is spoiled
+#define PRESSES     3000            //Frames through loop()
+
+typedef std::string FRAME;
+
+unsigned long fuzz_seed = 1;
+
+unsigned fuzz(unsigned n) {
+  //Random number below n
+  fuzz_seed = fuzz_seed * 1103515245UL + 12345UL;
+  return ((fuzz_seed >> 8) & 0xFFFFFF) % n;
+}
+
+byte fuzzByte(void) {
+  //Mostly the bytes that mean something to the parser
+  switch (fuzz(8)) {
+    case 0:
+    case 1:
+      return 0xFF;
+    case 2:
+      return NXR_TOUCH;
+    case 3:
+      return NXR_NUMBER;
+  }
+  return fuzz(256);
+}
+
+FRAME frameEnd(FRAME f) {
+  return f + NX_END;
+}
+
+FRAME frameTouch(byte page, byte id, byte press) {
+  FRAME f;
+  f += (char)NXR_TOUCH;
+  f += (char)page;
+  f += (char)id;
+  f += (char)press;
+  return frameEnd(f);
+}
+
+FRAME frameNumber(unsigned long n) {
+  FRAME f(1, (char)NXR_NUMBER);
+  for (int i = 0; i < 4; i++)
+    f += (char)(n >> (8 * i));
+  return frameEnd(f);
+}
+
+FRAME frameRandom(void) {
+  //Any frame the display sends
+
+  FRAME f;
+  int i, n;
+
+  switch (fuzz(6)) {
+    case 0:
+      return frameTouch(fuzz(3), fuzz(40), fuzz(2));
+    case 1:
+      //Including the 0xFF's in -1
+      return frameNumber(fuzz(4) ? fuzz(0x1000000) * 256UL + fuzz(256) : 0xFFFFFFFFUL);
+    case 2:
+      f += (char)NXR_PAGE;
+      f += (char)fuzz(3);
+      return frameEnd(f);
+    case 3:
+      f += (char)(fuzz(2) ? NXR_XY : NXR_XY_SLEEP);
+      for (i = 0; i < 5; i++)
+        f += (char)fuzz(255);
+      return frameEnd(f);
+    case 4:
+      f += (char)NXR_STRING;
+      n = fuzz(NX_FRAME - 4);
+      for (i = 0; i < n; i++)
+        f += (char)(' ' + fuzz(95));
+      return frameEnd(f);
+  }
+  f += (char)fuzz(NXR_ERRORS + 1);
+  return frameEnd(f);
+}
+
+FRAME frameSpoil(FRAME f) {
+  //One of the things that happens to a frame on the way
+
+  size_t at = fuzz(f.size());
+  int i, n;
+
+  switch (fuzz(6)) {
+    case 0:
+      f.erase(at, 1);
+      break;
+    case 1:
+      f.insert(at, 1, (char)fuzzByte());
+      break;
+    case 2:
+      f[at] = fuzzByte();
+      break;
+    case 3:
+      f.insert(at, 1, f[at]);
+      break;
+    case 4:
+      f.resize(at);
+      break;
+    default:
+      n = 1 + fuzz(20);
+      for (i = 0; i < n; i++)
+        f.insert(f.begin() + at, (char)fuzzByte());
+      break;
+  }
+  return f;
+}
+
+std::vector<FRAME> feed(const FRAME &bytes) {
+  //Hand bytes to the parser and collect the frames it finds
+
+  std::vector<FRAME> got;
+  size_t before;
+  byte len;
+
+  Serial2.in += bytes;
+  do {
+    before = Serial2.available();
+    len = nextionFrame();
+    CHECK(before - Serial2.available() <= NX_RX_BUDGET, "took %d bytes", (int)(before - Serial2.available()));
+    CHECK(nx_rx_len <= NX_FRAME, "%d bytes collected", nx_rx_len);
+    if (len) {
+      FRAME f((const char *)nx_rx, len);
+      byte need = nxFrameLength(nx_rx[0]);
+      CHECK(len <= NX_FRAME && len > 3, "frame of %d bytes", len);
+      CHECK(f.substr(len - 3) == NX_END, "frame without a terminator");
+      CHECK(!need || len == need, "frame 0x%02X of %d bytes", nx_rx[0], len);
+      got.push_back(f);
+    }
+  } while (len || Serial2.available());
+  return got;
+}
+
+void fuzzParser(void) {
+  //Streams of frames with some of them spoiled
+
+  unsigned long lost = 0, sent = 0, framing = nx_rx_framing;
+  int good = 2;
+
+  for (int s = 0; s < STREAMS; s++) {
+    for (int i = 0; i < FRAMES; i++) {
+      FRAME f = frameRandom();
+      bool spoil = s > 0 && fuzz(SPOIL) == 0;
+      std::vector<FRAME> got = feed(spoil ? frameSpoil(f) : f);
+
+      if (spoil) {
+        good = 0;
+        continue;
+      }
+      sent++;
+      if (good >= 2) {
+        CHECK(got.size() == 1 && got[0] == f, "stream %d frame %d lost (%d frames out)", s, i, (int)got.size());
+      } else if (got.empty() || got.back() != f) {
+        lost++;
+      }
+      //A number with a terminator in it looks the same from wherever a parser
+      //that's out of step is, so it doesn't help to get back in
+      if (f.find(NX_END) == f.size() - 3)
+        good++;
+    }
+    //The first stream is clean, and nothing in it may be a framing error
+    if (s == 0)
+      CHECK(nx_rx_framing == framing, "%lu framing errors with nothing spoiled", nx_rx_framing - framing);
+  }
+  printf("%lu good frames, %lu lost next to spoiled ones, %lu framing errors\n",
+         sent, lost, nx_rx_framing - framing);
+}
+
+void fuzzSketch(void) {
+  //Anything at all through loop(), then a mode button still works
+
+  unsigned int frames = nx_rx_frames, framing = nx_rx_framing;
+  int i;
+
+  setup();
+  hostLoop(HOST_MS(100));
+  for (i = 0; i < PRESSES; i++) {
+    switch (fuzz(4)) {
+      case 0:
+        Serial2.in += frameTouch(fuzz(3), fuzz(40), fuzz(2));
+        break;
+      case 1:
+        Serial2.in += frameNumber(fuzz(2) ? fuzz(200) : fuzz(0x10000) * 0x10000UL + fuzz(0x10000));
+        break;
+      case 2:
+        Serial2.in += frameSpoil(frameRandom());
+        break;
+      default:
+        Serial2.in += frameRandom();
+        break;
+    }
+    hostLoop(HOST_MS(fuzz(50)));
+    CHECK(nx_rx_len <= NX_FRAME, "%d bytes collected", nx_rx_len);
+  }
+  //Let whatever was started finish
+  Serial2.in += frameTouch(0, back_btn, 1) + frameTouch(0, back_btn, 0);
+  hostLoop(HOST_SEC(2));
+
+  Serial2.in += NX_END;
+  Serial2.in += frameTouch(0, metric_btn, 1) + frameTouch(0, metric_btn, 0);
+  hostLoop(HOST_MS(100));
+  CHECK(feed_mode == metric_feed, "METRIC didn't work, the mode is %d", feed_mode);
+  Serial2.in += frameTouch(0, inch_btn, 1) + frameTouch(0, inch_btn, 0);
+  hostLoop(HOST_MS(100));
+  CHECK(feed_mode == inch_feed, "INCH didn't work, the mode is %d", feed_mode);
+  CHECK(Serial2.available() == 0, "%d bytes not read", Serial2.available());
+  printf("%u frames, %u framing errors, %u failure codes through loop()\n",
+         nx_rx_frames - frames, nx_rx_framing - framing, nx_rx_failures);
+}
+
+int main(void) {
+  fuzzParser();
+  fuzzSketch();
+  return hostDone("test_nextion");
+}
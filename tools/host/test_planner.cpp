@@ -0,0 +1,190 @@
+// Copyright (c) 2020 Jon Bryan
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+//================================================================================
+//
+//  Host test: jog and rapid traverse planner
+//
+//  See Planner.h.  Moves from a single step to 256000 are run on the model with
+//  the spindle stopped, and the time of every step pulse is kept.  Each has to
+//  end on exactly its count, and no step may come sooner than the stepper's
+//  limit allows.  The speed at each step has to stay under the trapezoid:
+//  JOG_ACCEL up from the start and down to the end, with one level of the ramp
+//  to spare.  A move with a count starts on the ramp, with no creep, and a long
+//  one has to get up to the top speed in about the time the acceleration says.
+//
+//  Then a jog, which does creep first, is released at full speed, and has to
+//  stop within the steps it took to get there, and the rapid buttons have to go
+//  to the limits, or stop as quickly when something else is touched part way.
+//
+//================================================================================
+
+#include <vector>
+#include "host.h"
+#include "sketch.cpp"
+
+#define WATCH_US    10              //How often the pulses are looked at, under the shortest gap
+
+std::vector<unsigned long long> pulse_times;
+unsigned long unseen = 0;           //Pulses that came too close together to be timed
+
+void watch(std::function<bool(void)> done, unsigned long long limit) {
+  //Run with loop() every 200us, keeping the time of every pulse
+
+  unsigned long long end = host_now + limit, next_loop = host_now;
+  unsigned long pulses = host_t4.pulses;
+
+  while (!done() && host_now < end) {
+    hostFor(HOST_US(WATCH_US));
+    if (host_t4.pulses - pulses > 1)
+      unseen += host_t4.pulses - pulses - 1;
+    if (host_t4.pulses != pulses)
+      pulse_times.push_back(host_t4.last_pulse);
+    pulses = host_t4.pulses;
+    if (host_now >= next_loop) {
+      while (host_cpu_free > host_now)
+        hostRun(host_cpu_free);
+      loop();
+      next_loop = host_now + HOST_US(200);
+    }
+  }
+}
+
+double topRate(void) {
+  return 2000000.0 / PLAN_MIN_PERIOD;
+}
+
+bool underTrapezoid(const char *what, long creep) {
+  //Every step no faster than the ramp allows from the start and to the end
+
+  double v0 = 2000000.0 / ICR4_MAX, v1 = topRate();
+  double dv = (v1 - v0) / (PLAN_LEVELS - 1);
+  long n = pulse_times.size(), i, ramp;
+  int bad = 0;
+
+  for (i = 1; i < n; i++) {
+    double rate = 16e6 / (pulse_times[i] - pulse_times[i - 1]);
+    ramp = min(max(0L, i - creep), n - i);
+    double most = min(v1, sqrt(v0 * v0 + 2.0 * JOG_ACCEL * ramp) + dv);
+    if (rate > most * 1.01 && bad++ < 5)
+      printf("%s: step %ld of %ld at %.0f steps/s, over %.0f\n", what, i, n, rate, most);
+  }
+  return bad == 0;
+}
+
+void move(bool feed, long count) {
+  //A move of count steps, as rapidTo() starts them
+
+  long pos = host_t4.pos, lead = leadscrewGet();
+  unsigned long long gap_limit = 8ULL * T4CPM / machine.stepper_limit;
+  char what[40];
+
+  snprintf(what, sizeof(what), "%ld steps %s", count, feed ? "left" : "right");
+  pulse_times.clear();
+  host_t4.gap_min = HOST_NEVER;
+  jogStart(feed, count);
+  watch([] { return !jogging; }, HOST_SEC(count / 5000.0 + 5));
+
+  CHECK(!jogging, "%s: still jogging", what);
+  CHECK(labs(host_t4.pos - pos) == count, "%s: %ld steps", what, labs(host_t4.pos - pos));
+  CHECK(leadscrewGet() - lead == (feed ? -count : count), "%s: the leadscrew moved %ld", what, leadscrewGet() - lead);
+  CHECK(count < 2 || host_t4.gap_min >= gap_limit - 8, "%s: steps %.1fus apart, the limit is %.1fus", what,
+        host_t4.gap_min / 16.0, gap_limit / 16.0);
+  CHECK(underTrapezoid(what, 0), "%s: faster than the trapezoid", what);
+}
+
+std::string touch(byte id) {
+  std::string f("\x65\x01", 2);
+  f += (char)id;
+  f += (char)1;
+  return f + NX_END;
+}
+
+int main(void) {
+  static const long counts[] = { 1, 2, 3, 10, JOG_CREEP - 1, JOG_CREEP, JOG_CREEP + 1, 100, 257, 1000,
+                                 4321, 20000, 256000 };
+  unsigned long long start;
+  long lead, ramp;
+  size_t i;
+
+  setup();
+  hostLoop(HOST_MS(500));
+
+  for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+    move(i % 2, counts[i]);
+    hostLoop(HOST_MS(20));
+  }
+
+  //How long the 256000 step move took to get to the top speed
+  double v0 = 2000000.0 / ICR4_MAX, v1 = topRate();
+  double expect = (v1 - v0) / JOG_ACCEL;
+  double early = 16e6 / (pulse_times[JOG_CREEP] - pulse_times[JOG_CREEP - 1]);
+  CHECK(early > 4 * v0, "the move was at %.0f steps/s after %d steps, still creeping", early, JOG_CREEP);
+  for (i = 1; i < pulse_times.size(); i++)
+    if (pulse_times[i] - pulse_times[i - 1] <= 8ULL * PLAN_MIN_PERIOD + 8)
+      break;
+  double took = (pulse_times[i] - pulse_times[0]) / 16e6;
+  printf("top speed %.0f steps/s, reached in %.3fs, %.3fs expected\n", v1, took, expect);
+  CHECK(i < pulse_times.size(), "never got to the top speed");
+  CHECK(fabs(took - expect) < 0.15 * expect, "%.3fs to the top speed, not %.3fs", took, expect);
+  CHECK(v1 <= machine.stepper_limit / 60.0, "the top speed %.0f is over the limit", v1);
+
+  //A jog let go at full speed
+  pulse_times.clear();
+  jogStart(false, PLAN_FOREVER);
+  watch([] { return false; }, HOST_SEC(2));
+  ramp = plan_ramp;
+  lead = leadscrewGet();
+  jogStop();
+  start = pulse_times.size();
+  watch([] { return !jogging; }, HOST_SEC(2));
+  printf("jog released at step %llu after %ld ramp steps, stopped in %ld\n", start, ramp, leadscrewGet() - lead);
+  CHECK(!jogging, "the jog didn't stop");
+  CHECK(leadscrewGet() - lead <= ramp + 2, "%ld steps to stop from %ld ramp steps", leadscrewGet() - lead, ramp);
+  CHECK(underTrapezoid("jog", JOG_CREEP), "the jog was faster than the trapezoid");
+  double creep = 16e6 / (pulse_times[JOG_CREEP - 1] - pulse_times[JOG_CREEP - 2]);
+  CHECK(creep < 1.1 * v0, "the jog was at %.0f steps/s, not creeping at %.0f", creep, v0);
+  CHECK(unseen == 0, "%lu pulses too close together to time", unseen);
+
+  //Rapids to the limits
+  left_limit = leadscrewGet() - 30000;
+  right_limit = leadscrewGet() + 9000;
+  left_limited = right_limited = true;
+  Serial2.in += touch(lrapid_btn);
+  watch([] { return !jogging && leadscrewGet() == left_limit; }, HOST_SEC(10));
+  CHECK(leadscrewGet() == left_limit, "the left rapid stopped at %ld, not %ld", leadscrewGet(), left_limit);
+  Serial2.in += touch(rrapid_btn);
+  watch([] { return !jogging && leadscrewGet() == right_limit; }, HOST_SEC(10));
+  CHECK(leadscrewGet() == right_limit, "the right rapid stopped at %ld, not %ld", leadscrewGet(), right_limit);
+
+  //Something else touched half way
+  Serial2.in += touch(lrapid_btn);
+  watch([] { return leadscrewGet() <= (left_limit + right_limit) / 2; }, HOST_SEC(10));
+  CHECK(jogging, "the rapid stopped too soon");
+  ramp = plan_ramp;
+  lead = leadscrewGet();
+  Serial2.in += touch(metric_btn);
+  watch([] { return !jogging; }, HOST_SEC(10));
+  printf("rapid stopped %ld steps after the touch, with %ld ramp steps\n", lead - leadscrewGet(), ramp);
+  CHECK(!jogging && leadscrewGet() > left_limit, "the rapid went on to %ld", leadscrewGet());
+  CHECK(lead - leadscrewGet() <= ramp + 10, "%ld steps to stop from %ld ramp steps", lead - leadscrewGet(), ramp);
+
+  return hostDone("test_planner");
+}
@@ -0,0 +1,256 @@
+// Copyright (c) 2020 Jon Bryan
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+//================================================================================
+//
+//  Host test: the profiler
+//
+//  See Profile.h.  Before setup(), known times go into a site and each has to
+//  land in its log2 bucket, with n, min, max and the total kept.  PROF_START and
+//  PROF_END have to give the model's cycles between them, across the timebase
+//  wrapping too, and PROF_COMPARE the timer's counts past OCRnA times 8, with
+//  the counter stopped at known places on either side of the match and running
+//  from it, for TC4 and with CROSS_SLIDE for TC1.
+//
+//  Then the sketch runs a feed with the handlers given els_sim's estimated
+//  costs, and every spindle and TIMER4 interrupt has to be recorded once.  The
+//  TIMER4 latency has to be the model's, from the compare to the head of the
+//  handler, to within the timer's 8 counts, and with SPINDLE_ICP the spindle's
+//  exactly.  The model runs a handler's code all at once, so the durations are
+//  all 0.  "prof" has to print the sites and "profreset" clear them.
+//
+//  Flags:    -DELS_PROFILE
+//  Flags:    -DELS_PROFILE -DSPINDLE_ICP
+//  Flags:    -DELS_PROFILE -DCROSS_SLIDE
+//
+//================================================================================
+
+#include "host.h"
+#include "sketch.cpp"
+
+#define RPM         300
+#define SPIN_HEAD   480             //els_sim's estimates
+#define T4_HEAD     40
+#define TOP         999             //The known timer setup
+#define MATCH       200
+
+#ifdef SPINDLE_ICP
+#define SPIN_IRQ    irq_timer5_capt
+#else
+#define SPIN_IRQ    irq_int5
+#endif
+
+unsigned long long recorded(byte site, std::function<void(void)> fn) {
+  //What fn() added to a site, which has to be one time
+  unsigned long n = prof[site].n;
+  unsigned long long sum = prof[site].sum;
+
+  fn();
+  CHECK(prof[site].n == n + 1, "%lu times recorded, not 1", prof[site].n - n);
+  return prof[site].sum - sum;
+}
+
+void buckets(void) {
+  //Each time in its bucket, and the figures kept
+  static const struct {
+    unsigned long t;
+    byte bucket;
+  } times[] = {
+    { 0, 0 }, { 1, 0 }, { 2, 1 }, { 3, 1 }, { 4, 2 }, { 255, 7 }, { 256, 8 }, { 511, 8 }, { 512, 9 },
+    { 32767, 14 }, { 32768, 15 }, { 65535, 15 }, { 100000, 15 },
+  };
+  unsigned long long sum = 0;
+
+  profReset();
+  for (auto &x : times) {
+    unsigned long before[PROF_BUCKETS];
+
+    memcpy(before, prof[prof_loop].bucket, sizeof before);
+    profRecord(prof_loop, x.t);
+    for (int b = 0; b < PROF_BUCKETS; b++)
+      CHECK(prof[prof_loop].bucket[b] - before[b] == (b == x.bucket), "%lu counted in bucket %d", x.t, b);
+    sum += x.t;
+  }
+  PROFILE &p = prof[prof_loop];
+  CHECK(p.n == sizeof times / sizeof times[0] && p.min == 0 && p.max == 100000 && p.sum == sum,
+        "n %lu min %lu max %lu sum %llu", p.n, p.min, p.max, p.sum);
+  profRecord(prof_ui, 300);
+  CHECK(prof[prof_ui].min == 300 && prof[prof_ui].max == 300, "one time of 300 gave min %lu max %lu",
+        prof[prof_ui].min, prof[prof_ui].max);
+}
+
+void startEnd(void) {
+  //Model cycles between PROF_START and PROF_END
+  static const unsigned long long gaps[] = { 0, 1, 1234, 0xFFFF };
+
+  for (unsigned long long gap : gaps) {
+    unsigned long long t = recorded(prof_masked, [gap] {
+      PROF_START(t0);
+      hostFor(gap);
+      PROF_END(prof_masked, t0);
+    });
+    CHECK(t == gap, "%llu cycles recorded as %llu", gap, t);
+  }
+
+  //Across the 16-bit timebase wrapping
+  hostFor(0x10000 - (host_now & 0xFFFF) - 100);
+  unsigned long long t = recorded(prof_masked, [] {
+    PROF_START(t0);
+    hostFor(300);
+    PROF_END(prof_masked, t0);
+  });
+  CHECK(t == 300, "300 cycles across the wrap recorded as %llu", t);
+}
+
+#define COMPARE(n, site, count, want) do { \
+    TCNT##n = (count); \
+    unsigned long long t = recorded(site, [] { PROF_COMPARE(site, n); }); \
+    CHECK(t == (want), "TC" #n " at %u, OCR%dA %u, TOP %u recorded as %llu, not %u", (unsigned)(count), n, \
+          MATCH, TOP, t, (unsigned)(want)); \
+  } while (0)
+
+#define COMPARES(n, site) do { \
+    TCCR##n##B = _BV(WGM##n##3) | _BV(WGM##n##2); \
+    ICR##n = TOP; \
+    OCR##n##A = MATCH; \
+    COMPARE(n, site, MATCH, 0); \
+    COMPARE(n, site, MATCH + 5, 5 * 8); \
+    COMPARE(n, site, TOP, (TOP - MATCH) * 8); \
+    COMPARE(n, site, 0, (TOP + 1 - MATCH) * 8);         /*Past TOP and round again*/ \
+    COMPARE(n, site, 10, (TOP + 11 - MATCH) * 8); \
+    COMPARE(n, site, MATCH - 1, TOP * 8); \
+    /*Running from the match at 2Mhz*/ \
+    TCNT##n = MATCH; \
+    TCCR##n##B = _BV(WGM##n##3) | _BV(WGM##n##2) | _BV(CS##n##1); \
+    hostFor(37 * 8 + 3); \
+    unsigned long long t = recorded(site, [] { PROF_COMPARE(site, n); }); \
+    TCCR##n##B = _BV(WGM##n##3) | _BV(WGM##n##2); \
+    CHECK(t == 37 * 8, "37 counts after the match recorded as %llu", t); \
+  } while (0)
+
+void compares(void) {
+  COMPARES(4, prof_timer4_lat);
+#ifdef CROSS_SLIDE
+  COMPARES(1, prof_timer1_lat);
+#endif
+}
+
+void spindle(int rpm) {
+  host_spindle.rpm = rpm;
+  if (rpm)
+    hostLoopUntil([] { return synced && step_hold == hold_none; }, HOST_SEC(2));
+  else
+    hostLoopUntil([] { return spinRateGet() == SPINDLE_STOPPED && !synced; }, HOST_SEC(2));
+}
+
+void sites(void) {
+  //Every bucket adds up to n, and the mean is between min and max
+  for (int s = 0; s < prof_sites; s++) {
+    PROFILE &p = prof[s];
+    unsigned long n = 0;
+
+    for (int b = 0; b < PROF_BUCKETS; b++)
+      n += p.bucket[b];
+    CHECK(n == p.n, "site %d: %lu in the buckets, n %lu", s, n, p.n);
+    CHECK(p.n == 0 || (p.min <= p.sum / p.n && p.sum / p.n <= p.max), "site %d: min %lu mean %llu max %lu", s,
+          p.min, p.sum / p.n, p.max);
+  }
+}
+
+void running(void) {
+  //The sketch's own sites, with a feed engaged
+  host_irq[SPIN_IRQ].cost = [] { return 600U; };
+  host_irq[SPIN_IRQ].head = [] { return (unsigned)SPIN_HEAD; };
+  host_irq[irq_timer4].cost = [] { return steps == 1 ? 170U : 70U; };
+  host_irq[irq_timer4].head = [] { return (unsigned)T4_HEAD; };
+  host_irq[irq_timer3_ovf].cost = [] { return 40U; };
+  host_irq[irq_timer5_ovf].cost = [] { return 40U; };
+
+  feed_index[inch_feed] = INCHES / 2;
+  feedSelect(inch_feed);
+  spindle(RPM);
+  profReset();
+  hostResetStats();
+  hostLoop(HOST_SEC(1));
+  spindle(0);
+
+  PROFILE &t4 = prof[prof_timer4], &t4_lat = prof[prof_timer4_lat];
+  HostIrq &q4 = host_irq[irq_timer4], &qs = host_irq[SPIN_IRQ];
+  printf("timer4: n %lu, latency %lu to %lu counts, the model's %llu cycles at worst to the flag\n", t4_lat.n,
+         t4_lat.min, t4_lat.max, q4.latency_max);
+  CHECK(q4.n > 1000 && t4.n == q4.n && t4_lat.n == q4.n, "%lu TIMER4 interrupts, %lu and %lu recorded", q4.n, t4.n,
+        t4_lat.n);
+  CHECK(prof[prof_spindle].n == qs.n, "%lu spindle interrupts, %lu recorded", qs.n, prof[prof_spindle].n);
+  CHECK(t4_lat.min + 8 > HOST_ENTRY + T4_HEAD, "TIMER4 latency down to %lu", t4_lat.min);
+  CHECK(t4_lat.max + 8 > q4.latency_max + HOST_ENTRY + T4_HEAD &&
+        t4_lat.max < q4.latency_max + HOST_ENTRY + T4_HEAD + 8, "TIMER4 latency up to %lu, the model's %llu",
+        t4_lat.max, q4.latency_max + HOST_ENTRY + T4_HEAD);
+#ifdef SPINDLE_ICP
+  PROFILE &s_lat = prof[prof_spindle_lat];
+  printf("spindle: n %lu, latency %lu to %lu counts, the model's %llu cycles at worst to the flag\n", s_lat.n,
+         s_lat.min, s_lat.max, qs.latency_max);
+  CHECK(s_lat.n == qs.n, "%lu spindle interrupts, %lu latencies", qs.n, s_lat.n);
+  CHECK(s_lat.min >= HOST_ENTRY + SPIN_HEAD && s_lat.max == qs.latency_max + HOST_ENTRY + SPIN_HEAD,
+        "spindle latency %lu to %lu, the model's up to %llu", s_lat.min, s_lat.max,
+        qs.latency_max + HOST_ENTRY + SPIN_HEAD);
+#else
+  CHECK(prof[prof_spindle_lat].n == 0, "%lu spindle latencies without SPINDLE_ICP", prof[prof_spindle_lat].n);
+#endif
+  CHECK(t4.max == 0 && prof[prof_spindle].max == 0, "durations of %lu and %lu in no time", t4.max,
+        prof[prof_spindle].max);
+  CHECK(prof[prof_loop].n > 0 && prof[prof_ui].n > 0, "loop %lu ui %lu", prof[prof_loop].n, prof[prof_ui].n);
+  sites();
+}
+
+void commands(void) {
+  //From the debug port, with the spindle stopped so nothing more comes in
+  char line[64];
+
+  Serial.take();
+  Serial.in += "prof\n";
+  hostLoop(HOST_MS(50));
+  std::string out = Serial.take();
+  snprintf(line, sizeof line, "timer4_lat n %lu min %lu max %lu", prof[prof_timer4_lat].n,
+           prof[prof_timer4_lat].min, prof[prof_timer4_lat].max);
+  CHECK(out.find(line) != std::string::npos && out.find("ok") != std::string::npos, "prof printed %s",
+        out.c_str());
+  CHECK(out.find("knob n") == std::string::npos, "prof printed a site that hasn't run");
+
+  Serial.in += "profreset\n";
+  hostLoop(HOST_MS(1));
+  CHECK(Serial.take().find("ok") != std::string::npos, "profreset didn't answer");
+  for (int s = 0; s < prof_sites; s++)
+    CHECK(s == prof_loop || s == prof_ui || prof[s].n == 0, "site %d has %lu after profreset", s, prof[s].n);
+}
+
+int main(void) {
+  buckets();
+  startEnd();
+  compares();
+
+  setup();
+  host_spindle.ppr = machine.encoder_ppr;
+  host_spindle.start();
+  hostLoop(HOST_MS(300));
+  running();
+  commands();
+
+  return hostDone("test_profile");
+}
@@ -0,0 +1,251 @@
+// Copyright (c) 2020 Jon Bryan
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+//================================================================================
+//
+//  Host test: custom pitch ratio
+//
+//  See Ratio.h.  Random pitches of each kind, spread evenly over the log of the
+//  pitch, go through customRatio().  Those it takes have to come out as the
+//  fraction worked out here in long double, exactly when the reduced fraction
+//  fits the accumulator, with the error it reports within 1ppm of the real one,
+//  and display strings that read back as the pitch.  Those it refuses have to
+//  really be outside what the sketch can cut.  Every so often a pitch is run for
+//  100 revolutions of spindle counts both ways, which has to come to the steps
+//  the ratio says with nothing lost.
+//
+//  Then ratioApprox() is given fractions too big for the accumulator, and
+//  small ones with small denominators, where nothing closer can be found by
+//  trying every denominator, and a couple of pitches are entered the way the
+//  display does it and cut on the model.
+//
+//  Flags:
+//  Flags:    -DSTEP_DDA
+//
+//================================================================================
+
+#include <climits>
+#include "host.h"
+#include "sketch.cpp"
+
+#define PITCHES     5000            //Of each kind
+#define DRIFT_EVERY 50              //Pitches between the 100 revolution runs
+#define APPROXES    100000          //Oversized fractions
+#define SEARCHES    20000           //Small ones, against trying every denominator
+
+unsigned long long seed = 1;
+
+double random01(void) {
+  seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+  return (seed >> 11) * (1.0 / 9007199254740992.0);
+}
+
+long double stepsPerCount(byte kind, unsigned long value) {
+  //What customRatio() is after, with 355/113 for pi like the tables
+  long double lspi = machine.lspi, pi = 355.0L / 113.0L, v = value / 1000.0L;
+
+  switch (kind) {
+    case inch_feed:       return lspi / v / SCPR;
+    case metric_feed:     return v * lspi / 25.4L / SCPR;
+    case diametral_feed:  return pi * lspi / v / SCPR;
+    default:              return pi * v * lspi / 25.4L / SCPR;
+  }
+}
+
+bool reads(const char *str, double want, double within) {
+  //A display string reads back as the number it's meant to be
+  return fabs(atof(str) - want) <= within;
+}
+
+long drift(unsigned long p, unsigned long q) {
+  //Steps for 100 revolutions from a random start, less what p/q says,
+  //and what's left after going back again
+
+  long steps = 0, back = 0, n = 100L * SCPR;
+  long i;
+
+  spin_count = (unsigned)(random01() * SCPR);
+  ddaSync();
+  for (i = 0; i < n; i++) {
+    steps += TICK_STEPS;
+    spinModulus(true);
+  }
+  for (i = 0; i < n; i++) {
+    spinModulus(false);
+    back += TICK_STEPS;
+  }
+  if (back != steps)
+    return LONG_MAX;
+  return (long)floorl(steps - (long double)n * p / q);
+}
+
+void cut(byte kind, unsigned long value) {
+  //Enter a pitch the way the display does, and cut 3 revolutions of it
+
+  const int revs = 3;
+  std::string frame("\x71", 1);
+  long long target;
+  long pos;
+  int i;
+
+  customRequest(kind);
+  hostLoop(HOST_MS(50));
+  CHECK(Serial2.out.find("get " CUSTOM_VALUE) != std::string::npos, "the number wasn't asked for");
+  for (i = 0; i < 4; i++)
+    frame += (char)(value >> (8 * i));
+  Serial2.in += frame + NX_END;
+  hostLoop(HOST_MS(100));
+  CHECK(feed_mode == custom_feed && custom_kind == kind && custom_value == value, "%lu (kind %d) wasn't taken",
+        value, kind);
+
+  host_spindle.rpm = min(60.0, 0.5 * maxRPM(steps_per_rev));
+  hostLoop(HOST_SEC(72 / host_spindle.rpm));
+  for (unsigned long long end = host_now + HOST_MS(100); steps && host_now < end; )
+    hostFor(HOST_US(5));
+  pos = host_t4.pos;
+  target = host_spindle.q + 4LL * revs * host_spindle.ppr;
+  hostLoopUntil([target] { return labs(target - host_spindle.q) < 8; }, HOST_SEC(revs * 60 / host_spindle.rpm + 1));
+  hostLoopUntil([target] { return host_spindle.q == target; }, HOST_MS(100), HOST_US(5));
+  host_spindle.rpm = 0;
+  hostLoop(HOST_MS(100));
+
+  long double want = (long double)revs * SCPR * custom_num / custom_den;
+  CHECK(fabsl(labs(host_t4.pos - pos) - want) < 1, "%s: %ld steps in %d revolutions, not %.1Lf", custom.pitch,
+        labs(host_t4.pos - pos), revs, want);
+}
+
+int main(void) {
+  //Pitches in thousandths, roughly what each kind goes from and to
+  static const double lo[4] = { 1000, 50, 1000, 50 }, hi[4] = { 400000, 20000, 400000, 10000 };
+  long taken = 0, refused = 0, exact = 0, approx = 0, drifts = 0, bad = 0;
+  double worst_ppm = 0;
+  int kind, i;
+
+  setup();
+
+  for (kind = inch_feed; kind <= module_feed; kind++) {
+    for (i = 0; i < PITCHES; i++) {
+      unsigned long value = (unsigned long)(lo[kind] * pow(hi[kind] / lo[kind], random01()));
+      long double want = stepsPerCount(kind, value);
+
+      if (!customRatio(kind, value)) {
+        refused++;
+        //Under a step a revolution, or too many for a tick or for an int
+        CHECK(want * SCPR < 1 || want >= CUSTOM_MAX_TICK - 1e-9 || want * SCPR >= 32767 - 1e-6,
+              "kind %d pitch %lu refused at %.4Lf steps per count", kind, value, want);
+        continue;
+      }
+      taken++;
+
+      long double got = (long double)custom_num / custom_den;
+      double ppm = (double)((got / want - 1) * 1000000);
+      CHECK(fabs(ppm - custom.error) <= 1, "kind %d pitch %lu: %ldppm reported, %.3fppm really", kind, value,
+            custom.error, ppm);
+      if (custom.error == 0 && fabs(ppm) < 1e-6)
+        exact++;
+      else
+        approx++;
+      worst_ppm = max(worst_ppm, fabs(ppm));
+#ifdef STEP_DDA
+      CHECK(custom_den <= DDA_DEN_MAX, "kind %d pitch %lu: denominator %lu", kind, value, custom_den);
+#else
+      CHECK(custom_den == (unsigned long)SCPR && custom_num == (unsigned long)llroundl(want * SCPR), "kind %d pitch %lu: %lu/%lu",
+            kind, value, custom_num, custom_den);
+#endif
+      CHECK(custom.steps == (unsigned)ceill(got * SCPR - 1e-9), "kind %d pitch %lu: %u steps", kind, value,
+            custom.steps);
+
+      //Strings
+      if (kind == inch_feed || kind == diametral_feed) {
+        double rev = (kind == inch_feed ? 1000.0 : 3141.5927) / value;
+        CHECK(reads(custom.rate, rev, 0.00006), "kind %d pitch %lu shows %s", kind, value, custom.rate);
+        CHECK(reads(custom.pitch, value / 1000.0, max(0.006, value / 1000.0 * 0.006)), "kind %d pitch %lu shows %s",
+              kind, value, custom.pitch);
+        CHECK(strlen(custom.pitch) == 4, "kind %d pitch %lu shows \"%s\"", kind, value, custom.pitch);
+      } else {
+        double rev = value / 1000.0 * (kind == metric_feed ? 1 : 3.1416);
+        CHECK(reads(custom.rate, rev, 0.006), "kind %d pitch %lu shows %s", kind, value, custom.rate);
+      }
+      customShow();
+      CHECK(strstr(nx_value[nf_custom_err], "ppm") || strchr(nx_value[nf_custom_err], '%'),
+            "kind %d pitch %lu error shows \"%s\"", kind, value, nx_value[nf_custom_err]);
+
+      if (i % DRIFT_EVERY == 0) {
+        feedRatio(custom_num, custom_den);
+        long off = drift(custom_num, custom_den);
+        CHECK(off == 0 || off == -1, "kind %d pitch %lu: %ld steps out over 100 revolutions", kind, value, off);
+        drifts++;
+      }
+    }
+  }
+  printf("%ld pitches taken, %ld refused, %ld exact, %ld out by up to %.4fppm, %ld run 100 revolutions\n",
+         taken, refused, exact, approx, worst_ppm, drifts);
+  CHECK(taken > 2 * refused, "only %ld of %ld taken", taken, taken + refused);
+
+  //Fractions too big for the accumulator
+  for (i = 0; i < APPROXES; i++) {
+    unsigned long long den = DDA_DEN_MAX + 1 + (unsigned long long)(random01() * 1e13);
+    unsigned long long num = (unsigned long long)(den * (1.0 / SCPR) * pow(CUSTOM_MAX_TICK * SCPR, random01()));
+    unsigned long p, q;
+
+    ratioApprox(num, den, DDA_DEN_MAX, &p, &q);
+    long double off = fabsl((long double)p / q * den / num - 1) * 1000000;
+    CHECK(q > 0 && q <= DDA_DEN_MAX && off < 0.004, "%llu/%llu came to %lu/%lu, %.5Lfppm out", num, den, p, q, off);
+    if (off >= 0.004 && bad++ > 10)
+      break;
+  }
+
+  //Small ones, where the closest can be found by trying every denominator.
+  //Off by |p * den - num * q| / (q * den), compared without dividing.
+  long closer = 0;
+  for (i = 0; i < SEARCHES; i++) {
+    unsigned long long den = 2 + (unsigned long long)(random01() * 100000);
+    unsigned long long num = 1 + (unsigned long long)(random01() * 20 * den);
+    unsigned long max_den = 1 + (unsigned long)(random01() * 300);
+    unsigned long p, q;
+    unsigned long long best_e = ULLONG_MAX, best_q = 1;
+
+    ratioApprox(num, den, max_den, &p, &q);
+    for (unsigned long long bq = 1; bq <= max_den; bq++) {
+      for (unsigned long long bp = num * bq / den; bp <= num * bq / den + 1; bp++) {
+        unsigned long long e = bp * den > num * bq ? bp * den - num * bq : num * bq - bp * den;
+        if (best_e == ULLONG_MAX || e * best_q < best_e * bq) {
+          best_e = e;
+          best_q = bq;
+        }
+      }
+    }
+    unsigned long long e = (unsigned long long)p * den > num * q ? p * den - num * q : num * q - p * den;
+    if (q == 0 || q > max_den || e * best_q > best_e * q) {
+      if (closer++ < 10)
+        printf("%llu/%llu under %lu came to %lu/%lu, something else is closer\n", num, den, max_den, p, q);
+    }
+  }
+  CHECK(closer == 0, "%ld of %d small fractions weren't the closest", closer, SEARCHES);
+
+  //On the model
+  host_spindle.ppr = machine.encoder_ppr;
+  host_spindle.start();
+  cut(metric_feed, 1337);
+  cut(inch_feed, 13500);
+  cut(module_feed, 700);
+
+  return hostDone("test_ratio");
+}
@@ -0,0 +1,142 @@
+// Copyright (c) 2020 Jon Bryan
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+//================================================================================
+//
+//  Host test: spindle speed estimate and overspeed hold
+//
+//  See Speed.h.  With a feed engaged whose maxRPM() is set by its pitch, the spindle
+//  is started from rest, slow and just under the limit, both at once and run up
+//  over half a second, and none of that may hold the feed.  Then it's run up
+//  past the limit, which has to hold the feed before it gets there, and back
+//  down, which has to let the feed carry on.
+//
+//  Flags:
+//  Flags:    -DSTEP_DDA -DSPINDLE_X4
+//  Flags:    -DSPINDLE_ICP
+//
+//================================================================================
+
+#include "host.h"
+#include "sketch.cpp"
+
+int feedLimited(void) {
+  //The inch feed with the highest maxRPM() that's set by its pitch, and not by
+  //the top spindle speed the finest feed gets
+
+  FEED_TABLE f;
+  unsigned top, best_rpm = 0;
+  int best = -1;
+
+  feedGet(inch, 0, &f);
+  top = maxRPM(f.steps);
+  for (int i = 1; i < INCHES; i++) {
+    feedGet(inch, i, &f);
+    unsigned r = maxRPM(f.steps);
+    if (r < top && r > best_rpm) {
+      best = i;
+      best_rpm = r;
+    }
+  }
+  return best;
+}
+
+double tickRPM(void) {
+  //The estimate as an RPM
+  unsigned rate = speedRateGet();
+  return rate == SPINDLE_STOPPED ? 0 : (double)T3CPM / ((double)rate * SCPR);
+}
+
+void spinStop(void) {
+  host_spindle.profile = NULL;
+  host_spindle.rpm = 0;
+  hostLoop(HOST_MS(200));
+}
+
+void spinUp(const char *what, std::function<double(double)> profile, double seconds) {
+  //Start from rest and check nothing held the feed on the way
+
+  unsigned int holds = step_holds;
+
+  spinStop();
+  CHECK(spin_rate == SPINDLE_STOPPED, "%s: spindle didn't stop", what);
+  host_spindle.profile = profile;
+  hostLoop(HOST_SEC(seconds));
+  CHECK(step_holds == holds && step_hold == hold_none, "%s: held (%d), estimate %.0f rpm",
+        what, step_hold, tickRPM());
+}
+
+int main(void) {
+  int index, limit;
+
+  setup();
+  index = feedLimited();
+  CHECK(index >= 0, "no feed limited by its pitch");
+  if (index < 0)
+    return hostDone("test_speed");
+  feed_index[inch_feed] = index;
+  feed_mode = inch_feed;
+  feedSelect(inch_feed);
+  hostLoop(HOST_MS(300));
+  limit = maxRPM(steps_per_rev);
+  printf("feed %d, maxRPM %d\n", index, limit);
+
+  host_spindle.ppr = machine.encoder_ppr;
+  host_spindle.start();
+
+  //The clipped first period used to start the filter
+  spinUp("rest to 150rpm", [](double) { return 150.0; }, 2);
+  CHECK(fabs(tickRPM() - 150) < 3, "estimate %.1f rpm at 150", tickRPM());
+  spinUp("rest to 95%", [limit](double) { return 0.95 * limit; }, 1);
+  CHECK(fabs(tickRPM() - 0.95 * limit) < 0.02 * limit, "estimate %.1f rpm at %.1f", tickRPM(), 0.95 * limit);
+
+  //A period going down in a straight line soon got to zero
+  double t0 = host_now / 16e6 + 0.2;
+  spinUp("run up to 95%", [limit, t0](double t) { return min(0.95 * limit, max(0.0, (t - t0) / 0.5 * limit)); }, 1.5);
+
+  //Stopped long enough to lose the speed, and back at a different one
+  spinUp("restart at 50%", [limit](double) { return 0.5 * limit; }, 1);
+
+  host_spindle.jitter = 0.02;
+  spinUp("rest to 95% with jitter", [limit](double) { return 0.95 * limit; }, 2);
+  host_spindle.jitter = 0;
+
+  //Now past the limit, which has to hold before it gets there
+  unsigned long faults = faultCountGet();
+  double t1 = host_now / 16e6;
+  std::function<double(double)> over = [limit, t1](double t) {
+    return min(1.2 * limit, 0.95 * limit + (t - t1) / 0.5 * 0.25 * limit);
+  };
+  host_spindle.profile = over;
+  hostLoopUntil([] { return step_hold != hold_none; }, HOST_SEC(1));
+  double at = over(host_now / 16e6);
+  CHECK(step_hold == hold_speed, "not held for speed (%d)", step_hold);
+  CHECK(at <= limit && at > 0.97 * limit, "held at %.1f rpm, the limit is %d", at, limit);
+  hostLoop(HOST_MS(500));
+  CHECK(faultCountGet() == faults, "steps fell behind before the hold");
+
+  //Slowing back down lets it carry on
+  host_spindle.profile = NULL;
+  host_spindle.rpm = 0.9 * limit;
+  hostLoopUntil([] { return step_hold == hold_none; }, HOST_SEC(2));
+  CHECK(step_hold == hold_none, "still held at 90%% (%d)", step_hold);
+
+  return hostDone("test_speed");
+}
@@ -0,0 +1,182 @@
+// Copyright (c) 2020 Jon Bryan
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+//================================================================================
+//
+//  Host test: telemetry from the sketch through the decoder
+//
+//  See Telemetry.h.  The spindle is started, a feed engaged and the spindle
+//  stopped again, with every record the interrupts put in the ring kept as it
+//  goes in.  At RPM the ticks come faster than the port can send them, so
+//  packets carry more than one record and some are dropped.  Everything the
+//  sketch sends on the debug port, the startup text and then the packets, is
+//  decoded by tools/els_telemetry.cpp built in here.  The packets have to
+//  follow one another with nothing between them.  One in the middle has a byte
+//  flipped, and something that starts like a packet but isn't is put between
+//  two later ones, and the decoder has to resync after each: every other record
+//  has to come out as it went in, one line each with -t, and the bytes,
+//  packets, CRC errors, lost packets and drops have to add up.
+//
+//  Flags:    -DELS_TELEMETRY
+//  Flags:    -DELS_TELEMETRY -DSPINDLE_ICP
+//
+//================================================================================
+
+#include "host.h"
+#include "sketch.cpp"
+#include "../els_telemetry.cpp"
+
+#define RPM         800
+
+std::vector<TLM_RECORD> put;        //Every record, as it went in the ring
+void (*vects[host_irqs])(void);
+
+template <int irq> void kept(void) {
+  //The handler, and whatever records it put in the ring
+  byte head = tlm_head;
+
+  vects[irq]();
+  for (; head != tlm_head; head = (head + 1) & (TLM_RING - 1))
+    put.push_back(tlm_ring[head]);
+}
+
+template <int... irqs> void keepAll(std::integer_sequence<int, irqs...>) {
+  ((vects[irqs] = host_irq[irqs].vect, host_irq[irqs].vect = kept<irqs>), ...);
+}
+
+std::string line(const TLM_RECORD &r) {
+  //What els_telemetry -t prints for a record, after the time
+  char s[96];
+
+  if (r.type == tlm_tick)
+    snprintf(s, sizeof s, "tick  count %4d steps %2d interval %5u lead %9ld ", r.count, r.steps,
+             (unsigned)r.interval, (long)r.value);
+  else
+    snprintf(s, sizeof s, "%c err %+6d us at count %ld into the rev", r.type == tlm_a_err ? 'A' : 'B',
+             (int16_t)r.interval, (long)r.value);
+  return s;
+}
+
+int main(void) {
+  std::string wire;
+
+  keepAll(std::make_integer_sequence<int, host_irqs>());
+  setup();
+  host_spindle.ppr = machine.encoder_ppr;
+  host_spindle.rpm = RPM;
+  host_spindle.start();
+  feed_index[inch_feed] = INCHES / 2;
+  feedSelect(inch_feed);
+  for (int i = 0; i < 2000; i++) {
+    if (i == 1000)
+      host_spindle.rpm = 0;
+    hostLoop(HOST_MS(1));
+    wire += Serial.take();
+  }
+  hostLoopUntil([] { return tlm_head == tlm_tail; }, HOST_MS(100));
+  wire += Serial.take();
+
+  //The startup text, then back to back packets
+  size_t text = wire.find("\xA5\x5A");
+  std::vector<size_t> starts;
+  std::vector<size_t> firsts;         //Each packet's first record in put
+  size_t p = text, records = 0, not_packets = 0;
+  while (p != std::string::npos && p + TLM_HEADER < wire.size()) {
+    byte count = wire[p + 3];
+    if ((byte)wire[p] != TLM_SYNC0 || (byte)wire[p + 1] != TLM_SYNC1 || count < 1 || count > TLM_PACKET) {
+      not_packets++;
+      break;
+    }
+    starts.push_back(p);
+    firsts.push_back(records);
+    records += count;
+    p += TLM_HEADER + count * TLM_BYTES + 1;
+  }
+  printf("%zu bytes of text, %zu packets, %zu records, %zu put, %u dropped\n", text, starts.size(), records,
+         put.size(), tlm_drops);
+  CHECK(not_packets == 0 && p == wire.size(), "no packet at byte %zu of %zu", p, wire.size());
+  CHECK(records == put.size() && put.size() > 2000, "%zu records sent, %zu put", records, put.size());
+
+  //A byte flipped in a record of one packet, and a false start between two others
+  size_t bad = starts.size() / 2, late = starts.size() * 3 / 4;
+  const std::string junk("\xA5\x5A\x10\x03junk", 8);
+  byte bad_count = wire[starts[bad] + 3];
+  size_t bad_len = TLM_HEADER + bad_count * TLM_BYTES + 1;
+  wire[starts[bad] + TLM_HEADER + 5] ^= 0x40;
+  wire.insert(starts[late], junk);
+
+  //Decode it, with each record's line
+  char *out = NULL;
+  size_t out_len = 0;
+  FILE *in = fmemopen((void *)wire.data(), wire.size(), "rb");
+  FILE *lines = open_memstream(&out, &out_len);
+  FILE *real_stdout = stdout;
+  stdout = lines;
+  timeline = true;
+  decode(in);
+  stdout = real_stdout;
+  fclose(lines);
+  fclose(in);
+  summary();
+
+  std::vector<TLM_RECORD> want;
+  for (size_t i = 0; i < put.size(); i++)
+    if (i < firsts[bad] || i >= firsts[bad] + bad_count)
+      want.push_back(put[i]);
+  std::string decoded(out, out_len);
+  free(out);
+  size_t at = 0, wrong = 0, n = 0;
+  for (const TLM_RECORD &r : want) {
+    size_t eol = decoded.find('\n', at);
+    if (eol == std::string::npos)
+      break;
+    if (decoded.substr(at, eol - at).find(line(r)) == std::string::npos && wrong++ == 0)
+      printf("record %zu decoded as \"%s\", not \"%s\"\n", n, decoded.substr(at, eol - at).c_str(),
+             line(r).c_str());
+    at = eol + 1;
+    n++;
+  }
+  CHECK(n == want.size() && at == decoded.size() && wrong == 0, "%zu of %zu records decoded, %zu wrong", n,
+        want.size(), wrong);
+
+  long ticks = 0, faults = 0;
+  long long steps_sent = 0;
+  for (const TLM_RECORD &r : want) {
+    if (r.type == tlm_tick) {
+      ticks++;
+      steps_sent += r.steps;
+      faults += (r.flags & TLM_FAULT) != 0;
+    }
+  }
+  CHECK(stats.bytes == (long)wire.size() && stats.skipped == (long)(text + bad_len + junk.size()),
+        "%ld bytes, %ld skipped, not %zu and %zu", stats.bytes, stats.skipped, wire.size(),
+        text + bad_len + junk.size());
+  CHECK(stats.packets == (long)starts.size() - 1 && stats.lost_packets == 1 && stats.crc_errors >= 2,
+        "%ld packets, %ld lost, %ld CRC errors", stats.packets, stats.lost_packets, stats.crc_errors);
+  CHECK(stats.records == (long)want.size() && stats.ticks == ticks && stats.steps == steps_sent &&
+        stats.faults == faults, "%ld records, %ld ticks, %lld steps, %ld faults", stats.records, stats.ticks,
+        stats.steps, stats.faults);
+  CHECK(stats.first_time == want.front().time && stats.last_time == want.back().time, "times %llu to %llu",
+        (unsigned long long)stats.first_time, (unsigned long long)stats.last_time);
+  CHECK(stats.engages == 1 && stats.drops == tlm_drops, "engaged %ld times, %lu drops for %u", stats.engages,
+        stats.drops, tlm_drops);
+
+  return hostDone("test_telemetry");
+}
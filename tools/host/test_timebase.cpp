@@ -0,0 +1,172 @@
+// Copyright (c) 2020 Jon Bryan
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+//================================================================================
+//
+//  Host test: spindle timebase under interrupt latency
+//
+//  See Timebase.h.  The spindle turns at a steady 500rpm with a feed engaged,
+//  and something else keeps the CPU for up to HOLD_MAX cycles before 30% of
+//  the edges, and across half of the timer's overflows, so the spindle
+//  interrupt and the overflow are often both waiting.  Every edge's 32-bit time
+//  is compared with when the model made the edge: it may only be late by the
+//  latency, never by an overflow, and with the input capture unit it has to be
+//  exact.  The period error is reported, and the speed estimate has to be
+//  within 0.5%.  Leaving the pending overflow out of spinExtend() puts about
+//  one edge time in a thousand out by an overflow here.
+//
+//  Flags:
+//  Flags:    -DSPINDLE_ICP
+//  Flags:    -DSTEP_DDA -DSPINDLE_X4
+//
+//================================================================================
+
+#include "host.h"
+#include "sketch.cpp"
+
+#define EDGES       200000          //Spindle interrupts timed
+#define HOLD_MAX    160             //Most cycles the CPU is kept from the spindle
+#define RPM         500
+
+#ifdef SPINDLE_ICP
+#define SPIN_IRQ    irq_timer5_capt
+#else
+#define SPIN_IRQ    irq_int5
+#endif
+
+unsigned long seed = 1;
+void (*spindle_vect)(void);
+void (*b_vect)(void);
+
+unsigned long edges = 0, wrong = 0;  //Timed, and off by more than the latency
+long late_max = 0;
+double period_sq = 0;               //Sum of the squared period errors
+long period_max = 0;
+unsigned long long last_t = 0;
+
+double random01(void) {
+  seed = seed * 1103515245UL + 12345UL;
+  return ((seed >> 8) & 0xFFFFFF) / 16777216.0;
+}
+
+void timed(int irq) {
+  //After the spindle interrupt, what it made of the edge
+
+  static unsigned long last_edge = 0, offset;
+  unsigned long long t = host_irq[irq].flag_t;
+
+  if (spin_edge == last_edge)
+    return;                         //A glitch it threw away
+  last_edge = spin_edge;
+  if (edges == 0)                   //The timebase started with the sketch, in whole overflows
+    offset = (spin_edge - (unsigned long)t + 0x8000) & 0xFFFF0000UL;
+  long late = (int32_t)(spin_edge - (unsigned long)t - offset);
+  if (late < 0 || late > HOST_ENTRY + HOLD_MAX + 200)
+    wrong++;
+  late_max = max(late_max, late);
+  if (last_t && edges > SPIN_EDGES) {
+    long err = (long)spin_rate - (long)(t - last_t);
+    period_sq += (double)err * err;
+    period_max = max(period_max, labs(err));
+  }
+  last_t = t;
+  edges++;
+}
+
+void spindleTimed(void) {
+  spindle_vect();
+  timed(SPIN_IRQ);
+}
+
+void bTimed(void) {
+  b_vect();
+  timed(irq_int4);
+}
+
+void holdOff(void) {
+  //Keep the CPU for a while now and then, as a longer interrupt would
+
+  double gap = 16e6 * 60.0 / (RPM * host_spindle.ppr * SCPR_EDGES);
+
+  if (random01() < 0.3)
+    host_cpu_free = max(host_cpu_free, host_now + (unsigned long long)(random01() * HOLD_MAX));
+  hostAt(host_now + (unsigned long long)(gap * (0.5 + random01())), holdOff);
+}
+
+void overflowHold(void) {
+  //Across half the overflows, from just before
+  if (random01() < 0.5)
+    host_cpu_free = max(host_cpu_free, host_now + 50 + (unsigned long long)(random01() * HOLD_MAX));
+  hostAt(host_next_ovf + 0x10000 - 50, overflowHold);
+}
+
+int finest(void) {
+  //The inch feed with the fewest steps, so nothing holds it at RPM
+  FEED_TABLE f;
+  unsigned least = ~0U;
+  int best = 0;
+
+  for (int i = 0; i < INCHES; i++) {
+    feedGet(inch, i, &f);
+    if (f.steps < least) {
+      best = i;
+      least = f.steps;
+    }
+  }
+  return best;
+}
+
+int main(void) {
+  setup();
+  feed_index[inch_feed] = finest();
+  feedSelect(inch_feed);
+  host_spindle.ppr = machine.encoder_ppr;
+  host_spindle.rpm = RPM;
+  host_spindle.start();
+  hostLoop(HOST_SEC(1));
+  CHECK(synced && step_hold == hold_none, "no feed engaged");
+
+  spindle_vect = host_irq[SPIN_IRQ].vect;
+  host_irq[SPIN_IRQ].vect = spindleTimed;
+#ifdef SPINDLE_X4
+  b_vect = host_irq[irq_int4].vect;
+  host_irq[irq_int4].vect = bTimed;
+#endif
+  holdOff();
+  hostAt(host_next_ovf - 50, overflowHold);
+  hostLoopUntil([] { return edges >= EDGES; }, HOST_SEC(60));
+
+  double rpm = (double)T3CPM / ((double)speedRateGet() * SCPR);
+  double rms = sqrt(period_sq / max(1UL, edges - SPIN_EDGES - 1));
+  printf("%lu edges, latest %ld cycles late, period error rms %.1f max %ld, %lu off by more\n", edges, late_max,
+         rms, period_max, wrong);
+  printf("speed estimate %.2f rpm at %d\n", rpm, RPM);
+  CHECK(edges >= EDGES, "only %lu edges", edges);
+  CHECK(wrong == 0, "%lu edge times off by more than the latency", wrong);
+  CHECK(fabs(rpm - RPM) < 0.005 * RPM, "speed estimate %.2f rpm", rpm);
+#ifdef SPINDLE_ICP
+  CHECK(late_max == 0 && period_max == 0, "captured times %ld late, periods %ld out", late_max, period_max);
+#else
+  CHECK(late_max <= HOST_ENTRY + HOLD_MAX + 200, "edge times %ld late", late_max);
+  CHECK(period_max <= HOLD_MAX + 200, "periods %ld out", period_max);
+#endif
+
+  return hostDone("test_timebase");
+}
@@ -0,0 +1,206 @@
+// Copyright (c) 2020 Jon Bryan
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+//================================================================================
+//
+//  Host test: the user interface never stalls loop()
+//
+//  See the user interface states in configuration.h.  Sessions at the lathe are
+//  replayed as the byte streams the display sends, arriving a byte at a time at
+//  NEXTION_BAUD, so frames come in pieces across passes of loop().  Each one
+//  holds a button that used to sit in a busy-wait until it was let go: a jog,
+//  a jog refused with the spindle turning, the limit clear and zero buttons.
+//  While it's held the knob is clicked, the toggle switch flipped and the spindle
+//  speed changed, and all of that has to show up before the button is let go.
+//
+//  No pass of loop() may take longer than LATENCY_US, which is time the model
+//  went on without it, and the scheduler may never miss a UI_TICK by more than
+//  a pass.
+//
+//================================================================================
+
+#include <map>
+#include "host.h"
+#include "sketch.cpp"
+
+#define LATENCY_US  500             //Longest a pass of loop() may take
+#define PASS_US     200             //How often loop() runs
+
+unsigned long long worst = 0;       //Longest pass so far
+unsigned long long late = 0;        //Longest a UI tick was overdue
+unsigned long long sent = 0;        //When the last byte was sent
+
+std::string touch(byte id, bool press) {
+  std::string f("\x65\x01", 2);
+  f += (char)id;
+  f += (char)press;
+  return f + NX_END;
+}
+
+void send(const std::string &bytes) {
+  //A byte at a time, as fast as the display's UART goes
+
+  unsigned long long t = max(sent, host_now);
+
+  for (char c : bytes) {
+    t += 160000000ULL / NEXTION_BAUD;
+    hostAt(t, [c] { Serial2.in += c; });
+  }
+  sent = t;
+}
+
+void run(unsigned long ms) {
+  //loop() every PASS_US, timing each pass and the scheduler
+
+  unsigned long long end = host_now + HOST_MS(ms), start;
+  unsigned long tick = millis();
+
+  while (host_now < end) {
+    hostFor(HOST_US(PASS_US));
+    while (host_cpu_free > host_now)
+      hostRun(host_cpu_free);
+    start = host_now;
+    loop();
+    worst = max(worst, host_now - start);
+    if (millis() - tick >= UI_TICK) {
+      if (millis() - tick > UI_TICK)
+        late = max(late, HOST_MS(millis() - tick - UI_TICK));
+      tick = millis();
+    }
+  }
+}
+
+void click(bool up) {
+  //One detent of the knob
+  hostPin(reg_PIND, 1, !up);
+  hostPin(reg_PIND, 0, false);
+  run(5);
+  hostPin(reg_PIND, 0, true);
+  run(3 * UI_TICK);
+}
+
+void toggle(bool left) {
+  //Flip the direction switch and let it go
+  hostPin(reg_PIND, left ? 3 : 2, false);
+  run(3 * UI_TICK);
+  hostPin(reg_PIND, left ? 3 : 2, true);
+  run(UI_TICK);
+}
+
+void clicks(const char *what) {
+  //The knob works while the button is held
+
+  int index = feed_index[feed_mode];
+
+  click(true);
+  click(true);
+  click(false);
+  CHECK(feed_index[feed_mode] == index + 1, "%s: the knob took the feed from %d to %d, not %d",
+        what, index, feed_index[feed_mode], index + 1);
+}
+
+void toggles(const char *what) {
+  //And so does the switch
+  toggle(true);
+  CHECK(FEEDING_LEFT, "%s: the switch didn't feed left", what);
+  toggle(false);
+  CHECK(!FEEDING_LEFT, "%s: the switch didn't feed right", what);
+}
+
+bool sentSince(size_t from, const char *str) {
+  return Serial2.out.find(str, from) != std::string::npos;
+}
+
+int main(void) {
+  size_t out;
+  long pos;
+
+  setup();
+  host_spindle.ppr = machine.encoder_ppr;
+  host_spindle.start();
+  feed_index[inch_feed] = INCHES / 2;
+  feedSelect(inch_feed);
+  run(500);
+
+  //A jog, with the knob clicked while it's held
+  pos = host_t4.pos;
+  send(touch(left_btn, true));
+  run(JOG_HOLD + 200);
+  CHECK(jogging && ui_state == ui_jogging, "not jogging after JOG_HOLD (%d)", ui_state);
+  clicks("jogging");
+  CHECK(host_t4.pos != pos, "the jog didn't move");
+  send(touch(left_btn, false));
+  run(1500);
+  CHECK(!jogging && ui_state == ui_idle, "the jog didn't stop (%d)", ui_state);
+  pos = host_t4.pos;
+  run(200);
+  CHECK(host_t4.pos == pos, "still moving after the jog");
+
+  //Limit clear held, with the switch flipped
+  left_limited = true;
+  out = Serial2.out.size();
+  send(touch(lclr_btn, true));
+  run(100);
+  CHECK(!left_limited && ui_state == ui_release, "the left limit wasn't cleared (%d)", ui_state);
+  toggles("left limit clear held");
+  send(touch(lclr_btn, false));
+  run(100);
+  CHECK(ui_state == ui_idle && sentSince(out, "lclr_btn.bco2=1024"), "the button wasn't put back (%d)", ui_state);
+
+  //With the spindle turning, zero is refused and the RPM goes on changing
+  host_spindle.rpm = 100;
+  run(1000);
+  out = Serial2.out.size();
+  send(touch(zset_btn, true));
+  run(100);
+  CHECK(sentSince(out, "zset_btn.bco2=RED"), "zero wasn't refused");
+  host_spindle.rpm = 150;
+  out = Serial2.out.size();
+  run(1000);
+  CHECK(sentSince(out, "rpm.txt=\"150\""), "the RPM didn't change while zero was held");
+  clicks("zero held");
+  send(touch(zset_btn, false));
+  run(100);
+  CHECK(ui_state == ui_idle, "zero still held (%d)", ui_state);
+
+  //And a jog is refused
+  out = Serial2.out.size();
+  send(touch(right_btn, true));
+  run(JOG_HOLD + 200);
+  CHECK(ui_state == ui_nojog && sentSince(out, "right_btn.bco2=RED"), "the jog wasn't refused (%d)", ui_state);
+  toggles("refused jog held");
+  send(touch(right_btn, false));
+  run(100);
+  CHECK(ui_state == ui_idle && !feed_left && !jogging, "the refused jog didn't end right (%d)", ui_state);
+
+  //A mode button in the middle of a hold, which ends it as the release was lost
+  send(touch(rclr_btn, true));
+  run(100);
+  send(touch(metric_btn, true));
+  run(100);
+  CHECK(feed_mode == metric_feed && ui_state == ui_idle, "mode %d, state %d", feed_mode, ui_state);
+
+  printf("the longest pass %.0fus, the latest UI tick %.0fus\n", worst / 16.0, late / 16.0);
+  CHECK(worst <= HOST_US(LATENCY_US), "a pass took %.0fus", worst / 16.0);
+  CHECK(late <= HOST_US(PASS_US + 1000), "a UI tick was %.0fus late", late / 16.0);
+  CHECK(Serial2.available() == 0, "%d bytes not read", Serial2.available());
+
+  return hostDone("test_ui");
+}
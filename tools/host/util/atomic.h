@@ -0,0 +1,16 @@
+//Host stand-in for util/atomic.h.  The model never interrupts the sketch's own
+//code part way through (see host.h), so the block only has to keep SREG right.
+
+#ifndef __HOST_ATOMIC_H
+#define __HOST_ATOMIC_H
+
+#include <Arduino.h>
+
+#define ATOMIC_RESTORESTATE   1
+#define ATOMIC_FORCEON        0
+
+#define ATOMIC_BLOCK(type) \
+  for (uint8_t sreg_save = SREG, atomic_once = (noInterrupts(), 1); atomic_once; \
+       atomic_once = 0, ((type) ? (void)(SREG = sreg_save) : interrupts()))
+
+#endif
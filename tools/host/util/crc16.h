@@ -0,0 +1,35 @@
+//Host stand-in for util/crc16.h, the C equivalents from the avr-libc manual
+
+#ifndef __HOST_CRC16_H
+#define __HOST_CRC16_H
+
+#include <stdint.h>
+
+static inline uint16_t _crc16_update(uint16_t crc, uint8_t a) {
+  crc ^= a;
+  for (int i = 0; i < 8; ++i)
+    crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : (crc >> 1);
+  return crc;
+}
+
+static inline uint16_t _crc_ccitt_update(uint16_t crc, uint8_t data) {
+  data ^= crc & 0xFF;
+  data ^= data << 4;
+  return ((((uint16_t)data << 8) | (crc >> 8)) ^ (uint8_t)(data >> 4) ^ ((uint16_t)data << 3));
+}
+
+static inline uint8_t _crc8_ccitt_update(uint8_t crc, uint8_t data) {
+  crc ^= data;
+  for (int i = 0; i < 8; ++i)
+    crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : (crc << 1);
+  return crc;
+}
+
+static inline uint8_t _crc_ibutton_update(uint8_t crc, uint8_t data) {
+  crc ^= data;
+  for (int i = 0; i < 8; ++i)
+    crc = (crc & 1) ? (crc >> 1) ^ 0x8C : (crc >> 1);
+  return crc;
+}
+
+#endif